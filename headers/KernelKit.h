@@ -1,9 +1,9 @@
 #include <OS.h>
 // #include <debugger.h>
-// #include <fs_attr.h>
-// #include <fs_index.h>
+#include <fs_attr.h>
+#include <fs_index.h>
 // #include <fs_info.h>
-// #include <fs_query.h>
+#include <fs_query.h>
 #include <image.h>
 // #include <perfmon_user.h>
 // #include <scheduler.h>
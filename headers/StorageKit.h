@@ -9,9 +9,9 @@
 #include <Mime.h>
 // #include <Node.h>
 // #include <NodeInfo.h>
-// #include <NodeMonitor.h>
+#include <NodeMonitor.h>
 // #include <Path.h>
-// #include <Query.h>
+#include <Query.h>
 // #include <Resources.h>
 // #include <ResourceStrings.h>
 // #include <Statable.h>
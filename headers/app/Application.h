@@ -73,12 +73,15 @@ class BApplication : public BLooper
 	BApplication(const BApplication &);
 	BApplication &operator=(const BApplication &);
 
+	void _WaitForAddOns();
+
 	void		   *fCursorData;
 	bool			fCursorHidden;
 	bool			fCursorObscured;
 	bigtime_t		fPulseRate;
 	BMessageRunner *fPulseRunner;
 	status_t		fInitError;
+	thread_id		fAddOnsThread;	// preloads BE_PRELOAD_ADD_ONS
 
 	bool fReadyToRunCalled;
 };
@@ -67,6 +67,7 @@ class BHandler : public BArchivable
 
    private:
 	friend class BLooper;
+	friend int32 _get_handler_token_(const BHandler *handler);
 
 	BHandler(const BHandler &);
 	BHandler &operator=(const BHandler &);
@@ -76,6 +77,7 @@ class BHandler : public BArchivable
 	char	 *fName;
 	BLooper	*fLooper;
 	BHandler *fNextHandler;
+	int32	  fToken;	// names handler in port messages while in a looper
 };
 
 #endif /* _HANDLER_H */
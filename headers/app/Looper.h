@@ -89,7 +89,9 @@ class BLooper : public BHandler
 
    private:
 	friend class BApplication;
+	friend class BMessageRunner;
 	friend class BWindow;
+	friend port_id _get_looper_port_(const BLooper *looper);
 
 	BLooper(const BLooper &);
 	BLooper &operator=(const BLooper &);
@@ -102,8 +104,12 @@ class BLooper : public BHandler
 	virtual void	task_looper();
 	bool			AssertLocked() const;
 	void			_drain_message_queue();
+	ssize_t			_read_port(bigtime_t timeout);
+	void			_drain_port();
+	bool			_token_handler(BMessage *message, BHandler **_handler);
 
 	BMessageQueue *fQueue;
+	port_id		   fMsgPort;	// flattened messages from other threads/teams
 	BMessage		 *fLastMessage;
 	sem_id		   fLockSem;	// locks Looper between threads
 	std::mutex	   fLockMutex;	// protects Lock/Unlock critical sections in-thread
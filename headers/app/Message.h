@@ -21,6 +21,27 @@ class BString;
 #define B_FIELD_NAME_LENGTH 255
 #define B_PROPERTY_NAME_LENGTH 255
 
+/// Field name and its hash, as used by the field index of BMessage.
+/// Being constexpr, hot call sites hash literal names at compile time:
+///   static constexpr field_key kWhere("be:view_where");
+///   message->FindData(kWhere, B_POINT_TYPE, 0, &data, &size);
+struct field_key
+{
+	const char *name;
+	uint32		length;
+	uint32		hash;
+
+	/// FNV-1a of at most B_FIELD_NAME_LENGTH characters
+	constexpr field_key(const char *name)
+		: name{name}, length{0}, hash{2166136261u}
+	{
+		while (name && length < B_FIELD_NAME_LENGTH && name[length]) {
+			hash = (hash ^ (uint8)name[length]) * 16777619u;
+			length += 1;
+		}
+	}
+};
+
 enum {
 	B_NO_SPECIFIER	   = 0,
 	B_DIRECT_SPECIFIER = 1,
@@ -177,6 +198,8 @@ class BMessage
 					  const void **data, ssize_t *numBytes) const;
 	status_t FindData(const char *name, type_code type, int32 index,
 					  const void **data, ssize_t *numBytes) const;
+	status_t FindData(const field_key &key, type_code type, int32 index,
+					  const void **data, ssize_t *numBytes) const;
 
 	/// Replacing data
 	status_t ReplaceRect(const char *name, BRect a_rect);
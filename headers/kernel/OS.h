@@ -20,6 +20,8 @@ extern "C" {
 typedef intptr_t  area_id;
 typedef int		  port_id;
 typedef uintptr_t sem_id;
+typedef intptr_t  task_id;
+typedef int32	  timer_id;
 typedef pid_t	  thread_id;
 typedef pid_t	  team_id;
 
@@ -65,6 +67,7 @@ extern area_id clone_area(const char *name, void **dest_addr,
 extern area_id	find_area(const char *name);
 extern area_id	area_for(void *addr);
 extern status_t delete_area(area_id id);
+/* B_ANY_ADDRESS areas may move when they can't grow in place */
 extern status_t resize_area(area_id id, size_t new_size);
 extern status_t set_area_protection(area_id id,
 									uint32	new_protection);
@@ -113,6 +116,33 @@ extern ssize_t port_buffer_size(port_id port);
 extern ssize_t port_buffer_size_etc(port_id port,
 									uint32 flags, bigtime_t timeout);
 
+/// Batched port I/O
+/// Reads up to count messages, waiting (per flags and timeout) only for the
+/// first one. sizes[] holds buffer sizes on input and bytes read on output.
+/// A later message that does not fit its buffer ends the batch and is left
+/// queued for the next read.
+/// Returns number of messages read.
+extern ssize_t read_port_batch(port_id port, int32 *codes,
+							   void **bufs, size_t *sizes, int32 count,
+							   uint32 flags, bigtime_t timeout);
+/// Writes count messages, waiting for room as needed.
+/// Returns number of messages written, or error if none was written.
+extern ssize_t write_port_batch(port_id port, const int32 *codes,
+								const void *const *bufs, const size_t *sizes,
+								int32 count, uint32 flags, bigtime_t timeout);
+
+/// Zero-copy port I/O
+/// Large messages travel as sealed shared memory instead of being copied
+/// through the port. read_port_mapped() returns message as read-only
+/// mapping, release it with unmap_port_message().
+extern ssize_t read_port_mapped(port_id port, int32 *code, const void **data,
+								uint32 flags, bigtime_t timeout);
+extern status_t unmap_port_message(const void *data, size_t size);
+/// Sends first size bytes of area without copying them, area must stay
+/// alive until the message is read.
+extern status_t write_port_area(port_id port, int32 code, area_id area, size_t size,
+								uint32 flags, bigtime_t timeout);
+
 extern ssize_t	port_count(port_id port);
 extern status_t set_port_owner(port_id port, team_id team);
 
@@ -124,6 +154,8 @@ extern status_t delete_port(port_id port);
 extern status_t _get_port_info(port_id port, port_info *info,
 							   size_t size);
 extern status_t _get_next_port_info(team_id team, int32 *cookie, port_info *info, size_t size);
+/// Pollable descriptor, readable while port has messages. Owned by the port.
+extern int		_get_port_read_fd(port_id port);
 
 #define get_port_info(port, info) \
 	_get_port_info((port), (info), sizeof(*(info)))
@@ -142,6 +174,9 @@ typedef struct sem_info
 } sem_info;
 
 extern sem_id	create_sem(uint32 count, const char *name);
+/* B_SHARED_SEM makes a semaphore usable from other teams, its id is a
+   small integer and it is listed by get_next_sem_info() */
+extern sem_id	create_sem_etc(uint32 count, const char *name, uint32 flags);
 extern status_t delete_sem(sem_id sem);
 extern status_t acquire_sem(sem_id sem);
 extern status_t acquire_sem_etc(sem_id sem, uint32 count,
@@ -175,6 +210,39 @@ enum {
 	B_ABSOLUTE_TIMEOUT	= 16 /* honor the (absolute) timeout parameter */
 };
 
+/// semaphore contention profiling
+#define B_SEM_PROFILE_BUCKETS	32	/* bucket n is [2^(n-1), 2^n) microseconds */
+#define B_SEM_PROFILE_HOLDERS	4
+
+typedef struct sem_profile_info
+{
+	sem_info  info;
+	int64	  acquisitions;
+	int64	  contended_acquisitions;
+	bigtime_t wait_time;
+	bigtime_t hold_time; /* measured from the latest acquire */
+	int64	  wait_histogram[B_SEM_PROFILE_BUCKETS];
+	int64	  hold_histogram[B_SEM_PROFILE_BUCKETS];
+	thread_id latest_holders[B_SEM_PROFILE_HOLDERS]; /* most recent first */
+} sem_profile_info;
+
+/* profiling is off by default, and then costs one branch per call */
+extern void		set_sem_profiling(bool enabled);
+extern status_t dump_sem_profiling(int fd);
+
+#define get_sem_profile_info(sem, info) \
+	_get_sem_info((sem), (sem_info *)(info), sizeof(*(info)))
+
+/* system private, for locks that skip the semaphore when uncontended */
+extern int32	_sem_profiling;
+extern void		_sem_profile_acquired(sem_id sem, bool contended, bigtime_t wait);
+extern void		_sem_profile_released(sem_id sem);
+
+/// flags for create_sem_etc()
+enum {
+	B_SHARED_SEM		= 1 /* allocate in host wide arena, usable by any team */
+};
+
 /// alarms
 enum {
 	B_ONE_SHOT_ABSOLUTE_ALARM = 1, /* alarm is one-shot and time is specified absolutely */
@@ -184,6 +252,17 @@ enum {
 
 extern bigtime_t set_alarm(bigtime_t when, uint32 flags);
 
+/// Timers
+/* Hooks run on the team timer service thread, keep them short. Timers due
+   within slack of each other fire in the same wakeup. A period of zero
+   makes a one-shot timer, which is released after its hook returns. */
+typedef void (*timer_hook)(void *data);
+
+extern timer_id add_timer(timer_hook hook, void *data, bigtime_t when,
+						  bigtime_t period, bigtime_t slack);
+extern status_t reset_timer(timer_id timer, bigtime_t when, bigtime_t period);
+extern status_t cancel_timer(timer_id timer);
+
 /// Threads
 typedef enum {
 	B_THREAD_RUNNING = 1,
@@ -194,6 +273,8 @@ typedef enum {
 	B_THREAD_WAITING
 } thread_state;
 
+#define B_IDLE_PRIORITY 0
+#define B_LOWEST_ACTIVE_PRIORITY 1
 #define B_LOW_PRIORITY 5
 #define B_NORMAL_PRIORITY 10
 #define B_DISPLAY_PRIORITY 15
@@ -222,6 +303,11 @@ typedef struct
 	bigtime_t kernel_time;
 } team_usage_info;
 
+enum {
+	B_TEAM_USAGE_SELF	  = 0,
+	B_TEAM_USAGE_CHILDREN = -1
+};
+
 typedef int32 (*thread_func)(void *);
 
 extern thread_id spawn_thread(
@@ -234,18 +320,41 @@ extern status_t kill_thread(thread_id thread);
 extern status_t resume_thread(thread_id thread);
 extern status_t suspend_thread(thread_id thread);
 extern status_t rename_thread(thread_id thread, const char *new_name);
+/* returns previous priority */
 extern status_t set_thread_priority(thread_id thread, int32 new_priority);
 extern void		exit_thread(status_t status);
 extern status_t wait_for_thread(thread_id thread,
 								status_t *thread_return_value);
 extern status_t on_exit_thread(void (*callback)(void *), void *data);
 
+/// Scheduling policy of priorities, per team
+enum {
+	B_SCHED_IDLE = 0,	 /* runs only when CPU is otherwise idle */
+	B_SCHED_BATCH,		 /* time sharing, never preempts */
+	B_SCHED_NORMAL,		 /* time sharing */
+	B_SCHED_ROUND_ROBIN, /* real time, time sliced */
+	B_SCHED_FIFO		 /* real time, runs until it blocks */
+};
+
+/* level is nice value for time sharing and real time priority otherwise,
+   applies to threads that get the priority afterwards */
+extern status_t set_priority_policy(int32 priority, int32 policy, int32 level);
+extern status_t get_priority_policy(int32 priority, int32 *policy, int32 *level);
+
+/* cpu_mask has bit n set for CPU n */
+extern status_t set_thread_affinity(thread_id thread, const void *cpu_mask,
+									size_t mask_size);
+extern status_t get_thread_affinity(thread_id thread, void *cpu_mask,
+									size_t mask_size);
+/* hint, keeps thread on CPUs (and calling thread's memory) of node */
+extern status_t set_thread_numa_node(thread_id thread, int32 node);
+
 /* system private, use macros instead */
 extern status_t _get_thread_info(thread_id thread, thread_info *info, size_t size);
 extern status_t _get_next_thread_info(team_id tmid, int32 *cookie, thread_info *info, size_t size);
 extern status_t _get_team_usage_info(team_id tmid, int32 who, team_usage_info *ti, size_t size);
+/// Pollable descriptor, readable while receive_data() has something to return
 extern int		_get_thread_data_read_fd();
-extern int		_get_thread_data_write_fd(thread_id thread);
 
 extern thread_id find_thread(const char *name);
 
@@ -269,6 +378,17 @@ extern int32 receive_data(thread_id *sender,
 
 extern bool has_data(thread_id thread);
 
+/// Task pool
+/* Work-stealing pool of worker threads, one per core unless set before
+   the first submit_task(). Every task must be waited for.
+   submit_task() returns negative error code (B_BAD_VALUE, B_NO_MORE_THREADS
+   or B_NO_MEMORY) when task could not be queued, test it with < 0 before
+   waiting. */
+extern status_t set_task_pool_workers(int32 count);
+extern int32	count_task_pool_workers(void);
+extern task_id	submit_task(thread_func func, void *data);
+extern status_t wait_for_task(task_id task, status_t *task_return_value);
+
 extern status_t snooze(bigtime_t microseconds);
 
 extern status_t snooze_until(bigtime_t time, int timebase);
@@ -292,6 +412,10 @@ typedef struct
 
 extern status_t kill_team(team_id team);  /// see also: send_signal()
 
+/* Team and thread infos of other teams come from snapshots of /proc, which
+ * are reused for ttl microseconds, 100 ms by default. 0 disables reuse. */
+extern void set_team_info_ttl(bigtime_t ttl);
+
 /* system private, use macros instead */
 extern status_t _get_team_info(team_id team, team_info *info, size_t size);
 extern status_t _get_next_team_info(int32 *cookie, team_info *info, size_t size);
@@ -308,12 +432,50 @@ extern bigtime_t real_time_clock_usecs(void);
 extern status_t	 set_timezone(char *str);
 
 extern bigtime_t system_time(void); /* time since booting in microseconds */
+extern bigtime_t system_time_coarse(void); /* same clock, millisecond precision, cheaper */
+
+/// system_time() clock sources
+enum {
+	B_MONOTONIC_CLOCK_SOURCE = 0, /* clock_gettime(CLOCK_MONOTONIC), the default */
+	B_TSC_CLOCK_SOURCE		 = 1  /* calibrated invariant TSC, resynced periodically */
+};
+
+/* B_NOT_SUPPORTED when the TSC is not invariant or not used by the kernel */
+extern status_t set_system_time_source(uint32 source);
+extern uint32	get_system_time_source(void);
 
 /// debugging calls
 extern void		 debugger(const char *message);
 extern const int disable_debugger(int state);
 void			 sprint_code(char buf[11], const uint32 *value);
 
+/// flight recorder
+typedef struct flight_record
+{
+	bigtime_t time;
+	thread_id thread;
+	uint32	  event; /* B_RECORD_* or a four char code of the caller */
+	int64	  args[2];
+} flight_record;
+
+enum {
+	B_RECORD_PORT_WRITE	   = 'PtWr', /* port, code or count of batch */
+	B_RECORD_PORT_READ	   = 'PtRd', /* port, code or count of batch */
+	B_RECORD_SEM_ACQUIRE   = 'SmAq', /* sem, count or error */
+	B_RECORD_SEM_RELEASE   = 'SmRl', /* sem, count */
+	B_RECORD_MESSAGE_SEND  = 'MsSd', /* what, target looper or handler */
+	B_RECORD_DISPATCH	   = 'LpDs', /* what, handler */
+	B_RECORD_WINDOW_COMMIT = 'WnCm'	 /* window, damaged pixels */
+};
+
+/* Every thread keeps its latest records in a ring of its own. Recording is
+   on by default, the crash handler dumps the rings. */
+extern void	   set_flight_recording(bool enabled);
+extern void	   record_event(uint32 event, int64 arg0, int64 arg1);
+/* latest count records of all threads, oldest first */
+extern ssize_t get_flight_records(flight_record *records, size_t count);
+extern status_t dump_flight_records(int fd);
+
 #ifdef __cplusplus
 }
 #endif
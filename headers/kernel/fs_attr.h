@@ -0,0 +1,47 @@
+#ifndef _FS_ATTR_H
+#define _FS_ATTR_H
+
+#include <OS.h>
+#include <dirent.h>
+
+typedef struct attr_info
+{
+	uint32 type;
+	off_t  size;
+} attr_info;
+
+/// one attribute of fs_read_attrs()
+typedef struct fs_attr_entry
+{
+	const char *name;
+	uint32		type;
+	off_t		size;
+	const void *data;
+} fs_attr_entry;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+extern ssize_t fs_read_attr(int fd, const char *attribute, uint32 type,
+							off_t pos, void *buffer, size_t readBytes);
+extern ssize_t fs_write_attr(int fd, const char *attribute, uint32 type,
+							 off_t pos, const void *buffer, size_t count);
+extern int	   fs_remove_attr(int fd, const char *attribute);
+extern int	   fs_stat_attr(int fd, const char *attribute, struct attr_info *attrInfo);
+
+extern DIR			 *fs_fopen_attr_dir(int fd);
+extern int			  fs_close_attr_dir(DIR *dir);
+extern struct dirent *fs_read_attr_dir(DIR *dir);
+extern void			  fs_rewind_attr_dir(DIR *dir);
+
+/* Reads all attributes of the node into one allocation, release it with
+   free(*entries). Returns the number of entries, or -1 and sets errno.
+   Attributes of recently read nodes come from a per-team cache. */
+extern ssize_t fs_read_attrs(int fd, fs_attr_entry **entries);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _FS_ATTR_H */
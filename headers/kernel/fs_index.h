@@ -0,0 +1,38 @@
+#ifndef _FS_INDEX_H
+#define _FS_INDEX_H
+
+#include <OS.h>
+#include <dirent.h>
+#include <sys/types.h>
+
+typedef struct index_info
+{
+	uint32 type;
+	off_t  size;
+	time_t modification_time;
+	time_t creation_time;
+	uid_t  uid;
+	gid_t  gid;
+} index_info;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Indices live in the cache directory of the user, not on the volume.
+   They are kept current by a team running _kern_start_indexing(), new
+   indices are filled by its next crawl. */
+extern int fs_create_index(dev_t device, const char *name, uint32 type, uint32 flags);
+extern int fs_remove_index(dev_t device, const char *name);
+extern int fs_stat_index(dev_t device, const char *name, struct index_info *indexInfo);
+
+extern DIR			 *fs_open_index_dir(dev_t device);
+extern int			  fs_close_index_dir(DIR *indexDirectory);
+extern struct dirent *fs_read_index_dir(DIR *indexDirectory);
+extern void			  fs_rewind_index_dir(DIR *indexDirectory);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _FS_INDEX_H */
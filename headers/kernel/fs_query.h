@@ -0,0 +1,30 @@
+#ifndef _FS_QUERY_H
+#define _FS_QUERY_H
+
+#include <OS.h>
+#include <dirent.h>
+
+/// Flags for fs_open_query()
+#define B_LIVE_QUERY		0x00000001 /* not supported */
+#define B_QUERY_NON_INDEXED 0x00000002 /* scan all nodes if no term is indexed */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Predicates are BFS ones, like (BEOS:TYPE=="text/html")&&(size>1024).
+   At least one term of every || must be on an index, unless
+   B_QUERY_NON_INDEXED is given. Results are checked against the
+   attributes themselves, so they never come from a stale index. */
+extern DIR			 *fs_open_query(dev_t device, const char *query, uint32 flags);
+extern int			  fs_close_query(DIR *d);
+extern struct dirent *fs_read_query(DIR *d);
+
+/// Path of a dirent returned by fs_read_query()
+extern status_t get_path_for_dirent(struct dirent *dent, char *buf, size_t len);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _FS_QUERY_H */
@@ -9,6 +9,24 @@ extern "C" {
 
 typedef intptr_t image_id;
 
+/* symbol types of get_image_symbol() */
+#define B_SYMBOL_TYPE_DATA	0x1
+#define B_SYMBOL_TYPE_TEXT	0x2
+#define B_SYMBOL_TYPE_ANY	0x5
+
+/* The team starts suspended, resume_thread() runs it. Only the loading team
+ * can resume it. */
+extern thread_id load_image(int32 argc, const char **argv, const char **environ);
+
+extern image_id load_add_on(const char *path);
+extern status_t unload_add_on(image_id image);
+extern status_t get_image_symbol(image_id image, const char *name, int32 symbolType,
+								 void **_symbolLocation);
+
+/* Loads add-ons on a thread of low priority, so a later load_add_on() of
+ * one only takes a reference. The thread must be waited for. */
+extern thread_id preload_add_ons(const char **paths, int32 count);
+
 #ifdef __cplusplus
 }
 #endif
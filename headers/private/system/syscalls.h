@@ -5,6 +5,7 @@
 #ifndef _SYSTEM_SYSCALLS_H
 #define _SYSTEM_SYSCALLS_H
 
+#include <OS.h>
 #include <SupportDefs.h>
 #include <dirent.h>
 #include <sys/stat.h>
@@ -99,6 +100,15 @@ extern status_t _kern_unlock_node(int fd);
 // extern status_t _kern_get_next_fd_info(team_id team, uint32 *_cookie,
 // 									   struct fd_info *info, size_t infoSize);
 
+// node monitoring
+extern status_t _kern_stop_notifying(port_id port, int32 token);
+extern status_t _kern_start_watching(int nodefd, uint32 flags, port_id port, int32 token);
+extern status_t _kern_stop_watching(int nodefd, port_id port, int32 token);
+
+// attribute indexing, keeps indices of the volume current while running
+extern status_t _kern_start_indexing(dev_t device);
+extern status_t _kern_stop_indexing(dev_t device);
+
 #undef __NO_RETURN
 
 #ifdef __cplusplus
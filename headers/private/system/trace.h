@@ -0,0 +1,62 @@
+#ifndef _SYSTEM_TRACE_H
+#define _SYSTEM_TRACE_H
+
+/* Static tracepoints of provider "libbe", for perf, bpftrace and systemtap.
+ * They are USDT notes from <sys/sdt.h>: a nop at the probe site and an ELF
+ * note, so they cost nothing until a tracer attaches. Built without probes
+ * when the header is missing (systemtap-sdt-dev).
+ *
+ * Argument layouts are stable, add new probes instead of changing them.
+ *
+ *   port_read_start          port
+ *   port_read_done           port, code, bytes read or error
+ *   port_write_start         port, code, size
+ *   port_write_done          port, code, status
+ *   port_read_batch_start    port, count
+ *   port_read_batch_done     port, messages read or error
+ *   port_write_batch_start   port, count
+ *   port_write_batch_done    port, messages written or error
+ *   sem_acquire_start        sem, count, flags, timeout
+ *   sem_acquire_done         sem, count, status
+ *   sem_sleep_start          sem, count
+ *   sem_sleep_done           sem, futex result
+ *   sem_release              sem, count
+ *   thread_spawn             thread, priority, name
+ *   thread_start             thread
+ *   thread_exit              thread, status
+ *   thread_wait_start        thread
+ *   thread_wait_done         thread, status
+ *   looper_dispatch_start    looper, what, handler
+ *   looper_dispatch_done     looper, what
+ *   window_drain_start       window
+ *   window_drain_done        window
+ *   window_commit            window, damage width, damage height
+ *   view_update_start        view, update rect left, top, right, bottom (ints)
+ *   view_update_done         view
+ *
+ * See tools/trace for bpftrace scripts.
+ */
+#if defined(__has_include) && !defined(BE_NO_TRACE)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define BE_TRACE_ENABLED 1
+#endif
+#endif
+
+#ifdef BE_TRACE_ENABLED
+#define BE_TRACE0(name) DTRACE_PROBE(libbe, name)
+#define BE_TRACE1(name, a) DTRACE_PROBE1(libbe, name, a)
+#define BE_TRACE2(name, a, b) DTRACE_PROBE2(libbe, name, a, b)
+#define BE_TRACE3(name, a, b, c) DTRACE_PROBE3(libbe, name, a, b, c)
+#define BE_TRACE4(name, a, b, c, d) DTRACE_PROBE4(libbe, name, a, b, c, d)
+#define BE_TRACE5(name, a, b, c, d, e) DTRACE_PROBE5(libbe, name, a, b, c, d, e)
+#else
+#define BE_TRACE0(name) ((void)0)
+#define BE_TRACE1(name, a) ((void)0)
+#define BE_TRACE2(name, a, b) ((void)0)
+#define BE_TRACE3(name, a, b, c) ((void)0)
+#define BE_TRACE4(name, a, b, c, d) ((void)0)
+#define BE_TRACE5(name, a, b, c, d, e) ((void)0)
+#endif
+
+#endif /* _SYSTEM_TRACE_H */
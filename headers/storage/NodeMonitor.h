@@ -0,0 +1,55 @@
+#ifndef _NODE_MONITOR_H
+#define _NODE_MONITOR_H
+
+#include <StorageDefs.h>
+#include <SupportDefs.h>
+
+/// Flags for watch_node()
+enum {
+	B_STOP_WATCHING	  = 0x0000,
+	B_WATCH_NAME	  = 0x0001, /* node itself moved or removed */
+	B_WATCH_STAT	  = 0x0002,
+	B_WATCH_ATTR	  = 0x0004,
+	B_WATCH_DIRECTORY = 0x0008, /* entries created, removed or moved in directory */
+	B_WATCH_ALL		  = 0x000f,
+	B_WATCH_CHILDREN  = 0x0040	/* with B_WATCH_STAT or B_WATCH_ATTR, also for entries of directory */
+};
+
+/// "opcode" of B_NODE_MONITOR messages
+#define B_ENTRY_CREATED 1
+#define B_ENTRY_REMOVED 2
+#define B_ENTRY_MOVED	3
+#define B_STAT_CHANGED	4
+#define B_ATTR_CHANGED	5
+
+/// "fields" of B_STAT_CHANGED messages
+enum {
+	B_STAT_MODE				 = 0x0001,
+	B_STAT_UID				 = 0x0002,
+	B_STAT_GID				 = 0x0004,
+	B_STAT_SIZE				 = 0x0008,
+	B_STAT_ACCESS_TIME		 = 0x0010,
+	B_STAT_MODIFICATION_TIME = 0x0020,
+	B_STAT_CREATION_TIME	 = 0x0040,
+	B_STAT_CHANGE_TIME		 = 0x0080
+};
+
+#ifdef __cplusplus
+
+#include <Messenger.h>
+
+struct node_ref;
+
+/* Messages are delivered in batches to the port of the target looper and
+   go to the target handler, or the looper when there is none. Changes to a node within a few milliseconds
+   of each other arrive as one message. */
+status_t watch_node(const node_ref *node, uint32 flags, BMessenger target);
+status_t watch_node(const node_ref *node, uint32 flags,
+					const BHandler *handler, const BLooper *looper = nullptr);
+
+status_t stop_watching(BMessenger target);
+status_t stop_watching(const BHandler *handler, const BLooper *looper = nullptr);
+
+#endif
+
+#endif /* _NODE_MONITOR_H */
@@ -0,0 +1,76 @@
+#ifndef _QUERY_H
+#define _QUERY_H
+
+#include <EntryList.h>
+#include <StorageDefs.h>
+#include <SupportDefs.h>
+
+class BString;
+
+typedef enum
+{
+	B_INVALID_OP = 0,
+	B_EQ,
+	B_GT,
+	B_GE,
+	B_LT,
+	B_LE,
+	B_NE,
+	B_CONTAINS,
+	B_BEGINS_WITH,
+	B_ENDS_WITH,
+	B_AND = 0x101,
+	B_OR,
+	B_NOT,
+	_B_RESERVED_OP_ = 0x100000
+} query_op;
+
+/// Queries run on the attribute indices of a volume, see fs_query.h.
+/// Live queries are not supported.
+class BQuery : public BEntryList
+{
+   public:
+	BQuery();
+	virtual ~BQuery();
+
+	status_t Clear();
+
+	status_t PushAttr(const char *attrName);
+	status_t PushOp(query_op op);
+	status_t PushUInt32(uint32 value);
+	status_t PushInt32(int32 value);
+	status_t PushUInt64(uint64 value);
+	status_t PushInt64(int64 value);
+	status_t PushFloat(float value);
+	status_t PushDouble(double value);
+	status_t PushString(const char *value, bool caseInsensitive = false);
+
+	/// Takes the device instead of a BVolume.
+	status_t SetVolume(dev_t device);
+	status_t SetPredicate(const char *expression);
+
+	bool IsLive() const;
+
+	status_t GetPredicate(char *buffer, size_t length);
+	status_t GetPredicate(BString *predicate);
+	size_t	 PredicateLength();
+
+	dev_t TargetDevice() const;
+
+	status_t Fetch();
+
+	virtual status_t GetNextEntry(BEntry *entry, bool traverse = false);
+	virtual status_t GetNextRef(entry_ref *ref);
+	virtual int32	 GetNextDirents(struct dirent *buf, size_t length, int32 count = INT_MAX);
+	virtual status_t Rewind();
+	virtual int32	 CountEntries();
+
+   private:
+	BQuery(const BQuery &);
+	BQuery &operator=(const BQuery &);
+
+	class impl;
+	pimpl<impl> m;
+};
+
+#endif /* _QUERY_H */
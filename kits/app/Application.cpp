@@ -16,11 +16,14 @@
 #include <Path.h>
 #include <Roster.h>
 #include <binder/IPCThreadState.h>
+#include <image.h>
 #include <log/log.h>
 #include <signal.h>
+#include <stdlib.h>
 
 #include <algorithm>
 #include <fstream>
+#include <string>
 #include <vector>
 
 #include "AppMisc.h"
@@ -70,6 +73,7 @@ BApplication::BApplication(const char *signature)
 	  fPulseRate{0},
 	  fPulseRunner{nullptr},
 	  fInitError{B_NO_INIT},
+	  fAddOnsThread{-1},
 	  fReadyToRunCalled{false}
 {
 	if (be_app != NULL)
@@ -77,6 +81,23 @@ BApplication::BApplication(const char *signature)
 
 	be_app = this;
 
+	// add-ons load while the rest of the application is set up
+	if (const char *preload = getenv("BE_PRELOAD_ADD_ONS")) {
+		std::string				  list(preload);
+		std::vector<std::string>  paths;
+		std::vector<const char *> pointers;
+		for (size_t start = 0, end; start < list.size(); start = end + 1) {
+			end = list.find(':', start);
+			if (end == std::string::npos)
+				end = list.size();
+			if (end > start)
+				paths.push_back(list.substr(start, end - start));
+		}
+		for (const std::string &path : paths)
+			pointers.push_back(path.c_str());
+		fAddOnsThread = preload_add_ons(pointers.data(), pointers.size());
+	}
+
 	// Application cannot be suspended
 	signal(SIGTSTP, SIG_IGN);
 
@@ -268,12 +289,27 @@ BApplication::~BApplication()
 {
 	Lock();
 
+	_WaitForAddOns();
+
+	// stop pulses before the looper goes away
+	delete fPulseRunner;
+	fPulseRunner = nullptr;
+
 	delete be_roster;
 	be_roster		 = nullptr;
 	be_app_messenger = BMessenger();
 	be_app			 = nullptr;
 }
 
+void BApplication::_WaitForAddOns()
+{
+	if (fAddOnsThread < 0)
+		return;
+	status_t ret;
+	wait_for_thread(fAddOnsThread, &ret);
+	fAddOnsThread = -1;
+}
+
 status_t BApplication::Archive(BMessage *data, bool deep) const
 {
 	debugger(__PRETTY_FUNCTION__);
@@ -426,7 +462,6 @@ bool BApplication::IsLaunching() const
 
 void BApplication::DispatchMessage(BMessage *message, BHandler *handler)
 {
-	ALOGV("DispatchMessage 0x%x: %.4s -> %s", message->what, (char *)&message->what, handler ? handler->Name() : nullptr);
 	if (handler != this) {
 		// it's not ours to dispatch
 		BLooper::DispatchMessage(message, handler);
@@ -495,6 +530,7 @@ void BApplication::DispatchMessage(BMessage *message, BHandler *handler)
 
 		case B_READY_TO_RUN:
 			if (!fReadyToRunCalled) {
+				_WaitForAddOns();
 				ReadyToRun();
 				fReadyToRunCalled = true;
 			}
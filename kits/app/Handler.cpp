@@ -13,7 +13,8 @@ BHandler::BHandler(const char *name)
 	: BArchivable(),
 	  fName{nullptr},
 	  fLooper{nullptr},
-	  fNextHandler{nullptr}
+	  fNextHandler{nullptr},
+	  fToken{-1}
 {
 	SetName(name);
 }
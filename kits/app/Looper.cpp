@@ -6,16 +6,31 @@
 #include <MessageQueue.h>
 #include <doctest/doctest.h>
 #include <log/log.h>
+#include <trace.h>
 
+#include <poll.h>
+
+#include <atomic>
 #include <cstdio>
 #include <map>
 
+/// Max number of messages moved from the looper port per read_port_batch()
+#define LOOPER_PORT_BATCH 8
+/// Per message buffer for batched reads, bigger messages are read alone
+#define LOOPER_PORT_SLOT 2048
+/// Int32 field naming the target handler of a port message
+#define B_HANDLER_TOKEN_FIELD "be:token"
+
 static std::map<thread_id, BLooper *> g_Loopers;
 static std::mutex					  g_LoopersMutex;
+/// Source of handler tokens, every AddHandler() takes a new one, so a
+/// stale token never names a handler added later
+static std::atomic<int32>			  g_NextHandlerToken{1};
 
-BLooper::BLooper(const char *name, int32 priority, int32 _port_capacity)
+BLooper::BLooper(const char *name, int32 priority, int32 port_capacity)
 	: BHandler(name),
 	  fQueue{new BMessageQueue()},
+	  fMsgPort{create_port(port_capacity, name && *name ? name : "BLooper port")},
 	  fLastMessage{nullptr},
 	  fLockSem(create_sem(1, "BLooper Lock")),
 	  fOwnerCount{0},
@@ -49,6 +64,9 @@ BLooper::~BLooper()
 
 	delete fQueue;
 
+	if (fMsgPort >= B_OK)
+		delete_port(fMsgPort);
+
 	RemoveHandler(this);
 
 	// Remove all the "child" handlers
@@ -57,6 +75,7 @@ BLooper::~BLooper()
 		BHandler *handler = (BHandler *)fHandlers.ItemAt(i);
 		handler->SetNextHandler(NULL);
 		handler->SetLooper(NULL);
+		handler->fToken = -1;
 	}
 	fHandlers.MakeEmpty();
 
@@ -96,7 +115,6 @@ status_t BLooper::PostMessage(BMessage *message, BHandler *handler, BHandler *re
 
 void BLooper::DispatchMessage(BMessage *message, BHandler *target)
 {
-	ALOGV("DispatchMessage %p %p", message, target);
 	if (!message || !target) return;
 
 	if (message->what == B_QUIT_REQUESTED && target == this) {
@@ -130,6 +148,14 @@ BMessageQueue *BLooper::MessageQueue() const
 	return fQueue;
 }
 
+bool BLooper::IsMessageWaiting() const
+{
+	if (!fQueue->IsEmpty())
+		return true;
+
+	return fMsgPort >= B_OK && port_count(fMsgPort) > 0;
+}
+
 void BLooper::AddHandler(BHandler *handler)
 {
 	if (!handler) return;
@@ -140,6 +166,7 @@ void BLooper::AddHandler(BHandler *handler)
 		fHandlers.AddItem(handler);
 		handler->SetLooper(this);
 		handler->SetNextHandler(this);
+		handler->fToken = g_NextHandlerToken.fetch_add(1, std::memory_order_relaxed);
 	}
 }
 
@@ -155,6 +182,7 @@ bool BLooper::RemoveHandler(BHandler *handler)
 		}
 		handler->SetNextHandler(nullptr);
 		handler->SetLooper(nullptr);
+		handler->fToken = -1;
 
 		return true;
 	}
@@ -414,6 +442,37 @@ bool BLooper::AssertLocked() const
 	return true;
 }
 
+port_id _get_looper_port_(const BLooper *looper)
+{
+	return looper->fMsgPort;
+}
+
+// Names a handler in messages written straight to the looper port,
+// -1 while it isn't in a looper.
+int32 _get_handler_token_(const BHandler *handler)
+{
+	return handler->fToken;
+}
+
+// Port messages may name their handler by token. Returns false when there
+// is none, otherwise handler is set, to nullptr if it left the looper.
+bool BLooper::_token_handler(BMessage *message, BHandler **_handler)
+{
+	int32 token;
+	if (message->FindInt32(B_HANDLER_TOKEN_FIELD, &token) != B_OK)
+		return false;
+
+	*_handler = nullptr;
+	for (int32 i = 0; i < fHandlers.CountItems(); i++) {
+		BHandler *handler = (BHandler *)fHandlers.ItemAt(i);
+		if (handler->fToken == token) {
+			*_handler = handler;
+			break;
+		}
+	}
+	return true;
+}
+
 status_t BLooper::_PostMessage(BMessage *msg, BHandler *handler, BHandler *reply_to)
 {
 	msg->_set_handler(handler);
@@ -454,17 +513,32 @@ void BLooper::task_looper()
 	if (IsLocked())
 		debugger("task_looper() cannot unlock Looper");
 
+	// wait for messages posted in-process and for messages written to the port
+	struct pollfd fds[2] = {};
+	fds[0].fd	  = _get_thread_data_read_fd();
+	fds[0].events = POLLIN;
+	fds[1].fd	  = fMsgPort >= B_OK ? _get_port_read_fd(fMsgPort) : -1;
+	fds[1].events = POLLIN;
+	if (fds[0].fd < 0)
+		debugger("_get_thread_data_read_fd");
+
 	// loop: As long as we are not terminating.
 	while (!fTerminating) {
 		if (fQueue->IsEmpty()) {
 			ALOGV("waiting for data");
-			thread_id sender;
-			int32	  code = receive_data(&sender, nullptr, 0);
-			if (code < B_OK) {
-				ALOGE("receive_data error 0x%x: %s", code, strerror(-code));
-			}
-			else {
-				ALOGD("received data from %d: 0x%x '%.4s'", sender, code, (char *)&code);
+			if (poll(fds, 2, -1) < 0 && errno != EINTR)
+				debugger("Failed waiting for data");
+
+			// wakeup may be stale, do not block in receive_data()
+			if (has_data(find_thread(NULL))) {
+				thread_id sender;
+				int32	  code = receive_data(&sender, nullptr, 0);
+				if (code < B_OK) {
+					ALOGE("receive_data error 0x%x: %s", code, strerror(-code));
+				}
+				else {
+					ALOGD("received data from %d: 0x%x '%.4s'", sender, code, (char *)&code);
+				}
 			}
 		}
 
@@ -482,18 +556,84 @@ void BLooper::task_looper()
 	ALOGD("BLooper::task_looper() done");
 }
 
+BMessage *BLooper::MessageFromPort(bigtime_t timeout)
+{
+	if (fQueue->IsEmpty())
+		_read_port(timeout);
+
+	return fQueue->NextMessage();
+}
+
+// Moves a batch of flattened messages from the looper port to the queue,
+// so many small messages cost a single port lock and wakeup.
+ssize_t BLooper::_read_port(bigtime_t timeout)
+{
+	if (fMsgPort < B_OK)
+		return B_BAD_PORT_ID;
+
+	ssize_t size = port_buffer_size_etc(fMsgPort, B_RELATIVE_TIMEOUT, timeout);
+	if (size < B_OK)
+		return size;
+
+	if (size > LOOPER_PORT_SLOT) {
+		char *buffer = new char[size];
+		int32 code;
+		ssize_t read = read_port_etc(fMsgPort, &code, buffer, size, B_RELATIVE_TIMEOUT, 0);
+		if (read >= B_OK) {
+			BMessage *message = new BMessage();
+			if (message->Unflatten(buffer) == B_OK)
+				fQueue->AddMessage(message);
+			else
+				delete message;
+		}
+		delete[] buffer;
+		return read < B_OK ? read : 1;
+	}
+
+	char   buffer[LOOPER_PORT_BATCH][LOOPER_PORT_SLOT];
+	void  *buffers[LOOPER_PORT_BATCH];
+	size_t sizes[LOOPER_PORT_BATCH];
+	for (int32 i = 0; i < LOOPER_PORT_BATCH; i++) {
+		buffers[i] = buffer[i];
+		sizes[i]   = LOOPER_PORT_SLOT;
+	}
+
+	ssize_t count = read_port_batch(fMsgPort, nullptr, buffers, sizes, LOOPER_PORT_BATCH, B_RELATIVE_TIMEOUT, 0);
+	for (ssize_t i = 0; i < count; i++) {
+		BMessage *message = new BMessage();
+		if (message->Unflatten(buffer[i]) == B_OK)
+			fQueue->AddMessage(message);
+		else {
+			ALOGE("dropping malformed port message (%zu bytes)", sizes[i]);
+			delete message;
+		}
+	}
+
+	return count;
+}
+
+// Moves everything written to the looper port so far to the queue.
+// A short batch doesn't mean the port is empty, it also ends before a
+// message too big for its slot.
+void BLooper::_drain_port()
+{
+	while (_read_port(0) > 0)
+		;
+}
+
 void BLooper::_drain_message_queue()
 {
+	// pick up messages written to the looper port since last pass
+	_drain_port();
+
 	while ((fLastMessage = fQueue->NextMessage())) {
-		ALOGV_IF(fLastMessage->what != B_MOUSE_MOVED, "fLastMessage: 0x%x: %.4s", fLastMessage->what, (char *)&fLastMessage->what);
 		INFO(*fLastMessage);
 
 		// do we need to break draining to allow for repaint?
 		bool should_break = fLastMessage->what == _UPDATE_IF_NEEDED_;
 
 		BHandler *handler = fLastMessage->_get_handler();
-		if (handler == nullptr) {
-			ALOGV("use preferred target: %p:%s", fPreferred, fPreferred ? fPreferred->Name() : nullptr);
+		if (handler == nullptr && !_token_handler(fLastMessage, &handler)) {
 			handler = fPreferred;
 			if (handler == nullptr)
 				handler = this;
@@ -516,8 +656,13 @@ void BLooper::_drain_message_queue()
 			// Do filtering
 			// handler = _TopLevelFilter(fLastMessage, handler);
 			// ALOGV("_TopLevelFilter(): %p", handler);
-			if (handler && handler->Looper() == this)
+			if (handler && handler->Looper() == this) {
+				uint32 what = fLastMessage->what; // the message may be detached meanwhile
+				record_event(B_RECORD_DISPATCH, what, (intptr_t)handler);
+				BE_TRACE3(looper_dispatch_start, this, what, handler);
 				DispatchMessage(fLastMessage, handler);
+				BE_TRACE2(looper_dispatch_done, this, what);
+			}
 		}
 
 		/// NOTE: mind that message might get detached during dispatch
@@ -594,4 +739,94 @@ TEST_SUITE("BLooper")
 
 		delete loop;
 	}
+
+	TEST_CASE("Handler tokens")
+	{
+		BLooper *loop = new BLooper();
+		BHandler handler;
+		CHECK(_get_handler_token_(&handler) == -1);
+
+		loop->AddHandler(&handler);
+		int32 token = _get_handler_token_(&handler);
+		CHECK(token > _get_handler_token_(loop));
+
+		// messages for the old token must not reach the handler added again
+		loop->RemoveHandler(&handler);
+		CHECK(_get_handler_token_(&handler) == -1);
+		loop->AddHandler(&handler);
+		CHECK(_get_handler_token_(&handler) != token);
+
+		loop->RemoveHandler(&handler);
+		delete loop;
+	}
+
+	struct PortLooper : public BLooper {
+		PortLooper(const char *name)
+			: BLooper(name) {}
+		using BLooper::MessageFromPort;
+	};
+
+	TEST_CASE("Port")
+	{
+		PortLooper *loop = new PortLooper("port test");
+		port_id	 port = _get_looper_port_(loop);
+		REQUIRE(port >= B_OK);
+		CHECK_FALSE(loop->IsMessageWaiting());
+
+		BMessage	message('TST_');
+		ssize_t		size = message.FlattenedSize();
+		char		buffer[3][size];
+		int32		codes[3];
+		const void *buffers[3];
+		size_t		sizes[3];
+		for (int i = 0; i < 3; i++) {
+			message.what = 'TST0' + i;
+			codes[i]	 = B_MESSAGE_TYPE;
+			message.Flatten(buffer[i], size);
+			buffers[i] = buffer[i];
+			sizes[i]   = size;
+		}
+		CHECK(write_port_batch(port, codes, buffers, sizes, 3, 0, 0) == 3);
+		CHECK(loop->IsMessageWaiting());
+
+		BMessage *first = loop->MessageFromPort(0);
+		REQUIRE(first != nullptr);
+		CHECK(first->what == 'TST0');
+		CHECK(loop->MessageQueue()->CountMessages() == 2);
+		delete first;
+
+		delete loop;
+	}
+
+	struct CountingLooper : public BLooper {
+		std::atomic<int32> received{0};
+
+		void MessageReceived(BMessage *message) override
+		{
+			if (message->what == 'TST_')
+				received++;
+			else
+				BLooper::MessageReceived(message);
+		}
+	};
+
+	TEST_CASE("Port wakes running looper")
+	{
+		CountingLooper *loop = new CountingLooper();
+		loop->Run();
+		snooze(1000);
+
+		// nothing else is posted, the port alone must wake the looper
+		BMessage message('TST_');
+		ssize_t	 size = message.FlattenedSize();
+		char	 buffer[size];
+		message.Flatten(buffer, size);
+		CHECK(write_port(_get_looper_port_(loop), B_MESSAGE_TYPE, buffer, size) == B_OK);
+		for (int count = 100; count > 0 && loop->received == 0; --count)
+			snooze(1000);
+		CHECK(loop->received == 1);
+
+		loop->Lock();
+		loop->Quit();
+	}
 }
@@ -13,160 +13,373 @@
 #include <cstring>
 #include <iomanip>
 #include <iostream>
-#include <list>
-#include <vector>
+#include <algorithm>
+
+/// Fields of a message live in one arena, so adding a field or an item
+/// appends to it and copying a message is a single memcpy. The arena holds
+/// three kinds of records, 8 byte aligned and linked by offsets:
+///   Field: type, item count, item table, next field, name
+///   Table: item offsets by index, a full one is left for one twice as big
+///   Item:  capacity, size, data
+/// Small messages fit in the arena inside impl and do not allocate at all.
+/// Messages of more than MESSAGE_INDEX_FIELDS fields get an open addressing
+/// index from name hash to field on their first lookup. The index is a cache
+/// kept out of the arena, a copy builds its own.
+/// NOTE: Data returned by FindData() is valid until the message is changed
+#define MESSAGE_INLINE_ARENA 256
+#define MESSAGE_INDEX_FIELDS 8
+#define MESSAGE_ALIGN(size)	 (((size) + 7) & ~(size_t)7)
+#define MESSAGE_NONE		 UINT32_MAX
+
+struct Field
+{
+	type_code type;
+	uint32	  count;
+	uint32	  capacity;	 // of item table
+	uint32	  items;	 // item table offset
+	uint32	  next;		 // field offset
+	uint32	  hash;	 // of field_key
+	uint8	  name_length;
+	// followed by \0 terminated name
+
+	char *name() const { return reinterpret_cast<char *>(const_cast<Field *>(this) + 1); }
+};
 
-struct DataItem
+struct Item
 {
-	ssize_t		size;
-	const void *data;
-
-	DataItem(ssize_t size, const void *data) : size(size), data(data) {}
-
-	DataItem(const DataItem &)			  = delete;
-	DataItem &operator=(const DataItem &) = delete;
-
-	DataItem(DataItem &&source) : size(source.size), data(source.data)
-	{
-		source.size = 0;
-		source.data = nullptr;
-	}
+	uint32 capacity;  // of data
+	uint64 size;
+	// followed by data
 
-	~DataItem()
-	{
-		free(const_cast<void *>(data));
-	}
+	void *data() const { return const_cast<Item *>(this) + 1; }
 };
 
-struct Node
+/// Item data view, for printing
+struct DataItem
 {
-	std::string			  name;
-	type_code			  type;
-	std::vector<DataItem> data;
+	ssize_t		size;
+	const void *data;
 };
 
 class BMessage::impl
 {
-	/// NOTE: This is list, not forward_list to keep adding order
-	/// This is list not vector to avoid reallocation when creating new node
-	std::list<Node> *m_nodes;
+	char  *m_arena;
+	uint32 m_used;
+	uint32 m_capacity;
+	uint32 m_first;	 // field offsets
+	uint32 m_last;
+	uint32 m_count;	 // of fields
+	alignas(8) char m_inline[MESSAGE_INLINE_ARENA];
+
+	mutable uint32 *m_index;  // field offsets, nullptr until built
+	mutable uint32	m_index_mask;
 
    public:
 	BHandler *handler;
 	BHandler *reply_to;
 
-	impl() : m_nodes{nullptr}, handler{nullptr}, reply_to{nullptr} {}
+	impl()
+		: m_arena{m_inline}, m_used{0}, m_capacity{sizeof(m_inline)},
+		  m_first{MESSAGE_NONE}, m_last{MESSAGE_NONE}, m_count{0},
+		  m_index{nullptr}, m_index_mask{0}, handler{nullptr}, reply_to{nullptr}
+	{
+	}
 
 	~impl()
 	{
-		clearNodes();
+		if (m_arena != m_inline) free(m_arena);
+		free(m_index);
 	}
 
 	impl &operator=(const impl &other)
 	{
-		clearNodes();
-		if (other.m_nodes) {
-			for (auto &node : *other.m_nodes) {
-				const auto data_size = node.data.size();
-				for (auto &d : node.data) {
-					addNode(data_size, node.name.c_str(), node.type, d.size, d.data);
-				}
-			}
-		}
+		if (this == &other) return *this;
+
+		clear();
+		if (!reserve(other.m_used)) return *this;
+		memcpy(m_arena, other.m_arena, other.m_used);
+		m_used	= other.m_used;
+		m_first = other.m_first;
+		m_last	= other.m_last;
+		m_count = other.m_count;
 		return *this;
 	}
 
-	bool hasNodes() const
+	uint32 count() const
 	{
-		return m_nodes;
+		return m_count;
 	}
 
-	std::list<Node> &nodes()
+	const Field *firstField() const
 	{
-		if (m_nodes == nullptr) m_nodes = new std::list<Node>();
-		return *m_nodes;
+		return field(m_first);
 	}
 
-	/// Copy given data to NodeData
-	status_t addNode(int32 count, const char *const name, type_code type,
-					 ssize_t size, const void *const data);
+	const Field *nextField(const Field *field) const
+	{
+		return this->field(field->next);
+	}
 
-	/// Takes ownership of given *data into NodeData
-	/// Always make copy of *name string
-	status_t pushNode(int32 count, const char *const name, type_code type,
-					  ssize_t size, const void *const data);
+	/// WARNING! index must be below field->count
+	const Item *itemAt(const Field *field, uint32 index) const
+	{
+		return item(items(field)[index]);
+	}
+
+	/// Copy given data to the field of given name, adding the field if needed
+	/// count is a hint of how many items the field is going to have
+	status_t addData(int32 count, const field_key &key, type_code type,
+					 ssize_t size, const void *data);
 
-	void clearNodes()
+	status_t replaceData(const field_key &key, type_code type, int32 index,
+						 ssize_t size, const void *data);
+
+	/// Keeps the arena for reuse
+	void clear()
 	{
-		if (m_nodes) {
-			delete m_nodes;
-			m_nodes = nullptr;
-		}
+		m_used	= 0;
+		m_first = MESSAGE_NONE;
+		m_last	= MESSAGE_NONE;
+		m_count = 0;
+		dropIndex();
+	}
+
+	status_t findData(const field_key &key, type_code type, int32 index, const Item **item) const;
+
+   private:
+	Field *field(uint32 offset) const
+	{
+		return offset == MESSAGE_NONE ? nullptr : reinterpret_cast<Field *>(m_arena + offset);
+	}
+
+	Item *item(uint32 offset) const
+	{
+		return offset == MESSAGE_NONE ? nullptr : reinterpret_cast<Item *>(m_arena + offset);
+	}
+
+	uint32 *items(const Field *field) const
+	{
+		return reinterpret_cast<uint32 *>(m_arena + field->items);
+	}
+
+	static size_t tableSize(uint32 capacity)
+	{
+		return MESSAGE_ALIGN(capacity * sizeof(uint32));
 	}
 
-	status_t findData(const char *name, type_code type, int32 index, DataItem **dataItem) const;
+	bool reserve(size_t size);
+
+	uint32 findField(const field_key &key) const;
+
+	/// Builds the index, if the message has enough fields to need one
+	void buildIndex() const;
+
+	void indexField(uint32 offset) const;
+
+	void dropIndex() const
+	{
+		free(m_index);
+		m_index		 = nullptr;
+		m_index_mask = 0;
+	}
+
+	/// Appends item record of given capacity and copies data into it
+	uint32 appendItem(size_t capacity, ssize_t size, const void *data);
 };
 
-status_t BMessage::impl::addNode(int32 count, const char *const name, type_code type,
-								 ssize_t size, const void *const data)
+bool BMessage::impl::reserve(size_t size)
 {
-	auto data_copy = malloc(size);
-	if (!data_copy) return B_NO_MEMORY;
-	memcpy(data_copy, data, size);
+	if (size <= m_capacity) return true;
+	if (size > MESSAGE_NONE) return false;
+
+	size_t capacity = std::min<size_t>(std::max<size_t>(size, (size_t)m_capacity * 2), MESSAGE_NONE);
+	char  *arena;
+	if (m_arena == m_inline) {
+		arena = static_cast<char *>(malloc(capacity));
+		if (arena) memcpy(arena, m_inline, m_used);
+	}
+	else {
+		arena = static_cast<char *>(realloc(m_arena, capacity));
+	}
+	if (!arena) return false;
 
-	return pushNode(count, name, type, size, data_copy);
+	m_arena	   = arena;
+	m_capacity = capacity;
+	return true;
 }
 
-status_t BMessage::impl::pushNode(int32 count, const char *const name, type_code type,
-								  ssize_t size, const void *const data)
+void BMessage::impl::buildIndex() const
 {
-	auto &nodes = this->nodes();
+	if (m_count <= MESSAGE_INDEX_FIELDS) return;
 
-	Node *node = nullptr;
-	for (auto &el : nodes) {
-		if (strncmp(el.name.c_str(), name, B_FIELD_NAME_LENGTH) == 0) {
-			if (el.type != type) {
-				free(const_cast<void *>(data));
-				return B_BAD_TYPE;
-			}
+	// at most half full
+	uint32 size = 32;
+	while (size < m_count * 2) size *= 2;
+	m_index = static_cast<uint32 *>(malloc(size * sizeof(uint32)));
+	if (!m_index) return;  // lookups stay linear
+	memset(m_index, 0xff, size * sizeof(uint32));
+	m_index_mask = size - 1;
+
+	for (const Field *el = firstField(); el; el = nextField(el))
+		indexField(reinterpret_cast<const char *>(el) - m_arena);
+}
 
-			node = &el;
-			break;
+/// WARNING! m_index must not be full
+void BMessage::impl::indexField(uint32 offset) const
+{
+	uint32 slot = field(offset)->hash & m_index_mask;
+	while (m_index[slot] != MESSAGE_NONE) slot = (slot + 1) & m_index_mask;
+	m_index[slot] = offset;
+}
+
+uint32 BMessage::impl::findField(const field_key &key) const
+{
+	if (!m_index) buildIndex();
+
+	if (m_index) {
+		for (uint32 slot = key.hash & m_index_mask; m_index[slot] != MESSAGE_NONE; slot = (slot + 1) & m_index_mask) {
+			const Field *el = field(m_index[slot]);
+			if (el->hash == key.hash && el->name_length == key.length && memcmp(el->name(), key.name, key.length) == 0)
+				return m_index[slot];
 		}
+		return MESSAGE_NONE;
 	}
-	if (!node) {
-		Node new_node{std::string(name, strnlen(name, B_FIELD_NAME_LENGTH)), type};
-		new_node.data.reserve(count);
-		nodes.push_back(std::move(new_node));
-		node = &nodes.back();
+
+	for (const Field *el = firstField(); el; el = nextField(el)) {
+		if (el->hash == key.hash && el->name_length == key.length && memcmp(el->name(), key.name, key.length) == 0)
+			return reinterpret_cast<const char *>(el) - m_arena;
 	}
+	return MESSAGE_NONE;
+}
 
-	DataItem data_item(size, data);
-	node->data.push_back(std::move(data_item));
-	return B_OK;
+uint32 BMessage::impl::appendItem(size_t capacity, ssize_t size, const void *data)
+{
+	const uint32 offset = m_used;
+	Item		*item	= this->item(offset);
+	item->capacity		= capacity;
+	item->size			= size;
+	if (size) memcpy(item->data(), data, size);
+	m_used += sizeof(Item) + capacity;
+	return offset;
 }
 
-status_t BMessage::impl::findData(const char *name, type_code type, int32 index, DataItem **dataItem) const
+status_t BMessage::impl::addData(int32 count, const field_key &key, type_code type,
+								 ssize_t size, const void *data)
 {
-	if (!name || !dataItem) return B_BAD_VALUE;
+	if (!key.name || size < 0 || (size && !data)) return B_BAD_VALUE;
 
-	if (m_nodes)
-		for (auto &node : *m_nodes) {
-			if (strncmp(node.name.c_str(), name, B_FIELD_NAME_LENGTH) == 0) {
-				if (type != B_ANY_TYPE && node.type != type) {
-					return B_BAD_TYPE;
-				}
+	const size_t name_length = key.length;
+	uint32		 field		 = findField(key);
+	if (field != MESSAGE_NONE && this->field(field)->type != type) return B_BAD_TYPE;
 
-				if (index > node.data.size()) {
-					return B_BAD_INDEX;
-				}
+	// a new field gets a table for count items, a full one twice the size
+	uint32 table = 0;
+	if (field == MESSAGE_NONE)
+		table = std::max(count, 1);
+	else if (this->field(field)->count == this->field(field)->capacity)
+		table = this->field(field)->capacity * 2;
 
-				*dataItem = &node.data[index];
-				return B_OK;
-			}
+	const size_t capacity	= MESSAGE_ALIGN(size);
+	const size_t item_size	= sizeof(Item) + capacity;
+	const size_t field_size = field == MESSAGE_NONE ? MESSAGE_ALIGN(sizeof(Field) + name_length + 1) : 0;
+
+	// data may be in the arena, that moves when growing
+	const bool	 inside = data >= m_arena && data < m_arena + m_used;
+	const size_t offset = inside ? static_cast<const char *>(data) - m_arena : 0;
+	if (!reserve(m_used + field_size + tableSize(table) + item_size * (field_size ? table : 1))) {
+		if (field_size) table = 1;
+		if (!reserve(m_used + field_size + tableSize(table) + item_size)) return B_NO_MEMORY;
+	}
+	if (inside) data = m_arena + offset;
+
+	if (field == MESSAGE_NONE) {
+		field				   = m_used;
+		Field *new_field	   = this->field(field);
+		new_field->type		   = type;
+		new_field->count	   = 0;
+		new_field->capacity	   = 0;
+		new_field->items	   = MESSAGE_NONE;
+		new_field->next		   = MESSAGE_NONE;
+		new_field->hash		   = key.hash;
+		new_field->name_length = name_length;
+		memcpy(new_field->name(), key.name, name_length);
+		new_field->name()[name_length] = '\0';
+		m_used += field_size;
+
+		if (m_last != MESSAGE_NONE)
+			this->field(m_last)->next = field;
+		else
+			m_first = field;
+		m_last = field;
+		m_count += 1;
+
+		if (m_index) {
+			if (m_count * 2 > m_index_mask + 1)
+				dropIndex();  // rebuilt bigger by the next lookup
+			else
+				indexField(field);
 		}
+	}
+
+	Field *node = this->field(field);
+	if (table) {
+		if (node->count) memcpy(m_arena + m_used, items(node), node->count * sizeof(uint32));
+		node->items	   = m_used;
+		node->capacity = table;
+		m_used += tableSize(table);
+	}
 
-	return B_NAME_NOT_FOUND;
+	const uint32 item = appendItem(capacity, size, data);
+	items(node)[node->count++] = item;
+	return B_OK;
+}
+
+status_t BMessage::impl::replaceData(const field_key &key, type_code type, int32 index,
+									 ssize_t size, const void *data)
+{
+	if (size < 0 || (size && !data)) return B_BAD_VALUE;
+
+	const Item *found;
+	status_t	status = findData(key, type, index, &found);
+	if (status != B_OK) return status;
+
+	Item *item = const_cast<Item *>(found);
+	if ((size_t)size <= item->capacity) {
+		if (size) memmove(item->data(), data, size);
+		item->size = size;
+		return B_OK;
+	}
+
+	// does not fit, append a new item in place of the old one and leave the old one unused
+	const size_t capacity  = MESSAGE_ALIGN(size);
+	const uint32 field	   = findField(key);
+	const bool	 inside	   = data >= m_arena && data < m_arena + m_used;
+	const size_t offset	   = inside ? static_cast<const char *>(data) - m_arena : 0;
+	if (!reserve(m_used + sizeof(Item) + capacity)) return B_NO_MEMORY;
+	if (inside) data = m_arena + offset;
+
+	const uint32 replaced			 = appendItem(capacity, size, data);
+	items(this->field(field))[index] = replaced;
+	return B_OK;
+}
+
+status_t BMessage::impl::findData(const field_key &key, type_code type, int32 index, const Item **item) const
+{
+	if (!key.name || !item) return B_BAD_VALUE;
+
+	const Field *field = this->field(findField(key));
+	if (!field) return B_NAME_NOT_FOUND;
+
+	if (type != B_ANY_TYPE && field->type != type) {
+		return B_BAD_TYPE;
+	}
+
+	if (index < 0 || (uint32)index >= field->count) {
+		return B_BAD_INDEX;
+	}
+
+	*item = itemAt(field, index);
+	return B_OK;
 }
 
 void	  BMessage::_set_handler(BHandler *handler) { m->handler = handler; }
@@ -203,17 +416,18 @@ BMessage &BMessage::operator=(const BMessage &msg)
 
 int32 BMessage::CountNames(type_code type) const
 {
+	if (type == B_ANY_TYPE) return m->count();
+
 	int32 count = 0;
-	if (m->hasNodes())
-		for (auto &node : m->nodes()) {
-			if (type == B_ANY_TYPE || type == node.type) count += 1;
-		}
+	for (const Field *field = m->firstField(); field; field = m->nextField(field)) {
+		if (type == field->type) count += 1;
+	}
 	return count;
 }
 
 bool BMessage::IsEmpty() const
 {
-	return !m->hasNodes() || m->nodes().empty();
+	return m->count() == 0;
 }
 
 bool BMessage::IsSystem() const
@@ -318,16 +532,15 @@ ssize_t BMessage::FlattenedSize() const
 {
 	ssize_t size = sizeof(uint32);
 	size += sizeof(type_code);	// place for the terminating \0
-	if (m->hasNodes()) {
-		for (auto &node : m->nodes()) {
-			size += sizeof(type_code);	 // type
-			size += sizeof(uint8);		 // name length
-			size += node.name.length();	 // name
-			size += sizeof(uint32);		 // data vector length
-			for (auto &d : node.data) {
-				size += sizeof(uint64);	 // data item size
-				size += d.size;			 // data item
-			}
+	for (const Field *field = m->firstField(); field; field = m->nextField(field)) {
+		size += sizeof(type_code);	  // type
+		size += sizeof(uint8);		  // name length
+		size += field->name_length;	  // name
+		size += sizeof(uint32);		  // data vector length
+		for (uint32 i = 0; i < field->count; i++) {
+			const Item *item = m->itemAt(field, i);
+			size += sizeof(uint64);	 // data item size
+			size += item->size;		 // data item
 		}
 	}
 	return size;
@@ -343,53 +556,48 @@ status_t BMessage::Flatten(char *buffer, ssize_t max_size) const
 	*((uint32 *)current) = this->what;
 	current += sizeof(uint32);
 
-	if (m->hasNodes()) {
-		for (auto &node : m->nodes()) {
-			// type
-			const type_code type = node.type;
-			write_size += sizeof(type_code);
+	for (const Field *field = m->firstField(); field; field = m->nextField(field)) {
+		// type
+		const type_code type = field->type;
+		write_size += sizeof(type_code);
+		if (write_size > max_size) return B_NO_MEMORY;
+		*((type_code *)current) = type;
+		current += sizeof(type_code);
+
+		// name length
+		const uint8 name_length = field->name_length;
+		write_size += sizeof(uint8);
+		if (write_size > max_size) return B_NO_MEMORY;
+		*((uint8 *)current) = name_length;
+		current += sizeof(uint8);
+
+		// name
+		write_size += name_length;
+		if (write_size > max_size) return B_NO_MEMORY;
+		memcpy(current, field->name(), name_length);
+		current += name_length;
+
+		// data vector length
+		write_size += sizeof(uint32);
+		if (write_size > max_size) return B_NO_MEMORY;
+		*((uint32 *)current) = field->count;
+		current += sizeof(uint32);
+
+		// data vector items
+		for (uint32 i = 0; i < field->count; i++) {
+			const Item *item = m->itemAt(field, i);
+			// data item size
+			const uint64 data_item_size = item->size;
+			write_size += sizeof(uint64);
 			if (write_size > max_size) return B_NO_MEMORY;
-			*((type_code *)current) = type;
-			current += sizeof(type_code);
+			*((uint64 *)current) = data_item_size;
+			current += sizeof(uint64);
 
-			// name length
-			const auto name_length = node.name.length();
-			if (name_length > std::numeric_limits<uint8>::max()) return B_BAD_VALUE;
-			write_size += sizeof(uint8);
+			// data item
+			write_size += data_item_size;
 			if (write_size > max_size) return B_NO_MEMORY;
-			*((uint8 *)current) = static_cast<uint8>(name_length);
-			current += sizeof(uint8);
-
-			// name
-			write_size += name_length;
-			if (write_size > max_size) return B_NO_MEMORY;
-			memcpy(current, node.name.c_str(), name_length);
-			current += name_length;
-
-			// data vector length
-			const auto data_size = node.data.size();
-			if (data_size > std::numeric_limits<uint32>::max()) return B_BAD_VALUE;
-			write_size += sizeof(uint32);
-			if (write_size > max_size) return B_NO_MEMORY;
-			*((uint32 *)current) = static_cast<uint32>(data_size);
-			current += sizeof(uint32);
-
-			// data vector items
-			for (auto &d : node.data) {
-				// data item size
-				const auto data_item_size = d.size;
-				if (data_item_size > std::numeric_limits<uint64>::max()) return B_BAD_VALUE;
-				write_size += sizeof(uint64);
-				if (write_size > max_size) return B_NO_MEMORY;
-				*((uint64 *)current) = static_cast<uint64>(data_item_size);
-				current += sizeof(uint64);
-
-				// data item
-				write_size += data_item_size;
-				if (write_size > max_size) return B_NO_MEMORY;
-				memcpy(current, d.data, data_item_size);
-				current += data_item_size;
-			}
+			memcpy(current, item->data(), data_item_size);
+			current += data_item_size;
 		}
 	}
 
@@ -408,7 +616,7 @@ status_t BMessage::Flatten(BDataIO *stream, ssize_t *size) const
 
 status_t BMessage::Unflatten(const char *buf)
 {
-	m->clearNodes();
+	m->clear();
 
 	this->what = *((uint32 *)buf);
 	buf += sizeof(uint32);
@@ -459,7 +667,7 @@ bool BMessage::HasSpecifiers() const
 status_t BMessage::AddData(const char *name, type_code type, const void *data,
 						   ssize_t num_bytes, bool is_fixed_size, int32 count)
 {
-	return m->addNode(count, name, type, num_bytes, data);
+	return m->addData(count, field_key(name), type, num_bytes, data);
 }
 
 status_t BMessage::RemoveData(const char *name, int32 index)
@@ -476,7 +684,7 @@ status_t BMessage::RemoveName(const char *name)
 
 status_t BMessage::MakeEmpty()
 {
-	m->clearNodes();
+	m->clear();
 	return B_OK;
 }
 
@@ -487,11 +695,17 @@ status_t BMessage::FindData(const char *name, type_code type, const void **data,
 
 status_t BMessage::FindData(const char *name, type_code type, int32 index, const void **data, ssize_t *size) const
 {
-	if (!name || !data || !size) return B_BAD_VALUE;
+	if (!name) return B_BAD_VALUE;
+
+	return FindData(field_key(name), type, index, data, size);
+}
+
+status_t BMessage::FindData(const field_key &key, type_code type, int32 index, const void **data, ssize_t *size) const
+{
+	if (!key.name || !data || !size) return B_BAD_VALUE;
 
-	DataItem *data_item = nullptr;
-	status_t  status	= m->findData(name, type, index, &data_item);
-	if (status == B_OK && !data_item) status = B_ERROR;
+	const Item *item   = nullptr;
+	status_t	status = m->findData(key, type, index, &item);
 
 	if (status != B_OK) {
 		*data = nullptr;
@@ -499,8 +713,8 @@ status_t BMessage::FindData(const char *name, type_code type, int32 index, const
 		return status;
 	};
 
-	*data = data_item->data;
-	*size = data_item->size;
+	*data = item->data();
+	*size = item->size;
 	return B_OK;
 }
 
@@ -513,20 +727,9 @@ status_t BMessage::ReplaceData(const char *name, type_code type, int32 index, co
 {
 	if (type == B_ANY_TYPE) return B_BAD_TYPE;
 
-	DataItem *data_item = nullptr;
-	status_t  status	= m->findData(name, type, index, &data_item);
-	if (status == B_OK && !data_item) status = B_ERROR;
+	if (!name) return B_BAD_VALUE;
 
-	if (status != B_OK) return status;
-
-	auto data_copy = malloc(data_size);
-	if (!data_copy) return B_NO_MEMORY;
-	memcpy(data_copy, data, data_size);
-
-	free(const_cast<void *>(data_item->data));
-	data_item->data = data_copy;
-	data_item->size = data_size;
-	return B_OK;
+	return m->replaceData(field_key(name), type, index, data_size, data);
 }
 
 #pragma mark - Macro definitions for data access methods
@@ -995,14 +1198,16 @@ std::ostream &operator<<(std::ostream &os, const BMessage &value)
 
 	os << buf << ")";
 
-	if (value.m->hasNodes()) {
+	if (value.m->count()) {
 		os << std::endl;
 		size_t index = 0;
-		for (auto &node : value.m->nodes()) {
-			sprint_code(buf, &node.type);
-			os << '#' << index << ' ' << node.name << ", type = " << buf << ", count = " << node.data.size() << std::endl;
+		for (const Field *field = value.m->firstField(); field; field = value.m->nextField(field)) {
+			sprint_code(buf, &field->type);
+			os << '#' << index << ' ' << field->name() << ", type = " << buf << ", count = " << field->count << std::endl;
 
-			for (auto &d : node.data) {
+			for (uint32 i = 0; i < field->count; i++) {
+				const Item	  *item = value.m->itemAt(field, i);
+				const DataItem d{(ssize_t)item->size, item->data()};
 				os << ' ' << d.data << ' ' << d.size << " bytes" << std::endl;
 				os << d;
 			}
@@ -1162,4 +1367,112 @@ TEST_SUITE("BMessage")
 		test.FindPoint("point", &loaded_point);
 		CHECK(point == loaded_point);
 	}
+	TEST_CASE("Arena growth")
+	{
+		BMessage test('_TS_');
+		char	  name[16];
+		for (int32 i = 0; i < 100; i++) {
+			snprintf(name, sizeof(name), "field%d", i);
+			CHECK(test.AddInt32(name, i) == B_OK);
+			CHECK(test.AddInt32("all", i) == B_OK);
+		}
+		CHECK(test.CountNames(B_INT32_TYPE) == 101);
+
+		BMessage copy(test);
+		test.MakeEmpty();
+		int32 value;
+		for (int32 i = 0; i < 100; i++) {
+			snprintf(name, sizeof(name), "field%d", i);
+			CHECK(copy.FindInt32(name, &value) == B_OK);
+			CHECK(value == i);
+			CHECK(copy.FindInt32("all", i, &value) == B_OK);
+			CHECK(value == i);
+		}
+		CHECK(copy.FindInt32("all", 100, &value) == B_BAD_INDEX);
+		CHECK(copy.FindInt32("missing", &value) == B_NAME_NOT_FOUND);
+	}
+	TEST_CASE("Field index")
+	{
+		static constexpr field_key kKey("field42");
+		static_assert(kKey.length == 7);
+		CHECK(kKey.hash == field_key("field42").hash);
+
+		BMessage test('_TS_');
+		char	 name[16];
+		for (int32 i = 0; i < 64; i++) {
+			snprintf(name, sizeof(name), "field%d", i);
+			CHECK(test.AddInt32(name, i) == B_OK);
+			CHECK(test.AddInt32(name, -i) == B_OK);
+			CHECK(test.AddBool(name, true) == B_BAD_TYPE);
+		}
+
+		const void *data;
+		ssize_t		size;
+		CHECK(test.FindData(kKey, B_INT32_TYPE, 1, &data, &size) == B_OK);
+		CHECK(*static_cast<const int32 *>(data) == -42);
+		CHECK(test.FindData(kKey, B_BOOL_TYPE, 0, &data, &size) == B_BAD_TYPE);
+		CHECK(test.FindData("field64", B_INT32_TYPE, 0, &data, &size) == B_NAME_NOT_FOUND);
+
+		// copies and emptied messages index their own fields
+		BMessage copy(test);
+		test.MakeEmpty();
+		CHECK(test.FindData(kKey, B_INT32_TYPE, 0, &data, &size) == B_NAME_NOT_FOUND);
+		CHECK(copy.ReplaceInt32("field63", 1, 63) == B_OK);
+		int32 value;
+		CHECK(copy.FindInt32("field63", 1, &value) == B_OK);
+		CHECK(value == 63);
+		CHECK(copy.CountNames(B_INT32_TYPE) == 64);
+	}
+	TEST_CASE("Replace with larger data")
+	{
+		BMessage test('_TS_');
+		test.AddString("test", "a");
+		test.AddString("test", "b");
+		test.AddString("test", "c");
+		test.AddInt8("after", 7);
+
+		CHECK(test.ReplaceString("test", 1, "longer than the item was") == B_OK);
+		CHECK(test.ReplaceString("test", 2, "the last one, longer too") == B_OK);
+
+		const char *value;
+		CHECK(test.FindString("test", 0, &value) == B_OK);
+		CHECK(std::string(value) == "a");
+		CHECK(test.FindString("test", 1, &value) == B_OK);
+		CHECK(std::string(value) == "longer than the item was");
+		CHECK(test.FindString("test", 2, &value) == B_OK);
+		CHECK(std::string(value) == "the last one, longer too");
+
+		// items added after the replaced last one keep the order
+		test.AddString("test", "d");
+		CHECK(test.FindString("test", 3, &value) == B_OK);
+		CHECK(std::string(value) == "d");
+
+		int8 after;
+		CHECK(test.FindInt8("after", &after) == B_OK);
+		CHECK(after == 7);
+
+		// data of the message itself
+		CHECK(test.FindString("test", 1, &value) == B_OK);
+		CHECK(test.AddString("copy", value) == B_OK);
+		CHECK(test.FindString("copy", &value) == B_OK);
+		CHECK(std::string(value) == "longer than the item was");
+	}
+	TEST_CASE("Items by index")
+	{
+		BMessage test('_TS_');
+		int32	 value = 0;
+		CHECK(test.AddData("hinted", B_INT32_TYPE, &value, sizeof(value), true, 1000) == B_OK);
+		for (value = 1; value < 1000; value++) CHECK(test.AddInt32("hinted", value) == B_OK);
+
+		ssize_t size = test.FlattenedSize();
+		char	buffer[size];
+		CHECK(test.Flatten(buffer, size) == B_OK);
+		BMessage copy;
+		CHECK(copy.Unflatten(buffer) == B_OK);
+		for (int32 i = 999; i >= 0; i--) {
+			CHECK(copy.FindInt32("hinted", i, &value) == B_OK);
+			CHECK(value == i);
+		}
+		CHECK(copy.FindInt32("hinted", 1000, &value) == B_BAD_INDEX);
+	}
 }
@@ -1,43 +1,178 @@
 #include "MessageRunner.h"
 
+#include <Application.h>
+#include <Looper.h>
+#include <Message.h>
 #include <pimpl.h>
 
+#include <mutex>
+
+/* Runners are timers of the team timer service, so any number of them
+ * share one thread. Slack lets runners with nearby deadlines fire in the
+ * same wakeup, after which they stay in phase.
+ */
+#define RUNNER_SLACK_DIVISOR 16
+#define RUNNER_SLACK_MAX 10000
+
 class BMessageRunner::impl
 {
+   public:
+	BMessenger target;
+	BMessenger reply_to;
+	BMessage   message;
+	bigtime_t  interval;
+	int32	   count;  // remaining, negative for unlimited
+	timer_id   timer;
+	status_t   status;
+	std::mutex lock;
+
+	void start(BMessenger target, const BMessage *msg, bigtime_t interval, int32 count, BMessenger reply_to);
+	status_t schedule();
+
+	static void fire(void *data);
 };
 
+void BMessageRunner::impl::start(BMessenger target, const BMessage *msg, bigtime_t interval, int32 count, BMessenger reply_to)
+{
+	this->target   = target;
+	this->reply_to = reply_to;
+	this->interval = interval;
+	this->count	   = count;
+	this->timer	   = -1;
+
+	if (!msg || interval <= 0 || count == 0) {
+		status = B_BAD_VALUE;
+		return;
+	}
+	message = *msg;
+
+	std::lock_guard<std::mutex> guard(lock);
+	status = schedule();
+}
+
+/* WARNING! you need to lock impl in caller function! */
+status_t BMessageRunner::impl::schedule()
+{
+	if (timer >= 0)
+		return reset_timer(timer, system_time() + interval, interval);
+
+	bigtime_t slack = min_c(interval / RUNNER_SLACK_DIVISOR, RUNNER_SLACK_MAX);
+	timer_id  id	= add_timer(fire, this, system_time() + interval, interval, slack);
+	if (id < 0)
+		return id;
+	timer = id;
+	return B_OK;
+}
+
+void BMessageRunner::impl::fire(void *data)
+{
+	impl	*m	   = static_cast<impl *>(data);
+	timer_id done = -1;
+
+	{
+		std::lock_guard<std::mutex> guard(m->lock);
+		if (m->count > 0)
+			m->count--;
+	}
+
+	// post to the target looper's queue even for handler targets, the
+	// handler must only run on its looper thread. Posting doesn't wait for
+	// the looper, which is only woken through its mailbox when that's empty.
+	BLooper	*looper;
+	BHandler *handler = m->target.Target(&looper);
+	if (handler && !looper)
+		looper = handler->Looper();
+	if (looper) {
+		BHandler *reply_handler = m->reply_to.Target(nullptr);
+		if (!reply_handler)
+			reply_handler = be_app_messenger.Target(nullptr);
+		looper->_PostMessage(new BMessage(m->message), handler, reply_handler);
+	}
+
+	// timer is kept until here, so the destructor cancels it and waits for us
+	{
+		std::lock_guard<std::mutex> guard(m->lock);
+		if (m->count == 0) {
+			done	 = m->timer;
+			m->timer = -1;
+		}
+	}
+
+	// impl may be gone once unlocked
+	if (done >= 0)
+		cancel_timer(done);
+}
+
 BMessageRunner::BMessageRunner(BMessenger target, const BMessage *msg, bigtime_t interval, int32 count)
 {
+	m->start(target, msg, interval, count, BMessenger());
 }
 
 BMessageRunner::BMessageRunner(BMessenger target, const BMessage *msg, bigtime_t interval, int32 count, BMessenger reply_to)
 {
+	m->start(target, msg, interval, count, reply_to);
 }
 
 BMessageRunner::~BMessageRunner()
 {
+	timer_id timer;
+	{
+		std::lock_guard<std::mutex> guard(m->lock);
+		timer	 = m->timer;
+		m->timer = -1;
+	}
+	// waits for a hook in progress
+	if (timer >= 0)
+		cancel_timer(timer);
 }
 
 status_t BMessageRunner::InitCheck() const
 {
-	debugger(__PRETTY_FUNCTION__);
-	return B_ERROR;
+	return m->status;
 }
 
 status_t BMessageRunner::SetInterval(bigtime_t interval)
 {
-	debugger(__PRETTY_FUNCTION__);
-	return B_ERROR;
+	if (interval <= 0)
+		return B_BAD_VALUE;
+
+	std::lock_guard<std::mutex> guard(m->lock);
+	if (m->status != B_OK)
+		return m->status;
+	if (m->timer < 0)
+		return B_BAD_VALUE;
+
+	m->interval = interval;
+	return m->schedule();
 }
 
 status_t BMessageRunner::SetCount(int32 count)
 {
-	debugger(__PRETTY_FUNCTION__);
-	return B_ERROR;
+	if (count == 0)
+		return B_BAD_VALUE;
+
+	std::lock_guard<std::mutex> guard(m->lock);
+	if (m->status != B_OK)
+		return m->status;
+
+	m->count = count;
+	// a finished runner starts over
+	if (m->timer < 0)
+		return m->schedule();
+	return B_OK;
 }
 
 status_t BMessageRunner::GetInfo(bigtime_t *interval, int32 *count) const
 {
-	debugger(__PRETTY_FUNCTION__);
-	return B_ERROR;
+	std::lock_guard<std::mutex> guard(m->lock);
+	if (m->status != B_OK)
+		return m->status;
+	if (m->timer < 0)
+		return B_BAD_VALUE;
+
+	if (interval)
+		*interval = m->interval;
+	if (count)
+		*count = m->count;
+	return B_OK;
 }
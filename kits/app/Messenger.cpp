@@ -116,14 +116,14 @@ status_t BMessenger::SendMessage(BMessage *message, BMessenger reply_to, bigtime
 		BLooper	*looper;
 		BHandler *handler = Target(&looper);
 		if (handler) {
-			ALOGV("handler delivery 0x%x: %.4s to '%s'", message->what, (char *)&message->what, handler->Name());
+			record_event(B_RECORD_MESSAGE_SEND, message->what, (intptr_t)handler);
 			handler->MessageReceived(message);
 			return B_OK;
 		}
 		else if (looper) {
 			BHandler *reply_handler = reply_to.Target(nullptr);
 			if (!reply_handler) reply_handler = be_app_messenger.Target(nullptr);
-			ALOGV("looper delivery 0x%x: %.4s to '%s' (reply: %p)", message->what, (char *)&message->what, looper->Name(), reply_handler);
+			record_event(B_RECORD_MESSAGE_SEND, message->what, (intptr_t)looper);
 			return looper->PostMessage(message, nullptr, reply_handler);
 		}
 		else {
@@ -23,6 +23,7 @@
 #include <doctest/doctest.h>
 #include <log/log.h>
 #include <pimpl.h>
+#include <trace.h>
 
 #include <stack>
 #include <vector>
@@ -219,6 +220,18 @@ void BView::AllDetached()
 	// The default version of this functions is empty.
 }
 
+/// Mouse messages are the hottest, so their field name is hashed at compile time
+static constexpr field_key kViewWhere("be:view_where");
+
+static status_t _find_view_where(const BMessage *message, BPoint *where)
+{
+	const void *data;
+	ssize_t		size;
+	status_t	status = message->FindData(kViewWhere, B_POINT_TYPE, 0, &data, &size);
+	if (status == B_OK) *where = *static_cast<const BPoint *>(data);
+	return status;
+}
+
 void BView::MessageReceived(BMessage *message)
 {
 	ALOGV_IF(message->what != B_MOUSE_MOVED, "MessageReceived @%s 0x%x: %.4s", Name(), message->what, (char *)&message->what);
@@ -250,9 +263,12 @@ void BView::MessageReceived(BMessage *message)
 						}
 					}
 
+					BE_TRACE5(view_update_start, this, (int)updateRect.left, (int)updateRect.top, (int)updateRect.right,
+							  (int)updateRect.bottom);
 					SkCanvas *canvas = static_cast<SkCanvas *>(fOwner->_get_canvas());
 					if (!canvas) {
 						// FIXME: now what? ¯\_(ツ)_/¯
+						BE_TRACE1(view_update_done, this);
 						return;
 					}
 					canvas->restoreToCount(0);
@@ -318,6 +334,7 @@ void BView::MessageReceived(BMessage *message)
 					canvas->restoreToCount(0);	// free memory
 
 					fOwner->_damage_window({clipRect.left(), clipRect.top()}, {clipRect.right(), clipRect.bottom()});
+					BE_TRACE1(view_update_done, this);
 				}
 				else {
 					LOG_FATAL("_UPDATE_ with invalid updateRect");
@@ -352,7 +369,7 @@ void BView::MessageReceived(BMessage *message)
 			case B_MOUSE_MOVED: {
 				BPoint where;
 				uint32 transit = 0;
-				if (message->FindPoint("be:view_where", &where) == B_OK
+				if (_find_view_where(message, &where) == B_OK
 					&& message->FindUInt32("be:transit", &transit) == B_OK) {
 					BMessage *dragMessage = new BMessage();
 					if (message->FindMessage("be:drag_message", dragMessage) != B_OK) {
@@ -368,14 +385,14 @@ void BView::MessageReceived(BMessage *message)
 
 			case B_MOUSE_DOWN: {
 				BPoint where;
-				if (message->FindPoint("be:view_where", &where) == B_OK)
+				if (_find_view_where(message, &where) == B_OK)
 					MouseDown(where);
 				break;
 			}
 
 			case B_MOUSE_UP: {
 				BPoint where;
-				if (message->FindPoint("be:view_where", &where) == B_OK)
+				if (_find_view_where(message, &where) == B_OK)
 					MouseUp(where);
 				fMouseEventMask	   = 0;
 				fMouseEventOptions = 0;
@@ -20,6 +20,7 @@
 #include <View.h>
 #include <log/log.h>
 #include <pimpl.h>
+#include <trace.h>
 #include <sys/epoll.h>
 #include <sys/mman.h>
 #include <syscall.h>
@@ -2631,6 +2632,15 @@ void BWindow::task_looper()
 		debugger("epoll_ctl msg_fd");
 	}
 
+	int port_fd = fMsgPort >= B_OK ? _get_port_read_fd(fMsgPort) : -1;
+	if (port_fd >= 0) {
+		ev.events  = EPOLLIN;
+		ev.data.fd = port_fd;
+		if (epoll_ctl(epollfd, EPOLL_CTL_ADD, port_fd, &ev) == -1) {
+			debugger("epoll_ctl port_fd");
+		}
+	}
+
 #define MAX_EVENTS 4
 	struct epoll_event events[MAX_EVENTS];
 	int				   nfds;
@@ -2676,12 +2686,17 @@ void BWindow::task_looper()
 					debugger("Failed waiting for data");
 				}
 
-				if (events[n].events & EPOLLIN) {
+				// wakeup may be stale, do not block in receive_data()
+				if (events[n].events & EPOLLIN && has_data(find_thread(NULL))) {
 					thread_id sender;
 					uint32	  code = receive_data(&sender, nullptr, 0);
 					ALOGD("received data from %d: %.4s", sender, (char *)&code);
 				}
 			}
+
+			// queue them, the port stays readable until it is empty
+			if (events[n].data.fd == port_fd && events[n].events & EPOLLIN)
+				_drain_port();
 		}
 
 		if (wl_did_read)
@@ -2696,7 +2711,9 @@ void BWindow::task_looper()
 		if (!m->surface_committed) {
 			// process messages like BLooper
 			Lock();
+			BE_TRACE1(window_drain_start, this);
 			_drain_message_queue();
+			BE_TRACE1(window_drain_done, this);
 			if (!fTerminating) {
 				Unlock();
 			}
@@ -2706,6 +2723,8 @@ void BWindow::task_looper()
 
 				int width  = m->damage_x2 - m->damage_x1;
 				int height = m->damage_y2 - m->damage_y1;
+				record_event(B_RECORD_WINDOW_COMMIT, (intptr_t)this, max_c(width, 0) * (int64)max_c(height, 0));
+				BE_TRACE3(window_commit, this, width, height);
 				if (width > 0 || height > 0) {
 					wl_surface_damage_buffer(m->wl_surface, m->damage_x1, m->damage_y1, width, height);
 					m->damage_x1 = INT_MAX;
@@ -7,45 +7,198 @@
 #include <sys/syscall.h>
 #include <sys/mman.h>
 #include <linux/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 
 #include "private.h"
 #include "utlist.h"
 #include "rwlock.h"
+#include "idhash.h"
+
+/* Areas are memfd mappings, named by owner team and descriptor so other
+ * teams can clone them through /proc. The tag keeps these ids apart from
+ * SysV segment ids and clone addresses of areas attached with shmat().
+ */
+#define AREA_FD_TAG             ((area_id)1 << 62)
+#define AREA_FD_ID(team, fd)    (AREA_FD_TAG | (area_id)(team) << 32 | (fd))
+#define AREA_FD_TEAM(id)        ((team_id)(((id) & ~AREA_FD_TAG) >> 32))
+#define AREA_FD(id)             ((int)((id) & 0xffffffff))
+#define AREA_IS_FD(id)          (((id) & AREA_FD_TAG) && (id) > 0)
+
+/* B_FULL_LOCK areas from this size use huge pages */
+#define AREA_HUGE_PAGE_SIZE     (2 * 1024 * 1024)
 
 typedef struct _area_info_struct {
-    int         shmid;
+    area_id     id;
+    int         shmid;      // SysV segment, or -1
+    int         fd;         // memfd, or -1
+    ino_t       ino;        // memfd inode, identifies clones
+    size_t      size;
     char        name[B_OS_NAME_LENGTH];
     uint32		lock;
     uint32      protection;
+    uint32      addressSpec;
+    bool        huge;       // hugetlb memfd, size is multiple of huge page
     void        *address;
     struct _area_info_struct *next;
     struct _area_info_struct *prev;
 } _area_info;
 
 static _area_info *_areas = NULL;
+/* shmid -> first _area_info attached to it, memfd area id -> _area_info */
+static _idhash _areas_index;
+/* address -> _area_info, clones of own areas are identified by address */
+static _idhash _areas_address_index;
+/* areas sorted by address for area_for() */
+static _area_info **_areas_ranges = NULL;
+static uint32 _areas_ranges_count = 0;
+static uint32 _areas_ranges_size = 0;
 RWLOCK(_areas)
 
-/* WARNING! you need to lock _areas in caller function! */
+/* WARNING! you need to lock _areas in caller function to keep info alive! */
 static _area_info *_find_area_info(area_id id)
 {
-    _area_info *info;
-    int shmid = (int)id;
-    DL_SEARCH_SCALAR(_areas, info, shmid, shmid);
+    _area_info *info = _idhash_find(&_areas_index, id);
     if (info) return info;
 
-    void *address = (void *)id;
-    DL_SEARCH_SCALAR(_areas, info, address, address);
-    return info;
+    return _idhash_find(&_areas_address_index, id);
+}
+
+/* Index of first area starting above address.
+ * WARNING! you need to lock _areas in caller function!
+ */
+static uint32 _area_range_search(uintptr_t address)
+{
+    uint32 low = 0, high = _areas_ranges_count;
+    while (low < high) {
+        uint32 middle = (low + high) / 2;
+        if ((uintptr_t)_areas_ranges[middle]->address <= address) low = middle + 1;
+        else high = middle;
+    }
+    return low;
+}
+
+/* Makes room for one more area in range index.
+ * WARNING! you need to wlock _areas in caller function!
+ */
+static status_t _area_range_reserve(void)
+{
+    if (_areas_ranges_count < _areas_ranges_size) return B_OK;
+
+    uint32 size = _areas_ranges_size ? _areas_ranges_size * 2 : 16;
+    _area_info **ranges = realloc(_areas_ranges, size * sizeof(_area_info *));
+    if (!ranges) return B_NO_MEMORY;
+    _areas_ranges = ranges;
+    _areas_ranges_size = size;
+    return B_OK;
 }
+
+/* WARNING! you need to wlock _areas in caller function! */
+static status_t _area_range_insert(_area_info *info)
+{
+    if (_area_range_reserve() != B_OK) return B_NO_MEMORY;
+
+    uint32 i = _area_range_search((uintptr_t)info->address);
+    memmove(&_areas_ranges[i + 1], &_areas_ranges[i],
+            (_areas_ranges_count - i) * sizeof(_area_info *));
+    _areas_ranges[i] = info;
+    _areas_ranges_count++;
+    return B_OK;
+}
+
+/* WARNING! you need to wlock _areas in caller function! */
+static void _area_range_remove(_area_info *info)
+{
+    uint32 i = _area_range_search((uintptr_t)info->address);
+    while (i > 0 && _areas_ranges[i - 1] != info) i--;
+    if (i == 0) return;
+    i--;
+    memmove(&_areas_ranges[i], &_areas_ranges[i + 1],
+            (_areas_ranges_count - i - 1) * sizeof(_area_info *));
+    _areas_ranges_count--;
+}
+
+/* WARNING! you need to wlock _areas in caller function! */
+static status_t _add_area_info(_area_info *info)
+{
+    if (_area_range_insert(info) != B_OK) return B_NO_MEMORY;
+    if (info->fd >= 0) {
+        _idhash_insert(&_areas_index, info->id, info);
+    } else {
+        if (!_idhash_lookup(&_areas_index, info->shmid))
+            _idhash_insert(&_areas_index, info->shmid, info);
+        _idhash_insert(&_areas_address_index, (intptr_t)info->address, info);
+    }
+    DL_APPEND(_areas, info);
+    return B_OK;
+}
+
+/* WARNING! you need to wlock _areas in caller function! */
+static void _remove_area_info(_area_info *info)
+{
+    DL_DELETE(_areas, info);
+    _area_range_remove(info);
+    if (info->fd >= 0) {
+        _idhash_remove(&_areas_index, info->id);
+        return;
+    }
+    _idhash_remove(&_areas_address_index, (intptr_t)info->address);
+    if (_idhash_lookup(&_areas_index, info->shmid) == info) {
+        _idhash_remove(&_areas_index, info->shmid);
+        /* index next attachment of the same segment, if any */
+        _area_info *other;
+        DL_FOREACH(_areas, other) {
+            if (other->fd < 0 && other->shmid == info->shmid) break;
+        }
+        if (other) _idhash_insert(&_areas_index, other->shmid, other);
+    }
+}
+/* WARNING! you need to lock _areas in caller function! */
 static _area_info *_find_area_info_name(const char *name)
 {
     _area_info *info;
-    DL_SEARCH_SCALAR(_areas, info, name, name);
+    DL_FOREACH(_areas, info) {
+        if (strncmp(info->name, name, B_OS_NAME_LENGTH) == 0) break;
+    }
     return info;
 }
 
+static status_t _lock_area_memory(void *address, size_t size, uint32 lock)
+{
+    int flags = 0;
+    switch (lock) {
+    case B_NO_LOCK:
+        return B_OK;
+    case B_FULL_LOCK:
+    case B_CONTIGUOUS:
+        flags = 0;
+        break;
+    case B_LAZY_LOCK:
+        flags = MLOCK_ONFAULT;
+        break;
+    case B_LOMEM:
+    default:
+        return B_NOT_SUPPORTED;
+    }
+
+    if (syscall(SYS_mlock2, address, size, flags) != 0) {
+        switch (errno) {
+        case ENOMEM:
+            return B_NO_MEMORY;
+        case EPERM:
+        case EAGAIN:
+        case EINVAL:
+            return B_BAD_VALUE;
+        default:
+            return B_ERROR;
+        }
+    }
+    return B_OK;
+}
+
 static area_id _attach_shm_area(int shmid, const char *name,
                                 void **startAddress, uint32 addressSpec,
                                 size_t size, uint32 lock, uint32 protection)
@@ -87,60 +240,167 @@ static area_id _attach_shm_area(int shmid, const char *name,
         }
     }
 
-    int flags = 0;
-    switch (lock) {
-    case B_FULL_LOCK:
-        flags = 0;
+    /* SysV segments are never physically contiguous */
+    status_t status = lock == B_CONTIGUOUS ? B_NOT_SUPPORTED : _lock_area_memory(shmaddr, size, lock);
+    if (status != B_OK) {
+        shmdt(shmaddr);
+        return status;
+    }
+
+    _area_info *info = calloc(1, sizeof(_area_info));
+    info->shmid = shmid;
+    info->fd = -1;
+    info->size = size;
+    COPY_OS_NAME_LENGTH(info->name, name);
+    info->address = shmaddr;
+    info->lock = lock;
+    info->protection = protection;
+    info->addressSpec = addressSpec;
+    _areas_wlock();
+    info->id = _idhash_lookup(&_areas_index, shmid) ? (intptr_t)shmaddr : shmid;
+    status = _add_area_info(info);
+    _areas_unlock();
+    if (status != B_OK) {
+        shmdt(shmaddr);
+        free(info);
+        return status;
+    }
+
+    *startAddress = shmaddr;
+    return info->id;
+}
+
+/* Maps memfd as new area, takes ownership of fd. */
+static area_id _map_fd_area(int fd, const char *name, void **startAddress, uint32 addressSpec,
+                            size_t size, uint32 lock, uint32 protection, bool huge)
+{
+    void *address = NULL;
+    int flags = MAP_SHARED;
+
+    if (!startAddress) {
+        close(fd);
+        return B_BAD_VALUE;
+    }
+
+    switch (addressSpec) {
+    case B_EXACT_ADDRESS:
+        flags |= MAP_FIXED_NOREPLACE;
+        // fallthrough
+    case B_BASE_ADDRESS:
+        address = *startAddress;
         break;
-    case B_LAZY_LOCK:
-        flags = MLOCK_ONFAULT;
+    case B_ANY_ADDRESS:
+        address = NULL;
         break;
-    case B_CONTIGUOUS:
-    case B_LOMEM:
-        shmdt(shmaddr);
+    case B_CLONE_ADDRESS:
+        close(fd);
+        return B_BAD_VALUE;
+    case B_ANY_KERNEL_ADDRESS:
+    default:
+        close(fd);
         return B_NOT_SUPPORTED;
     }
 
-    if (lock != B_NO_LOCK) {
-        if (syscall(SYS_mlock2, shmaddr, size, flags) != 0) {
-            int e = errno;
-            shmdt(shmaddr);
-            switch (e) {
-            case ENOMEM:
-                return B_NO_MEMORY;
-            case EPERM:
-            case EAGAIN:
-            case EINVAL:
-                return B_BAD_VALUE;
-            default:
-                return B_ERROR;
-            }
+    int prot = 0;
+    if (protection & B_READ_AREA) prot |= PROT_READ;
+    if (protection & B_WRITE_AREA) prot |= PROT_WRITE;
+
+    address = mmap(address, size, prot, flags, fd, 0);
+    if (address == MAP_FAILED) {
+        int error = errno;
+        close(fd);
+        switch (error) {
+        case EEXIST:
+        case EINVAL:
+            return B_BAD_VALUE;
+        case ENOMEM:
+            return B_NO_MEMORY;
+        default:
+            return B_ERROR;
         }
     }
 
-    _area_info *info = calloc(1, sizeof(_area_info));
-    info->shmid = shmid;
+    /* transparent huge pages, when hugetlb pool is not available */
+    if (!huge && lock == B_FULL_LOCK && size >= AREA_HUGE_PAGE_SIZE)
+        madvise(address, size, MADV_HUGEPAGE);
+
+    status_t status = _lock_area_memory(address, size, lock);
+    struct stat st;
+    if (status == B_OK && fstat(fd, &st) != 0) status = B_ERROR;
+    _area_info *info = status == B_OK ? calloc(1, sizeof(_area_info)) : NULL;
+    if (!info) {
+        munmap(address, size);
+        close(fd);
+        return status == B_OK ? B_NO_MEMORY : status;
+    }
+
+    info->id = AREA_FD_ID(_info->team, fd);
+    info->shmid = -1;
+    info->fd = fd;
+    info->ino = st.st_ino;
+    info->size = size;
     COPY_OS_NAME_LENGTH(info->name, name);
-    info->address = shmaddr;
+    info->address = address;
     info->lock = lock;
     info->protection = protection;
+    info->addressSpec = addressSpec;
+    info->huge = huge;
     _areas_wlock();
-    DL_APPEND(_areas, info);
+    status = _add_area_info(info);
     _areas_unlock();
+    if (status != B_OK) {
+        munmap(address, size);
+        close(fd);
+        free(info);
+        return status;
+    }
 
-    *startAddress = shmaddr;
-    return shmid;
+    *startAddress = address;
+    return info->id;
+}
+
+static size_t _area_huge_size(size_t size)
+{
+    return (size + AREA_HUGE_PAGE_SIZE - 1) & ~(size_t)(AREA_HUGE_PAGE_SIZE - 1);
 }
 
 area_id create_area(const char *name, void **startAddress, uint32 addressSpec,
                     size_t size, uint32 lock, uint32 protection)
 {
-    int shmid = shmget(IPC_PRIVATE, size, IPC_CREAT | 0600);
-    if (shmid < 0) {
+    if (size == 0) return B_BAD_VALUE;
+
+    /* Large locked areas try hugetlb pool first, it may be empty and then
+     * only mmap() fails. Contiguous memory can be promised only within one
+     * huge page.
+     */
+    if ((lock == B_CONTIGUOUS && size <= AREA_HUGE_PAGE_SIZE)
+        || (lock == B_FULL_LOCK && size >= AREA_HUGE_PAGE_SIZE)) {
+        area_id id = B_NOT_SUPPORTED;
+        int fd = memfd_create(name ? name : "area", MFD_CLOEXEC | MFD_HUGETLB);
+        if (fd >= 0 && ftruncate(fd, _area_huge_size(size)) == 0) {
+            id = _map_fd_area(fd, name, startAddress, addressSpec, _area_huge_size(size),
+                              lock, protection, true);
+        } else if (fd >= 0) {
+            close(fd);
+        }
+        if (id >= 0) return id;
+    }
+    if (lock == B_CONTIGUOUS) return B_NOT_SUPPORTED;
+
+    int fd = memfd_create(name ? name : "area", MFD_CLOEXEC);
+    if (fd >= 0 && ftruncate(fd, size) != 0) {
+        int error = errno;
+        close(fd);
+        fd = -1;
+        errno = error;
+    }
+    if (fd < 0) {
         switch (errno) {
         case EINVAL:
             return B_BAD_VALUE;
+        case EFBIG:
         case ENFILE:
+        case EMFILE:
         case ENOMEM:
         case ENOSPC:
             return B_NO_MEMORY;
@@ -148,20 +408,26 @@ area_id create_area(const char *name, void **startAddress, uint32 addressSpec,
             return B_ERROR;
         }
     }
-    return _attach_shm_area(shmid, name, startAddress, addressSpec, size, lock, protection);
+
+    return _map_fd_area(fd, name, startAddress, addressSpec, size, lock, protection, false);
 }
 
 status_t delete_area(area_id id)
 {
-    _areas_rlock();
+    _areas_wlock();
     _area_info *info = _find_area_info(id);
+    if (info) _remove_area_info(info);
     _areas_unlock();
-    if(info) {
-        _areas_wlock();
-        DL_DELETE(_areas, info);
-        _areas_unlock();
+
+    if (info && info->fd >= 0) {
+        munmap(info->address, info->size);
+        close(info->fd);
         free(info);
+        return B_OK;
     }
+    if (AREA_IS_FD(id)) return B_BAD_VALUE;
+
+    free(info);
     if (shmctl(id, IPC_RMID, NULL) != 0) {
         switch (errno) {
         case EIDRM:
@@ -176,20 +442,90 @@ status_t delete_area(area_id id)
     return B_OK;
 }
 
+/* Grows or shrinks memfd area in place. Areas created with B_ANY_ADDRESS
+ * move when there is no room to grow, without copying their pages.
+ */
+status_t resize_area(area_id id, size_t newSize)
+{
+    if (newSize == 0) return B_BAD_VALUE;
+
+    _areas_wlock();
+    _area_info *info = _find_area_info(id);
+    if (!info) {
+        _areas_unlock();
+        return B_BAD_VALUE;
+    }
+    if (info->fd < 0) {
+        /* SysV segments can't change size */
+        _areas_unlock();
+        return B_NOT_SUPPORTED;
+    }
+
+    status_t status = B_OK;
+    size_t oldSize = info->size;
+    if (info->huge) newSize = _area_huge_size(newSize);
+    if (newSize == oldSize) goto exit;
+
+    /* area is moved in range index below, that must not fail after mremap */
+    status = _area_range_reserve();
+    if (status != B_OK) goto exit;
+
+    if (newSize > oldSize && ftruncate(info->fd, newSize) != 0) {
+        status = errno == EFBIG || errno == ENOSPC ? B_NO_MEMORY : B_ERROR;
+        goto exit;
+    }
+
+    int flags = info->addressSpec == B_ANY_ADDRESS ? MREMAP_MAYMOVE : 0;
+    void *address = mremap(info->address, oldSize, newSize, flags);
+    if (address == MAP_FAILED) {
+        status = errno == ENOMEM ? B_NO_MEMORY : B_ERROR;
+        if (newSize > oldSize) ftruncate(info->fd, oldSize);
+        goto exit;
+    }
+    if (newSize < oldSize) ftruncate(info->fd, newSize);
+
+    if (newSize > oldSize && info->lock != B_NO_LOCK)
+        _lock_area_memory((char *)address + oldSize, newSize - oldSize, info->lock);
+
+    /* address and size are the keys of range index, room is reserved */
+    _area_range_remove(info);
+    info->address = address;
+    info->size = newSize;
+    status = _area_range_insert(info);
+
+exit:
+    _areas_unlock();
+    return status;
+}
+
 status_t set_area_protection(area_id id, uint32 newProtection)
 {
     int shmid = -1;
+    int fd = -1;
     void *shmaddr = NULL;
+    size_t size = 0;
     _areas_wlock();
     _area_info *info = _find_area_info(id);
     if (info) {
         info->protection = newProtection;
         shmaddr = info->address;
         shmid = info->shmid;
+        fd = info->fd;
+        size = info->size;
     }
     _areas_unlock();
     if (!info || !shmaddr) return B_BAD_VALUE;
 
+    if (fd >= 0) {
+        int prot = 0;
+        if (newProtection & B_READ_AREA) prot |= PROT_READ;
+        if (newProtection & B_WRITE_AREA) prot |= PROT_WRITE;
+        if (mprotect(shmaddr, size, prot) != 0) {
+            return errno == ENOMEM ? B_NO_MEMORY : B_BAD_VALUE;
+        }
+        return B_OK;
+    }
+
     int shmflg = SHM_REMAP;
     if (!(newProtection & B_WRITE_AREA)) shmflg |= SHM_RDONLY;
     shmaddr = shmat(shmid, shmaddr, shmflg);
@@ -212,14 +548,65 @@ area_id find_area(const char *name)
     area_id id = -1;
     _areas_rlock();
     _area_info *info = _find_area_info_name(name);
-    if (info) id = info->shmid;
+    if (info) id = info->id;
     _areas_unlock();
     return info ? id : B_NAME_NOT_FOUND;
 }
 
+area_id area_for(void *address)
+{
+    area_id id = B_ERROR;
+    _areas_rlock();
+    uint32 i = _area_range_search((uintptr_t)address);
+    if (i > 0) {
+        _area_info *info = _areas_ranges[i - 1];
+        if ((uintptr_t)address < (uintptr_t)info->address + info->size) id = info->id;
+    }
+    _areas_unlock();
+    return id;
+}
+
+/* Opens memfd of area by its id, in this team or through /proc in other. */
+static int _open_area_fd(area_id source, uint32 protection)
+{
+    int fd = -1;
+    _areas_rlock();
+    _area_info *info = _find_area_info(source);
+    if (info && info->fd >= 0) fd = fcntl(info->fd, F_DUPFD_CLOEXEC, 0);
+    _areas_unlock();
+    if (info) return fd;
+
+    if (AREA_FD_TEAM(source) == _info->team) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%d/fd/%d", AREA_FD_TEAM(source), AREA_FD(source));
+    return open(path, (protection & B_WRITE_AREA ? O_RDWR : O_RDONLY) | O_CLOEXEC);
+}
+
 area_id clone_area(const char *name, void **destAddress,
                    uint32 addressSpec, uint32 protection, area_id source)
 {
+    if (AREA_IS_FD(source)) {
+        int fd = _open_area_fd(source, protection);
+        struct stat st;
+        if (fd < 0 || fstat(fd, &st) != 0) {
+            int error = errno;
+            if (fd >= 0) close(fd);
+            switch (error) {
+            case EACCES:
+            case EPERM:
+                return B_PERMISSION_DENIED;
+            default:
+                return B_BAD_VALUE;
+            }
+        }
+        return _map_fd_area(fd, name, destAddress, addressSpec, st.st_size, B_NO_LOCK,
+                            protection, false);
+    }
+
     int shmid = -1;
     _areas_rlock();
     _area_info *info = _find_area_info(source);
@@ -238,8 +625,29 @@ area_id clone_area(const char *name, void **destAddress,
             return B_ERROR;
         }
     }
-    area_id clone = _attach_shm_area(shmid, name, destAddress, addressSpec, ds.shm_segsz, B_NO_LOCK, protection);
-    return info ? (intptr_t)*destAddress : clone;
+    return _attach_shm_area(shmid, name, destAddress, addressSpec, ds.shm_segsz, B_NO_LOCK, protection);
+}
+
+/* Returns segment backing the area, or -1. */
+int _get_area_shmid(area_id area)
+{
+    int shmid = -1;
+    _areas_rlock();
+    _area_info *info = _find_area_info(area);
+    if (info) shmid = info->shmid;
+    _areas_unlock();
+    return shmid;
+}
+
+/* Returns new descriptor of memfd backing the area, or -1. */
+int _get_area_fd(area_id area)
+{
+    int fd = -1;
+    _areas_rlock();
+    _area_info *info = _find_area_info(area);
+    if (info && info->fd >= 0) fd = fcntl(info->fd, F_DUPFD_CLOEXEC, 0);
+    _areas_unlock();
+    return fd;
 }
 
 status_t _get_area_info(area_id id, area_info *areaInfo, size_t size)
@@ -258,9 +666,19 @@ status_t _get_area_info(area_id id, area_info *areaInfo, size_t size)
         areaInfo->lock = info->lock;
         areaInfo->protection = info->protection;
         areaInfo->address = info->address;
+        areaInfo->size = info->size;
+        if (info->fd >= 0) {
+            /* clones in this team map the same memfd */
+            _area_info *other;
+            DL_FOREACH(_areas, other) {
+                if (other->fd >= 0 && other->ino == info->ino) areaInfo->copy_count++;
+            }
+            areaInfo->team = _info->team;
+        }
     }
     _areas_unlock();
     if (!info) return B_ERROR;
+    if (shmid < 0) return B_OK;
 
     struct shmid_ds ds = {};
     if (shmctl(shmid, IPC_STAT, &ds) != 0) {
@@ -1,19 +1,60 @@
 #include <OS.h>
 #include <KernelKit.h>
+#include <fs_attr.h>
+#include <TypeConstants.h>
 
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/xattr.h>
+#include <linux/limits.h>
+
+#include "private.h"
+#include "utlist.h"
+#include "idhash.h"
 
 #define XATTR_SIZE_READ_RETRIES 8
+#define XATTR_LIST_SIZE         1024
+
+/* Attribute cache.
+ * fs_read_attrs() keeps the attributes of the most recently read nodes,
+ * keyed by device and inode. Any attribute change bumps ctime, so an
+ * entry is valid while mtime and ctime match the node. Writes through
+ * this file and node monitor events drop entries right away, which also
+ * covers changes within one timestamp tick. Nodes too large to cache keep
+ * an entry without attributes, so single lookups read just their one.
+ */
+#define ATTR_CACHE_NODES        256
+#define ATTR_CACHE_NODE_SIZE    (64 * 1024) // larger nodes are not cached
+
+typedef struct _attr_node_struct {
+    dev_t           device;
+    ino_t           node;
+    struct timespec mtime;
+    struct timespec ctime;
+    fs_attr_entry   *entries;   // one allocation with names and data, NULL if too large
+    size_t          size;
+    ssize_t         count;
+    struct _attr_node_struct *next;
+    struct _attr_node_struct *prev;
+} _attr_node;
+
+static pthread_mutex_t _attr_lock = PTHREAD_MUTEX_INITIALIZER;
+static _attr_node *_attr_nodes = NULL; // most recently used first
+static int32 _attr_nodes_count = 0;
+static _idhash _attr_index;
 
 // prefix attribute name with user. namespace
 #define GEN_ATTRIBUTE_NAME \
-    char *name; \
-    asprintf(&name, "user.%s", attribute);
+    char name[XATTR_NAME_MAX + 1]; \
+    if (snprintf(name, sizeof(name), "user.%s", attribute) >= (int)sizeof(name)) { \
+        errno = B_NAME_TOO_LONG; \
+        return -1; \
+    }
 
 struct _attr_dir {
     char    *curr;
@@ -22,48 +63,418 @@ struct _attr_dir {
     struct dirent value;
 };
 
-DIR *fs_fopen_attr_dir(int fd)
+static inline intptr_t _attr_key(dev_t device, ino_t node)
+{
+    return (intptr_t)(node ^ ((uint64)device << 40));
+}
+
+static inline bool _attr_same_time(const struct timespec *a, const struct timespec *b)
+{
+    return a->tv_sec == b->tv_sec && a->tv_nsec == b->tv_nsec;
+}
+
+/* WARNING! you need to lock _attr_lock in caller function! */
+static void _attr_node_remove(_attr_node *node)
+{
+    DL_DELETE(_attr_nodes, node);
+    _idhash_remove(&_attr_index, _attr_key(node->device, node->node));
+    _attr_nodes_count--;
+    free(node->entries);
+    free(node);
+}
+
+void _attr_cache_invalidate(dev_t device, ino_t node)
+{
+    pthread_mutex_lock(&_attr_lock);
+    _attr_node *cached = _idhash_lookup(&_attr_index, _attr_key(device, node));
+    if (cached && cached->device == device && cached->node == node)
+        _attr_node_remove(cached);
+    pthread_mutex_unlock(&_attr_lock);
+}
+
+static void _attr_cache_invalidate_fd(int fd)
+{
+    struct stat st;
+    if (fstat(fd, &st) == 0)
+        _attr_cache_invalidate(st.st_dev, st.st_ino);
+}
+
+/* Copies entries to a new allocation, moving pointers along. */
+static fs_attr_entry *_attr_copy(const fs_attr_entry *entries, size_t size, ssize_t count)
+{
+    fs_attr_entry *copy = malloc(size ? size : 1);
+    if (!copy) return NULL;
+    memcpy(copy, entries, size);
+
+    intptr_t delta = (char *)copy - (char *)entries;
+    for (ssize_t i = 0; i < count; i++) {
+        copy[i].name += delta;
+        copy[i].data = (const char *)copy[i].data + delta;
+    }
+    return copy;
+}
+
+/* Attributes of fd, or of path without following it when given. */
+static inline ssize_t _attr_listxattr(int fd, const char *path, char *list, size_t size)
+{
+    return path ? llistxattr(path, list, size) : flistxattr(fd, list, size);
+}
+
+static inline ssize_t _attr_getxattr(int fd, const char *path, const char *name, void *value, size_t size)
+{
+    return path ? lgetxattr(path, name, value, size) : fgetxattr(fd, name, value, size);
+}
+
+/* Lists attribute names, in one flistxattr() unless the list is long. */
+static ssize_t _attr_list(int fd, const char *path, char **list)
+{
+    size_t size = XATTR_LIST_SIZE;
+    char *buf = NULL;
+    for (unsigned retries = XATTR_SIZE_READ_RETRIES; retries; retries--) {
+        char *grown = realloc(buf, size ? size : 1);
+        if (!grown) break;
+        buf = grown;
+
+        ssize_t read = _attr_listxattr(fd, path, buf, size);
+        if (read >= 0) {
+            *list = buf;
+            return read;
+        }
+        if (errno != ERANGE) break;
+
+        /* list grew past buffer, ask for its size */
+        ssize_t len = _attr_listxattr(fd, path, NULL, 0);
+        if (len < 0) break;
+        size = len;
+    }
+    free(buf);
+    errno = B_FILE_ERROR;
+    return -1;
+}
+
+/* Reads all user attributes into one allocation laid out as entries,
+ * names, then data. Pointers are kept as offsets until the end, as the
+ * allocation moves when values outgrow it.
+ */
+static ssize_t _attr_read_all(int fd, const char *path, fs_attr_entry **entries, size_t *size)
+{
+    char *list;
+    ssize_t length = _attr_list(fd, path, &list);
+    if (length < 0) return -1;
+
+    ssize_t count = 0;
+    size_t used = 0;
+    for (char *p = list; p < list + length; p += strlen(p) + 1) {
+        if (strncmp(p, "user.", sizeof("user.")-1) != 0) continue;
+        count++;
+        used += strlen(p) - (sizeof("user.")-1) + 1;
+    }
+    used += count * sizeof(fs_attr_entry);
+
+    size_t capacity = used + XATTR_LIST_SIZE;
+    char *arena = malloc(capacity);
+    if (!arena) {
+        free(list);
+        errno = B_NO_MEMORY;
+        return -1;
+    }
+
+    ssize_t index = 0;
+    size_t name = count * sizeof(fs_attr_entry);
+    for (char *p = list; p < list + length; p += strlen(p) + 1) {
+        if (strncmp(p, "user.", sizeof("user.")-1) != 0) continue;
+
+        ssize_t read = -1;
+        for (unsigned retries = XATTR_SIZE_READ_RETRIES; retries; retries--) {
+            read = _attr_getxattr(fd, path, p, arena + used, capacity - used);
+            if (read >= 0 || errno != ERANGE) break;
+
+            ssize_t len = _attr_getxattr(fd, path, p, NULL, 0);
+            if (len < 0) break;
+            while (capacity < used + len) capacity *= 2;
+            char *grown = realloc(arena, capacity);
+            if (!grown) {
+                free(arena);
+                free(list);
+                errno = B_NO_MEMORY;
+                return -1;
+            }
+            arena = grown;
+        }
+
+        fs_attr_entry *entry = (fs_attr_entry *)arena + index++;
+        size_t name_size = strlen(p) - (sizeof("user.")-1) + 1;
+        memcpy(arena + name, p + sizeof("user.")-1, name_size);
+        entry->name = (const char *)name;
+        name += name_size;
+
+        if (read < (ssize_t)sizeof(entry->type)) {
+            /* removed meanwhile, or not written by fs_write_attr() */
+            entry->type = B_RAW_TYPE;
+            entry->size = 0;
+            entry->data = (const void *)used;
+        } else {
+            memcpy(&entry->type, arena + used, sizeof(entry->type));
+            entry->size = read - sizeof(entry->type);
+            entry->data = (const void *)(used + sizeof(entry->type));
+            used += read;
+        }
+    }
+    free(list);
+
+    for (ssize_t i = 0; i < count; i++) {
+        fs_attr_entry *entry = (fs_attr_entry *)arena + i;
+        entry->name = arena + (size_t)entry->name;
+        entry->data = arena + (size_t)entry->data;
+    }
+    *entries = (fs_attr_entry *)arena;
+    *size = used;
+    return count;
+}
+
+/* Like fs_read_attrs() for a path, past the cache as nodes are read once
+ * by the index crawler.
+ */
+ssize_t _attr_read_path(const char *path, fs_attr_entry **entries)
+{
+    size_t size;
+    return _attr_read_all(-1, path, entries, &size);
+}
+
+/* Returns valid cached node, most recently used from now on.
+ * WARNING! you need to lock _attr_lock in caller function!
+ */
+static _attr_node *_attr_cache_get(const struct stat *st)
+{
+    _attr_node *node = _idhash_lookup(&_attr_index, _attr_key(st->st_dev, st->st_ino));
+    if (!node || node->device != st->st_dev || node->node != st->st_ino) return NULL;
+
+    if (!_attr_same_time(&node->mtime, &st->st_mtim) || !_attr_same_time(&node->ctime, &st->st_ctim)) {
+        _attr_node_remove(node);
+        return NULL;
+    }
+    if (node != _attr_nodes) {
+        DL_DELETE(_attr_nodes, node);
+        DL_PREPEND(_attr_nodes, node);
+    }
+    return node;
+}
+
+/* Caches entries, which are freed with the node.
+ * WARNING! you need to lock _attr_lock in caller function!
+ */
+static _attr_node *_attr_cache_put(const struct stat *st, fs_attr_entry *entries, size_t size, ssize_t count)
+{
+    _attr_node *node = malloc(sizeof(_attr_node));
+    if (!node) return NULL;
+    node->device = st->st_dev;
+    node->node = st->st_ino;
+    node->mtime = st->st_mtim;
+    node->ctime = st->st_ctim;
+    node->entries = entries;
+    node->size = size;
+    node->count = count;
+
+    /* another thread read it meanwhile, or the key collides */
+    intptr_t key = _attr_key(st->st_dev, st->st_ino);
+    _attr_node *other = _idhash_lookup(&_attr_index, key);
+    if (other) _attr_node_remove(other);
+    if (_attr_nodes_count == ATTR_CACHE_NODES)
+        _attr_node_remove(_attr_nodes->prev); // least recently used
+
+    if (_idhash_insert(&_attr_index, key, node) != B_OK) {
+        free(node);
+        return NULL;
+    }
+    DL_PREPEND(_attr_nodes, node);
+    _attr_nodes_count++;
+    return node;
+}
+
+ssize_t fs_read_attrs(int fd, fs_attr_entry **entries)
 {
     if (fd < 0) {
         errno = B_FILE_ERROR;
-        return NULL;
+        return -1;
+    }
+    if (!entries) {
+        errno = B_BAD_VALUE;
+        return -1;
     }
 
-    char *buf = NULL;
-    ssize_t len, read;
-    unsigned retries = XATTR_SIZE_READ_RETRIES;
-    while (--retries) {
-		free(buf);
-		len = flistxattr(fd, NULL, 0);
-		if (len < 0) return NULL;
-        buf = malloc(len);
-        if (!buf) return NULL;
-        read = flistxattr(fd, buf, len);
-        if (read < 0) {
-            free(buf);
-            errno = B_FILE_ERROR;
-            return NULL;
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        errno = B_FILE_ERROR;
+        return -1;
+    }
+
+    pthread_mutex_lock(&_attr_lock);
+    _attr_node *node = _attr_cache_get(&st);
+    if (node && node->entries) {
+        ssize_t count = node->count;
+        *entries = _attr_copy(node->entries, node->size, count);
+        pthread_mutex_unlock(&_attr_lock);
+        if (!*entries) {
+            errno = B_NO_MEMORY;
+            return -1;
+        }
+        return count;
+    }
+    pthread_mutex_unlock(&_attr_lock);
+
+    size_t size;
+    ssize_t count = _attr_read_all(fd, NULL, entries, &size);
+    if (count < 0) return count;
+
+    /* large nodes are cached without their attributes */
+    fs_attr_entry *copy = NULL;
+    if (size <= ATTR_CACHE_NODE_SIZE && !(copy = _attr_copy(*entries, size, count))) return count;
+    pthread_mutex_lock(&_attr_lock);
+    if (!_attr_cache_put(&st, copy, size, count)) free(copy);
+    pthread_mutex_unlock(&_attr_lock);
+    return count;
+}
+
+/* Fills type and copies readBytes from pos of found entry to buffer when
+ * given. Returns the entry size, or -1 and sets errno.
+ */
+static off_t _attr_take(const fs_attr_entry *found, uint32 *type,
+                        off_t pos, void *buffer, size_t readBytes)
+{
+    if (!found) {
+        errno = B_ENTRY_NOT_FOUND;
+        return -1;
+    }
+    if (buffer && pos + (off_t)readBytes > found->size) {
+        errno = B_BAD_VALUE;
+        return -1;
+    }
+    if (type) *type = found->type;
+    if (buffer) memcpy(buffer, (const char *)found->data + pos, readBytes);
+    return found->size;
+}
+
+/* Reads one attribute past the cache, for nodes too large to cache. */
+static off_t _attr_lookup_one(int fd, const char *attribute, uint32 *type,
+                              off_t pos, void *buffer, size_t readBytes)
+{
+    GEN_ATTRIBUTE_NAME;
+
+    char *value = NULL;
+    ssize_t read = -1;
+    for (unsigned retries = XATTR_SIZE_READ_RETRIES; retries; retries--) {
+        ssize_t len = fgetxattr(fd, name, NULL, 0);
+        if (len < 0) break;
+        char *grown = realloc(value, len ? len : 1);
+        if (!grown) {
+            free(value);
+            errno = B_NO_MEMORY;
+            return -1;
         }
-        if (read == len) {
+        value = grown;
+
+        read = fgetxattr(fd, name, value, len);
+        if (read >= 0 || errno != ERANGE) break;
+    }
+    if (read < 0) {
+        free(value);
+        errno = errno == ENODATA ? B_ENTRY_NOT_FOUND : B_FILE_ERROR;
+        return -1;
+    }
+
+    /* same as _attr_read_all() for values not written by fs_write_attr() */
+    fs_attr_entry entry = { .name = attribute, .type = B_RAW_TYPE, .size = 0, .data = value };
+    if (read >= (ssize_t)sizeof(entry.type)) {
+        memcpy(&entry.type, value, sizeof(entry.type));
+        entry.size = read - sizeof(entry.type);
+        entry.data = value + sizeof(entry.type);
+    }
+    off_t result = _attr_take(&entry, type, pos, buffer, readBytes);
+    free(value);
+    return result;
+}
+
+/* Looks attribute up through the cache, copies readBytes from pos to
+ * buffer when given. Returns the entry size, or -1 and sets errno.
+ */
+static off_t _attr_lookup(int fd, const char *attribute, uint32 *type,
+                          off_t pos, void *buffer, size_t readBytes)
+{
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        errno = B_FILE_ERROR;
+        return -1;
+    }
+
+    fs_attr_entry *entries = NULL;
+    size_t size = 0;
+    ssize_t count;
+
+    pthread_mutex_lock(&_attr_lock);
+    _attr_node *node = _attr_cache_get(&st);
+    if (node && !node->entries) {
+        pthread_mutex_unlock(&_attr_lock);
+        return _attr_lookup_one(fd, attribute, type, pos, buffer, readBytes);
+    }
+    if (!node) {
+        pthread_mutex_unlock(&_attr_lock);
+        count = _attr_read_all(fd, NULL, &entries, &size);
+        if (count < 0) return -1;
+        pthread_mutex_lock(&_attr_lock);
+        if (size <= ATTR_CACHE_NODE_SIZE) {
+            if ((node = _attr_cache_put(&st, entries, size, count))) entries = NULL;
+        } else {
+            /* remember the node is too large, next lookups read one attribute */
+            _attr_cache_put(&st, NULL, size, count);
+        }
+    }
+    fs_attr_entry *found = NULL;
+    fs_attr_entry *search = node ? node->entries : entries;
+    count = node ? node->count : count;
+    for (ssize_t i = 0; i < count; i++) {
+        if (strcmp(search[i].name, attribute) == 0) {
+            found = &search[i];
             break;
         }
     }
-    if (retries) {
-        struct _attr_dir *ret = malloc(sizeof(struct _attr_dir));
-        ret->list = ret->curr = buf;
-        ret->end = ret->list + read;
-        return (DIR *)ret;
+
+    off_t result = _attr_take(found, type, pos, buffer, readBytes);
+    pthread_mutex_unlock(&_attr_lock);
+
+    free(entries);
+    return result;
+}
+
+DIR *fs_fopen_attr_dir(int fd)
+{
+    if (fd < 0) {
+        errno = B_FILE_ERROR;
+        return NULL;
+    }
+
+    char *buf;
+    ssize_t read = _attr_list(fd, NULL, &buf);
+    if (read < 0) return NULL;
+
+    struct _attr_dir *ret = malloc(sizeof(struct _attr_dir));
+    if (!ret) {
+        free(buf);
+        errno = B_NO_MEMORY;
+        return NULL;
     }
-    return NULL;
+    ret->list = ret->curr = buf;
+    ret->end = ret->list + read;
+    return (DIR *)ret;
 }
 
 void fs_rewind_attr_dir(DIR *dir)
 {
     if (!dir) {
         errno = B_FILE_ERROR;
+        return;
     }
 
-    ((struct _attr_dir *)dir)->curr = 0;
+    ((struct _attr_dir *)dir)->curr = ((struct _attr_dir *)dir)->list;
 }
 
 int fs_close_attr_dir(DIR *dir)
@@ -122,33 +533,11 @@ int fs_stat_attr(int fd, const char *attribute, struct attr_info *attrInfo)
         return -1;
     }
 
-    int ret = 0;
-    GEN_ATTRIBUTE_NAME;
-
-    char *buf = NULL;
-    unsigned retries = XATTR_SIZE_READ_RETRIES;
-    while (--retries) {
-		free(buf);
-		attrInfo->size = fgetxattr(fd, name, NULL, 0);
-        if (attrInfo->size < 1) {
-            errno = B_ENTRY_NOT_FOUND;
-            ret = -1;
-            break;
-        }
-        buf = malloc(attrInfo->size);
-        if (fgetxattr(fd, name, buf, attrInfo->size) < 1) {
-            errno = B_ENTRY_NOT_FOUND;
-            ret = -1;
-        }
-        else {
-            attrInfo->type = *((typeof(attrInfo->type)*)buf);
-            attrInfo->size -= sizeof(attrInfo->type);
-        }
-    }
+    off_t size = _attr_lookup(fd, attribute, &attrInfo->type, 0, NULL, 0);
+    if (size < 0) return -1;
 
-    free(buf);
-    free(name);
-    return ret;
+    attrInfo->size = size;
+    return 0;
 }
 
 ssize_t fs_read_attr(int fd, const char *attribute, uint32 type,
@@ -162,32 +551,14 @@ ssize_t fs_read_attr(int fd, const char *attribute, uint32 type,
         errno = B_BAD_VALUE;
         return -1;
     }
-    if (pos < 0) {
+    if (pos < 0 || !buffer) {
         errno = B_BAD_VALUE;
         return -1;
     }
 
-    int ret = 0;
-    GEN_ATTRIBUTE_NAME;
-
-    size_t size = pos + readBytes + sizeof(type);
-    char *buf = malloc(size);
-    size_t read = 0;
-    if ((read = fgetxattr(fd, name, buf, size)) < 1) {
-        errno = B_ENTRY_NOT_FOUND;
-        ret = -1;
-    }
-    else if (sizeof(type) + pos + readBytes > read) {
-        errno = B_BAD_VALUE;
-        ret = -1;
-    }
-    else {
-        memcpy(buffer, buf + sizeof(type) + pos, readBytes);
-    }
-
-    free(buf);
-    free(name);
-    return ret;
+    if (_attr_lookup(fd, attribute, NULL, pos, buffer, readBytes) < 0)
+        return -1;
+    return readBytes;
 }
 
 ssize_t fs_write_attr(int fd, const char *attribute, uint32 type,
@@ -211,13 +582,16 @@ ssize_t fs_write_attr(int fd, const char *attribute, uint32 type,
     // encode type as first data bytes
     size_t size = count + sizeof(type);
     char *value = malloc(size);
+    if (!value) {
+        errno = B_NO_MEMORY;
+        return -1;
+    }
     *((typeof(type) *)value) = type;
-    memcpy(value + sizeof(type), buffer, size);
+    memcpy(value + sizeof(type), buffer, count);
     int ret = fsetxattr(fd, name, value, size, 0);
-
-    free(name);
     free(value);
 
+    _attr_cache_invalidate_fd(fd);
     return ret < 0 ? ret : (ssize_t)count;
 }
 
@@ -241,13 +615,14 @@ int fs_remove_attr(int fd, const char *attribute)
             break;
         case ENOTSUP:
             errno = B_NOT_ALLOWED;
+            break;
         default:
             errno = B_FILE_ERROR;
         }
         ret = -1;
     }
 
-    free(name);
+    _attr_cache_invalidate_fd(fd);
     return ret;
 }
 
@@ -0,0 +1,524 @@
+#include <OS.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "private.h"
+#include "btree.h"
+
+#define BTREE_MAGIC         'BPT1'
+#define BTREE_LEAF          0x0001
+#define BTREE_INITIAL_PAGES 16
+
+typedef struct {
+    uint32      magic;
+    uint32      page_size;
+    uint32      type;       // of the keys, kept for the owner
+    uint32      root;
+    uint32      pages;      // in use, page 0 is this header
+    uint32      height;
+    uint32      dirty;      // writer in progress
+    uint32      reserved;
+    uint64      count;
+} _btree_header;
+
+typedef struct {
+    uint16      flags;
+    uint16      count;
+    uint16      data;       // start of records, they grow down from page end
+    uint16      garbage;    // bytes of removed records
+    uint32      link;       // leaf: next leaf, internal: child left of first key
+    uint16      slots[];
+} _btree_page;
+
+typedef struct {
+    uint16      key_size;
+    uint16      value_size;
+    uint8       bytes[];    // key, then value
+} _btree_record;
+
+#define BTREE_RECORD_SIZE(K, V) (sizeof(_btree_record) + (K) + (V))
+
+static inline _btree_header *_btree_head(_btree *tree)
+{
+    return (_btree_header *)tree->map;
+}
+
+static inline _btree_page *_btree_page_at(_btree *tree, uint32 page)
+{
+    return (_btree_page *)(tree->map + (size_t)page * BTREE_PAGE_SIZE);
+}
+
+static inline _btree_record *_btree_record_at(_btree_page *page, uint32 index)
+{
+    return (_btree_record *)((char *)page + page->slots[index]);
+}
+
+static inline size_t _btree_record_size(_btree_record *record)
+{
+    return BTREE_RECORD_SIZE(record->key_size, record->value_size);
+}
+
+static inline uint32 _btree_child_at(_btree_page *page, uint32 index)
+{
+    uint32 child;
+    _btree_record *record = _btree_record_at(page, index);
+    memcpy(&child, record->bytes + record->key_size, sizeof(child));
+    return child;
+}
+
+static int _btree_compare(const void *a, size_t aSize, const void *b, size_t bSize)
+{
+    int result = memcmp(a, b, aSize < bSize ? aSize : bSize);
+    if (result) return result;
+    return aSize < bSize ? -1 : aSize > bSize;
+}
+
+/* Index of the first record not less than key. */
+static uint32 _btree_search(_btree_page *page, const void *key, size_t keySize, bool *found)
+{
+    uint32 low = 0, high = page->count;
+    *found = false;
+    while (low < high) {
+        uint32 middle = (low + high) / 2;
+        _btree_record *record = _btree_record_at(page, middle);
+        int result = _btree_compare(record->bytes, record->key_size, key, keySize);
+        if (result < 0) {
+            low = middle + 1;
+        } else {
+            if (result == 0) *found = true;
+            high = middle;
+        }
+    }
+    return low;
+}
+
+/* Child covering key, whose keys are not less than the separator left of it. */
+static uint32 _btree_child(_btree_page *page, const void *key, size_t keySize)
+{
+    bool found;
+    uint32 index = _btree_search(page, key, keySize, &found);
+    if (found) return _btree_child_at(page, index);
+    return index ? _btree_child_at(page, index - 1) : page->link;
+}
+
+static void _btree_page_init(_btree_page *page, uint16 flags)
+{
+    page->flags = flags;
+    page->count = 0;
+    page->data = BTREE_PAGE_SIZE;
+    page->garbage = 0;
+    page->link = 0;
+}
+
+static inline size_t _btree_free(_btree_page *page)
+{
+    return page->data - sizeof(_btree_page) - page->count * sizeof(uint16);
+}
+
+/* Moves records together at the end of page, dropping removed ones. */
+static void _btree_compact(_btree_page *page)
+{
+    char copy[BTREE_PAGE_SIZE];
+    memcpy(copy, page, BTREE_PAGE_SIZE);
+
+    uint16 data = BTREE_PAGE_SIZE;
+    for (uint32 i = 0; i < page->count; i++) {
+        _btree_record *record = (_btree_record *)(copy + page->slots[i]);
+        size_t size = _btree_record_size(record);
+        data -= size;
+        memcpy((char *)page + data, record, size);
+        page->slots[i] = data;
+    }
+    page->data = data;
+    page->garbage = 0;
+}
+
+static bool _btree_fits(_btree_page *page, size_t size)
+{
+    if (_btree_free(page) >= size + sizeof(uint16)) return true;
+    if (_btree_free(page) + page->garbage < size + sizeof(uint16)) return false;
+    _btree_compact(page);
+    return true;
+}
+
+/* WARNING! record must fit, see _btree_fits()! */
+static void _btree_put(_btree_page *page, uint32 index, const _btree_record *record)
+{
+    size_t size = _btree_record_size((_btree_record *)record);
+    page->data -= size;
+    memcpy((char *)page + page->data, record, size);
+    memmove(&page->slots[index + 1], &page->slots[index], (page->count - index) * sizeof(uint16));
+    page->slots[index] = page->data;
+    page->count++;
+}
+
+static void _btree_erase(_btree_page *page, uint32 index)
+{
+    page->garbage += _btree_record_size(_btree_record_at(page, index));
+    memmove(&page->slots[index], &page->slots[index + 1], (page->count - index - 1) * sizeof(uint16));
+    page->count--;
+}
+
+/* Maps the whole file, which may have been grown by another team. */
+static status_t _btree_map(_btree *tree)
+{
+    struct stat st;
+    if (fstat(tree->fd, &st) < 0) return B_FROM_POSIX_ERROR(errno);
+    if ((size_t)st.st_size == tree->size) return B_OK;
+
+    char *map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, tree->fd, 0);
+    if (map == MAP_FAILED) return B_NO_MEMORY;
+    if (tree->map) munmap(tree->map, tree->size);
+    tree->map = map;
+    tree->size = st.st_size;
+    return B_OK;
+}
+
+/* Returns a new page, which moves all others when the file grows. */
+static uint32 _btree_alloc(_btree *tree, uint16 flags)
+{
+    _btree_header *header = _btree_head(tree);
+    size_t needed = (size_t)(header->pages + 1) * BTREE_PAGE_SIZE;
+    if (needed > tree->size) {
+        /* another team may have grown the file already */
+        struct stat st;
+        if (fstat(tree->fd, &st) < 0) return 0;
+        if ((size_t)st.st_size < needed && ftruncate(tree->fd, tree->size * 2) < 0) return 0;
+        if (_btree_map(tree) != B_OK) return 0;
+        header = _btree_head(tree);
+    }
+    uint32 page = header->pages++;
+    _btree_page_init(_btree_page_at(tree, page), flags);
+    return page;
+}
+
+/* WARNING! you need to lock tree in caller function! */
+status_t _btree_clear(_btree *tree)
+{
+    _btree_header *header = _btree_head(tree);
+    header->root = 1;
+    header->pages = 2;
+    header->height = 1;
+    header->count = 0;
+    _btree_page_init(_btree_page_at(tree, 1), BTREE_LEAF);
+    return B_OK;
+}
+
+status_t _btree_open(_btree *tree, const char *path, uint32 type)
+{
+    memset(tree, 0, sizeof(_btree));
+    pthread_mutex_init(&tree->lock, NULL);
+
+    tree->fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (tree->fd < 0) return B_FROM_POSIX_ERROR(errno);
+
+    flock(tree->fd, LOCK_EX);
+    struct stat st;
+    status_t result = fstat(tree->fd, &st) < 0 ? B_FROM_POSIX_ERROR(errno) : B_OK;
+    if (result == B_OK && st.st_size == 0
+        && ftruncate(tree->fd, BTREE_INITIAL_PAGES * BTREE_PAGE_SIZE) < 0)
+        result = B_FROM_POSIX_ERROR(errno);
+    if (result == B_OK) result = _btree_map(tree);
+
+    if (result == B_OK) {
+        _btree_header *header = _btree_head(tree);
+        if (header->magic != BTREE_MAGIC || header->page_size != BTREE_PAGE_SIZE) {
+            /* new, or not ours */
+            memset(header, 0, sizeof(_btree_header));
+            header->magic = BTREE_MAGIC;
+            header->page_size = BTREE_PAGE_SIZE;
+            header->type = type;
+            _btree_clear(tree);
+            tree->recovered = st.st_size != 0;
+        } else if (header->dirty) {
+            _btree_clear(tree);
+            header->dirty = 0;
+            tree->recovered = true;
+        }
+    }
+    flock(tree->fd, LOCK_UN);
+
+    if (result != B_OK) _btree_close(tree);
+    return result;
+}
+
+void _btree_close(_btree *tree)
+{
+    if (tree->map) munmap(tree->map, tree->size);
+    if (tree->fd >= 0) close(tree->fd);
+    tree->map = NULL;
+    tree->size = 0;
+    tree->fd = -1;
+    pthread_mutex_destroy(&tree->lock);
+}
+
+status_t _btree_lock(_btree *tree, bool write)
+{
+    pthread_mutex_lock(&tree->lock);
+    flock(tree->fd, write ? LOCK_EX : LOCK_SH);
+
+    status_t result = B_OK;
+    _btree_header *header = _btree_head(tree);
+    if ((size_t)header->pages * BTREE_PAGE_SIZE > tree->size) {
+        result = _btree_map(tree);
+        header = _btree_head(tree);
+    }
+    if (result == B_OK && header->dirty) {
+        /* writer of another team died meanwhile */
+        if (write) {
+            _btree_clear(tree);
+            tree->recovered = true;
+        } else {
+            result = B_IO_ERROR;
+        }
+    }
+    if (result != B_OK) {
+        flock(tree->fd, LOCK_UN);
+        pthread_mutex_unlock(&tree->lock);
+        return result;
+    }
+
+    tree->write = write;
+    if (write) header->dirty = 1;
+    return B_OK;
+}
+
+void _btree_unlock(_btree *tree)
+{
+    if (tree->write) {
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+        _btree_head(tree)->dirty = 0;
+        tree->write = false;
+    }
+    flock(tree->fd, LOCK_UN);
+    pthread_mutex_unlock(&tree->lock);
+}
+
+/* WARNING! you need to lock tree in caller function! */
+uint32 _btree_type(_btree *tree)
+{
+    return _btree_head(tree)->type;
+}
+
+/* WARNING! you need to lock tree in caller function! */
+uint64 _btree_count(_btree *tree)
+{
+    return _btree_head(tree)->count;
+}
+
+/* Splits full page into itself and sibling while adding record at index.
+ * Returns the separator for the parent in separator, whose value is
+ * left for the caller.
+ */
+static void _btree_split(_btree_page *page, _btree_page *sibling, uint32 index,
+                         const _btree_record *record, _btree_record *separator)
+{
+    char copy[BTREE_PAGE_SIZE];
+    memcpy(copy, page, BTREE_PAGE_SIZE);
+    _btree_page *old = (_btree_page *)copy;
+
+    uint32 count = old->count + 1;
+    const _btree_record *records[count];
+    size_t total = 0;
+    for (uint32 i = 0, j = 0; i < count; i++) {
+        records[i] = i == index ? record : _btree_record_at(old, j++);
+        total += _btree_record_size((_btree_record *)records[i]) + sizeof(uint16);
+    }
+
+    /* half of the bytes to each page, at least one record each */
+    uint32 middle = 0;
+    size_t left = 0;
+    while (middle < count - 1 && left + _btree_record_size((_btree_record *)records[middle]) / 2 < total / 2)
+        left += _btree_record_size((_btree_record *)records[middle++]) + sizeof(uint16);
+    if (middle == 0) middle = 1;
+
+    bool leaf = old->flags & BTREE_LEAF;
+    const _btree_record *up = records[middle];
+    memcpy(separator, up, sizeof(_btree_record) + up->key_size);
+    separator->value_size = sizeof(uint32);
+
+    _btree_page_init(page, old->flags);
+    page->link = old->link;
+    for (uint32 i = 0; i < middle; i++)
+        _btree_put(page, i, records[i]);
+
+    if (!leaf) {
+        /* separator moves up, its child becomes leftmost of sibling */
+        memcpy(&sibling->link, up->bytes + up->key_size, sizeof(uint32));
+        middle++;
+    }
+    for (uint32 i = middle; i < count; i++)
+        _btree_put(sibling, i - middle, records[i]);
+}
+
+/* WARNING! you need to lock tree in caller function! */
+status_t _btree_insert(_btree *tree, const void *key, size_t keySize, const void *value, size_t valueSize)
+{
+    if (keySize + valueSize > BTREE_MAX_RECORD) return B_BAD_VALUE;
+
+    _btree_header *header = _btree_head(tree);
+    uint32 path[BTREE_MAX_HEIGHT];
+    int32 depth = 0;
+    uint32 number = header->root;
+    _btree_page *page = _btree_page_at(tree, number);
+    while (!(page->flags & BTREE_LEAF)) {
+        if (depth == BTREE_MAX_HEIGHT) return B_IO_ERROR;
+        path[depth++] = number;
+        number = _btree_child(page, key, keySize);
+        page = _btree_page_at(tree, number);
+    }
+
+    bool found;
+    uint32 index = _btree_search(page, key, keySize, &found);
+    if (found) {
+        _btree_erase(page, index);
+    } else {
+        header->count++;
+    }
+
+    union {
+        _btree_record record;
+        char bytes[BTREE_RECORD_SIZE(BTREE_MAX_RECORD, 0)];
+    } record, separator;
+    record.record.key_size = keySize;
+    record.record.value_size = valueSize;
+    memcpy(record.record.bytes, key, keySize);
+    memcpy(record.record.bytes + keySize, value, valueSize);
+
+    for (;;) {
+        if (_btree_fits(page, _btree_record_size(&record.record))) {
+            _btree_put(page, index, &record.record);
+            return B_OK;
+        }
+
+        uint32 other = _btree_alloc(tree, page->flags);
+        if (!other) return B_NO_MEMORY;
+        header = _btree_head(tree);
+        page = _btree_page_at(tree, number);
+        _btree_page *sibling = _btree_page_at(tree, other);
+
+        _btree_split(page, sibling, index, &record.record, &separator.record);
+        if (page->flags & BTREE_LEAF) {
+            sibling->link = page->link;
+            page->link = other;
+        }
+        memcpy(separator.record.bytes + separator.record.key_size, &other, sizeof(other));
+        memcpy(&record, &separator, _btree_record_size(&separator.record));
+
+        if (depth == 0) {
+            uint32 root = _btree_alloc(tree, 0);
+            if (!root) return B_NO_MEMORY;
+            header = _btree_head(tree);
+            page = _btree_page_at(tree, root);
+            page->link = number;
+            _btree_put(page, 0, &record.record);
+            header->root = root;
+            header->height++;
+            return B_OK;
+        }
+
+        number = path[--depth];
+        page = _btree_page_at(tree, number);
+        index = _btree_search(page, record.record.bytes, record.record.key_size, &found);
+    }
+}
+
+/* WARNING! you need to lock tree in caller function! */
+static _btree_page *_btree_leaf(_btree *tree, const void *key, size_t keySize, uint32 *number)
+{
+    *number = _btree_head(tree)->root;
+    _btree_page *page = _btree_page_at(tree, *number);
+    for (uint32 depth = 0; !(page->flags & BTREE_LEAF); depth++) {
+        if (depth == BTREE_MAX_HEIGHT) return NULL;
+        *number = _btree_child(page, key, keySize);
+        page = _btree_page_at(tree, *number);
+    }
+    return page;
+}
+
+/* WARNING! you need to lock tree in caller function! */
+status_t _btree_remove(_btree *tree, const void *key, size_t keySize)
+{
+    uint32 number;
+    _btree_page *page = _btree_leaf(tree, key, keySize, &number);
+    if (!page) return B_IO_ERROR;
+
+    bool found;
+    uint32 index = _btree_search(page, key, keySize, &found);
+    if (!found) return B_ENTRY_NOT_FOUND;
+
+    _btree_erase(page, index);
+    _btree_head(tree)->count--;
+    return B_OK;
+}
+
+/* Copies value of key, returns its size.
+ * WARNING! you need to lock tree in caller function!
+ */
+ssize_t _btree_find(_btree *tree, const void *key, size_t keySize, void *value, size_t valueSize)
+{
+    uint32 number;
+    _btree_page *page = _btree_leaf(tree, key, keySize, &number);
+    if (!page) return B_IO_ERROR;
+
+    bool found;
+    uint32 index = _btree_search(page, key, keySize, &found);
+    if (!found) return B_ENTRY_NOT_FOUND;
+
+    _btree_record *record = _btree_record_at(page, index);
+    memcpy(value, record->bytes + record->key_size, min_c(valueSize, record->value_size));
+    return record->value_size;
+}
+
+/* Moves cursor over empty leaves and past leaf ends. */
+static void _btree_settle(_btree *tree, _btree_cursor *cursor)
+{
+    while (cursor->page) {
+        _btree_page *page = _btree_page_at(tree, cursor->page);
+        if (cursor->index < page->count) return;
+        cursor->page = page->link;
+        cursor->index = 0;
+    }
+}
+
+/* WARNING! you need to lock tree in caller function! */
+void _btree_seek(_btree *tree, _btree_cursor *cursor, const void *key, size_t keySize)
+{
+    bool found;
+    _btree_page *page = _btree_leaf(tree, key, keySize, &cursor->page);
+    if (!page) {
+        cursor->page = 0;
+        return;
+    }
+    cursor->index = _btree_search(page, key, keySize, &found);
+    _btree_settle(tree, cursor);
+}
+
+/* WARNING! you need to lock tree in caller function! */
+bool _btree_get(_btree *tree, const _btree_cursor *cursor, const void **key, size_t *keySize,
+                const void **value, size_t *valueSize)
+{
+    if (!cursor->page) return false;
+
+    _btree_record *record = _btree_record_at(_btree_page_at(tree, cursor->page), cursor->index);
+    if (key) *key = record->bytes;
+    if (keySize) *keySize = record->key_size;
+    if (value) *value = record->bytes + record->key_size;
+    if (valueSize) *valueSize = record->value_size;
+    return true;
+}
+
+/* WARNING! you need to lock tree in caller function! */
+void _btree_next(_btree *tree, _btree_cursor *cursor)
+{
+    if (!cursor->page) return;
+    cursor->index++;
+    _btree_settle(tree, cursor);
+}
@@ -0,0 +1,52 @@
+#include <SupportDefs.h>
+#include <pthread.h>
+
+/* B+tree in a memory mapped file, ordered by memcmp() of keys.
+ * Pages hold a slot array growing up and records {key size, value size,
+ * key, value} growing down. Removal does not merge pages, so the tree
+ * only shrinks when it is cleared.
+ * Teams share the file: access is serialized by the tree mutex within
+ * the team and by flock() between teams. A writer marks the header dirty
+ * while it holds the lock, so a tree left dirty by a crashed writer is
+ * found and cleared by the next writer.
+ */
+#define BTREE_PAGE_SIZE     4096
+#define BTREE_MAX_HEIGHT    16
+#define BTREE_MAX_RECORD    1000 // key and value, at least four per page
+
+typedef struct {
+    int         fd;
+    char        *map;
+    size_t      size;       // mapped bytes
+    bool        write;      // locked for writing
+    bool        recovered;  // was cleared after a crash, contents need rebuild
+    pthread_mutex_t lock;
+} _btree;
+
+/* Position of a key, only valid while the tree stays locked. */
+typedef struct {
+    uint32      page;       // 0 past the last key
+    uint32      index;
+} _btree_cursor;
+
+status_t _btree_open(_btree *tree, const char *path, uint32 type);
+void _btree_close(_btree *tree);
+
+status_t _btree_lock(_btree *tree, bool write);
+void _btree_unlock(_btree *tree);
+
+/* WARNING! you need to lock tree in caller function! */
+uint32 _btree_type(_btree *tree);
+uint64 _btree_count(_btree *tree);
+status_t _btree_clear(_btree *tree);
+status_t _btree_insert(_btree *tree, const void *key, size_t keySize, const void *value, size_t valueSize);
+status_t _btree_remove(_btree *tree, const void *key, size_t keySize);
+ssize_t _btree_find(_btree *tree, const void *key, size_t keySize, void *value, size_t valueSize);
+
+/* Cursor at the first key not less than key, or past the last one.
+ * WARNING! you need to lock tree in caller function!
+ */
+void _btree_seek(_btree *tree, _btree_cursor *cursor, const void *key, size_t keySize);
+bool _btree_get(_btree *tree, const _btree_cursor *cursor, const void **key, size_t *keySize,
+                const void **value, size_t *valueSize);
+void _btree_next(_btree *tree, _btree_cursor *cursor);
@@ -72,6 +72,10 @@ static void _crash_handler(int sig, siginfo_t *siginfo, void *ctx)
 			siginfo->si_pid, siginfo->si_uid,
 			((ucontext_t *)ctx)->uc_stack.ss_sp, siginfo->si_lower, siginfo->si_upper);
 
+	// what led here, before the backtrace can fault again
+	set_flight_recording(false);
+	dump_flight_records(2);
+
 	backward::SignalHandling::handleSignal(sig, siginfo, ctx);
 
 	// restore original handler and raise again
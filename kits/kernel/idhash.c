@@ -0,0 +1,172 @@
+#include <stdlib.h>
+#include <errno.h>
+
+#include "private.h"
+#include "idhash.h"
+
+#define IDHASH_MIN_SIZE 16
+#define IDHASH_DELETED ((void *)-1)
+
+static inline uint32 _idhash_hash(intptr_t key)
+{
+    /* splitmix64 finalizer */
+    uint64 x = (uint64)key;
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ULL;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebULL;
+    x ^= x >> 31;
+    return (uint32)x;
+}
+
+uint32 _idhash_read_begin(_idhash *hash)
+{
+    uint32 seq;
+    while ((seq = __atomic_load_n(&hash->seq, __ATOMIC_ACQUIRE)) & 1) {
+        cpu_relax();
+    }
+    return seq;
+}
+
+bool _idhash_read_retry(_idhash *hash, uint32 seq)
+{
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(&hash->seq, __ATOMIC_RELAXED) != seq;
+}
+
+void *_idhash_lookup(_idhash *hash, intptr_t key)
+{
+    _idhash_table *table = __atomic_load_n(&hash->table, __ATOMIC_ACQUIRE);
+    if (!table) return NULL;
+
+    uint32 mask = table->mask;
+    uint32 i = _idhash_hash(key) & mask;
+    for (uint32 n = 0; n <= mask; n++, i = (i + 1) & mask) {
+        void *value = __atomic_load_n(&table->slots[i].value, __ATOMIC_ACQUIRE);
+        if (value == NULL) return NULL;
+        if (value != IDHASH_DELETED && __atomic_load_n(&table->slots[i].key, __ATOMIC_RELAXED) == key)
+            return value;
+    }
+    return NULL;
+}
+
+void *_idhash_find(_idhash *hash, intptr_t key)
+{
+    uint32 seq;
+    void *value;
+    do {
+        seq = _idhash_read_begin(hash);
+        value = _idhash_lookup(hash, key);
+    } while (_idhash_read_retry(hash, seq));
+    return value;
+}
+
+static void _idhash_write_begin(_idhash *hash)
+{
+    atomic_add(&hash->seq, 1);
+}
+
+static void _idhash_write_end(_idhash *hash)
+{
+    atomic_add(&hash->seq, 1);
+}
+
+static void _idhash_put(_idhash_table *table, intptr_t key, void *value)
+{
+    uint32 i = _idhash_hash(key) & table->mask;
+    while (table->slots[i].value != NULL && table->slots[i].value != IDHASH_DELETED) {
+        i = (i + 1) & table->mask;
+    }
+    table->slots[i].key = key;
+    __atomic_store_n(&table->slots[i].value, value, __ATOMIC_RELEASE);
+}
+
+/* Drops deleted entries without a new table, readers retry meanwhile.
+ * WARNING! you need to hold registry write lock!
+ */
+static status_t _idhash_rehash(_idhash *hash)
+{
+    _idhash_table *table = hash->table;
+    _idhash_slot *live = malloc(max_c(hash->count, 1) * sizeof(_idhash_slot));
+    if (!live) return B_NO_MEMORY;
+
+    uint32 count = 0;
+    for (uint32 i = 0; i <= table->mask; i++) {
+        void *value = table->slots[i].value;
+        if (value != NULL && value != IDHASH_DELETED) live[count++] = table->slots[i];
+        __atomic_store_n(&table->slots[i].value, NULL, __ATOMIC_RELAXED);
+    }
+    for (uint32 i = 0; i < count; i++) _idhash_put(table, live[i].key, live[i].value);
+    free(live);
+
+    hash->used = hash->count;
+    return B_OK;
+}
+
+/* WARNING! you need to hold registry write lock! */
+static status_t _idhash_grow(_idhash *hash)
+{
+    _idhash_table *old = hash->table;
+    uint32 size = old ? old->mask + 1 : IDHASH_MIN_SIZE;
+    while (size * 3 < (hash->count + 1) * 4 * 2) size <<= 1;
+
+    /* mostly deleted entries, never shrink so retired tables stay bounded */
+    if (old && size == old->mask + 1) return _idhash_rehash(hash);
+
+    _idhash_table *table = calloc(1, sizeof(_idhash_table) + size * sizeof(_idhash_slot));
+    if (!table) return B_NO_MEMORY;
+    table->mask = size - 1;
+    table->retired = old;
+
+    if (old) {
+        for (uint32 i = 0; i <= old->mask; i++) {
+            void *value = old->slots[i].value;
+            if (value != NULL && value != IDHASH_DELETED)
+                _idhash_put(table, old->slots[i].key, value);
+        }
+    }
+
+    __atomic_store_n(&hash->table, table, __ATOMIC_RELEASE);
+    hash->used = hash->count;
+    return B_OK;
+}
+
+/* WARNING! you need to hold registry write lock! */
+status_t _idhash_insert(_idhash *hash, intptr_t key, void *value)
+{
+    if (value == NULL || value == IDHASH_DELETED) return B_BAD_VALUE;
+
+    _idhash_write_begin(hash);
+    status_t status = B_OK;
+    if (!hash->table || (hash->used + 1) * 4 > (hash->table->mask + 1) * 3) {
+        status = _idhash_grow(hash);
+    }
+    if (status == B_OK) {
+        _idhash_put(hash->table, key, value);
+        hash->count++;
+        hash->used++;
+    }
+    _idhash_write_end(hash);
+    return status;
+}
+
+/* WARNING! you need to hold registry write lock! */
+void *_idhash_remove(_idhash *hash, intptr_t key)
+{
+    _idhash_table *table = hash->table;
+    if (!table) return NULL;
+
+    uint32 i = _idhash_hash(key) & table->mask;
+    for (uint32 n = 0; n <= table->mask; n++, i = (i + 1) & table->mask) {
+        void *value = table->slots[i].value;
+        if (value == NULL) break;
+        if (value != IDHASH_DELETED && table->slots[i].key == key) {
+            _idhash_write_begin(hash);
+            __atomic_store_n(&table->slots[i].value, IDHASH_DELETED, __ATOMIC_RELEASE);
+            hash->count--;
+            _idhash_write_end(hash);
+            return value;
+        }
+    }
+    return NULL;
+}
@@ -0,0 +1,43 @@
+#include <SupportDefs.h>
+
+/* Open addressing hash index from integer id to registry record.
+ * Lookups are lock-free and validated with a sequence counter, so they
+ * never touch the registry lock. Modifications must be serialized by
+ * the caller (registry write lock).
+ * Replaced tables are never freed, as lock-free readers may still probe
+ * them. Tables never shrink and deleted entries are dropped in place, so
+ * every replacement doubles and retired tables stay below the live one.
+ */
+typedef struct {
+    intptr_t    key;
+    void        *value;
+} _idhash_slot;
+
+typedef struct _idhash_table_struct {
+    uint32      mask;
+    struct _idhash_table_struct *retired;
+    _idhash_slot slots[];
+} _idhash_table;
+
+typedef struct {
+    uint32      seq;    // odd while modification is in progress
+    uint32      count;  // live entries
+    uint32      used;   // live and deleted entries
+    _idhash_table *table;
+} _idhash;
+
+void *_idhash_find(_idhash *hash, intptr_t key);
+status_t _idhash_insert(_idhash *hash, intptr_t key, void *value);
+void *_idhash_remove(_idhash *hash, intptr_t key);
+
+/* Seqlock read section for copying fields out of found record:
+ *
+ *     do {
+ *         seq = _idhash_read_begin(&index);
+ *         info = _idhash_lookup(&index, id);
+ *         if (info) field = info->field;
+ *     } while (_idhash_read_retry(&index, seq));
+ */
+uint32 _idhash_read_begin(_idhash *hash);
+bool _idhash_read_retry(_idhash *hash, uint32 seq);
+void *_idhash_lookup(_idhash *hash, intptr_t key);
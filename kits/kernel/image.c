@@ -4,6 +4,53 @@
 #include <unistd.h>
 #include <signal.h>
 #include <dlfcn.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#include "private.h"
+#include "utlist.h"
+#include "rwlock.h"
+
+/* Teams are launched by a clone() sharing the address space, so no page
+ * tables are copied however large the parent is. The child runs on a stack
+ * of its own, with copies of the arguments, and blocks in recv() on a
+ * socket pair until resume_thread() sends a byte. Its end is closed on
+ * exec, so the parent sees the exec happen, or reads its errno, before it
+ * unmaps the stack. The pidfd tells when a launch that was never resumed
+ * exited. Kernels without CLONE_PIDFD fork() and wait for SIGCONT.
+ * The child shares the thread pointer of the parent thread too, so it makes
+ * raw system calls only: libc would write errno and check cancellation of
+ * the parent thread. Architectures without them always fork().
+ */
+#define IMAGE_STACK_SIZE    (64 * 1024)
+
+typedef struct _image_launch_struct {
+    team_id     team;
+    int         pidfd;
+    int         socket;     // parent end
+    int         child;      // child end
+    sigset_t    mask;       // of the parent, restored for exec
+    char        **argv;
+    char        **environ;
+    void        *block;     // this, arguments and stack
+    size_t      size;
+    struct _image_launch_struct *next;
+    struct _image_launch_struct *prev;
+} _image_launch;
+
+static pthread_mutex_t _launches_lock = PTHREAD_MUTEX_INITIALIZER;
+static _image_launch *_launches = NULL; // not yet resumed
+/* held from socketpair() until the child end is closed, and around fork(),
+ * so no other child inherits the child end and keeps it open */
+static pthread_mutex_t _spawn_lock = PTHREAD_MUTEX_INITIALIZER;
 
 static __thread int _resumed;
 
@@ -12,7 +59,7 @@ static void _cont_sigaction(int signum, siginfo_t *si, void *context)
     _resumed = 1;
 }
 
-thread_id load_image(int32 argc, const char **argv, const char **environ)
+static thread_id _load_image_fork(const char **argv, const char **environ)
 {
     _resumed = 0;
 	struct sigaction sc = {0};
@@ -21,7 +68,9 @@ thread_id load_image(int32 argc, const char **argv, const char **environ)
 	sc.sa_flags		= SA_SIGINFO;
 	sigaction(SIGCONT, &sc, NULL);
 
+	pthread_mutex_lock(&_spawn_lock);
 	pid_t pid = fork();
+	if (pid != 0) pthread_mutex_unlock(&_spawn_lock);
 	if (pid < 0) {
 		switch (errno) {
 			case EAGAIN:
@@ -54,22 +103,424 @@ thread_id load_image(int32 argc, const char **argv, const char **environ)
     exit(-1);
 }
 
+#if defined(__x86_64__)
+static inline long _image_syscall(long n, long a, long b, long c, long d, long e, long f)
+{
+    register long r10 __asm__("r10") = d;
+    register long r8 __asm__("r8") = e;
+    register long r9 __asm__("r9") = f;
+    long ret;
+    __asm__ volatile ("syscall" : "=a"(ret)
+                      : "a"(n), "D"(a), "S"(b), "d"(c), "r"(r10), "r"(r8), "r"(r9)
+                      : "rcx", "r11", "memory");
+    return ret;
+}
+#define IMAGE_RAW_SYSCALLS 1
+#elif defined(__aarch64__)
+static inline long _image_syscall(long n, long a, long b, long c, long d, long e, long f)
+{
+    register long x8 __asm__("x8") = n;
+    register long x0 __asm__("x0") = a;
+    register long x1 __asm__("x1") = b;
+    register long x2 __asm__("x2") = c;
+    register long x3 __asm__("x3") = d;
+    register long x4 __asm__("x4") = e;
+    register long x5 __asm__("x5") = f;
+    __asm__ volatile ("svc 0" : "+r"(x0)
+                      : "r"(x8), "r"(x1), "r"(x2), "r"(x3), "r"(x4), "r"(x5)
+                      : "memory");
+    return x0;
+}
+#define IMAGE_RAW_SYSCALLS 1
+#else
+#define IMAGE_RAW_SYSCALLS 0
+#endif
+
+#if IMAGE_RAW_SYSCALLS
+/* struct sigaction of the kernel, not of libc */
+typedef struct {
+    void        (*handler)(int);
+    unsigned long flags;
+    void        (*restorer)(void);
+    uint64      mask;
+} _image_sigaction;
+
+/* Runs in the address space of the parent with all signals blocked, so it
+ * must not touch anything but the launch and its stack. Failed calls return
+ * -errno. */
+static int _image_child(void *data)
+{
+    _image_launch *launch = data;
+    _image_syscall(SYS_close, launch->socket, 0, 0, 0, 0, 0);
+    _image_syscall(SYS_setpgid, 0, 0, 0, 0, 0, 0); // work in own process group
+
+    _image_sigaction sa = { .handler = SIG_IGN };
+    _image_syscall(SYS_rt_sigaction, SIGHUP, (long)&sa, 0, sizeof(sa.mask), 0, 0); // do not die with parent
+
+    /* nothing read if the parent exited */
+    char resume;
+    if (_image_syscall(SYS_recvfrom, launch->child, (long)&resume, 1, 0, 0, 0) != 1)
+        _image_syscall(SYS_exit_group, -1, 0, 0, 0, 0, 0);
+
+    _image_syscall(SYS_rt_sigprocmask, SIG_SETMASK, (long)&launch->mask, 0, sizeof(sa.mask), 0, 0);
+    int error = -_image_syscall(SYS_execve, (long)launch->argv[0], (long)launch->argv,
+                                (long)launch->environ, 0, 0, 0);
+    _image_syscall(SYS_sendto, launch->child, (long)&error, sizeof(error), MSG_NOSIGNAL, 0, 0);
+    _image_syscall(SYS_exit_group, -1, 0, 0, 0, 0, 0);
+    return -1;
+}
+#endif
+
+static void _image_free_launch(_image_launch *launch)
+{
+    close(launch->pidfd);
+    close(launch->socket);
+    munmap(launch->block, launch->size);
+}
+
+/* Releases launches that exited without being resumed, killed for example.
+ * WARNING! you need to lock _launches_lock in caller function! */
+static void _image_reap_launches(void)
+{
+    _image_launch *launch, *tmp;
+    DL_FOREACH_SAFE(_launches, launch, tmp) {
+        struct pollfd pfd = { .fd = launch->pidfd, .events = POLLIN };
+        if (poll(&pfd, 1, 0) == 1) {
+            DL_DELETE(_launches, launch);
+            _image_free_launch(launch);
+        }
+    }
+}
+
+/* Copies a NULL terminated vector and its strings to *p. */
+static char **_image_copy_vector(const char **vector, char **p)
+{
+    size_t count = 0;
+    while (vector[count]) count++;
+    char **copy = (char **)*p;
+    char *text = (char *)(copy + count + 1);
+    for (size_t i = 0; i < count; i++) {
+        size_t length = strlen(vector[i]) + 1;
+        memcpy(text, vector[i], length);
+        copy[i] = text;
+        text += length;
+    }
+    copy[count] = NULL;
+    *p = (char *)(((uintptr_t)text + 15) & ~(uintptr_t)15);
+    return copy;
+}
+
+static size_t _image_vector_size(const char **vector)
+{
+    size_t size = sizeof(char *);
+    for (; *vector; vector++) size += sizeof(char *) + strlen(*vector) + 1;
+    return size + 16;
+}
+
+thread_id load_image(int32 argc, const char **argv, const char **environ)
+{
+    if (!argv || !argv[0]) return B_BAD_VALUE;
+    if (!environ) environ = (const char **)__environ;
+
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t size = sizeof(_image_launch) + 16 + _image_vector_size(argv) + _image_vector_size(environ);
+    size = (size + IMAGE_STACK_SIZE + page - 1) & ~(page - 1);
+    void *block = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0);
+    if (block == MAP_FAILED) return B_NO_MEMORY;
+
+    _image_launch *launch = block;
+    char *p = (char *)(((uintptr_t)(launch + 1) + 15) & ~(uintptr_t)15);
+    launch->block = block;
+    launch->size = size;
+    launch->argv = _image_copy_vector(argv, &p);
+    launch->environ = _image_copy_vector(environ, &p);
+
+    int sockets[2];
+    pthread_mutex_lock(&_spawn_lock);
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sockets) < 0) {
+        pthread_mutex_unlock(&_spawn_lock);
+        munmap(block, size);
+        return B_NO_MORE_TEAMS;
+    }
+    launch->socket = sockets[0];
+    launch->child = sockets[1];
+
+    pid_t pid = -1;
+    int error = ENOSYS;
+#if IMAGE_RAW_SYSCALLS
+    /* no signal handlers in the shared address space */
+    sigset_t all;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &launch->mask);
+    pid = clone(_image_child, (char *)block + size, CLONE_VM | CLONE_PIDFD | SIGCHLD, launch,
+                &launch->pidfd);
+    error = errno;
+    pthread_sigmask(SIG_SETMASK, &launch->mask, NULL);
+#endif
+    close(launch->child);
+    pthread_mutex_unlock(&_spawn_lock);
+
+    if (pid < 0) {
+        close(launch->socket);
+        munmap(block, size);
+        switch (error) {
+        case EINVAL:
+        case ENOSYS:
+            return _load_image_fork(argv, environ);
+        case EAGAIN:
+        case ENOMEM:
+            return B_NO_MORE_TEAMS;
+        default:
+            return B_ERROR;
+        }
+    }
+
+    launch->team = pid;
+    pthread_mutex_lock(&_launches_lock);
+    _image_reap_launches();
+    DL_APPEND(_launches, launch);
+    pthread_mutex_unlock(&_launches_lock);
+    return pid;
+}
+
+status_t _image_resume(team_id team)
+{
+    pthread_mutex_lock(&_launches_lock);
+    _image_launch *launch;
+    DL_FOREACH(_launches, launch) {
+        if (launch->team == team) break;
+    }
+    if (launch) DL_DELETE(_launches, launch);
+    pthread_mutex_unlock(&_launches_lock);
+    if (!launch) return B_BAD_THREAD_ID;
+
+    /* exec closes the child end, the child sends errno if it fails */
+    status_t result = B_OK;
+    int error;
+    char resume = 1;
+    if (send(launch->socket, &resume, 1, MSG_NOSIGNAL) != 1) {
+        result = B_BAD_THREAD_ID;
+    } else {
+        ssize_t length;
+        while ((length = recv(launch->socket, &error, sizeof(error), MSG_WAITALL)) < 0 && errno == EINTR);
+        if (length == sizeof(error)) result = B_FROM_POSIX_ERROR(error);
+    }
+    _image_free_launch(launch);
+    return result;
+}
+
+/* Add-ons are registered by inode, so loading one path again, or a link to
+ * it, only takes a reference instead of a trip through the dynamic linker.
+ * Each keeps the symbols looked up so far in an open addressing table,
+ * read under the registry read lock. Add-ons loaded by preload_add_ons()
+ * hold no reference until load_add_on() takes one.
+ */
+#define IMAGE_SYMBOLS_MIN   16
+
+typedef struct {
+    uint32      hash;
+    char        *name;      // NULL if free
+    void        *symbol;    // NULL if not found
+} _image_symbol;
+
+typedef struct _image_add_on_struct {
+    image_id    id;         // dlopen() handle
+    dev_t       device;
+    ino_t       node;       // 0 if found by library search path
+    int32       refs;
+    _image_symbol *symbols;
+    uint32      mask;
+    uint32      count;
+    struct _image_add_on_struct *next;
+    struct _image_add_on_struct *prev;
+} _image_add_on;
+
+RWLOCK(_add_ons)
+static _image_add_on *_add_ons = NULL;
+
+/* WARNING! you need to lock _add_ons in caller function! */
+static _image_add_on *_image_find_add_on(image_id id, dev_t device, ino_t node)
+{
+    _image_add_on *add_on;
+    DL_FOREACH(_add_ons, add_on) {
+        if (add_on->id == id || (node && add_on->node == node && add_on->device == device)) break;
+    }
+    return add_on;
+}
+
+static image_id _image_load_add_on(const char *path, int32 refs)
+{
+    struct stat st = {};
+    if (strchr(path, '/') && stat(path, &st) < 0) return B_ERROR;
+
+    _add_ons_wlock();
+    _image_add_on *add_on = st.st_ino ? _image_find_add_on(0, st.st_dev, st.st_ino) : NULL;
+    if (add_on) {
+        add_on->refs += refs;
+        _add_ons_unlock();
+        return add_on->id;
+    }
+    _add_ons_unlock();
+
+    void *handle = dlopen(path, RTLD_LAZY|RTLD_GLOBAL);
+    if (!handle) return B_ERROR;
+
+    /* loaded meanwhile, the registry keeps one reference of the linker */
+    _add_ons_wlock();
+    add_on = _image_find_add_on((image_id)handle, st.st_dev, st.st_ino);
+    if (add_on) {
+        add_on->refs += refs;
+        _add_ons_unlock();
+        dlclose(handle);
+        return add_on->id;
+    }
+    add_on = calloc(1, sizeof(_image_add_on));
+    if (!add_on) {
+        _add_ons_unlock();
+        dlclose(handle);
+        return B_NO_MEMORY;
+    }
+    add_on->id = (image_id)handle;
+    add_on->device = st.st_dev;
+    add_on->node = st.st_ino;
+    add_on->refs = refs;
+    DL_APPEND(_add_ons, add_on);
+    _add_ons_unlock();
+    return add_on->id;
+}
+
 image_id load_add_on(const char *path)
 {
-    void *addr = dlopen(path, RTLD_LAZY|RTLD_GLOBAL);
-    return addr == NULL ? B_ERROR : (intptr_t)addr;
+    if (!path) return B_BAD_VALUE;
+    return _image_load_add_on(path, 1);
 }
 
 status_t unload_add_on(image_id image)
 {
+    _add_ons_wlock();
+    _image_add_on *add_on = _image_find_add_on(image, 0, 0);
+    if (add_on && --add_on->refs > 0) {
+        _add_ons_unlock();
+        return B_OK;
+    }
+    if (add_on) DL_DELETE(_add_ons, add_on);
+    _add_ons_unlock();
+
+    if (add_on) {
+        for (uint32 i = 0; add_on->symbols && i <= add_on->mask; i++) free(add_on->symbols[i].name);
+        free(add_on->symbols);
+        free(add_on);
+    }
     return dlclose((void *)image) ? B_ERROR : B_OK;
 }
 
+static uint32 _image_hash(const char *name)
+{
+    uint32 hash = 2166136261u; // FNV-1a
+    for (; *name; name++) hash = (hash ^ (uint8)*name) * 16777619u;
+    return hash;
+}
+
+/* WARNING! you need to lock _add_ons in caller function! */
+static _image_symbol *_image_find_symbol(_image_add_on *add_on, const char *name, uint32 hash)
+{
+    if (!add_on->symbols) return NULL;
+    for (uint32 i = hash & add_on->mask;; i = (i + 1) & add_on->mask) {
+        _image_symbol *symbol = &add_on->symbols[i];
+        if (!symbol->name || (symbol->hash == hash && !strcmp(symbol->name, name))) return symbol;
+    }
+}
+
+/* WARNING! you need to write lock _add_ons in caller function! */
+static void _image_insert_symbol(_image_add_on *add_on, const char *name, uint32 hash, void *symbol)
+{
+    /* at most three quarters full */
+    if (!add_on->symbols || (add_on->count + 1) * 4 > (add_on->mask + 1) * 3) {
+        uint32 size = add_on->symbols ? (add_on->mask + 1) * 2 : IMAGE_SYMBOLS_MIN;
+        _image_symbol *symbols = calloc(size, sizeof(_image_symbol));
+        if (!symbols) return;
+        for (uint32 i = 0; add_on->symbols && i <= add_on->mask; i++) {
+            _image_symbol *old = &add_on->symbols[i];
+            if (!old->name) continue;
+            uint32 j = old->hash & (size - 1);
+            while (symbols[j].name) j = (j + 1) & (size - 1);
+            symbols[j] = *old;
+        }
+        free(add_on->symbols);
+        add_on->symbols = symbols;
+        add_on->mask = size - 1;
+    }
+
+    _image_symbol *slot = _image_find_symbol(add_on, name, hash);
+    if (slot->name) return; // looked up meanwhile
+    slot->name = strdup(name);
+    if (!slot->name) return;
+    slot->hash = hash;
+    slot->symbol = symbol;
+    add_on->count++;
+}
+
 status_t get_image_symbol(image_id image, const char *name, int32 symbolType,
                           void **_symbolLocation)
 {
+    if (!name || !_symbolLocation) return B_BAD_VALUE;
+
+    uint32 hash = _image_hash(name);
+    _add_ons_rlock();
+    _image_add_on *add_on = image == -1 ? NULL : _image_find_add_on(image, 0, 0);
+    _image_symbol *cached = add_on ? _image_find_symbol(add_on, name, hash) : NULL;
+    bool found = cached && cached->name;
+    if (found) *_symbolLocation = cached->symbol;
+    _add_ons_unlock();
+    if (found) return *_symbolLocation ? B_OK : B_BAD_VALUE;
+
     if (image == -1) image = (image_id)RTLD_DEFAULT;
-    dlerror();
+    /* dlerror() only to clear the error of a symbol not found */
     *_symbolLocation = dlsym((void*)image, name);
-    return dlerror() ? B_BAD_VALUE : B_OK;
+    if (!*_symbolLocation) dlerror();
+
+    if (add_on) {
+        _add_ons_wlock();
+        add_on = _image_find_add_on(image, 0, 0);
+        if (add_on) _image_insert_symbol(add_on, name, hash, *_symbolLocation);
+        _add_ons_unlock();
+    }
+    return *_symbolLocation ? B_OK : B_BAD_VALUE;
+}
+
+static void _image_free_paths(char **paths)
+{
+    for (char **path = paths; *path; path++) free(*path);
+    free(paths);
+}
+
+static int32 _image_preload(void *data)
+{
+    char **paths = data;
+    for (char **path = paths; *path; path++) _image_load_add_on(*path, 0);
+    _image_free_paths(paths);
+    return B_OK;
+}
+
+thread_id preload_add_ons(const char **paths, int32 count)
+{
+    if (!paths || count < 0) return B_BAD_VALUE;
+
+    char **copy = calloc(count + 1, sizeof(char *));
+    if (!copy) return B_NO_MEMORY;
+    for (int32 i = 0; i < count; i++) {
+        copy[i] = strdup(paths[i]);
+        if (!copy[i]) {
+            _image_free_paths(copy);
+            return B_NO_MEMORY;
+        }
+    }
+
+    thread_id thread = spawn_thread(_image_preload, "add-on preloader", B_LOW_PRIORITY, copy);
+    if (thread < 0) {
+        _image_free_paths(copy);
+        return thread;
+    }
+    resume_thread(thread);
+    return thread;
 }
@@ -0,0 +1,1199 @@
+#include <OS.h>
+#include <fs_attr.h>
+#include <fs_index.h>
+#include <syscalls.h>
+#include <NodeMonitor.h>
+#include <TypeConstants.h>
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+
+#include "private.h"
+#include "utlist.h"
+#include "index.h"
+
+/* Attribute indices.
+ * Every volume has a node table and one B+tree per index in the cache
+ * directory of the user, shared by all teams. The node table maps inodes
+ * to parent and name, for paths of query results, and entries back to
+ * inodes. An index maps values suffixed by inode to nothing, and inodes
+ * back to values, so a change finds the entry it replaces.
+ * A team calling _kern_start_indexing() keeps a volume current. It crawls
+ * the volume on the task pool, reading attributes only of nodes whose
+ * ctime changed, and drops nodes the crawl did not see. Every directory
+ * is watched for entry changes and, with B_WATCH_CHILDREN, for attribute
+ * changes of its entries. A burst the port cannot take is lost until the
+ * next crawl, queries check their results anyway.
+ */
+#define INDEX_DIRECTORY     "be/index"
+#define INDEX_BATCH         256     // entries of a directory stored at once
+#define INDEX_SWEEP         1024    // stale nodes dropped at once
+#define INDEX_MAX_DEPTH     256     // of paths
+#define INDEX_PORT_CAPACITY 1024
+#define INDEX_MESSAGES      64      // read at once by the watcher
+#define INDEX_MESSAGE_SIZE  (1024 + 2 * NAME_MAX)
+#define INDEX_WATCH_FLAGS   (B_WATCH_DIRECTORY | B_WATCH_ATTR | B_WATCH_CHILDREN)
+
+typedef struct {
+    uint64      parent;
+    int64       ctime;      // nanoseconds
+    uint32      generation; // of the crawl that saw it last
+    char        name[];
+} __attribute__((packed)) _index_node_record;
+
+typedef struct {
+    uint64      root;       // inode of volume root, changes when it is another volume
+    uint32      generation;
+} __attribute__((packed)) _index_generation_record;
+
+/* Entry found by the crawler or the watcher */
+typedef struct {
+    struct stat st;
+    ino_t       parent;
+    bool        changed;    // attributes must be read
+    fs_attr_entry *entries;
+    ssize_t     count;
+    char        name[NAME_MAX + 1];
+} _index_item;
+
+/* Crawl of one tree, tasks of all its directories are waited for by _index_crawl_tree() */
+typedef struct {
+    _index_volume *volume;
+    pthread_mutex_t lock;
+    task_id     *tasks;
+    int32       count;
+    int32       size;
+} _index_crawl_job;
+
+typedef struct _index_crawl {
+    _index_crawl_job *job;
+    ino_t       node;
+    struct _index_crawl *next;  // crawled by the same task when submit_task() failed
+    char        path[PATH_MAX];
+} _index_crawl;
+
+typedef struct {
+    DIR         *dir;
+    struct dirent value;
+} _index_dir;
+
+static pthread_mutex_t _index_lock = PTHREAD_MUTEX_INITIALIZER;
+static _index_volume *_index_volumes = NULL;
+
+static const struct {
+    const char  *name;
+    uint32      type;
+} _index_defaults[] = {
+    { "BEOS:TYPE", B_STRING_TYPE },
+    { "BEOS:APP_SIG", B_STRING_TYPE },
+};
+
+/* Index file names escape '/', '%' and a leading '.' */
+static void _index_escape(const char *name, char *escaped, size_t size)
+{
+    size_t used = 0;
+    for (const char *p = name; *p && used + 4 < size; p++) {
+        if (*p == '/' || *p == '%' || (p == name && *p == '.'))
+            used += snprintf(escaped + used, size - used, "%%%02X", (uint8)*p);
+        else
+            escaped[used++] = *p;
+    }
+    escaped[used] = '\0';
+}
+
+static void _index_unescape(const char *escaped, char *name, size_t size)
+{
+    size_t used = 0;
+    for (const char *p = escaped; *p && used + 1 < size; p++) {
+        unsigned int c;
+        if (*p == '%' && sscanf(p + 1, "%2X", &c) == 1) {
+            name[used++] = c;
+            p += 2;
+        } else {
+            name[used++] = *p;
+        }
+    }
+    name[used] = '\0';
+}
+
+/* Index directory of volume, or file of index name in it */
+static bool _index_file(_index_volume *volume, const char *name, char *path, size_t size)
+{
+    size_t used = strlen(volume->path);
+    if (used + sizeof("/index") >= size) return false;
+    memcpy(path, volume->path, used);
+    strcpy(path + used, "/index");
+    used += strlen("/index");
+    if (name) {
+        path[used++] = '/';
+        _index_escape(name, path + used, size - used);
+    }
+    return true;
+}
+
+static status_t _index_mkdirs(char *path)
+{
+    for (char *p = path + 1; *p; p++) {
+        if (*p != '/') continue;
+        *p = '\0';
+        int result = mkdir(path, 0700);
+        *p = '/';
+        if (result < 0 && errno != EEXIST) return B_FROM_POSIX_ERROR(errno);
+    }
+    if (mkdir(path, 0700) < 0 && errno != EEXIST) return B_FROM_POSIX_ERROR(errno);
+    return B_OK;
+}
+
+/* Mount point of device, the one of its whole file system if bound more than once. */
+static status_t _index_mount_root(dev_t device, char *root, size_t size)
+{
+    FILE *mounts = fopen("/proc/self/mountinfo", "re");
+    if (!mounts) return B_FROM_POSIX_ERROR(errno);
+
+    status_t result = B_DEVICE_NOT_FOUND;
+    char *line = NULL;
+    size_t length = 0;
+    while (getline(&line, &length, mounts) > 0) {
+        char fsroot[PATH_MAX], point[PATH_MAX], path[PATH_MAX];
+        if (sscanf(line, "%*d %*d %*s %4095s %4095s", fsroot, point) != 2) continue;
+
+        /* mountinfo escapes blanks and backslashes as octal */
+        size_t used = 0;
+        for (const char *p = point; *p && used + 1 < sizeof(path); p++) {
+            unsigned int c;
+            if (*p == '\\' && sscanf(p + 1, "%3o", &c) == 1) {
+                path[used++] = c;
+                p += 3;
+            } else {
+                path[used++] = *p;
+            }
+        }
+        path[used] = '\0';
+
+        struct stat st;
+        if (stat(path, &st) < 0 || st.st_dev != device) continue;
+        if (result == B_OK && strcmp(fsroot, "/") != 0) continue;
+        snprintf(root, size, "%s", path);
+        result = B_OK;
+        if (strcmp(fsroot, "/") == 0) break;
+    }
+    free(line);
+    fclose(mounts);
+    return result;
+}
+
+/* WARNING! you need to lock _index_lock in caller function! */
+static _index *_index_open(_index_volume *volume, const char *name, uint32 type)
+{
+    char path[PATH_MAX];
+    if (!_index_file(volume, name, path, sizeof(path))) return NULL;
+
+    _index *index = calloc(1, sizeof(_index));
+    if (!index) return NULL;
+    if (_btree_open(&index->tree, path, type) != B_OK) {
+        free(index);
+        return NULL;
+    }
+    snprintf(index->name, sizeof(index->name), "%s", name);
+    _btree_lock(&index->tree, false);
+    index->type = _btree_type(&index->tree);
+    _btree_unlock(&index->tree);
+    DL_APPEND(volume->indices, index);
+    return index;
+}
+
+/* Opens indices other teams created. Removed ones stay open, as
+ * queries may still use them.
+ * WARNING! you need to lock _index_lock in caller function!
+ */
+static int32 _index_refresh(_index_volume *volume)
+{
+    char path[PATH_MAX];
+    struct stat st;
+    if (!_index_file(volume, NULL, path, sizeof(path)) || stat(path, &st) < 0) return 0;
+    if (st.st_mtim.tv_sec == volume->indices_time.tv_sec && st.st_mtim.tv_nsec == volume->indices_time.tv_nsec)
+        return 0;
+    volume->indices_time = st.st_mtim;
+
+    DIR *dir = opendir(path);
+    if (!dir) return 0;
+    int32 added = 0;
+    struct dirent *ent;
+    while ((ent = readdir(dir))) {
+        if (ent->d_name[0] == '.') continue;
+        char name[B_ATTR_NAME_LENGTH + 1];
+        _index_unescape(ent->d_name, name, sizeof(name));
+
+        _index *index;
+        bool found = false;
+        DL_FOREACH(volume->indices, index) {
+            if (strcmp(index->name, name) == 0) {
+                found = true;
+                break;
+            }
+        }
+        if (!found && _index_open(volume, name, 0)) added++;
+    }
+    closedir(dir);
+    return added;
+}
+
+_index_volume *_index_volume_get(dev_t device)
+{
+    pthread_mutex_lock(&_index_lock);
+    _index_volume *volume;
+    DL_FOREACH(_index_volumes, volume) {
+        if (volume->device == device) {
+            _index_refresh(volume);
+            pthread_mutex_unlock(&_index_lock);
+            return volume;
+        }
+    }
+
+    volume = calloc(1, sizeof(_index_volume));
+    if (!volume) {
+        pthread_mutex_unlock(&_index_lock);
+        errno = B_NO_MEMORY;
+        return NULL;
+    }
+    volume->device = device;
+    volume->thread = -1;
+    volume->port = -1;
+
+    struct stat st;
+    status_t result = _index_mount_root(device, volume->root, sizeof(volume->root));
+    if (result == B_OK && stat(volume->root, &st) < 0) result = B_FROM_POSIX_ERROR(errno);
+    if (result == B_OK) volume->root_node = st.st_ino;
+
+    const char *cache = getenv("XDG_CACHE_HOME");
+    const char *home = getenv("HOME");
+    if (result == B_OK && cache && cache[0])
+        snprintf(volume->path, sizeof(volume->path), "%s/" INDEX_DIRECTORY "/%lx", cache, (unsigned long)device);
+    else if (result == B_OK && home && home[0])
+        snprintf(volume->path, sizeof(volume->path), "%s/.cache/" INDEX_DIRECTORY "/%lx", home, (unsigned long)device);
+    else if (result == B_OK)
+        result = B_ENTRY_NOT_FOUND;
+
+    char path[PATH_MAX];
+    bool created = false;
+    if (result == B_OK && !_index_file(volume, NULL, path, sizeof(path)))
+        result = B_NAME_TOO_LONG;
+    if (result == B_OK) {
+        created = access(path, F_OK) < 0;
+        result = _index_mkdirs(path);
+    }
+    if (result == B_OK) {
+        /* sibling of index directory */
+        strcpy(path + strlen(path) - strlen("index"), "nodes");
+        result = _btree_open(&volume->nodes, path, 0);
+    }
+    if (result != B_OK) {
+        free(volume);
+        pthread_mutex_unlock(&_index_lock);
+        errno = result;
+        return NULL;
+    }
+
+    if (created) {
+        for (size_t i = 0; i < sizeof(_index_defaults) / sizeof(_index_defaults[0]); i++)
+            _index_open(volume, _index_defaults[i].name, _index_defaults[i].type);
+    }
+    _index_refresh(volume);
+    DL_APPEND(_index_volumes, volume);
+    pthread_mutex_unlock(&_index_lock);
+    return volume;
+}
+
+_index *_index_get(_index_volume *volume, const char *name)
+{
+    pthread_mutex_lock(&_index_lock);
+    _index_refresh(volume);
+    _index *index;
+    DL_FOREACH(volume->indices, index) {
+        if (strcmp(index->name, name) == 0) break;
+    }
+    pthread_mutex_unlock(&_index_lock);
+    return index;
+}
+
+/* Encodes attribute data so that memcmp() sorts values of type.
+ * Returns the encoded size, 0 if data is no value of type.
+ */
+size_t _index_encode(uint32 type, const void *data, size_t size, uint8 *value)
+{
+    uint64 bits;
+    int64 number;
+    switch (type) {
+    case B_STRING_TYPE:
+    case INDEX_MIME_STRING_TYPE: {
+        size_t length = strnlen(data, min_c(size, INDEX_MAX_VALUE));
+        memcpy(value, data, length);
+        value[length] = '\0';
+        return length + 1;
+    }
+    case B_INT8_TYPE:
+    case B_INT16_TYPE:
+    case B_INT32_TYPE:
+    case B_INT64_TYPE:
+    case B_OFF_T_TYPE:
+    case B_SSIZE_T_TYPE:
+    case B_TIME_TYPE:
+        if (!_index_read_signed(data, size, &number)) return 0;
+        bits = (uint64)number ^ (1ULL << 63);
+        break;
+    case B_UINT8_TYPE:
+    case B_UINT16_TYPE:
+    case B_UINT32_TYPE:
+    case B_UINT64_TYPE:
+    case B_SIZE_T_TYPE:
+    case B_BOOL_TYPE:
+        if (!_index_read_unsigned(data, size, &bits)) return 0;
+        break;
+    case B_FLOAT_TYPE:
+    case B_DOUBLE_TYPE: {
+        double real;
+        if (size == sizeof(float)) real = *(const float *)data;
+        else if (size == sizeof(double)) real = *(const double *)data;
+        else return 0;
+        memcpy(&bits, &real, sizeof(bits));
+        /* negative numbers sort reversed */
+        bits = (bits & (1ULL << 63)) ? ~bits : bits | (1ULL << 63);
+        break;
+    }
+    default:
+        size = min_c(size, INDEX_MAX_VALUE);
+        memcpy(value, data, size);
+        return size;
+    }
+    bits = htobe64(bits);
+    memcpy(value, &bits, sizeof(bits));
+    return sizeof(bits);
+}
+
+static bool _index_compatible(uint32 indexType, uint32 attrType)
+{
+    if (indexType == attrType) return true;
+    /* MIME strings are strings */
+    return (indexType == B_STRING_TYPE || indexType == INDEX_MIME_STRING_TYPE)
+           && (attrType == B_STRING_TYPE || attrType == INDEX_MIME_STRING_TYPE);
+}
+
+static size_t _index_entry_key(uint8 *key, ino_t parent, const char *name)
+{
+    size_t length = strlen(name);
+    _index_node_key(key, parent);
+    key[0] = INDEX_KEY_ENTRY;
+    memcpy(key + INDEX_NODE_KEY_SIZE, name, length);
+    return INDEX_NODE_KEY_SIZE + length;
+}
+
+/* WARNING! you need to lock volume->nodes in caller function! */
+static ssize_t _index_node_read(_index_volume *volume, ino_t node, _index_node_record *record, size_t size)
+{
+    uint8 key[INDEX_NODE_KEY_SIZE];
+    _index_node_key(key, node);
+    ssize_t read = _btree_find(&volume->nodes, key, sizeof(key), record, size - 1);
+    if (read < (ssize_t)sizeof(_index_node_record)) return -1;
+    ((char *)record)[min_c((size_t)read, size - 1)] = '\0';
+    return read;
+}
+
+status_t _index_node_path(_index_volume *volume, ino_t node, char *path, size_t size)
+{
+    const char *names[INDEX_MAX_DEPTH];
+    union {
+        _index_node_record record;
+        char bytes[sizeof(_index_node_record) + NAME_MAX + 1];
+    } records[INDEX_MAX_DEPTH];
+
+    status_t result = _btree_lock(&volume->nodes, false);
+    if (result != B_OK) return result;
+    int32 depth = 0;
+    while (node != volume->root_node) {
+        if (depth == INDEX_MAX_DEPTH
+            || _index_node_read(volume, node, &records[depth].record, sizeof(records[depth])) < 0) {
+            _btree_unlock(&volume->nodes);
+            return B_ENTRY_NOT_FOUND;
+        }
+        names[depth] = records[depth].record.name;
+        node = records[depth++].record.parent;
+    }
+    _btree_unlock(&volume->nodes);
+
+    size_t used = snprintf(path, size, "%s", volume->root);
+    if (used == 1) used = 0; // root of the file system
+    while (depth-- > 0 && used < size)
+        used += snprintf(path + used, size - used, "/%s", names[depth]);
+    if (used >= size) return B_NAME_TOO_LONG;
+    if (used == 0) snprintf(path, size, "/");
+    return B_OK;
+}
+
+/* Replaces value of node in index, no value removes it.
+ * WARNING! you need to lock index->tree in caller function!
+ */
+static void _index_set(_index *index, ino_t node, const uint8 *value, size_t size)
+{
+    uint8 key[INDEX_KEY_SIZE], old[INDEX_VALUE_SIZE];
+    uint64 suffix = htobe64(node);
+
+    _index_node_key(key, node);
+    ssize_t oldSize = _btree_find(&index->tree, key, INDEX_NODE_KEY_SIZE, old, sizeof(old));
+    if (oldSize > (ssize_t)sizeof(old)) oldSize = -1;
+    if (oldSize >= 0) {
+        if (size && (size_t)oldSize == size && memcmp(old, value, size) == 0) return;
+        key[0] = INDEX_KEY_VALUE;
+        memcpy(key + 1, old, oldSize);
+        memcpy(key + 1 + oldSize, &suffix, sizeof(suffix));
+        _btree_remove(&index->tree, key, 1 + oldSize + sizeof(suffix));
+    }
+
+    _index_node_key(key, node);
+    if (!size) {
+        if (oldSize >= 0) _btree_remove(&index->tree, key, INDEX_NODE_KEY_SIZE);
+        return;
+    }
+    _btree_insert(&index->tree, key, INDEX_NODE_KEY_SIZE, value, size);
+    key[0] = INDEX_KEY_VALUE;
+    memcpy(key + 1, value, size);
+    memcpy(key + 1 + size, &suffix, sizeof(suffix));
+    _btree_insert(&index->tree, key, 1 + size + sizeof(suffix), NULL, 0);
+}
+
+/* Stores values of changed items, or drops them when removed, in every index. */
+static void _index_write(_index_volume *volume, _index_item *items, int32 count, bool removed)
+{
+    pthread_mutex_lock(&_index_lock);
+    _index *index;
+    DL_FOREACH(volume->indices, index) {
+        if (!index->name[0]) continue; // removed
+        bool locked = false;
+        for (int32 i = 0; i < count; i++) {
+            _index_item *item = &items[i];
+            if (!removed && !item->changed) continue;
+
+            uint8 value[INDEX_VALUE_SIZE];
+            size_t size = 0;
+            for (ssize_t j = 0; !removed && j < item->count; j++) {
+                fs_attr_entry *entry = &item->entries[j];
+                if (strcmp(entry->name, index->name) == 0 && _index_compatible(index->type, entry->type)) {
+                    size = _index_encode(index->type, entry->data, entry->size, value);
+                    break;
+                }
+            }
+
+            if (!locked && _btree_lock(&index->tree, true) != B_OK) break;
+            locked = true;
+            _index_set(index, item->st.st_ino, value, size);
+        }
+        if (locked) _btree_unlock(&index->tree);
+    }
+    pthread_mutex_unlock(&_index_lock);
+}
+
+/* WARNING! you need to lock volume->nodes in caller function! */
+static void _index_node_write(_index_volume *volume, _index_item *item)
+{
+    union {
+        _index_node_record record;
+        char bytes[sizeof(_index_node_record) + NAME_MAX + 1];
+    } old, new;
+    uint8 key[INDEX_NODE_KEY_SIZE + NAME_MAX];
+    uint64 node = item->st.st_ino;
+
+    if (_index_node_read(volume, item->st.st_ino, &old.record, sizeof(old)) >= 0
+        && (old.record.parent != (uint64)item->parent || strcmp(old.record.name, item->name) != 0)) {
+        /* moved or linked elsewhere */
+        _btree_remove(&volume->nodes, key, _index_entry_key(key, old.record.parent, old.record.name));
+    }
+
+    size_t length = strlen(item->name);
+    new.record.parent = item->parent;
+    new.record.ctime = item->st.st_ctim.tv_sec * 1000000000LL + item->st.st_ctim.tv_nsec;
+    new.record.generation = volume->generation;
+    memcpy(new.record.name, item->name, length + 1);
+    _btree_insert(&volume->nodes, key, _index_node_key(key, item->st.st_ino),
+                  &new, sizeof(_index_node_record) + length + 1);
+    _btree_insert(&volume->nodes, key, _index_entry_key(key, item->parent, item->name), &node, sizeof(node));
+}
+
+/* Adds entries of directory, reading attributes of changed ones. */
+static void _index_store(_index_volume *volume, const char *directory, _index_item *items, int32 count)
+{
+    union {
+        _index_node_record record;
+        char bytes[sizeof(_index_node_record) + NAME_MAX + 1];
+    } old;
+
+    if (_btree_lock(&volume->nodes, false) != B_OK) return;
+    for (int32 i = 0; i < count; i++) {
+        _index_item *item = &items[i];
+        int64 ctime = item->st.st_ctim.tv_sec * 1000000000LL + item->st.st_ctim.tv_nsec;
+        if (_index_node_read(volume, item->st.st_ino, &old.record, sizeof(old)) < 0 || old.record.ctime != ctime)
+            item->changed = true;
+    }
+    _btree_unlock(&volume->nodes);
+
+    bool changed = false;
+    for (int32 i = 0; i < count; i++) {
+        _index_item *item = &items[i];
+        item->entries = NULL;
+        item->count = 0;
+        if (!item->changed) continue;
+        changed = true;
+        if (!S_ISREG(item->st.st_mode) && !S_ISDIR(item->st.st_mode)) continue; // no user attributes
+
+        char path[PATH_MAX];
+        snprintf(path, sizeof(path), "%s/%s", strcmp(directory, "/") ? directory : "", item->name);
+        item->count = _attr_read_path(path, &item->entries);
+        if (item->count < 0) item->count = 0;
+    }
+    if (changed) _index_write(volume, items, count, false);
+
+    /* node records last, a crash before leaves them to be read again */
+    if (_btree_lock(&volume->nodes, true) == B_OK) {
+        for (int32 i = 0; i < count; i++)
+            _index_node_write(volume, &items[i]);
+        _btree_unlock(&volume->nodes);
+    }
+    for (int32 i = 0; i < count; i++)
+        free(items[i].entries);
+}
+
+/* Drops node, and everything below when it is a directory. */
+static void _index_drop(_index_volume *volume, ino_t node)
+{
+    ino_t *stack = malloc(INDEX_SWEEP * sizeof(ino_t));
+    _index_item *items = malloc(INDEX_SWEEP * sizeof(_index_item));
+    if (!stack || !items) {
+        free(stack);
+        free(items);
+        return;
+    }
+
+    int32 depth = 0;
+    stack[depth++] = node;
+    while (depth > 0) {
+        int32 count = 0;
+        if (_btree_lock(&volume->nodes, true) != B_OK) break;
+        while (depth > 0 && count < INDEX_SWEEP) {
+            ino_t current = stack[--depth];
+            union {
+                _index_node_record record;
+                char bytes[sizeof(_index_node_record) + NAME_MAX + 1];
+            } record;
+            uint8 key[INDEX_NODE_KEY_SIZE + NAME_MAX];
+
+            /* children of directory, deepest first */
+            _btree_cursor cursor;
+            size_t prefix = _index_node_key(key, current);
+            key[0] = INDEX_KEY_ENTRY;
+            _btree_seek(&volume->nodes, &cursor, key, prefix);
+            const void *childKey, *value;
+            size_t childKeySize, valueSize;
+            while (depth < INDEX_SWEEP
+                   && _btree_get(&volume->nodes, &cursor, &childKey, &childKeySize, &value, &valueSize)
+                   && childKeySize >= prefix && memcmp(childKey, key, prefix) == 0) {
+                memcpy(&stack[depth++], value, sizeof(ino_t));
+                _btree_next(&volume->nodes, &cursor);
+            }
+
+            if (_index_node_read(volume, current, &record.record, sizeof(record)) >= 0) {
+                _btree_remove(&volume->nodes, key, _index_entry_key(key, record.record.parent, record.record.name));
+                _btree_remove(&volume->nodes, key, _index_node_key(key, current));
+            }
+            items[count++].st.st_ino = current;
+        }
+        _btree_unlock(&volume->nodes);
+        _index_write(volume, items, count, true);
+    }
+    free(stack);
+    free(items);
+}
+
+static void _index_watch(_index_volume *volume, int fd)
+{
+    _kern_start_watching(fd, INDEX_WATCH_FLAGS, volume->port, 0);
+}
+
+static status_t _index_crawl_directory(void *data);
+
+/* Returns error when crawl was not submitted, then caller must crawl it itself */
+static status_t _index_crawl_submit(_index_crawl *crawl)
+{
+    _index_crawl_job *job = crawl->job;
+    status_t status = B_NO_MEMORY;
+    pthread_mutex_lock(&job->lock);
+    if (job->count == job->size) {
+        int32 size = job->size ? job->size * 2 : 64;
+        task_id *grown = realloc(job->tasks, size * sizeof(task_id));
+        if (grown) {
+            job->tasks = grown;
+            job->size = size;
+        }
+    }
+    if (job->count < job->size) {
+        task_id task = submit_task(_index_crawl_directory, crawl);
+        if (task >= 0) job->tasks[job->count++] = task;
+        status = task < 0 ? (status_t)task : B_OK;
+    }
+    pthread_mutex_unlock(&job->lock);
+    return status;
+}
+
+/* Indexes entries of directory, subdirectories are submitted or queued to pending. */
+static void _index_crawl_entries(_index_crawl *crawl, _index_item *items, _index_crawl **pending)
+{
+    _index_volume *volume = crawl->job->volume;
+    DIR *dir = opendir(crawl->path);
+    if (!dir) return;
+    int fd = dirfd(dir);
+    if (volume->port >= 0) _index_watch(volume, fd);
+
+    int32 count = 0;
+    struct dirent *ent;
+    while (!volume->quit && (ent = readdir(dir))) {
+        if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0) continue;
+
+        _index_item *item = &items[count];
+        if (fstatat(fd, ent->d_name, &item->st, AT_SYMLINK_NOFOLLOW) < 0) continue;
+        if (item->st.st_dev != volume->device) continue; // mount point of another volume
+        item->parent = crawl->node;
+        item->changed = false;
+        snprintf(item->name, sizeof(item->name), "%s", ent->d_name);
+
+        if (S_ISDIR(item->st.st_mode)) {
+            _index_crawl *child = malloc(sizeof(_index_crawl));
+            if (child && snprintf(child->path, sizeof(child->path), "%s/%s",
+                                  strcmp(crawl->path, "/") ? crawl->path : "", ent->d_name) < (int)sizeof(child->path)) {
+                child->job = crawl->job;
+                child->node = item->st.st_ino;
+                if (_index_crawl_submit(child) != B_OK) LL_PREPEND(*pending, child);
+            } else {
+                free(child);
+            }
+        }
+
+        if (++count == INDEX_BATCH) {
+            _index_store(volume, crawl->path, items, count);
+            count = 0;
+        }
+    }
+    if (count) _index_store(volume, crawl->path, items, count);
+    closedir(dir);
+}
+
+/* Crawl tasks never wait for other tasks, so helping in wait_for_task() does not nest. */
+static status_t _index_crawl_directory(void *data)
+{
+    _index_crawl *pending = data, *crawl;
+    pending->next = NULL;
+    _index_item *items = malloc(INDEX_BATCH * sizeof(_index_item));
+    while ((crawl = pending)) {
+        LL_DELETE(pending, crawl);
+        if (items) _index_crawl_entries(crawl, items, &pending);
+        free(crawl);
+    }
+    free(items);
+    return items ? B_OK : B_NO_MEMORY;
+}
+
+static status_t _index_crawl_tree(_index_volume *volume, const char *path, ino_t node)
+{
+    _index_crawl_job job = { .volume = volume };
+    _index_crawl *crawl = malloc(sizeof(_index_crawl));
+    if (!crawl) return B_NO_MEMORY;
+    pthread_mutex_init(&job.lock, NULL);
+    crawl->job = &job;
+    crawl->node = node;
+    snprintf(crawl->path, sizeof(crawl->path), "%s", path);
+
+    status_t status = B_OK;
+    if (_index_crawl_submit(crawl) != B_OK) status = _index_crawl_directory(crawl);
+
+    // tasks append their children before they finish, so count only grows while waiting
+    for (int32 i = 0;; i++) {
+        pthread_mutex_lock(&job.lock);
+        task_id task = i < job.count ? job.tasks[i] : -1;
+        pthread_mutex_unlock(&job.lock);
+        if (task < 0) break;
+        status_t result = B_OK;
+        wait_for_task(task, &result);
+        if (result != B_OK) status = result;
+    }
+    free(job.tasks);
+    pthread_mutex_destroy(&job.lock);
+    return status;
+}
+
+/* Drops nodes the last crawl did not see. */
+static void _index_sweep(_index_volume *volume)
+{
+    ino_t *stale = malloc(INDEX_SWEEP * sizeof(ino_t));
+    if (!stale) return;
+
+    uint8 key[INDEX_NODE_KEY_SIZE];
+    _index_node_key(key, 0);
+    for (;;) {
+        int32 count = 0;
+        if (_btree_lock(&volume->nodes, false) != B_OK) break;
+        _btree_cursor cursor;
+        _btree_seek(&volume->nodes, &cursor, key, sizeof(key));
+        const void *nodeKey, *value;
+        size_t nodeKeySize, valueSize;
+        while (count < INDEX_SWEEP
+               && _btree_get(&volume->nodes, &cursor, &nodeKey, &nodeKeySize, &value, &valueSize)
+               && ((const uint8 *)nodeKey)[0] == INDEX_KEY_NODE && nodeKeySize == INDEX_NODE_KEY_SIZE) {
+            _index_node_record record;
+            memcpy(&record, value, sizeof(record));
+            if (record.generation != volume->generation)
+                stale[count++] = _index_key_node((const uint8 *)nodeKey + 1);
+            memcpy(key, nodeKey, sizeof(key));
+            _btree_next(&volume->nodes, &cursor);
+        }
+        bool done = count < INDEX_SWEEP;
+        _btree_unlock(&volume->nodes);
+
+        for (int32 i = 0; i < count; i++)
+            _index_drop(volume, stale[i]);
+        if (done) break;
+    }
+    free(stale);
+}
+
+/* Crawls whole volume, from scratch when the node table is of another
+ * volume or when indices were added since.
+ */
+static void _index_crawl_volume(_index_volume *volume, bool reset)
+{
+    uint8 key = INDEX_KEY_GENERATION;
+    _index_generation_record generation = { 0, 0 };
+
+    pthread_mutex_lock(&_index_lock);
+    _index *index;
+    DL_FOREACH(volume->indices, index) {
+        if (index->tree.recovered) reset = true;
+    }
+    pthread_mutex_unlock(&_index_lock);
+
+    if (_btree_lock(&volume->nodes, true) != B_OK) return;
+    if (_btree_find(&volume->nodes, &key, sizeof(key), &generation, sizeof(generation)) != sizeof(generation)
+        || generation.root != (uint64)volume->root_node || volume->nodes.recovered)
+        reset = true;
+    if (reset) {
+        /* every node is read again, so indices start empty too */
+        pthread_mutex_lock(&_index_lock);
+        DL_FOREACH(volume->indices, index) {
+            if (_btree_lock(&index->tree, true) != B_OK) continue;
+            _btree_clear(&index->tree);
+            index->tree.recovered = false;
+            _btree_unlock(&index->tree);
+        }
+        pthread_mutex_unlock(&_index_lock);
+        _btree_clear(&volume->nodes);
+        volume->nodes.recovered = false;
+    }
+    generation.root = volume->root_node;
+    generation.generation++;
+    volume->generation = generation.generation;
+    _btree_insert(&volume->nodes, &key, sizeof(key), &generation, sizeof(generation));
+    _btree_unlock(&volume->nodes);
+
+    _index_crawl_tree(volume, volume->root, volume->root_node);
+    if (!volume->quit) _index_sweep(volume);
+}
+
+/* Finds field in flattened B_NODE_MONITOR message, see monitor.c */
+static ssize_t _index_field(const char *message, size_t size, const char *name, void *value, size_t valueSize)
+{
+    const char *p = message + sizeof(uint32), *end = message + size;
+    size_t length = strlen(name);
+    while (p + sizeof(uint32) <= end) {
+        uint32 type;
+        uint8 nameLength;
+        uint32 count;
+        uint64 dataSize;
+        memcpy(&type, p, sizeof(type));
+        if (!type) break;
+        p += sizeof(type);
+        if (p + sizeof(nameLength) > end) break;
+        memcpy(&nameLength, p, sizeof(nameLength));
+        p += sizeof(nameLength);
+        const char *fieldName = p;
+        p += nameLength;
+        if (p + sizeof(count) + sizeof(dataSize) > end) break;
+        memcpy(&count, p, sizeof(count));
+        p += sizeof(count);
+        memcpy(&dataSize, p, sizeof(dataSize));
+        p += sizeof(dataSize);
+        if (dataSize > (uint64)(end - p)) break;
+
+        if (nameLength == length && memcmp(fieldName, name, length) == 0) {
+            memcpy(value, p, min_c(dataSize, valueSize));
+            if (dataSize < valueSize) memset((char *)value + dataSize, 0, valueSize - dataSize);
+            return dataSize;
+        }
+        p += dataSize;
+    }
+    return -1;
+}
+
+/* Indexes entry of directory, and the tree below when it is one. */
+static void _index_entry(_index_volume *volume, ino_t directory, const char *name, bool force)
+{
+    char path[PATH_MAX];
+    if (_index_node_path(volume, directory, path, sizeof(path)) != B_OK) return;
+
+    _index_item item;
+    char entry[PATH_MAX];
+    if (snprintf(entry, sizeof(entry), "%s/%s", strcmp(path, "/") ? path : "", name) >= (int)sizeof(entry)
+        || lstat(entry, &item.st) < 0 || item.st.st_dev != volume->device) return;
+    item.parent = directory;
+    item.changed = force;
+    snprintf(item.name, sizeof(item.name), "%s", name);
+    _index_store(volume, path, &item, 1);
+
+    if (S_ISDIR(item.st.st_mode) && !force)
+        _index_crawl_tree(volume, entry, item.st.st_ino);
+}
+
+static void _index_removed(_index_volume *volume, ino_t directory, const char *name)
+{
+    uint8 key[INDEX_NODE_KEY_SIZE + NAME_MAX];
+    ino_t node;
+    if (_btree_lock(&volume->nodes, false) != B_OK) return;
+    ssize_t found = _btree_find(&volume->nodes, key, _index_entry_key(key, directory, name), &node, sizeof(node));
+    _btree_unlock(&volume->nodes);
+    if (found == sizeof(node)) _index_drop(volume, node);
+}
+
+static void _index_moved(_index_volume *volume, ino_t from, const char *fromName, ino_t to, const char *name)
+{
+    uint8 key[INDEX_NODE_KEY_SIZE + NAME_MAX];
+    ino_t node;
+    if (_btree_lock(&volume->nodes, true) != B_OK) return;
+    ssize_t found = _btree_find(&volume->nodes, key, _index_entry_key(key, from, fromName), &node, sizeof(node));
+    if (found == sizeof(node)) {
+        union {
+            _index_node_record record;
+            char bytes[sizeof(_index_node_record) + NAME_MAX + 1];
+        } record;
+        _index_item item;
+        if (_index_node_read(volume, node, &record.record, sizeof(record)) >= 0) {
+            _btree_remove(&volume->nodes, key, _index_entry_key(key, from, fromName));
+            memset(&item.st, 0, sizeof(item.st));
+            item.st.st_ino = node;
+            item.st.st_ctim.tv_sec = record.record.ctime / 1000000000LL;
+            item.st.st_ctim.tv_nsec = record.record.ctime % 1000000000LL;
+            item.parent = to;
+            snprintf(item.name, sizeof(item.name), "%s", name);
+            _index_node_write(volume, &item);
+        }
+    }
+    _btree_unlock(&volume->nodes);
+
+    /* moved in from a directory not known yet */
+    if (found != sizeof(node)) _index_entry(volume, to, name, false);
+}
+
+static void _index_changed(_index_volume *volume, ino_t node)
+{
+    union {
+        _index_node_record record;
+        char bytes[sizeof(_index_node_record) + NAME_MAX + 1];
+    } record;
+    if (_btree_lock(&volume->nodes, false) != B_OK) return;
+    ssize_t found = _index_node_read(volume, node, &record.record, sizeof(record));
+    _btree_unlock(&volume->nodes);
+    if (found >= 0) _index_entry(volume, record.record.parent, record.record.name, true);
+}
+
+static void _index_handle(_index_volume *volume, const char *message, size_t size)
+{
+    int32 opcode;
+    int64 directory, to, node;
+    char name[NAME_MAX + 1], fromName[NAME_MAX + 1];
+    if (_index_field(message, size, "opcode", &opcode, sizeof(opcode)) < 0) return;
+
+    switch (opcode) {
+    case B_ENTRY_CREATED:
+        if (_index_field(message, size, "directory", &directory, sizeof(directory)) < 0
+            || _index_field(message, size, "name", name, sizeof(name) - 1) < 0) return;
+        name[NAME_MAX] = '\0';
+        _index_entry(volume, directory, name, false);
+        break;
+    case B_ENTRY_REMOVED:
+        if (_index_field(message, size, "directory", &directory, sizeof(directory)) < 0
+            || _index_field(message, size, "name", name, sizeof(name) - 1) < 0) return;
+        name[NAME_MAX] = '\0';
+        _index_removed(volume, directory, name);
+        break;
+    case B_ENTRY_MOVED:
+        if (_index_field(message, size, "from directory", &directory, sizeof(directory)) < 0
+            || _index_field(message, size, "to directory", &to, sizeof(to)) < 0
+            || _index_field(message, size, "from name", fromName, sizeof(fromName) - 1) < 0
+            || _index_field(message, size, "name", name, sizeof(name) - 1) < 0) return;
+        name[NAME_MAX] = fromName[NAME_MAX] = '\0';
+        _index_moved(volume, directory, fromName, to, name);
+        break;
+    case B_ATTR_CHANGED:
+        if (_index_field(message, size, "node", &node, sizeof(node)) < 0) return;
+        if (node != (int64)volume->root_node) _index_changed(volume, node);
+        break;
+    }
+}
+
+static int32 _index_service(void *data)
+{
+    _index_volume *volume = data;
+    int32 codes[INDEX_MESSAGES];
+    void *buffers[INDEX_MESSAGES];
+    size_t sizes[INDEX_MESSAGES];
+    char *messages = malloc(INDEX_MESSAGES * INDEX_MESSAGE_SIZE);
+    if (!messages) return B_NO_MEMORY;
+    for (int32 i = 0; i < INDEX_MESSAGES; i++)
+        buffers[i] = messages + i * INDEX_MESSAGE_SIZE;
+
+    _index_crawl_volume(volume, false);
+    while (!volume->quit) {
+        for (int32 i = 0; i < INDEX_MESSAGES; i++)
+            sizes[i] = INDEX_MESSAGE_SIZE;
+        ssize_t count = read_port_batch(volume->port, codes, buffers, sizes, INDEX_MESSAGES, 0, 0);
+        if (count == B_INTERRUPTED) continue;
+        if (count < 0) break;
+
+        for (int32 i = 0; i < count && !volume->quit; i++) {
+            if (codes[i] == B_MESSAGE_TYPE) _index_handle(volume, buffers[i], sizes[i]);
+        }
+
+        /* indices added by any team are filled from scratch */
+        pthread_mutex_lock(&_index_lock);
+        int32 added = _index_refresh(volume);
+        pthread_mutex_unlock(&_index_lock);
+        if (added) _index_crawl_volume(volume, true);
+    }
+    free(messages);
+    return B_OK;
+}
+
+status_t _kern_start_indexing(dev_t device)
+{
+    _index_volume *volume = _index_volume_get(device);
+    if (!volume) return errno;
+
+    pthread_mutex_lock(&_index_lock);
+    if (volume->thread >= 0) {
+        pthread_mutex_unlock(&_index_lock);
+        return B_OK;
+    }
+
+    /* every directory is watched, and a watch keeps a descriptor */
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+
+    volume->quit = false;
+    volume->port = create_port(INDEX_PORT_CAPACITY, "index monitor");
+    if (volume->port < 0) {
+        status_t result = volume->port;
+        pthread_mutex_unlock(&_index_lock);
+        return result;
+    }
+    int fd = open(volume->root, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd >= 0) {
+        _index_watch(volume, fd);
+        close(fd);
+    }
+
+    volume->thread = spawn_thread(_index_service, "indexer", B_LOW_PRIORITY, volume);
+    if (volume->thread < 0) {
+        status_t result = volume->thread;
+        _kern_stop_notifying(volume->port, 0);
+        delete_port(volume->port);
+        volume->port = -1;
+        volume->thread = -1;
+        pthread_mutex_unlock(&_index_lock);
+        return result;
+    }
+    resume_thread(volume->thread);
+    pthread_mutex_unlock(&_index_lock);
+    return B_OK;
+}
+
+status_t _kern_stop_indexing(dev_t device)
+{
+    _index_volume *volume = _index_volume_get(device);
+    if (!volume) return errno;
+
+    pthread_mutex_lock(&_index_lock);
+    thread_id thread = volume->thread;
+    port_id port = volume->port;
+    volume->thread = -1;
+    pthread_mutex_unlock(&_index_lock);
+    if (thread < 0) return B_BAD_VALUE;
+
+    volume->quit = true;
+    _kern_stop_notifying(port, 0);
+    delete_port(port);
+    status_t result;
+    wait_for_thread(thread, &result);
+    volume->port = -1;
+    return B_OK;
+}
+
+int fs_create_index(dev_t device, const char *name, uint32 type, uint32 flags)
+{
+    (void)flags;
+    if (!name || !name[0] || strlen(name) > B_ATTR_NAME_LENGTH) {
+        errno = B_BAD_VALUE;
+        return -1;
+    }
+    _index_volume *volume = _index_volume_get(device);
+    if (!volume) return -1;
+
+    pthread_mutex_lock(&_index_lock);
+    _index *index;
+    DL_FOREACH(volume->indices, index) {
+        if (strcmp(index->name, name) == 0) {
+            pthread_mutex_unlock(&_index_lock);
+            errno = B_FILE_EXISTS;
+            return -1;
+        }
+    }
+    index = _index_open(volume, name, type);
+    pthread_mutex_unlock(&_index_lock);
+    if (!index) {
+        errno = B_NO_MEMORY;
+        return -1;
+    }
+    return 0;
+}
+
+int fs_remove_index(dev_t device, const char *name)
+{
+    if (!name) {
+        errno = B_BAD_VALUE;
+        return -1;
+    }
+    _index_volume *volume = _index_volume_get(device);
+    if (!volume) return -1;
+
+    char path[PATH_MAX];
+    if (!_index_file(volume, name, path, sizeof(path))) {
+        errno = B_NAME_TOO_LONG;
+        return -1;
+    }
+    if (unlink(path) < 0) {
+        errno = errno == ENOENT ? B_ENTRY_NOT_FOUND : B_FROM_POSIX_ERROR(errno);
+        return -1;
+    }
+
+    /* stays open for queries using it, new ones do not find it */
+    pthread_mutex_lock(&_index_lock);
+    _index *index;
+    DL_FOREACH(volume->indices, index) {
+        if (strcmp(index->name, name) == 0) {
+            index->name[0] = '\0';
+            break;
+        }
+    }
+    pthread_mutex_unlock(&_index_lock);
+    return 0;
+}
+
+int fs_stat_index(dev_t device, const char *name, struct index_info *indexInfo)
+{
+    if (!name || !indexInfo) {
+        errno = B_BAD_VALUE;
+        return -1;
+    }
+    _index_volume *volume = _index_volume_get(device);
+    if (!volume) return -1;
+    _index *index = _index_get(volume, name);
+    if (!index) {
+        errno = B_ENTRY_NOT_FOUND;
+        return -1;
+    }
+
+    struct stat st;
+    if (fstat(index->tree.fd, &st) < 0) {
+        errno = B_FROM_POSIX_ERROR(errno);
+        return -1;
+    }
+    indexInfo->type = index->type;
+    indexInfo->size = st.st_size;
+    indexInfo->modification_time = st.st_mtime;
+    indexInfo->creation_time = st.st_ctime;
+    indexInfo->uid = st.st_uid;
+    indexInfo->gid = st.st_gid;
+    return 0;
+}
+
+DIR *fs_open_index_dir(dev_t device)
+{
+    _index_volume *volume = _index_volume_get(device);
+    if (!volume) return NULL;
+
+    char path[PATH_MAX];
+    _index_file(volume, NULL, path, sizeof(path));
+    _index_dir *dir = malloc(sizeof(_index_dir));
+    if (!dir) {
+        errno = B_NO_MEMORY;
+        return NULL;
+    }
+    dir->dir = opendir(path);
+    if (!dir->dir) {
+        free(dir);
+        errno = B_FROM_POSIX_ERROR(errno);
+        return NULL;
+    }
+    return (DIR *)dir;
+}
+
+int fs_close_index_dir(DIR *indexDirectory)
+{
+    if (!indexDirectory) {
+        errno = B_BAD_VALUE;
+        return -1;
+    }
+    _index_dir *dir = (_index_dir *)indexDirectory;
+    closedir(dir->dir);
+    free(dir);
+    return 0;
+}
+
+struct dirent *fs_read_index_dir(DIR *indexDirectory)
+{
+    if (!indexDirectory) {
+        errno = B_BAD_VALUE;
+        return NULL;
+    }
+    _index_dir *dir = (_index_dir *)indexDirectory;
+    struct dirent *ent;
+    while ((ent = readdir(dir->dir))) {
+        if (ent->d_name[0] == '.') continue;
+        dir->value = *ent;
+        _index_unescape(ent->d_name, dir->value.d_name, sizeof(dir->value.d_name));
+        return &dir->value;
+    }
+    return NULL;
+}
+
+void fs_rewind_index_dir(DIR *indexDirectory)
+{
+    if (!indexDirectory) {
+        errno = B_BAD_VALUE;
+        return;
+    }
+    rewinddir(((_index_dir *)indexDirectory)->dir);
+}
@@ -0,0 +1,100 @@
+#include <OS.h>
+#include <StorageDefs.h>
+#include <endian.h>
+#include <limits.h>
+#include <string.h>
+
+#include "btree.h"
+
+/* Keys of the node table and of index trees, inodes are big endian so
+ * they sort numerically.
+ *     node table: 'n' inode -> _index_node_record
+ *                 'd' parent name -> inode
+ *                 'g' -> _index_generation_record
+ *     index:      'v' value inode -> nothing
+ *                 'n' inode -> value
+ * Longer values are cut to INDEX_MAX_VALUE, queries compare the
+ * attributes themselves anyway.
+ */
+#define INDEX_MAX_VALUE     256
+#define INDEX_VALUE_SIZE    (INDEX_MAX_VALUE + 1)   // encoded, string terminator included
+#define INDEX_KEY_SIZE      (1 + INDEX_VALUE_SIZE + sizeof(uint64))
+#define INDEX_NODE_KEY_SIZE (1 + sizeof(uint64))
+#define INDEX_MIME_STRING_TYPE 'MIMS' // B_MIME_STRING_TYPE, a string too
+
+enum {
+    INDEX_KEY_NODE          = 'n',
+    INDEX_KEY_ENTRY         = 'd',
+    INDEX_KEY_GENERATION    = 'g',
+    INDEX_KEY_VALUE         = 'v'
+};
+
+typedef struct _index_struct {
+    char        name[B_ATTR_NAME_LENGTH + 1];
+    uint32      type;
+    _btree      tree;
+    struct _index_struct *next;
+    struct _index_struct *prev;
+} _index;
+
+typedef struct _index_volume_struct {
+    dev_t       device;
+    ino_t       root_node;
+    char        root[PATH_MAX];     // mount point
+    char        path[PATH_MAX];     // of index files
+    _btree      nodes;
+    _index      *indices;
+    struct timespec indices_time;   // of index directory when read
+    thread_id   thread;             // indexing, or -1
+    port_id     port;
+    uint32      generation;
+    bool        quit;
+    struct _index_volume_struct *next;
+    struct _index_volume_struct *prev;
+} _index_volume;
+
+/* Volumes and indices stay allocated until the team exits, so queries
+ * keep using them without a lock.
+ */
+_index_volume *_index_volume_get(dev_t device);
+_index *_index_get(_index_volume *volume, const char *name);
+
+size_t _index_encode(uint32 type, const void *data, size_t size, uint8 *value);
+status_t _index_node_path(_index_volume *volume, ino_t node, char *path, size_t size);
+
+static inline size_t _index_node_key(uint8 *key, ino_t node)
+{
+    uint64 value = htobe64(node);
+    key[0] = INDEX_KEY_NODE;
+    memcpy(key + 1, &value, sizeof(value));
+    return INDEX_NODE_KEY_SIZE;
+}
+
+static inline ino_t _index_key_node(const uint8 *key)
+{
+    uint64 value;
+    memcpy(&value, key, sizeof(value));
+    return be64toh(value);
+}
+
+static inline bool _index_read_signed(const void *data, size_t size, int64 *value)
+{
+    switch (size) {
+    case 1: *value = *(const int8 *)data; return true;
+    case 2: *value = *(const int16 *)data; return true;
+    case 4: *value = *(const int32 *)data; return true;
+    case 8: *value = *(const int64 *)data; return true;
+    default: return false;
+    }
+}
+
+static inline bool _index_read_unsigned(const void *data, size_t size, uint64 *value)
+{
+    switch (size) {
+    case 1: *value = *(const uint8 *)data; return true;
+    case 2: *value = *(const uint16 *)data; return true;
+    case 4: *value = *(const uint32 *)data; return true;
+    case 8: *value = *(const uint64 *)data; return true;
+    default: return false;
+    }
+}
@@ -1,18 +1,713 @@
 #include <OS.h>
 #include <syscalls.h>
+#include <NodeMonitor.h>
+#include <TypeConstants.h>
 
-status_t _kern_stop_notifying(port_id port, uint32 token)
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+
+#include "private.h"
+#include "utlist.h"
+#include "idhash.h"
+
+/* Node monitor.
+ * All watches of the team share one inotify instance read by a single
+ * service thread. inotify returns the same descriptor for every watch of
+ * an inode, so a watch is one descriptor with the listeners (port, token)
+ * added for it and the union of their masks.
+ * After the first event of a burst the thread keeps reading for
+ * MONITOR_COALESCE_USECS. Stat and attribute changes of one node within
+ * that window are merged into one event. With B_WATCH_CHILDREN a
+ * directory watch reports them for its entries too, which inotify tells
+ * on the directory descriptor anyway. The burst is then flattened to
+ * B_NODE_MONITOR messages and written to each port with one
+ * write_port_batch() per MONITOR_BATCH messages.
+ */
+#define MONITOR_COALESCE_USECS  10000
+#define MONITOR_SEND_TIMEOUT    100000
+#define MONITOR_BATCH           64
+#define MONITOR_READ_SIZE       (64 * 1024)
+#define MONITOR_WHAT            'NDMN' // B_NODE_MONITOR
+#define MONITOR_TOKEN_FIELD     "be:token" // B_HANDLER_TOKEN_FIELD
+
+#define MONITOR_NAME_MASK       (IN_MOVE_SELF | IN_DELETE_SELF)
+#define MONITOR_STAT_MASK       (IN_ATTRIB | IN_MODIFY)
+#define MONITOR_ATTR_MASK       (IN_ATTRIB)
+#define MONITOR_DIRECTORY_MASK  (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO)
+
+typedef struct {
+    port_id     port;
+    int32       token;
+    uint32      flags;
+} _monitor_listener;
+
+typedef struct _monitor_watch_struct {
+    int         wd;
+    int         fd;         // watched node, for stat of new entries
+    dev_t       device;
+    ino_t       node;
+    _monitor_listener *listeners;
+    int32       count;
+    int32       size;
+    int32       pending_stat;   // event index in current burst, or -1
+    int32       pending_attr;
+    struct _monitor_watch_struct *next;
+    struct _monitor_watch_struct *prev;
+} _monitor_watch;
+
+typedef struct {
+    int32       opcode;
+    int         wd;
+    int         to_wd;      // B_ENTRY_MOVED between directories, or -1
+    uint32      cookie;     // pairs IN_MOVED_FROM with IN_MOVED_TO
+    uint32      fields;     // B_STAT_CHANGED
+    bool        entry;      // entry of watched directory, not the node itself
+    bool        child;      // stat or attributes of such entry, B_WATCH_CHILDREN
+    ino_t       node;
+    char        name[NAME_MAX + 1];
+    char        from_name[NAME_MAX + 1]; // B_ENTRY_MOVED
+} _monitor_event;
+
+typedef struct {
+    port_id     port;
+    size_t      offset;     // into _monitor_messages
+    size_t      size;
+} _monitor_message;
+
+static pthread_mutex_t _monitor_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t _monitor_once = PTHREAD_ONCE_INIT;
+static int _monitor_fd = -1;
+static thread_id _monitor_thread = -1;
+
+static _monitor_watch *_monitor_watches = NULL;
+static _idhash _monitor_index; // wd -> _monitor_watch
+
+/* current burst, only touched by the service thread */
+static _monitor_event *_monitor_events = NULL;
+static int32 _monitor_events_count = 0;
+static int32 _monitor_events_size = 0;
+static _monitor_message *_monitor_outgoing = NULL;
+static int32 _monitor_outgoing_count = 0;
+static int32 _monitor_outgoing_size = 0;
+static char *_monitor_messages = NULL;
+static size_t _monitor_messages_used = 0;
+static size_t _monitor_messages_size = 0;
+
+static uint32 _monitor_mask(uint32 flags)
+{
+    uint32 mask = 0;
+    if (flags & B_WATCH_NAME) mask |= MONITOR_NAME_MASK;
+    if (flags & B_WATCH_STAT) mask |= MONITOR_STAT_MASK;
+    if (flags & B_WATCH_ATTR) mask |= MONITOR_ATTR_MASK;
+    if (flags & B_WATCH_DIRECTORY) mask |= MONITOR_DIRECTORY_MASK;
+    return mask;
+}
+
+/* WARNING! you need to lock _monitor_lock in caller function! */
+static uint32 _monitor_watch_flags(_monitor_watch *watch)
+{
+    uint32 flags = 0;
+    for (int32 i = 0; i < watch->count; i++) flags |= watch->listeners[i].flags;
+    return flags;
+}
+
+/* WARNING! you need to lock _monitor_lock in caller function! */
+static uint32 _monitor_watch_mask(_monitor_watch *watch)
+{
+    return _monitor_mask(_monitor_watch_flags(watch));
+}
+
+/* Sets, or with IN_MASK_ADD extends, inotify mask of the node.
+ * Returns the watch descriptor, which is the same for every call on
+ * the same node.
+ */
+static int _monitor_update(int nodefd, uint32 mask)
+{
+    char path[32];
+    snprintf(path, sizeof(path), "/proc/self/fd/%d", nodefd);
+    return inotify_add_watch(_monitor_fd, path, mask | IN_EXCL_UNLINK);
+}
+
+/* WARNING! you need to lock _monitor_lock in caller function! */
+static void _monitor_watch_free(_monitor_watch *watch)
+{
+    DL_DELETE(_monitor_watches, watch);
+    _idhash_remove(&_monitor_index, watch->wd);
+    close(watch->fd);
+    free(watch->listeners);
+    free(watch);
+}
+
+/* WARNING! you need to lock _monitor_lock in caller function! */
+static void _monitor_listener_remove(_monitor_watch *watch, int32 index)
+{
+    watch->listeners[index] = watch->listeners[--watch->count];
+    if (watch->count == 0) {
+        inotify_rm_watch(_monitor_fd, watch->wd);
+        _monitor_watch_free(watch);
+    } else {
+        _monitor_update(watch->fd, _monitor_watch_mask(watch));
+    }
+}
+
+/* Same layout as BMessage::Flatten():
+ * [what] then [type][name length][name][count][size][data]... per field,
+ * then a zero type.
+ */
+static bool _monitor_reserve(size_t size)
 {
-    STUB;return 0;
+    if (_monitor_messages_used + size <= _monitor_messages_size) return true;
+
+    size_t capacity = _monitor_messages_size ? _monitor_messages_size : 4096;
+    while (capacity < _monitor_messages_used + size) capacity *= 2;
+    char *messages = realloc(_monitor_messages, capacity);
+    if (!messages) return false;
+    _monitor_messages = messages;
+    _monitor_messages_size = capacity;
+    return true;
+}
+
+static void _monitor_put(const void *data, size_t size)
+{
+    memcpy(_monitor_messages + _monitor_messages_used, data, size);
+    _monitor_messages_used += size;
+}
+
+static void _monitor_add_field(type_code type, const char *name, const void *data, uint64 size)
+{
+    uint8 length = strlen(name);
+    uint32 count = 1;
+    _monitor_put(&type, sizeof(type));
+    _monitor_put(&length, sizeof(length));
+    _monitor_put(name, length);
+    _monitor_put(&count, sizeof(count));
+    _monitor_put(&size, sizeof(size));
+    _monitor_put(data, size);
+}
+
+static void _monitor_add_int32(const char *name, int32 value)
+{
+    _monitor_add_field(B_INT32_TYPE, name, &value, sizeof(value));
+}
+
+static void _monitor_add_int64(const char *name, int64 value)
+{
+    _monitor_add_field(B_INT64_TYPE, name, &value, sizeof(value));
+}
+
+/* Appends message for event to the outgoing list of listener port, token
+ * routes it to the listening handler.
+ * watch is where event came from, to is the target directory of a move.
+ */
+static void _monitor_flatten(const _monitor_listener *listener, _monitor_event *event,
+                             _monitor_watch *watch, _monitor_watch *to)
+{
+    if (_monitor_outgoing_count == _monitor_outgoing_size) {
+        int32 size = _monitor_outgoing_size ? _monitor_outgoing_size * 2 : MONITOR_BATCH;
+        _monitor_message *outgoing = realloc(_monitor_outgoing, size * sizeof(_monitor_message));
+        if (!outgoing) return;
+        _monitor_outgoing = outgoing;
+        _monitor_outgoing_size = size;
+    }
+    /* fixed fields plus two names, generously */
+    if (!_monitor_reserve(512 + 2 * NAME_MAX)) return;
+
+    size_t offset = _monitor_messages_used;
+    uint32 what = MONITOR_WHAT;
+    type_code end = 0;
+    _monitor_put(&what, sizeof(what));
+    _monitor_add_int32(MONITOR_TOKEN_FIELD, listener->token);
+    _monitor_add_int32("opcode", event->opcode);
+    _monitor_add_int32("device", watch->device);
+
+    if (event->opcode == B_ENTRY_MOVED && event->entry) {
+        _monitor_add_int64("from directory", watch->node);
+        _monitor_add_int64("to directory", to->node);
+        _monitor_add_int64("node", event->node);
+        _monitor_add_field(B_STRING_TYPE, "from name", event->from_name, strlen(event->from_name) + 1);
+        _monitor_add_field(B_STRING_TYPE, "name", event->name, strlen(event->name) + 1);
+    } else if (event->entry) {
+        _monitor_add_int64("directory", watch->node);
+        _monitor_add_int64("node", event->node);
+        _monitor_add_field(B_STRING_TYPE, "name", event->name, strlen(event->name) + 1);
+    } else if (event->child) {
+        _monitor_add_int64("directory", watch->node);
+        _monitor_add_int64("node", event->node);
+        if (event->opcode == B_STAT_CHANGED)
+            _monitor_add_int32("fields", event->fields);
+    } else {
+        _monitor_add_int64("node", watch->node);
+        if (event->opcode == B_STAT_CHANGED)
+            _monitor_add_int32("fields", event->fields);
+    }
+    _monitor_put(&end, sizeof(end));
+
+    _monitor_message *message = &_monitor_outgoing[_monitor_outgoing_count++];
+    message->port = listener->port;
+    message->offset = offset;
+    message->size = _monitor_messages_used - offset;
+}
+
+static _monitor_event *_monitor_event_new(int wd, int32 opcode)
+{
+    if (_monitor_events_count == _monitor_events_size) {
+        int32 size = _monitor_events_size ? _monitor_events_size * 2 : MONITOR_BATCH;
+        _monitor_event *events = realloc(_monitor_events, size * sizeof(_monitor_event));
+        if (!events) return NULL;
+        _monitor_events = events;
+        _monitor_events_size = size;
+    }
+    _monitor_event *event = &_monitor_events[_monitor_events_count++];
+    memset(event, 0, offsetof(_monitor_event, name));
+    event->name[0] = '\0';
+    event->from_name[0] = '\0';
+    event->opcode = opcode;
+    event->wd = wd;
+    event->to_wd = -1;
+    return event;
+}
+
+static void _monitor_entry_event(_monitor_watch *watch, int32 opcode, const struct inotify_event *ev)
+{
+    _monitor_event *event = _monitor_event_new(watch->wd, opcode);
+    if (!event) return;
+    event->entry = true;
+    event->cookie = ev->cookie;
+    strncpy(event->name, ev->name, NAME_MAX);
+    event->name[NAME_MAX] = '\0';
+
+    struct stat st;
+    event->node = fstatat(watch->fd, ev->name, &st, AT_SYMLINK_NOFOLLOW) == 0 ? st.st_ino : (ino_t)-1;
+}
+
+/* Stat and attribute changes of a node merge into one event per burst. */
+static void _monitor_node_event(_monitor_watch *watch, int32 opcode, uint32 fields)
+{
+    int32 *pending = opcode == B_STAT_CHANGED ? &watch->pending_stat : &watch->pending_attr;
+    if (*pending >= 0) {
+        _monitor_events[*pending].fields |= fields;
+        return;
+    }
+    _monitor_event *event = _monitor_event_new(watch->wd, opcode);
+    if (!event) return;
+    event->fields = fields;
+    *pending = event - _monitor_events;
+}
+
+/* Changes of an entry merge like those of a watched node, found by name
+ * as the entry has no watch of its own.
+ */
+static void _monitor_child_event(_monitor_watch *watch, int32 opcode, uint32 fields,
+                                 const struct inotify_event *ev)
+{
+    for (int32 i = _monitor_events_count - 1; i >= 0; i--) {
+        _monitor_event *event = &_monitor_events[i];
+        if (event->child && event->wd == watch->wd && event->opcode == opcode
+            && strcmp(event->name, ev->name) == 0) {
+            event->fields |= fields;
+            return;
+        }
+    }
+
+    struct stat st;
+    if (fstatat(watch->fd, ev->name, &st, AT_SYMLINK_NOFOLLOW) < 0) return;
+    _attr_cache_invalidate(st.st_dev, st.st_ino);
+
+    _monitor_event *event = _monitor_event_new(watch->wd, opcode);
+    if (!event) return;
+    event->child = true;
+    event->fields = fields;
+    event->node = st.st_ino;
+    strncpy(event->name, ev->name, NAME_MAX);
+    event->name[NAME_MAX] = '\0';
+}
+
+/* WARNING! you need to lock _monitor_lock in caller function! */
+static void _monitor_collect(const struct inotify_event *ev)
+{
+    _monitor_watch *watch = _idhash_lookup(&_monitor_index, ev->wd);
+    if (!watch) return;
+
+    if (ev->len) {
+        /* entry of a watched directory */
+        if (ev->mask & IN_CREATE)
+            _monitor_entry_event(watch, B_ENTRY_CREATED, ev);
+        if (ev->mask & IN_DELETE)
+            _monitor_entry_event(watch, B_ENTRY_REMOVED, ev);
+        if (ev->mask & IN_MOVED_FROM)
+            _monitor_entry_event(watch, B_ENTRY_MOVED, ev);
+        if (ev->mask & IN_MOVED_TO) {
+            /* complete the move this entry came from */
+            for (int32 i = _monitor_events_count - 1; i >= 0; i--) {
+                _monitor_event *from = &_monitor_events[i];
+                if (from->opcode == B_ENTRY_MOVED && from->entry && from->to_wd < 0
+                    && from->cookie == ev->cookie) {
+                    struct stat st;
+                    from->to_wd = watch->wd;
+                    if (fstatat(watch->fd, ev->name, &st, AT_SYMLINK_NOFOLLOW) == 0)
+                        from->node = st.st_ino;
+                    memcpy(from->from_name, from->name, sizeof(from->name));
+                    strncpy(from->name, ev->name, NAME_MAX);
+                    return;
+                }
+            }
+            /* moved in from outside the watched directories */
+            _monitor_entry_event(watch, B_ENTRY_CREATED, ev);
+        }
+        if (!(_monitor_watch_flags(watch) & B_WATCH_CHILDREN))
+            return;
+        if (ev->mask & IN_MODIFY)
+            _monitor_child_event(watch, B_STAT_CHANGED, B_STAT_SIZE | B_STAT_MODIFICATION_TIME, ev);
+        if (ev->mask & IN_ATTRIB) {
+            _monitor_child_event(watch, B_STAT_CHANGED,
+                                 B_STAT_MODE | B_STAT_UID | B_STAT_GID | B_STAT_ACCESS_TIME | B_STAT_CHANGE_TIME, ev);
+            _monitor_child_event(watch, B_ATTR_CHANGED, 0, ev);
+        }
+        return;
+    }
+
+    /* attribute cache must not outlive the change, whatever the listeners */
+    if (ev->mask & (IN_ATTRIB | IN_MODIFY | IN_DELETE_SELF))
+        _attr_cache_invalidate(watch->device, watch->node);
+
+    if (ev->mask & IN_MODIFY)
+        _monitor_node_event(watch, B_STAT_CHANGED, B_STAT_SIZE | B_STAT_MODIFICATION_TIME);
+    if (ev->mask & IN_ATTRIB) {
+        /* inotify does not tell xattr changes from chmod, chown or utimes */
+        _monitor_node_event(watch, B_STAT_CHANGED,
+                            B_STAT_MODE | B_STAT_UID | B_STAT_GID | B_STAT_ACCESS_TIME | B_STAT_CHANGE_TIME);
+        _monitor_node_event(watch, B_ATTR_CHANGED, 0);
+    }
+    if (ev->mask & IN_MOVE_SELF)
+        _monitor_event_new(watch->wd, B_ENTRY_MOVED);
+    if (ev->mask & IN_DELETE_SELF)
+        _monitor_event_new(watch->wd, B_ENTRY_REMOVED);
+}
+
+static uint32 _monitor_event_flags(_monitor_event *event)
+{
+    if (event->child) return B_WATCH_CHILDREN;
+    if (event->entry) return B_WATCH_DIRECTORY;
+    switch (event->opcode) {
+    case B_STAT_CHANGED: return B_WATCH_STAT;
+    case B_ATTR_CHANGED: return B_WATCH_ATTR;
+    default: return B_WATCH_NAME;
+    }
+}
+
+/* Entry changes need B_WATCH_CHILDREN and the kind of change. */
+static bool _monitor_wants(uint32 flags, _monitor_event *event)
+{
+    if (!(flags & _monitor_event_flags(event))) return false;
+    if (!event->child) return true;
+    return flags & (event->opcode == B_STAT_CHANGED ? B_WATCH_STAT : B_WATCH_ATTR);
+}
+
+/* WARNING! you need to lock _monitor_lock in caller function! */
+static bool _monitor_listening(_monitor_watch *watch, _monitor_listener *listener, uint32 flags)
+{
+    for (int32 i = 0; i < watch->count; i++) {
+        if (watch->listeners[i].port == listener->port && watch->listeners[i].token == listener->token)
+            return watch->listeners[i].flags & flags;
+    }
+    return false;
+}
+
+/* WARNING! you need to lock _monitor_lock in caller function! */
+static void _monitor_prepare(void)
+{
+    for (int32 i = 0; i < _monitor_events_count; i++) {
+        _monitor_event *event = &_monitor_events[i];
+        _monitor_watch *watch = _idhash_lookup(&_monitor_index, event->wd);
+        _monitor_watch *to = NULL;
+        if (!watch) continue;
+
+        if (event->opcode == B_ENTRY_MOVED && event->entry) {
+            to = event->to_wd >= 0 ? _idhash_lookup(&_monitor_index, event->to_wd) : NULL;
+            if (!to) {
+                /* moved out of the watched directories */
+                event->opcode = B_ENTRY_REMOVED;
+                event->node = -1;
+            }
+        }
+
+        uint32 flags = _monitor_event_flags(event);
+        for (int32 j = 0; j < watch->count; j++) {
+            if (_monitor_wants(watch->listeners[j].flags, event))
+                _monitor_flatten(&watch->listeners[j], event, watch, to);
+        }
+        /* listeners of both directories get a move once */
+        for (int32 j = 0; to && to != watch && j < to->count; j++) {
+            if ((to->listeners[j].flags & flags) && !_monitor_listening(watch, &to->listeners[j], flags))
+                _monitor_flatten(&to->listeners[j], event, watch, to);
+        }
+    }
+
+    _monitor_watch *watch;
+    DL_FOREACH(_monitor_watches, watch) {
+        watch->pending_stat = -1;
+        watch->pending_attr = -1;
+    }
+    _monitor_events_count = 0;
+}
+
+/* Drops listeners of a deleted port.
+ * WARNING! you need to lock _monitor_lock in caller function!
+ */
+static void _monitor_forget_port(port_id port)
+{
+    _monitor_watch *watch, *tmp;
+    DL_FOREACH_SAFE(_monitor_watches, watch, tmp) {
+        for (int32 i = watch->count - 1; i >= 0; i--) {
+            if (watch->listeners[i].port == port) {
+                bool last = watch->count == 1;
+                _monitor_listener_remove(watch, i);
+                if (last) break;
+            }
+        }
+    }
+}
+
+static ssize_t _monitor_write(port_id port, const int32 *codes, const void **buffers,
+                              const size_t *sizes, int32 count)
+{
+    ssize_t result = write_port_batch(port, codes, buffers, sizes, count,
+                                      B_RELATIVE_TIMEOUT, MONITOR_SEND_TIMEOUT);
+    if (result == B_BAD_PORT_ID) {
+        pthread_mutex_lock(&_monitor_lock);
+        _monitor_forget_port(port);
+        pthread_mutex_unlock(&_monitor_lock);
+    }
+    return result;
+}
+
+/* Writes outgoing messages, grouped by port in the order they were queued.
+ * A port that stays full loses the rest of the burst.
+ */
+static void _monitor_send(void)
+{
+    int32 codes[MONITOR_BATCH];
+    const void *buffers[MONITOR_BATCH];
+    size_t sizes[MONITOR_BATCH];
+
+    for (int32 first = 0; first < _monitor_outgoing_count; first++) {
+        port_id port = _monitor_outgoing[first].port;
+        if (port < 0) continue;
+
+        int32 count = 0;
+        ssize_t result = B_OK;
+        for (int32 i = first; i < _monitor_outgoing_count; i++) {
+            _monitor_message *message = &_monitor_outgoing[i];
+            if (message->port != port) continue;
+            message->port = -1;
+            if (result < B_OK) continue;
+
+            codes[count] = B_MESSAGE_TYPE;
+            buffers[count] = _monitor_messages + message->offset;
+            sizes[count] = message->size;
+            if (++count == MONITOR_BATCH) {
+                result = _monitor_write(port, codes, buffers, sizes, count);
+                count = 0;
+            }
+        }
+        if (count && result >= B_OK)
+            _monitor_write(port, codes, buffers, sizes, count);
+    }
+
+    _monitor_outgoing_count = 0;
+    _monitor_messages_used = 0;
+}
+
+/* Reads what is queued on the inotify descriptor, false when it is gone. */
+static bool _monitor_read(char *buffer)
+{
+    for (;;) {
+        ssize_t size = read(_monitor_fd, buffer, MONITOR_READ_SIZE);
+        if (size < 0) return errno == EAGAIN || errno == EINTR;
+        if (size == 0) return true;
+
+        pthread_mutex_lock(&_monitor_lock);
+        for (char *p = buffer; p < buffer + size;) {
+            const struct inotify_event *ev = (const struct inotify_event *)p;
+            if (ev->mask & IN_IGNORED) {
+                /* node is gone or its file system unmounted */
+                _monitor_watch *watch = _idhash_lookup(&_monitor_index, ev->wd);
+                if (watch) _monitor_watch_free(watch);
+            } else {
+                _monitor_collect(ev);
+            }
+            p += sizeof(struct inotify_event) + ev->len;
+        }
+        pthread_mutex_unlock(&_monitor_lock);
+    }
+}
+
+static int32 _monitor_service(void *data)
+{
+    (void)data;
+
+    char *buffer = malloc(MONITOR_READ_SIZE);
+    if (!buffer) return B_NO_MEMORY;
+
+    struct pollfd pfd = { .fd = _monitor_fd, .events = POLLIN };
+    for (;;) {
+        if (poll(&pfd, 1, -1) < 0 && errno != EINTR) break;
+        if (!_monitor_read(buffer)) break;
+
+        /* gather the rest of the burst */
+        bigtime_t deadline = system_time() + MONITOR_COALESCE_USECS;
+        bigtime_t left;
+        while ((left = deadline - system_time()) > 0) {
+            if (poll(&pfd, 1, (left + 999) / 1000) <= 0) break;
+            if (!_monitor_read(buffer)) break;
+        }
+
+        pthread_mutex_lock(&_monitor_lock);
+        _monitor_prepare();
+        pthread_mutex_unlock(&_monitor_lock);
+        _monitor_send();
+    }
+
+    free(buffer);
+    return B_ERROR;
+}
+
+static void _monitor_start(void)
+{
+    _monitor_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (_monitor_fd < 0) return;
+
+    _monitor_thread = spawn_thread(_monitor_service, "node monitor", B_NORMAL_PRIORITY, NULL);
+    if (_monitor_thread < 0) {
+        close(_monitor_fd);
+        _monitor_fd = -1;
+        return;
+    }
+    resume_thread(_monitor_thread);
+}
+
+status_t _kern_stop_notifying(port_id port, int32 token)
+{
+    pthread_mutex_lock(&_monitor_lock);
+    _monitor_watch *watch, *tmp;
+    DL_FOREACH_SAFE(_monitor_watches, watch, tmp) {
+        for (int32 i = watch->count - 1; i >= 0; i--) {
+            if (watch->listeners[i].port == port && watch->listeners[i].token == token) {
+                _monitor_listener_remove(watch, i);
+                break;
+            }
+        }
+    }
+    pthread_mutex_unlock(&_monitor_lock);
+    return B_OK;
 }
 
 status_t _kern_start_watching(int nodefd, uint32 flags,
-                              port_id port, uint32 token)
+                              port_id port, int32 token)
 {
-    STUB;return 0;
+    flags &= B_WATCH_ALL | B_WATCH_CHILDREN;
+    if (flags == B_STOP_WATCHING) return _kern_stop_watching(nodefd, port, token);
+    if (port < 0) return B_BAD_PORT_ID;
+
+    pthread_once(&_monitor_once, _monitor_start);
+    if (_monitor_fd < 0) return B_NO_MORE_THREADS;
+
+    pthread_mutex_lock(&_monitor_lock);
+    int wd = _monitor_update(nodefd, _monitor_mask(flags) | IN_MASK_ADD);
+    if (wd < 0) {
+        pthread_mutex_unlock(&_monitor_lock);
+        return B_FROM_POSIX_ERROR(errno);
+    }
+
+    _monitor_watch *watch = _idhash_lookup(&_monitor_index, wd);
+    if (!watch) {
+        struct stat st;
+        watch = calloc(1, sizeof(_monitor_watch));
+        int fd = watch ? fcntl(nodefd, F_DUPFD_CLOEXEC, 0) : -1;
+        if (fd < 0 || fstat(fd, &st) < 0 || _idhash_insert(&_monitor_index, wd, watch) != B_OK) {
+            if (fd >= 0) close(fd);
+            free(watch);
+            inotify_rm_watch(_monitor_fd, wd);
+            pthread_mutex_unlock(&_monitor_lock);
+            return B_NO_MEMORY;
+        }
+        watch->wd = wd;
+        watch->fd = fd;
+        watch->device = st.st_dev;
+        watch->node = st.st_ino;
+        watch->pending_stat = -1;
+        watch->pending_attr = -1;
+        DL_APPEND(_monitor_watches, watch);
+    }
+
+    /* watching again with other flags replaces them */
+    for (int32 i = 0; i < watch->count; i++) {
+        if (watch->listeners[i].port == port && watch->listeners[i].token == token) {
+            watch->listeners[i].flags = flags;
+            _monitor_update(watch->fd, _monitor_watch_mask(watch));
+            pthread_mutex_unlock(&_monitor_lock);
+            return B_OK;
+        }
+    }
+
+    if (watch->count == watch->size) {
+        int32 size = watch->size ? watch->size * 2 : 4;
+        _monitor_listener *listeners = realloc(watch->listeners, size * sizeof(_monitor_listener));
+        if (!listeners) {
+            if (watch->count == 0) {
+                inotify_rm_watch(_monitor_fd, watch->wd);
+                _monitor_watch_free(watch);
+            } else {
+                _monitor_update(watch->fd, _monitor_watch_mask(watch));
+            }
+            pthread_mutex_unlock(&_monitor_lock);
+            return B_NO_MEMORY;
+        }
+        watch->listeners = listeners;
+        watch->size = size;
+    }
+    watch->listeners[watch->count++] = (_monitor_listener){ port, token, flags };
+
+    pthread_mutex_unlock(&_monitor_lock);
+    return B_OK;
 }
 
-status_t _kern_stop_watching(int nodefd, port_id port, uint32 token)
+status_t _kern_stop_watching(int nodefd, port_id port, int32 token)
 {
-    STUB;return 0;
+    if (_monitor_fd < 0) return B_BAD_VALUE;
+
+    pthread_mutex_lock(&_monitor_lock);
+    /* finds the descriptor of the node, the mask is recomputed below */
+    int wd = _monitor_update(nodefd, IN_DELETE_SELF | IN_MASK_ADD);
+    if (wd < 0) {
+        pthread_mutex_unlock(&_monitor_lock);
+        return B_FROM_POSIX_ERROR(errno);
+    }
+
+    _monitor_watch *watch = _idhash_lookup(&_monitor_index, wd);
+    if (!watch) {
+        inotify_rm_watch(_monitor_fd, wd);
+        pthread_mutex_unlock(&_monitor_lock);
+        return B_BAD_VALUE;
+    }
+
+    for (int32 i = 0; i < watch->count; i++) {
+        if (watch->listeners[i].port == port && watch->listeners[i].token == token) {
+            _monitor_listener_remove(watch, i);
+            pthread_mutex_unlock(&_monitor_lock);
+            return B_OK;
+        }
+    }
+    _monitor_update(watch->fd, _monitor_watch_mask(watch));
+    pthread_mutex_unlock(&_monitor_lock);
+    return B_BAD_VALUE;
 }
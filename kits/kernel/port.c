@@ -1,3 +1,5 @@
+#define _GNU_SOURCE
+
 #include <OS.h>
 
 #include <stdlib.h>
@@ -5,30 +7,112 @@
 #include <sys/socket.h>
 #include <sys/un.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/shm.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/eventfd.h>
+#include <linux/futex.h>
 #include <linux/sockios.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <poll.h>
+#include <unistd.h>
 #include <string.h>
 #include <errno.h>
 
+#include <trace.h>
+
 #include "private.h"
 #include "utlist.h"
 #include "rwlock.h"
+#include "idhash.h"
 
 #define MAX_WRITE_RETRIES   50
 #define MAX_WRITE_SNOOZE    10000
 
+/* ring is sized for `capacity` messages of this size, within limits below */
+#define PORT_RING_MESSAGE_SIZE  512
+#define PORT_RING_MIN_SIZE      (64 * 1024)
+#define PORT_RING_MAX_SIZE      (4 * 1024 * 1024)
+#define PORT_RING_ALIGN         8
+
+/* max messages moved by one sendmmsg on socket ports */
+#define PORT_BATCH_MAX          64
+
+/* payloads from this size travel as sealed memfd instead of being copied */
+#define PORT_MAPPED_MIN_SIZE    (64 * 1024)
+/* ring record flag, payload is _port_mapped */
+#define PORT_RECORD_MAPPED      0x80000000
+
+/* Shared memory port transport.
+ * Memfd holds one header page followed by the data ring. The data ring is
+ * mapped twice back-to-back, so a record is always virtually contiguous
+ * and never needs to be split at the wrap point.
+ * Writers reserve space by CAS on tail, fill the record and publish it by
+ * storing its length. Readers are serialized by lock, consume at head and
+ * zero consumed bytes, so uncommitted record always reads as len == 0.
+ * Ring lives in the team that created the port, other teams can reach
+ * socket ports only.
+ */
+typedef struct {
+    uint32  size;       // data ring bytes, power of two
+    int32   capacity;   // max queued messages
+    uint32  closed;
+    uint32  lock;       // futex; serializes readers
+    int32   count;      // queued (reserved) messages
+    int32   total;      // messages read so far
+    uint32  data_seq;   // futex; bumped on every commit
+    uint32  space_seq;  // futex; bumped on every consume
+    uint32  readers;    // sleeping on data_seq
+    uint32  writers;    // sleeping on space_seq
+    uint64  head __attribute__((aligned(64)));  // read position
+    uint64  tail __attribute__((aligned(64)));  // reserved position
+} _port_ring;
+
+typedef struct {
+    uint32  len;        // payload length + 1 | PORT_RECORD_MAPPED; 0 while not committed
+    int32   code;
+} _port_record;
+
+/* Zero-copy message, travels in place of its payload.
+ * Socket ports pass memfd with SCM_RIGHTS. Ring never leaves its team, so
+ * ring ports pass descriptor number as is, and SysV area by its shmid.
+ */
+typedef struct {
+    uint64  size;
+    int32   fd;         // sealed memfd owned by message, or -1
+    int32   shmid;      // area segment when fd is -1
+} _port_mapped;
 typedef struct _port_info_struct {
     int     fd;
     char    name[B_OS_NAME_LENGTH];
     size_t  namelen;
     int32   capacity;
     bool    bound;
+    _port_ring *ring;   // NULL for socket ports
+    size_t  ringmap;    // size of ring reservation
+    int32   refs;       // registry + operations in flight; 0 when recycled
+    int     readfd;     // eventfd of ring port, -1 until polled
+    uint32  mapped;     // readers in read_port_mapped
+    /* queue accounting of socket ports, ring keeps its own in shared header */
+    uint32  closed;
+    int32   count;      // queued (reserved) messages
+    int32   total;      // messages read so far
+    uint32  space_seq;  // futex; bumped on every consume
+    uint32  writers;    // sleeping on space_seq
     struct _port_info_struct *next;
     struct _port_info_struct *prev;
 } _port_info;
 
 /* head of linked list of all _port_info */
 static _port_info *_ports = NULL;
+/* released _port_info, reused by create_port; they are never freed */
+static _port_info *_ports_free = NULL;
+/* port_id -> _port_info */
+static _idhash _ports_index;
+/* address -> area segment attached by read_port_mapped */
+static _idhash _ports_attached;
 RWLOCK(_ports)
 
 static socklen_t _fill_sockaddr(struct sockaddr_un *address, _port_info *info)
@@ -41,188 +125,601 @@ static socklen_t _fill_sockaddr(struct sockaddr_un *address, _port_info *info)
     return offsetof(struct sockaddr_un, sun_path) + 1 + len;
 }
 
-/* WARNING! you need to lock _threads in caller function! */
+/* WARNING! you need to lock _ports in caller function to keep info alive! */
 static _port_info *_find_port_info(port_id port)
 {
-    _port_info *info;
-    DL_SEARCH_SCALAR(_ports, info, fd, port);
-    return info;
+    return _idhash_find(&_ports_index, port);
 }
 
-static _port_info *_bound_port_info(port_id port)
+static void _port_ring_discard(_port_ring *ring);
+
+/* Drops reference, the last one closes port and recycles its record. */
+static status_t _release_port(_port_info *info)
 {
-    _port_info *info = _find_port_info(port);
-    if (info && !info->bound) {
-        _ports_unlock();
-        _ports_wlock();
-        _port_info *info = _find_port_info(port);
-        if (!info->bound) {
-            struct sockaddr_un address;
-            socklen_t addrlen = _fill_sockaddr(&address, info);
+    if (atomic_sub(&info->refs, 1) != 0) return B_OK;
 
-            if (bind(info->fd, (struct sockaddr*)&address, addrlen) < 0) {
-                return NULL;
-            }
+    int fd = info->fd;
+    if (info->ring) {
+        _port_ring_discard(info->ring);
+        munmap(info->ring, info->ringmap);
+    }
+    if (info->readfd >= 0) close(info->readfd);
+
+    _ports_wlock();
+    LL_PREPEND(_ports_free, info);
+    _ports_unlock();
+
+    if (close(fd) < 0) {
+        switch (errno) {
+        case EBADF:
+            return B_BAD_PORT_ID;
+        case EINTR:
+            return B_INTERRUPTED;
+        default:
+            return B_FROM_POSIX_ERROR(errno);
+        }
+    }
+    return B_OK;
+}
+
+/* Lock-free lookup taking a reference on port.
+ * Port records are recycled but never freed, so a stale pointer from the
+ * index is safe to reference as long as it is still live (refs > 0) and
+ * still carries the id we looked for.
+ */
+static _port_info *_acquire_port(port_id port)
+{
+    for (;;) {
+        _port_info *info;
+        uint32 seq;
+        do {
+            seq = _idhash_read_begin(&_ports_index);
+            info = _idhash_lookup(&_ports_index, port);
+        } while (_idhash_read_retry(&_ports_index, seq));
+        if (!info) return NULL;
+
+        int32 refs = __atomic_load_n(&info->refs, __ATOMIC_ACQUIRE);
+        if (refs > 0 && cmpxchg(&info->refs, refs, refs + 1) == refs) {
+            if (info->fd == port) return info;
+            _release_port(info);
+        }
+    }
+}
+
+/* Socket ports are bound on first read. */
+static status_t _bind_port(_port_info *info)
+{
+    if (info->bound) return B_OK;
 
+    status_t status = B_OK;
+    _ports_wlock();
+    if (!info->bound) {
+        struct sockaddr_un address;
+        socklen_t addrlen = _fill_sockaddr(&address, info);
+
+        if (bind(info->fd, (struct sockaddr*)&address, addrlen) < 0) {
+            status = B_BAD_PORT_ID;
+        } else {
             info->bound = true;
         }
     }
+    _ports_unlock();
+    return status;
+}
+
+/* Returns referenced port ready for reading. */
+static _port_info *_acquire_port_reader(port_id port)
+{
+    _port_info *info = _acquire_port(port);
+    if (info && _bind_port(info) != B_OK) {
+        _release_port(info);
+        return NULL;
+    }
     return info;
 }
 
-#define _port_fd_check_recv \
-    if (flags & B_RELATIVE_TIMEOUT) {   \
-        recvflags |= MSG_DONTWAIT;      \
-                                        \
-        struct timespec tm;             \
-        tm.tv_sec = timeout / 1000000;  \
-        tm.tv_nsec = (timeout % 1000000) * 1000;            \
-        struct pollfd pfd = { .fd = fd, .events = POLLIN }; \
-        int ret = ppoll(&pfd, 1, &tm, NULL);    \
-        if (ret == 0) return B_TIMED_OUT;       \
-        if (ret < 0) {          \
-            switch (errno) {    \
-            case EINTR:         \
-                return B_INTERRUPTED;   \
-            case ENOMEM:                \
-                return B_NO_MEMORY;     \
-            }   \
-        }       \
+/* Rings the read descriptor of ring port after messages were written. */
+static void _port_notify(_port_info *info)
+{
+    int fd = __atomic_load_n(&info->readfd, __ATOMIC_SEQ_CST);
+    if (fd >= 0) eventfd_write(fd, 1);
+}
+
+/* Leaves read descriptor of ring port readable only while messages are queued. */
+static void _port_settle(_port_info *info)
+{
+    int fd = __atomic_load_n(&info->readfd, __ATOMIC_SEQ_CST);
+    if (fd < 0 || __atomic_load_n(&info->ring->count, __ATOMIC_SEQ_CST) > 0) return;
+
+    eventfd_t value;
+    eventfd_read(fd, &value);
+    if (__atomic_load_n(&info->ring->count, __ATOMIC_SEQ_CST) > 0) eventfd_write(fd, 1);
+}
+
+static inline long _futex_wait(uint32 *addr, uint32 val, const struct timespec *deadline)
+{
+    /* FUTEX_WAIT_BITSET takes absolute CLOCK_MONOTONIC deadline */
+    return syscall(SYS_futex, addr, FUTEX_WAIT_BITSET, val, deadline, NULL, FUTEX_BITSET_MATCH_ANY);
+}
+
+static inline void _futex_wake(uint32 *addr, int count)
+{
+    syscall(SYS_futex, addr, FUTEX_WAKE, count, NULL, NULL, 0);
+}
+
+/* Returns NULL when there is no timeout to honour. */
+static struct timespec *_port_deadline(struct timespec *tm, uint32 flags, bigtime_t timeout)
+{
+    bigtime_t when;
+    if (flags & B_ABSOLUTE_TIMEOUT) {
+        when = timeout;
     }
+    else if (flags & B_RELATIVE_TIMEOUT) {
+        if (timeout == B_INFINITE_TIMEOUT) return NULL;
+        when = system_time() + timeout;
+    }
+    else {
+        return NULL;
+    }
+    if (when < 0) when = 0;
+    tm->tv_sec = when / 1000000;
+    tm->tv_nsec = (when % 1000000) * 1000;
+    return tm;
+}
 
-ssize_t port_buffer_size_etc(port_id port, uint32 flags, bigtime_t timeout)
+static inline uint8 *_port_ring_data(_port_ring *ring)
 {
-    int fd = -1;
-    _ports_rlock();
-    _port_info *info = _bound_port_info(port);
-    if (info) fd = info->fd;
-    _ports_unlock();
-    if (fd < 0) return B_BAD_PORT_ID;
+    return (uint8 *)ring + B_PAGE_SIZE;
+}
+
+static inline size_t _port_record_length(size_t bufferSize)
+{
+    return (sizeof(_port_record) + bufferSize + PORT_RING_ALIGN - 1) & ~(size_t)(PORT_RING_ALIGN - 1);
+}
 
-    int recvflags = MSG_PEEK | MSG_TRUNC;
-    _port_fd_check_recv;
+/* Returns bytes taken in ring by committed record. */
+static inline size_t _port_record_stored(_port_record *rec)
+{
+    return (rec->len & ~PORT_RECORD_MAPPED) - 1;
+}
 
-    ssize_t size = recv(fd, NULL, 0, recvflags);
+/* Returns message size of committed record. */
+static inline size_t _port_record_size(_port_record *rec)
+{
+    if (rec->len & PORT_RECORD_MAPPED) return ((_port_mapped *)(rec + 1))->size;
+    return rec->len - 1;
+}
 
-    if (size < 0) {
-        return B_BAD_PORT_ID;
+/* Moves payload to sealed memfd. Returns descriptor or -1. */
+static int _port_mapped_create(const void *buffer, size_t size)
+{
+    int fd = memfd_create("port message", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (fd < 0) return -1;
+
+    const uint8 *data = buffer;
+    while (size > 0) {
+        ssize_t written = write(fd, data, size);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            close(fd);
+            return -1;
+        }
+        data += written;
+        size -= written;
     }
 
+    if (fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/* Copies mapped payload to buffer and releases message. */
+static size_t _port_mapped_copy(const _port_mapped *mapped, void *buffer, size_t bufferSize)
+{
+    size_t size = buffer ? min_c(mapped->size, bufferSize) : 0;
+    if (mapped->fd >= 0) {
+        ssize_t read = size ? pread(mapped->fd, buffer, size, 0) : 0;
+        close(mapped->fd);
+        return read > 0 ? read : 0;
+    }
+    if (size) {
+        void *data = shmat(mapped->shmid, NULL, SHM_RDONLY);
+        if (data == (void *)-1) return 0;
+        memcpy(buffer, data, size);
+        shmdt(data);
+    }
     return size;
 }
 
-ssize_t port_buffer_size(port_id port)
+/* Maps payload read-only and releases message. */
+static const void *_port_mapped_map(const _port_mapped *mapped)
 {
-    return port_buffer_size_etc(port, 0, 0);
+    void *data;
+    if (mapped->fd >= 0) {
+        data = mmap(NULL, max_c(mapped->size, 1), PROT_READ, MAP_SHARED, mapped->fd, 0);
+        close(mapped->fd);
+    } else {
+        data = shmat(mapped->shmid, NULL, SHM_RDONLY);
+        if (data != MAP_FAILED) {
+            /* unmap_port_message has to detach it instead of unmapping */
+            _ports_wlock();
+            status_t status = _idhash_insert(&_ports_attached, (intptr_t)data, data);
+            _ports_unlock();
+            if (status != B_OK) {
+                shmdt(data);
+                data = MAP_FAILED;
+            }
+        }
+    }
+    return data == MAP_FAILED ? NULL : data;
 }
 
-ssize_t port_count(port_id port)
+static status_t _port_sleep(uint32 *seq, uint32 *waiters, uint32 value,
+                            const struct timespec *deadline)
 {
-    int fd = -1;
-    _ports_rlock();
-    _port_info *info = _bound_port_info(port);
-    if (info) fd = info->fd;
-    _ports_unlock();
-    if (fd < 0) return B_BAD_PORT_ID;
+    atomic_add(waiters, 1);
+    long ret = _futex_wait(seq, value, deadline);
+    int error = errno;
+    atomic_sub(waiters, 1);
+    if (ret == 0) return B_OK;
+    switch (error) {
+    case EAGAIN:
+        return B_OK;
+    case ETIMEDOUT:
+        return B_TIMED_OUT;
+    case EINTR:
+        return B_INTERRUPTED;
+    default:
+        return B_FROM_POSIX_ERROR(error);
+    }
+}
 
-    ssize_t count = 0;
-    int ov = 0;
-    ssize_t size;
+static inline void _port_signal(uint32 *seq, uint32 *waiters)
+{
+    atomic_add(seq, 1);
+    if (*(volatile uint32 *)waiters) _futex_wake(seq, INT_MAX);
+}
+
+static status_t _port_ring_lock(_port_ring *ring, const struct timespec *deadline)
+{
+    /* http://locklessinc.com/articles/mutex_cv_futex/ */
+    uint32 c = cmpxchg(&ring->lock, 0, 1);
+    if (c == 0) return B_OK;
+    if (c != 2) c = __sync_lock_test_and_set(&ring->lock, 2);
+    while (c != 0) {
+        if (_futex_wait(&ring->lock, 2, deadline) != 0) {
+            switch (errno) {
+            case ETIMEDOUT:
+                return B_TIMED_OUT;
+            case EINTR:
+                return B_INTERRUPTED;
+            }
+        }
+        c = __sync_lock_test_and_set(&ring->lock, 2);
+    }
+    return B_OK;
+}
 
-    while ((size = recv(fd, NULL, 0, MSG_DONTWAIT | MSG_PEEK | MSG_TRUNC)) > 0) {
-        ov += size;
-        setsockopt(fd, SOL_SOCKET, SO_PEEK_OFF, &ov, sizeof(ov));
-        count++;
+static void _port_ring_unlock(_port_ring *ring)
+{
+    if (atomic_xadd(&ring->lock, -1) != 1) {
+        ring->lock = 0;
+        _futex_wake(&ring->lock, 1);
     }
+}
 
-    size = -1;
-    setsockopt(fd, SOL_SOCKET, SO_PEEK_OFF, &size, sizeof(size));
+static _port_ring *_port_ring_create(int fd, int32 capacity, size_t *_mapsize)
+{
+    size_t size = PORT_RING_MIN_SIZE;
+    size_t wanted = (size_t)max_c(capacity, 1) * PORT_RING_MESSAGE_SIZE;
+    while (size < wanted && size < PORT_RING_MAX_SIZE) size <<= 1;
 
-    return count;
+    if (ftruncate(fd, B_PAGE_SIZE + size) < 0) return NULL;
+
+    /* reserve header page and two views of the data ring */
+    size_t mapsize = B_PAGE_SIZE + 2 * size;
+    uint8 *base = mmap(NULL, mapsize, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (base == MAP_FAILED) return NULL;
+
+    if (mmap(base, B_PAGE_SIZE + size, PROT_READ | PROT_WRITE,
+             MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED
+        || mmap(base + B_PAGE_SIZE + size, size, PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_FIXED, fd, B_PAGE_SIZE) == MAP_FAILED) {
+        munmap(base, mapsize);
+        return NULL;
+    }
+
+    _port_ring *ring = (_port_ring *)base;
+    ring->size = (uint32)size;
+    ring->capacity = capacity > 0 ? capacity : INT32_MAX;
+    *_mapsize = mapsize;
+    return ring;
 }
 
-ssize_t read_port_etc(port_id port, int32 *code, void *buffer,
-                      size_t bufferSize, uint32 flags, bigtime_t timeout)
+static void _port_ring_close(_port_ring *ring)
 {
-    int fd = -1;
-    _ports_rlock();
-    _port_info *info = _bound_port_info(port);
-    if (info) fd = info->fd;
-    _ports_unlock();
-    if (fd < 0) return B_BAD_PORT_ID;
+    ring->closed = 1;
+    _port_signal(&ring->data_seq, &ring->readers);
+    _port_signal(&ring->space_seq, &ring->writers);
+}
 
-    struct msghdr msg = {};
+/* Releases unread mapped messages. Ring must not be in use anymore. */
+static void _port_ring_discard(_port_ring *ring)
+{
+    for (uint64 head = ring->head; head != ring->tail;) {
+        _port_record *rec = (_port_record *)(_port_ring_data(ring) + (head & (ring->size - 1)));
+        if (rec->len == 0) break;
+        if (rec->len & PORT_RECORD_MAPPED) {
+            _port_mapped *mapped = (_port_mapped *)(rec + 1);
+            if (mapped->fd >= 0) close(mapped->fd);
+        }
+        head += _port_record_length(_port_record_stored(rec));
+    }
+}
 
-    struct iovec iov[2] = {};
-    msg.msg_iov = &iov[0];
-    msg.msg_iovlen = count_of(iov);
+/* Writes as many messages as fit with one reservation per pass.
+ * Returns number of messages written or error if none was written.
+ */
+static ssize_t _port_ring_write_batch(_port_ring *ring, const int32 *codes,
+                                      const void *const *buffers, const size_t *sizes,
+                                      int32 count, uint32 flags, bigtime_t timeout,
+                                      uint32 recflags)
+{
+    struct timespec tm;
+    struct timespec *deadline = _port_deadline(&tm, flags, timeout);
+    int32 written = 0;
 
-    iov[0].iov_base = code;
-    iov[0].iov_len = sizeof(*code);
-    iov[1].iov_base = buffer;
-    iov[1].iov_len = bufferSize;
+    while (written < count) {
+        if (ring->closed) return written ? written : B_BAD_PORT_ID;
 
-    int recvflags = MSG_CMSG_CLOEXEC;
-    _port_fd_check_recv;
+        uint32 seq = __atomic_load_n(&ring->space_seq, __ATOMIC_ACQUIRE);
+        int32 queued = __atomic_load_n(&ring->count, __ATOMIC_ACQUIRE);
+        uint64 tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+        uint64 head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
 
-    ssize_t read = recvmsg(fd, &msg, recvflags);
-    if (read < 0) {
-        switch (errno) {
-        case EBADF:
-        case ECONNREFUSED:
-        case EFAULT:
-        case ENOTCONN:
-        case ENOTSOCK:
+        int32 n = 0;
+        size_t bytes = 0;
+        while (written + n < count && queued + n < ring->capacity) {
+            size_t reclen = _port_record_length(sizes[written + n]);
+            if (tail + bytes + reclen - head > ring->size) break;
+            bytes += reclen;
+            n++;
+        }
+
+        if (n > 0) {
+            /* reserve message slots first, then bytes */
+            if (cmpxchg(&ring->count, queued, queued + n) != queued) continue;
+            if (cmpxchg(&ring->tail, tail, tail + bytes) != tail) {
+                /* lost the race to another writer - it made progress, retry */
+                atomic_sub(&ring->count, n);
+                _port_signal(&ring->space_seq, &ring->writers);
+                continue;
+            }
+
+            for (int32 i = written; i < written + n; i++) {
+                _port_record *rec = (_port_record *)(_port_ring_data(ring) + (tail & (ring->size - 1)));
+                rec->code = codes[i];
+                if (sizes[i]) memcpy(rec + 1, buffers[i], sizes[i]);
+                __atomic_store_n(&rec->len, ((uint32)sizes[i] + 1) | recflags, __ATOMIC_RELEASE);
+                tail += _port_record_length(sizes[i]);
+            }
+            _port_signal(&ring->data_seq, &ring->readers);
+            written += n;
+            continue;
+        }
+
+        if (_port_record_length(sizes[written]) > ring->size)
+            return written ? written : B_BAD_VALUE;
+
+        if ((flags & B_RELATIVE_TIMEOUT) && timeout <= 0)
+            return written ? written : B_WOULD_BLOCK;
+
+        status_t status = _port_sleep(&ring->space_seq, &ring->writers, seq, deadline);
+        if (status != B_OK) return written ? written : status;
+    }
+    return written;
+}
+
+static status_t _port_ring_write(_port_ring *ring, int32 code, const void *buffer,
+                                 size_t bufferSize, uint32 flags, bigtime_t timeout)
+{
+    ssize_t written = _port_ring_write_batch(ring, &code, &buffer, &bufferSize, 1, flags, timeout, 0);
+    return written < 0 ? written : B_OK;
+}
+
+/* On failure message is left to caller. */
+static status_t _port_ring_write_mapped(_port_ring *ring, int32 code, const _port_mapped *mapped,
+                                        uint32 flags, bigtime_t timeout)
+{
+    const void *buffer = mapped;
+    size_t size = sizeof(_port_mapped);
+    ssize_t written = _port_ring_write_batch(ring, &code, &buffer, &size, 1, flags, timeout,
+                                             PORT_RECORD_MAPPED);
+    return written < 0 ? written : B_OK;
+}
+
+/* WARNING! you need to hold ring lock in caller function! */
+static status_t _port_ring_wait(_port_ring *ring, const struct timespec *deadline,
+                                uint32 flags, bigtime_t timeout, _port_record **_rec)
+{
+    for (;;) {
+        uint32 seq = __atomic_load_n(&ring->data_seq, __ATOMIC_ACQUIRE);
+        uint64 head = ring->head;
+        _port_record *rec = (_port_record *)(_port_ring_data(ring) + (head & (ring->size - 1)));
+
+        if (__atomic_load_n(&rec->len, __ATOMIC_ACQUIRE) != 0) {
+            *_rec = rec;
+            return B_OK;
+        }
+        if (ring->closed && head == __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE))
             return B_BAD_PORT_ID;
-        case EAGAIN: //case EWOULDBLOCK:
-            return B_WOULD_BLOCK;
+
+        if ((flags & B_RELATIVE_TIMEOUT) && timeout <= 0) return B_TIMED_OUT;
+
+        status_t status = _port_sleep(&ring->data_seq, &ring->readers, seq, deadline);
+        if (status != B_OK) return status;
+    }
+}
+
+/* Blocks for the first message only, then takes whatever else is queued.
+ * Returns number of messages read, sizes[] is updated with bytes read.
+ * With _mapped set, mapped message is handed over instead of being copied.
+ */
+static ssize_t _port_ring_read_batch(_port_ring *ring, int32 *codes, void **buffers,
+                                     size_t *sizes, int32 count, uint32 flags, bigtime_t timeout,
+                                     _port_mapped *_mapped)
+{
+    struct timespec tm;
+    struct timespec *deadline = _port_deadline(&tm, flags, timeout);
+
+    status_t status = _port_ring_lock(ring, deadline);
+    if (status != B_OK) return status;
+
+    _port_record *rec;
+    status = _port_ring_wait(ring, deadline, flags, timeout, &rec);
+    if (status != B_OK) {
+        _port_ring_unlock(ring);
+        return status;
+    }
+
+    uint64 head = ring->head;
+    int32 n = 0;
+    do {
+        size_t stored = _port_record_stored(rec);
+        size_t reclen = _port_record_length(stored);
+        if (codes) codes[n] = rec->code;
+        if (rec->len & PORT_RECORD_MAPPED) {
+            _port_mapped *mapped = (_port_mapped *)(rec + 1);
+            if (_mapped) {
+                *_mapped = *mapped;
+                sizes[n] = mapped->size;
+            } else {
+                sizes[n] = _port_mapped_copy(mapped, buffers ? buffers[n] : NULL, sizes[n]);
+            }
+        } else {
+            size_t read = min_c(stored, sizes[n]);
+            if (buffers && buffers[n] && read) memcpy(buffers[n], rec + 1, read);
+            sizes[n] = read;
+        }
+        n++;
+
+        /* keep uncommitted space zeroed for writers */
+        memset(rec, 0, reclen);
+        head += reclen;
+        rec = (_port_record *)(_port_ring_data(ring) + (head & (ring->size - 1)));
+        /* a message that would not fit its buffer is left for the next call */
+    } while (n < count && __atomic_load_n(&rec->len, __ATOMIC_ACQUIRE) != 0
+             && _port_record_size(rec) <= sizes[n]);
+
+    __atomic_store_n(&ring->head, head, __ATOMIC_RELEASE);
+    atomic_sub(&ring->count, n);
+    atomic_add(&ring->total, n);
+    _port_ring_unlock(ring);
+
+    _port_signal(&ring->space_seq, &ring->writers);
+
+    return n;
+}
+
+static ssize_t _port_ring_buffer_size(_port_ring *ring, uint32 flags, bigtime_t timeout)
+{
+    struct timespec tm;
+    struct timespec *deadline = _port_deadline(&tm, flags, timeout);
+
+    status_t status = _port_ring_lock(ring, deadline);
+    if (status != B_OK) return status;
+
+    _port_record *rec;
+    status = _port_ring_wait(ring, deadline, flags, timeout, &rec);
+    ssize_t size = status == B_OK ? (ssize_t)_port_record_size(rec) : status;
+    _port_ring_unlock(ring);
+    return size;
+}
+
+/* Waits for data on socket port when reading with relative timeout. */
+static status_t _port_fd_wait(int fd, uint32 flags, bigtime_t timeout)
+{
+    if (!(flags & B_RELATIVE_TIMEOUT)) return B_OK;
+
+    struct timespec tm;
+    tm.tv_sec = timeout / 1000000;
+    tm.tv_nsec = (timeout % 1000000) * 1000;
+    struct pollfd pfd = { .fd = fd, .events = POLLIN };
+    int ret = ppoll(&pfd, 1, &tm, NULL);
+    if (ret == 0) return B_TIMED_OUT;
+    if (ret < 0) {
+        switch (errno) {
         case EINTR:
             return B_INTERRUPTED;
-        case EINVAL:
-        case EMSGSIZE:
-            return B_BAD_VALUE;
         case ENOMEM:
             return B_NO_MEMORY;
-        default:
-            return B_FROM_POSIX_ERROR(errno);
         }
     }
-
-    return read - sizeof(*code);
+    return B_OK;
 }
 
-ssize_t read_port(port_id port, int32 *code, void *buffer, size_t bufferSize)
+static status_t _port_recv_error(int error)
 {
-    return read_port_etc(port, code, buffer, bufferSize, 0, 0);
+    switch (error) {
+    case EBADF:
+    case ECONNREFUSED:
+    case EFAULT:
+    case ENOTCONN:
+    case ENOTSOCK:
+        return B_BAD_PORT_ID;
+    case EAGAIN: //case EWOULDBLOCK:
+        return B_WOULD_BLOCK;
+    case EINTR:
+        return B_INTERRUPTED;
+    case EINVAL:
+    case EMSGSIZE:
+        return B_BAD_VALUE;
+    case ENOMEM:
+        return B_NO_MEMORY;
+    default:
+        return B_FROM_POSIX_ERROR(error);
+    }
 }
 
-
-status_t write_port_etc(port_id port, int32 code, const void *buffer,
-                        size_t bufferSize, uint32 flags, bigtime_t timeout)
+/* Reserves queue slots for up to count messages of socket port, waiting
+ * while the port is at capacity. Returns number of slots reserved.
+ */
+static ssize_t _port_reserve(_port_info *info, int32 count, uint32 flags, bigtime_t timeout)
 {
-    int fd = -1;
-    struct sockaddr_un address;
-    struct msghdr msg = {};
-    msg.msg_name = (struct sockaddr*)&address;
+    struct timespec tm;
+    struct timespec *deadline = _port_deadline(&tm, flags, timeout);
+    int32 capacity = info->capacity > 0 ? info->capacity : INT32_MAX;
 
-    _ports_rlock();
-    _port_info *info = _find_port_info(port);
-    if (info) {
-        fd = info->fd;
-        msg.msg_namelen = _fill_sockaddr(&address, info);
-    }
-    _ports_unlock();
-    if (fd < 0) return B_BAD_PORT_ID;
+    for (;;) {
+        uint32 seq = __atomic_load_n(&info->space_seq, __ATOMIC_ACQUIRE);
+        if (info->closed) return B_BAD_PORT_ID;
 
-    struct iovec iov[2] = {};
-    msg.msg_iov = &iov[0];
-    msg.msg_iovlen = count_of(iov);
+        int32 queued = __atomic_load_n(&info->count, __ATOMIC_ACQUIRE);
+        if (queued < capacity) {
+            int32 n = min_c(count, capacity - queued);
+            if (cmpxchg(&info->count, queued, queued + n) == queued) return n;
+            continue;
+        }
 
-    iov[0].iov_base = &code;
-    iov[0].iov_len = sizeof(code);
-    iov[1].iov_base = (void *)buffer;
-    iov[1].iov_len = bufferSize;
+        if ((flags & B_RELATIVE_TIMEOUT) && timeout <= 0) return B_WOULD_BLOCK;
 
+        status_t status = _port_sleep(&info->space_seq, &info->writers, seq, deadline);
+        if (status != B_OK) return status;
+    }
+}
+
+/* Frees count queue slots of socket port, read of them were consumed. */
+static void _port_unreserve(_port_info *info, int32 count, int32 read)
+{
+    atomic_sub(&info->count, count);
+    if (read) atomic_add(&info->total, read);
+    _port_signal(&info->space_seq, &info->writers);
+}
+
+static status_t _port_send(int fd, struct msghdr *msg, uint32 flags, bigtime_t timeout)
+{
     unsigned retries = MAX_WRITE_RETRIES;
     bigtime_t retrysnooze = MAX_WRITE_SNOOZE;
 
@@ -234,7 +731,7 @@ status_t write_port_etc(port_id port, int32 code, const void *buffer,
     }
 
 retry:
-    if (sendmsg(fd, &msg, sendflags) < 0) {
+    if (sendmsg(fd, msg, sendflags) < 0) {
         if (errno == ECONNREFUSED && --retries) {
             snooze(retrysnooze);
             goto retry;
@@ -280,34 +777,566 @@ retry:
     return B_OK;
 }
 
+/* Returns memfd passed with socket message, or -1. */
+static int _port_cmsg_fd(struct msghdr *msg)
+{
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(msg);
+    if (!cmsg || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+        return -1;
+
+    int fd;
+    memcpy(&fd, CMSG_DATA(cmsg), sizeof(fd));
+    return fd;
+}
+
+static void _port_mapped_fd(_port_mapped *mapped, int fd)
+{
+    struct stat st;
+    mapped->size = fstat(fd, &st) == 0 ? st.st_size : 0;
+    mapped->fd = fd;
+    mapped->shmid = -1;
+}
+
+/* Returns size of next message queued in socket without taking it. */
+static ssize_t _port_socket_peek(int fd, int recvflags)
+{
+    int32 code;
+    struct iovec iov = { .iov_base = &code, .iov_len = sizeof(code) };
+    char control[CMSG_SPACE(sizeof(int))];
+    struct msghdr msg = {};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    ssize_t size = recvmsg(fd, &msg, recvflags | MSG_PEEK | MSG_TRUNC | MSG_CMSG_CLOEXEC);
+    if (size < 0) return errno == EAGAIN ? B_WOULD_BLOCK : B_BAD_PORT_ID;
+
+    /* peeking duplicates passed descriptor */
+    int mappedfd = _port_cmsg_fd(&msg);
+    if (mappedfd >= 0) {
+        _port_mapped mapped;
+        _port_mapped_fd(&mapped, mappedfd);
+        close(mappedfd);
+        return mapped.size;
+    }
+    return size - sizeof(code);
+}
+
+static ssize_t _port_buffer_size(_port_info *info, uint32 flags, bigtime_t timeout)
+{
+    if (info->ring) return _port_ring_buffer_size(info->ring, flags, timeout);
+
+    ssize_t size = _port_fd_wait(info->fd, flags, timeout);
+    if (size != B_OK) return size;
+
+    return _port_socket_peek(info->fd, flags & B_RELATIVE_TIMEOUT ? MSG_DONTWAIT : 0);
+}
+
+/* Takes one message from socket, waiting per recvflags. */
+static ssize_t _port_socket_read(_port_info *info, int32 *code, void *buffer, size_t bufferSize,
+                                 _port_mapped *_mapped, int recvflags)
+{
+    struct msghdr msg = {};
+
+    struct iovec iov[2] = {};
+    msg.msg_iov = &iov[0];
+    msg.msg_iovlen = count_of(iov);
+
+    int32 dummy;
+    iov[0].iov_base = code ? code : &dummy;
+    iov[0].iov_len = sizeof(int32);
+    iov[1].iov_base = buffer;
+    iov[1].iov_len = bufferSize;
+
+    char control[CMSG_SPACE(sizeof(int))];
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    ssize_t read = recvmsg(info->fd, &msg, recvflags | MSG_CMSG_CLOEXEC);
+    if (read < 0) return _port_recv_error(errno);
+    _port_unreserve(info, 1, 1);
+
+    int fd = _port_cmsg_fd(&msg);
+    if (fd < 0) return read - sizeof(int32);
+
+    _port_mapped mapped;
+    _port_mapped_fd(&mapped, fd);
+    if (_mapped) {
+        *_mapped = mapped;
+        return mapped.size;
+    }
+    return _port_mapped_copy(&mapped, buffer, bufferSize);
+}
+
+/* Reads one message. With _mapped set, mapped message is handed over
+ * instead of being copied to buffer.
+ */
+static ssize_t _port_read(_port_info *info, int32 *code, void *buffer, size_t bufferSize,
+                          _port_mapped *_mapped, uint32 flags, bigtime_t timeout)
+{
+    if (info->ring) {
+        ssize_t read = _port_ring_read_batch(info->ring, code, &buffer, &bufferSize, 1,
+                                             flags, timeout, _mapped);
+        return read < 0 ? read : (ssize_t)bufferSize;
+    }
+
+    ssize_t read = _port_fd_wait(info->fd, flags, timeout);
+    if (read != B_OK) return read;
+
+    return _port_socket_read(info, code, buffer, bufferSize, _mapped,
+                             flags & B_RELATIVE_TIMEOUT ? MSG_DONTWAIT : 0);
+}
+
+static status_t _port_socket_write(_port_info *info, int32 code, const void *buffer,
+                                   size_t bufferSize, int fd, uint32 flags, bigtime_t timeout)
+{
+    struct sockaddr_un address;
+    struct msghdr msg = {};
+    msg.msg_name = (struct sockaddr*)&address;
+    msg.msg_namelen = _fill_sockaddr(&address, info);
+
+    struct iovec iov[2] = {};
+    msg.msg_iov = &iov[0];
+    msg.msg_iovlen = count_of(iov);
+
+    iov[0].iov_base = &code;
+    iov[0].iov_len = sizeof(code);
+    iov[1].iov_base = (void *)buffer;
+    iov[1].iov_len = bufferSize;
+
+    char control[CMSG_SPACE(sizeof(int))] = {};
+    if (fd >= 0) {
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+    }
+
+    /* wait for room in the queue first, then in the socket */
+    bigtime_t start = flags & B_RELATIVE_TIMEOUT ? system_time() : 0;
+    status_t status = _port_reserve(info, 1, flags, timeout);
+    if (status >= 0) {
+        if (flags & B_RELATIVE_TIMEOUT) timeout = max_c(timeout - (system_time() - start), 0);
+        status = _port_send(info->fd, &msg, flags, timeout);
+        if (status != B_OK) _port_unreserve(info, 1, 0);
+    }
+    return status;
+}
+
+/* Message is released on failure. */
+static status_t _port_write_mapped(_port_info *info, int32 code, const _port_mapped *mapped,
+                                   uint32 flags, bigtime_t timeout)
+{
+    if (info->ring) {
+        status_t status = _port_ring_write_mapped(info->ring, code, mapped, flags, timeout);
+        if (status != B_OK && mapped->fd >= 0) close(mapped->fd);
+        return status;
+    }
+
+    /* socket holds its own reference to descriptor in flight */
+    status_t status = _port_socket_write(info, code, NULL, 0, mapped->fd, flags, timeout);
+    close(mapped->fd);
+    return status;
+}
+
+/* Large payloads go as sealed memfd. Ring copies them cheaper than memfd
+ * and pread do, so ring ports only pass memfd to mapped readers or when
+ * payload would never fit the ring.
+ */
+static bool _port_pass_mapped(_port_info *info, size_t size)
+{
+    if (size < PORT_MAPPED_MIN_SIZE) return false;
+    if (!info->ring) return true;
+    return __atomic_load_n(&info->mapped, __ATOMIC_RELAXED)
+        || _port_record_length(size) > info->ring->size;
+}
+
+/* Writes one message, large payload may be passed as sealed memfd. */
+static status_t _port_write(_port_info *info, int32 code, const void *buffer,
+                            size_t bufferSize, uint32 flags, bigtime_t timeout)
+{
+    int fd = _port_pass_mapped(info, bufferSize) ? _port_mapped_create(buffer, bufferSize) : -1;
+    if (fd >= 0) {
+        _port_mapped mapped = { .size = bufferSize, .fd = fd, .shmid = -1 };
+        return _port_write_mapped(info, code, &mapped, flags, timeout);
+    }
+
+    if (info->ring) return _port_ring_write(info->ring, code, buffer, bufferSize, flags, timeout);
+    return _port_socket_write(info, code, buffer, bufferSize, -1, flags, timeout);
+}
+
+static ssize_t _port_socket_write_batch(_port_info *info, const int32 *codes,
+                                        const void *const *buffers, const size_t *sizes,
+                                        int32 count, uint32 flags, bigtime_t timeout)
+{
+    struct sockaddr_un address;
+    socklen_t addrlen = _fill_sockaddr(&address, info);
+
+    int32 written = 0;
+    status_t status = B_OK;
+    while (written < count) {
+        ssize_t n = _port_reserve(info, min_c(count - written, PORT_BATCH_MAX), flags, timeout);
+        if (n < 0) {
+            status = n;
+            break;
+        }
+
+        struct mmsghdr msgs[PORT_BATCH_MAX] = {};
+        struct iovec iov[PORT_BATCH_MAX][2] = {};
+        for (int32 i = 0; i < n; i++) {
+            iov[i][0].iov_base = (void *)&codes[written + i];
+            iov[i][0].iov_len = sizeof(int32);
+            iov[i][1].iov_base = (void *)buffers[written + i];
+            iov[i][1].iov_len = sizes[written + i];
+            msgs[i].msg_hdr.msg_name = &address;
+            msgs[i].msg_hdr.msg_namelen = addrlen;
+            msgs[i].msg_hdr.msg_iov = iov[i];
+            msgs[i].msg_hdr.msg_iovlen = count_of(iov[i]);
+        }
+
+        int sent = sendmmsg(info->fd, msgs, n, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (sent > 0) {
+            if (sent < n) _port_unreserve(info, n - sent, 0);
+            written += sent;
+            continue;
+        }
+
+        /* let single message path do the retrying and waiting */
+        if (n > 1) _port_unreserve(info, n - 1, 0);
+        status = _port_send(info->fd, &msgs[0].msg_hdr, flags, timeout);
+        if (status != B_OK) {
+            _port_unreserve(info, 1, 0);
+            break;
+        }
+        written++;
+    }
+    return written ? written : status;
+}
+
+ssize_t port_buffer_size_etc(port_id port, uint32 flags, bigtime_t timeout)
+{
+    _port_info *info = _acquire_port_reader(port);
+    if (!info) return B_BAD_PORT_ID;
+
+    ssize_t size = _port_buffer_size(info, flags, timeout);
+    _release_port(info);
+    return size;
+}
+
+ssize_t port_buffer_size(port_id port)
+{
+    return port_buffer_size_etc(port, 0, 0);
+}
+
+ssize_t port_count(port_id port)
+{
+    ssize_t count = B_BAD_PORT_ID;
+    _ports_rlock();
+    _port_info *info = _find_port_info(port);
+    if (info) {
+        int32 *queued = info->ring ? &info->ring->count : &info->count;
+        count = __atomic_load_n(queued, __ATOMIC_ACQUIRE);
+    }
+    _ports_unlock();
+    return count;
+}
+
+ssize_t read_port_etc(port_id port, int32 *code, void *buffer,
+                      size_t bufferSize, uint32 flags, bigtime_t timeout)
+{
+    _port_info *info = _acquire_port_reader(port);
+    if (!info) return B_BAD_PORT_ID;
+
+    BE_TRACE1(port_read_start, port);
+    ssize_t read = _port_read(info, code, buffer, bufferSize, NULL, flags, timeout);
+    _port_settle(info);
+    _release_port(info);
+    BE_TRACE3(port_read_done, port, read >= 0 && code ? *code : 0, read);
+    if (read >= 0) record_event(B_RECORD_PORT_READ, port, code ? *code : 0);
+    return read;
+}
+
+ssize_t read_port(port_id port, int32 *code, void *buffer, size_t bufferSize)
+{
+    return read_port_etc(port, code, buffer, bufferSize, 0, 0);
+}
+
+
+status_t write_port_etc(port_id port, int32 code, const void *buffer,
+                        size_t bufferSize, uint32 flags, bigtime_t timeout)
+{
+    _port_info *info = _acquire_port(port);
+    if (!info) return B_BAD_PORT_ID;
+
+    BE_TRACE3(port_write_start, port, code, bufferSize);
+    status_t status = _port_write(info, code, buffer, bufferSize, flags, timeout);
+    if (status == B_OK) _port_notify(info);
+    _release_port(info);
+    BE_TRACE3(port_write_done, port, code, status);
+    if (status == B_OK) record_event(B_RECORD_PORT_WRITE, port, code);
+    return status;
+}
+
 status_t write_port(port_id port, int32 code, const void *buffer, size_t bufferSize)
 {
     return write_port_etc(port, code, buffer, bufferSize, 0, 0);
 }
 
+ssize_t read_port_batch(port_id port, int32 *codes, void **buffers, size_t *sizes,
+                        int32 count, uint32 flags, bigtime_t timeout)
+{
+    if (count < 1 || !sizes) return B_BAD_VALUE;
+
+    _port_info *info = _acquire_port_reader(port);
+    if (!info) return B_BAD_PORT_ID;
+
+    BE_TRACE2(port_read_batch_start, port, count);
+    if (info->ring) {
+        ssize_t read = _port_ring_read_batch(info->ring, codes, buffers, sizes, count,
+                                             flags, timeout, NULL);
+        _port_settle(info);
+        _release_port(info);
+        BE_TRACE2(port_read_batch_done, port, read);
+        if (read > 0) record_event(B_RECORD_PORT_READ, port, read);
+        return read;
+    }
+
+    /* block for the first message only, later ones are taken while they
+     * are queued and fit their buffers, like on ring ports */
+    ssize_t read = _port_fd_wait(info->fd, flags, timeout);
+    if (read == B_OK) {
+        int recvflags = flags & B_RELATIVE_TIMEOUT ? MSG_DONTWAIT : 0;
+        for (read = 0; read < count; read++) {
+            if (read > 0) {
+                ssize_t size = _port_socket_peek(info->fd, MSG_DONTWAIT);
+                if (size < 0 || (size_t)size > sizes[read]) break;
+                recvflags = MSG_DONTWAIT;
+            }
+            ssize_t size = _port_socket_read(info, codes ? &codes[read] : NULL,
+                                             buffers ? buffers[read] : NULL, sizes[read],
+                                             NULL, recvflags);
+            if (size < 0) {
+                if (read == 0) read = size;
+                break;
+            }
+            sizes[read] = size;
+        }
+    }
+    _release_port(info);
+
+    BE_TRACE2(port_read_batch_done, port, read);
+    if (read > 0) record_event(B_RECORD_PORT_READ, port, read);
+    return read;
+}
+
+ssize_t write_port_batch(port_id port, const int32 *codes, const void *const *buffers,
+                         const size_t *sizes, int32 count, uint32 flags, bigtime_t timeout)
+{
+    if (count < 1 || !codes || !buffers || !sizes) return B_BAD_VALUE;
+
+    _port_info *info = _acquire_port(port);
+    if (!info) return B_BAD_PORT_ID;
+
+    BE_TRACE2(port_write_batch_start, port, count);
+    int32 written = 0;
+    ssize_t status = B_OK;
+    while (written < count) {
+        /* messages passed as sealed memfd go one by one */
+        int32 n = 0;
+        while (written + n < count && !_port_pass_mapped(info, sizes[written + n])) n++;
+        if (n == 0) {
+            status = _port_write(info, codes[written], buffers[written], sizes[written],
+                                 flags, timeout);
+            if (status != B_OK) break;
+            written++;
+            continue;
+        }
+
+        if (info->ring) {
+            status = _port_ring_write_batch(info->ring, codes + written, buffers + written,
+                                            sizes + written, n, flags, timeout, 0);
+        } else {
+            status = _port_socket_write_batch(info, codes + written, buffers + written,
+                                              sizes + written, n, flags, timeout);
+        }
+        if (status < 0) break;
+        written += status;
+        if (status < n) break;
+    }
+
+    if (written) _port_notify(info);
+    _release_port(info);
+    BE_TRACE2(port_write_batch_done, port, written ? written : status);
+    if (written) record_event(B_RECORD_PORT_WRITE, port, written);
+    return written ? written : status;
+}
+
+ssize_t read_port_mapped(port_id port, int32 *code, const void **data,
+                         uint32 flags, bigtime_t timeout)
+{
+    if (!data) return B_BAD_VALUE;
+
+    _port_info *info = _acquire_port_reader(port);
+    if (!info) return B_BAD_PORT_ID;
+    atomic_add(&info->mapped, 1);
+
+    bigtime_t deadline = (flags & B_RELATIVE_TIMEOUT) && timeout != B_INFINITE_TIMEOUT
+        ? system_time() + timeout : 0;
+    ssize_t size;
+    for (;;) {
+        /* small messages are copied to private mapping of their size */
+        size = _port_buffer_size(info, flags, timeout);
+        if (size < 0) break;
+
+        void *buffer = mmap(NULL, max_c(size, 1), PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        _port_mapped mapped = { .fd = -1, .shmid = -1 };
+        ssize_t read = buffer == MAP_FAILED ? B_NO_MEMORY
+            : _port_read(info, code, buffer, size, &mapped, B_RELATIVE_TIMEOUT, 0);
+
+        if (mapped.fd >= 0 || mapped.shmid >= 0) {
+            munmap(buffer, max_c(size, 1));
+            *data = _port_mapped_map(&mapped);
+            size = *data ? (ssize_t)mapped.size : B_NO_MEMORY;
+        } else if (read >= 0) {
+            mprotect(buffer, max_c(size, 1), PROT_READ);
+            *data = buffer;
+            size = read;
+        } else {
+            if (buffer != MAP_FAILED) munmap(buffer, max_c(size, 1));
+            size = read;
+            if (read == B_TIMED_OUT || read == B_WOULD_BLOCK) {
+                /* another reader took the message, wait for the next one */
+                if (deadline) timeout = max_c(deadline - system_time(), 0);
+                continue;
+            }
+        }
+        break;
+    }
+
+    atomic_sub(&info->mapped, 1);
+    _port_settle(info);
+    _release_port(info);
+    return size;
+}
+
+status_t unmap_port_message(const void *data, size_t size)
+{
+    /* area messages are attached segments, the rest are mappings */
+    _ports_wlock();
+    void *attached = _idhash_remove(&_ports_attached, (intptr_t)data);
+    _ports_unlock();
+    if (attached) return shmdt(attached) == 0 ? B_OK : B_BAD_VALUE;
+    return munmap((void *)data, max_c(size, 1)) == 0 ? B_OK : B_BAD_VALUE;
+}
+
+status_t write_port_area(port_id port, int32 code, area_id area, size_t size,
+                         uint32 flags, bigtime_t timeout)
+{
+    area_info areaInfo;
+    status_t status = get_area_info(area, &areaInfo);
+    if (status != B_OK) return status;
+    if (size > areaInfo.size) return B_BAD_VALUE;
+
+    _port_info *info = _acquire_port(port);
+    if (!info) return B_BAD_PORT_ID;
+
+    if (info->ring) {
+        /* message owns its own descriptor of memfd area */
+        _port_mapped mapped = { .size = size, .fd = _get_area_fd(area), .shmid = -1 };
+        if (mapped.fd < 0) mapped.shmid = _get_area_shmid(area);
+        status = _port_write_mapped(info, code, &mapped, flags, timeout);
+    } else {
+        /* socket can't pass area, its contents go as regular message */
+        status = _port_write(info, code, areaInfo.address, size, flags, timeout);
+    }
+
+    if (status == B_OK) _port_notify(info);
+    _release_port(info);
+    return status;
+}
+
 port_id create_port(int32 capacity, const char *name)
 {
     if (!name || name[0] == '\0') {
         return B_BAD_VALUE;
     }
 
-    int fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    _port_ring *ring = NULL;
+    size_t ringmap = 0;
+    int fd = memfd_create(name, MFD_CLOEXEC);
+    if (fd >= 0) {
+        ring = _port_ring_create(fd, capacity, &ringmap);
+        if (!ring) {
+            close(fd);
+            fd = -1;
+        }
+    }
+
+    /* fall back to datagram socket when shared memory is not available */
+    if (fd < 0) fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
     if (fd < 0) {
         return B_NO_MORE_PORTS;
     }
 
-    _port_info *info = calloc(1, sizeof(_port_info));
+    _ports_wlock();
+    _port_info *info = _ports_free;
+    if (info) LL_DELETE(_ports_free, info);
+    _ports_unlock();
+    if (!info) info = malloc(sizeof(_port_info));
+
+    /* refs stays 0 until record is ready, so stale readers can't take it */
+    memset(info, 0, sizeof(_port_info));
     info->fd = fd;
+    info->ring = ring;
+    info->ringmap = ringmap;
+    info->bound = ring != NULL; // ring ports have no socket to bind
     size_t len = name ? strlen(name) : 0;
     info->namelen = min_c(len, B_OS_NAME_LENGTH);
     strncpy(info->name, name, info->namelen);
     info->capacity = capacity;
+    info->readfd = -1;
+    __atomic_store_n(&info->refs, 1, __ATOMIC_RELEASE);
 
     _ports_wlock();
-    DL_APPEND(_ports, info);
+    status_t status = _idhash_insert(&_ports_index, fd, info);
+    if (status == B_OK) DL_APPEND(_ports, info);
     _ports_unlock();
+    if (status != B_OK) {
+        _release_port(info);
+        return B_NO_MORE_PORTS;
+    }
 
-    return info->fd;
+    return fd;
+}
+
+int _get_port_read_fd(port_id port)
+{
+    _port_info *info = _acquire_port_reader(port);
+    if (!info) return B_BAD_PORT_ID;
+
+    /* socket is readable as is */
+    int fd = info->fd;
+    if (info->ring) {
+        _ports_wlock();
+        if (info->readfd < 0) {
+            int readfd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+            if (readfd >= 0) {
+                __atomic_store_n(&info->readfd, readfd, __ATOMIC_SEQ_CST);
+                /* ring for messages queued before */
+                if (__atomic_load_n(&info->ring->count, __ATOMIC_SEQ_CST) > 0) eventfd_write(readfd, 1);
+            }
+        }
+        fd = info->readfd >= 0 ? info->readfd : B_FROM_POSIX_ERROR(errno);
+        _ports_unlock();
+    }
+
+    _release_port(info);
+    return fd;
 }
 
 port_id find_port(const char *name)
@@ -327,36 +1356,37 @@ status_t delete_port(port_id port)
     _ports_wlock();
     _port_info *info = _find_port_info(port);
     if (info) {
+        _idhash_remove(&_ports_index, port);
         DL_DELETE(_ports, info);
     }
     _ports_unlock();
     if (!info) return B_BAD_PORT_ID;
 
-    int fd = info->fd;
-    free(info);
+    /* wake up threads still waiting on port, it is closed by the last user */
+    if (info->ring) _port_ring_close(info->ring);
+    else shutdown(info->fd, SHUT_RDWR);
+    info->closed = 1;
+    _port_signal(&info->space_seq, &info->writers);
 
-    if (close(fd) < 0) {
-        switch (errno) {
-        case EBADF:
-            return B_BAD_PORT_ID;
-        case EINTR:
-            return B_INTERRUPTED;
-        default:
-            return B_FROM_POSIX_ERROR(errno);
-        }
-    }
-
-    return info->fd;
+    return _release_port(info);
 }
 
 status_t close_port(port_id port)
 {
     int fd = -1;
+    _port_ring *ring = NULL;
     _ports_rlock();
     _port_info *info = _find_port_info(port);
-    if (info) fd = info->fd;
+    if (info) {
+        fd = info->fd;
+        ring = info->ring;
+        if (ring) _port_ring_close(ring);
+        info->closed = 1;
+        _port_signal(&info->space_seq, &info->writers);
+    }
     _ports_unlock();
     if (fd < 0) return B_BAD_PORT_ID;
+    if (ring) return B_OK;
 
     if (shutdown(fd, SHUT_WR) < 0) {
         switch (errno) {
@@ -388,7 +1418,9 @@ status_t _get_port_info(port_id port, port_info *portInfo, size_t portInfoSize)
     portInfo->team = _info->team;
     COPY_OS_NAME_LENGTH(portInfo->name, info->name);
     portInfo->capacity = info->capacity;
-    portInfo->queue_count = (int32) port_count(port);
-//    portInfo->total_count =
+    _port_ring *ring = info->ring;
+    portInfo->queue_count = __atomic_load_n(ring ? &ring->count : &info->count, __ATOMIC_ACQUIRE);
+    portInfo->total_count = __atomic_load_n(ring ? &ring->total : &info->total, __ATOMIC_ACQUIRE);
+    _ports_unlock();
     return B_OK;
 }
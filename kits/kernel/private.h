@@ -19,6 +19,8 @@ typedef enum {
     TASK_EXITED
 } _task_state;
 
+typedef struct _thread_mailbox_struct _thread_mailbox;
+
 typedef struct _thread_info_struct {
     thread_id       tid; // futex
     pthread_t       pthread;
@@ -32,7 +34,7 @@ typedef struct _thread_info_struct {
     thread_func		func;
     void			*data;
     _task_state     task_state;
-    int             data_pipe[2];
+    _thread_mailbox *mailbox;   // send_data()/receive_data()
     _task_state     *task_state_copy;
     struct _thread_info_struct *next;
     struct _thread_info_struct *prev;
@@ -40,6 +42,8 @@ typedef struct _thread_info_struct {
 
 typedef struct {
     int             count; // futex
+    uint32          waiters; // sleeping in acquire_sem_etc()
+    int32           spin; // average spins of recent acquires
     team_id         team;
     char			name[B_OS_NAME_LENGTH];
     thread_id       latest_holder;
@@ -49,6 +53,23 @@ typedef struct {
 
 extern __thread _thread_info *_info; // current thread info
 _thread_info *_find_thread_info(thread_id thread);
+int _get_area_shmid(area_id area);
+int _get_area_fd(area_id area);
+void _attr_cache_invalidate(dev_t device, ino_t node);
+struct fs_attr_entry;
+ssize_t _attr_read_path(const char *path, struct fs_attr_entry **entries);
+
+typedef struct {
+    team_info       info;
+    team_usage_info usage;
+    team_usage_info children; // waited for
+} _proc_team;
+
+status_t _proc_get_team(team_id id, _proc_team *team);
+status_t _proc_next_team(int32 *cookie, _proc_team *team);
+status_t _proc_get_thread(team_id team, thread_id id, thread_info *thread); // team 0 if unknown
+status_t _proc_next_thread(team_id team, int32 *cookie, thread_info *thread);
+status_t _image_resume(team_id team); // teams of load_image()
 
 #include <string.h>
 #define COPY_OS_NAME_LENGTH(dest, src) \
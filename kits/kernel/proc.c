@@ -0,0 +1,408 @@
+#include <OS.h>
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "private.h"
+#include "utlist.h"
+
+/* /proc snapshots.
+ * Infos of teams and of threads come from /proc. Every file is read with
+ * one read() into a page sized buffer and parsed by a scanner, so a team
+ * costs two open()/read()/close() and an fstat() for the owner.
+ * Enumerations read all teams, or all threads of a team, at once and
+ * serve later calls from that snapshot until it is older than the TTL.
+ * Single lookups use a fresh snapshot when there is one and otherwise
+ * read only the files of their team or thread.
+ */
+#define PROC_BUFFER_SIZE    4096
+#define PROC_DEFAULT_TTL    100000  // 100 ms
+#define PROC_THREAD_TEAMS   32      // teams with thread snapshots
+
+typedef struct _proc_threads_struct {
+    team_id     team;
+    bigtime_t   time;
+    thread_info *threads;   // sorted by id
+    int32       count;
+    struct _proc_threads_struct *next;
+    struct _proc_threads_struct *prev;
+} _proc_threads;
+
+static pthread_mutex_t _proc_lock = PTHREAD_MUTEX_INITIALIZER;
+static bigtime_t _proc_ttl = PROC_DEFAULT_TTL;
+static int _proc_fd = -1;
+static long _proc_ticks;    // per second
+
+static _proc_team *_proc_teams = NULL; // sorted by id
+static int32 _proc_teams_count = 0;
+static bigtime_t _proc_teams_time = 0;
+
+static _proc_threads *_proc_thread_lists = NULL; // least recently read first
+static int32 _proc_thread_lists_count = 0;
+
+void set_team_info_ttl(bigtime_t ttl)
+{
+    pthread_mutex_lock(&_proc_lock);
+    _proc_ttl = max_c(ttl, 0);
+    pthread_mutex_unlock(&_proc_lock);
+}
+
+/* WARNING! you need to lock _proc_lock in caller function! */
+static bool _proc_fresh(bigtime_t time)
+{
+    return time && system_time_coarse() - time < _proc_ttl;
+}
+
+/* WARNING! you need to lock _proc_lock in caller function! */
+static bool _proc_open(void)
+{
+    if (_proc_fd < 0) {
+        _proc_fd = open("/proc", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        _proc_ticks = sysconf(_SC_CLK_TCK);
+    }
+    return _proc_fd >= 0;
+}
+
+/* Reads file below /proc, up to size - 1 bytes and terminated.
+ * Returns bytes read, or -1 when it does not exist.
+ * WARNING! you need to lock _proc_lock in caller function!
+ */
+static ssize_t _proc_read(const char *path, char *buffer, size_t size, struct stat *st)
+{
+    if (!_proc_open()) return -1;
+
+    int fd = openat(_proc_fd, path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return -1;
+    ssize_t length = read(fd, buffer, size - 1);
+    if (length >= 0 && st && fstat(fd, st) < 0) length = -1;
+    close(fd);
+    if (length < 0) return -1;
+    buffer[length] = '\0';
+    return length;
+}
+
+static int64 _proc_scan_number(const char **p)
+{
+    const char *s = *p;
+    while (*s == ' ') s++;
+    bool negative = *s == '-';
+    if (negative) s++;
+    int64 value = 0;
+    while (*s >= '0' && *s <= '9') value = value * 10 + (*s++ - '0');
+    *p = s;
+    return negative ? -value : value;
+}
+
+static void _proc_scan_skip(const char **p, int32 fields)
+{
+    const char *s = *p;
+    while (fields-- > 0) {
+        while (*s == ' ') s++;
+        while (*s && *s != ' ') s++;
+    }
+    *p = s;
+}
+
+static bigtime_t _proc_ticks_time(int64 ticks)
+{
+    return _proc_ticks > 0 ? ticks * 1000000 / _proc_ticks : 0;
+}
+
+/* Parses stat of a team or a thread, see proc(5). The name may hold
+ * blanks and parentheses, so it ends at the last ')'.
+ */
+static bool _proc_scan_stat(const char *buffer, thread_info *thread, _proc_team *team)
+{
+    const char *p = buffer;
+    int64 id = _proc_scan_number(&p);
+    const char *name = strchr(p, '(');
+    const char *end = strrchr(p, ')');
+    if (!name || !end || end < name) return false;
+
+    p = end + 1;
+    while (*p == ' ') p++;
+    char state = *p++;
+    _proc_scan_skip(&p, 10);                        // ppid .. cmajflt
+    int64 utime = _proc_scan_number(&p);
+    int64 stime = _proc_scan_number(&p);
+    int64 cutime = _proc_scan_number(&p);
+    int64 cstime = _proc_scan_number(&p);
+    int64 priority = _proc_scan_number(&p);
+    int64 nice = _proc_scan_number(&p);
+    int64 threads = _proc_scan_number(&p);
+
+    if (thread) {
+        memset(thread, 0, sizeof(thread_info));
+        thread->thread = id;
+        thread->sem = -1;
+        size_t length = min_c((size_t)(end - name - 1), sizeof(thread->name) - 1);
+        memcpy(thread->name, name + 1, length);
+        thread->name[length] = '\0';
+        switch (state) {
+        case 'R': thread->state = B_THREAD_RUNNING; break;
+        case 'S': case 'D': case 'I': thread->state = B_THREAD_WAITING; break;
+        case 'T': case 't': thread->state = B_THREAD_SUSPENDED; break;
+        default: thread->state = B_THREAD_READY; break;
+        }
+        /* negative for real time policies */
+        thread->priority = priority < 0 ? B_REAL_TIME_DISPLAY_PRIORITY
+                           : min_c(max_c(B_NORMAL_PRIORITY - nice, B_LOWEST_ACTIVE_PRIORITY), B_REAL_TIME_DISPLAY_PRIORITY - 1);
+        thread->user_time = _proc_ticks_time(utime);
+        thread->kernel_time = _proc_ticks_time(stime);
+    }
+    if (team) {
+        memset(team, 0, sizeof(_proc_team));
+        team->info.team = id;
+        team->info.thread_count = threads;
+        team->usage.user_time = _proc_ticks_time(utime);
+        team->usage.kernel_time = _proc_ticks_time(stime);
+        team->children.user_time = _proc_ticks_time(cutime);
+        team->children.kernel_time = _proc_ticks_time(cstime);
+    }
+    return true;
+}
+
+/* WARNING! you need to lock _proc_lock in caller function! */
+static bool _proc_read_team(team_id id, _proc_team *team, char *buffer)
+{
+    char path[32];
+    struct stat st;
+    snprintf(path, sizeof(path), "%d/stat", id);
+    if (_proc_read(path, buffer, PROC_BUFFER_SIZE, &st) < 0 || !_proc_scan_stat(buffer, NULL, team))
+        return false;
+    team->info.uid = st.st_uid;
+    team->info.gid = st.st_gid;
+
+    /* arguments are terminated, only the first ones are kept */
+    snprintf(path, sizeof(path), "%d/cmdline", id);
+    ssize_t length = _proc_read(path, buffer, PROC_BUFFER_SIZE, NULL);
+    for (ssize_t i = 0; i < length; i++) {
+        if (!buffer[i]) team->info.argc++;
+        if (i < (ssize_t)sizeof(team->info.args)) team->info.args[i] = buffer[i] ? buffer[i] : ' ';
+    }
+    return true;
+}
+
+/* ids lead team_info, thread_info and _proc_team */
+static int _proc_compare_id(const void *a, const void *b)
+{
+    return *(const int32 *)a - *(const int32 *)b;
+}
+
+/* Ids of numeric entries of directory below /proc, sorted.
+ * WARNING! you need to lock _proc_lock in caller function!
+ */
+static int32 _proc_list(const char *path, int32 **ids)
+{
+    int fd = openat(_proc_fd, path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    DIR *dir = fd >= 0 ? fdopendir(fd) : NULL;
+    if (!dir) {
+        if (fd >= 0) close(fd);
+        return -1;
+    }
+
+    int32 count = 0, size = 0;
+    *ids = NULL;
+    struct dirent *ent;
+    while ((ent = readdir(dir))) {
+        if (ent->d_name[0] < '0' || ent->d_name[0] > '9') continue;
+        if (count == size) {
+            size = size ? size * 2 : 256;
+            int32 *grown = realloc(*ids, size * sizeof(int32));
+            if (!grown) break;
+            *ids = grown;
+        }
+        (*ids)[count++] = atoi(ent->d_name);
+    }
+    closedir(dir);
+    qsort(*ids, count, sizeof(int32), _proc_compare_id);
+    return count;
+}
+
+/* WARNING! you need to lock _proc_lock in caller function! */
+static status_t _proc_refresh_teams(void)
+{
+    if (_proc_fresh(_proc_teams_time)) return B_OK;
+
+    char *buffer = malloc(PROC_BUFFER_SIZE);
+    if (!buffer) return B_NO_MEMORY;
+    int32 *ids = NULL;
+    int32 count = _proc_open() ? _proc_list(".", &ids) : -1;
+    _proc_team *teams = count > 0 ? malloc(count * sizeof(_proc_team)) : NULL;
+    if (!teams) {
+        free(ids);
+        free(buffer);
+        return B_NO_MEMORY;
+    }
+
+    int32 read = 0;
+    for (int32 i = 0; i < count; i++) {
+        if (_proc_read_team(ids[i], &teams[read], buffer)) read++; // exited meanwhile otherwise
+    }
+    free(ids);
+    free(buffer);
+
+    free(_proc_teams);
+    _proc_teams = teams;
+    _proc_teams_count = read;
+    _proc_teams_time = system_time_coarse();
+    return B_OK;
+}
+
+/* WARNING! you need to lock _proc_lock in caller function! */
+static _proc_threads *_proc_refresh_threads(team_id team)
+{
+    _proc_threads *list;
+    DL_FOREACH(_proc_thread_lists, list) {
+        if (list->team == team) break;
+    }
+    if (list && _proc_fresh(list->time)) return list;
+
+    char *buffer = malloc(PROC_BUFFER_SIZE);
+    if (!buffer) return NULL;
+    char path[48];
+    snprintf(path, sizeof(path), "%d/task", team);
+    int32 *ids = NULL;
+    int32 count = _proc_open() ? _proc_list(path, &ids) : -1;
+    thread_info *threads = count > 0 ? malloc(count * sizeof(thread_info)) : NULL;
+    if (!threads) {
+        free(ids);
+        free(buffer);
+        return NULL;
+    }
+
+    int32 read = 0;
+    for (int32 i = 0; i < count; i++) {
+        snprintf(path, sizeof(path), "%d/task/%d/stat", team, ids[i]);
+        if (_proc_read(path, buffer, PROC_BUFFER_SIZE, NULL) >= 0 && _proc_scan_stat(buffer, &threads[read], NULL)) {
+            threads[read].team = team;
+            read++;
+        }
+    }
+    free(ids);
+    free(buffer);
+
+    if (!list) {
+        if (_proc_thread_lists_count == PROC_THREAD_TEAMS) {
+            list = _proc_thread_lists;
+            DL_DELETE(_proc_thread_lists, list);
+            free(list->threads);
+        } else {
+            list = malloc(sizeof(_proc_threads));
+            if (!list) {
+                free(threads);
+                return NULL;
+            }
+            _proc_thread_lists_count++;
+        }
+    } else {
+        DL_DELETE(_proc_thread_lists, list);
+        free(list->threads);
+    }
+    list->team = team;
+    list->threads = threads;
+    list->count = read;
+    list->time = system_time_coarse();
+    DL_APPEND(_proc_thread_lists, list);
+    return list;
+}
+
+status_t _proc_get_team(team_id id, _proc_team *team)
+{
+    pthread_mutex_lock(&_proc_lock);
+    if (_proc_fresh(_proc_teams_time)) {
+        _proc_team *found = bsearch(&id, _proc_teams, _proc_teams_count, sizeof(_proc_team), _proc_compare_id);
+        if (found) {
+            *team = *found;
+            pthread_mutex_unlock(&_proc_lock);
+            return B_OK;
+        }
+    }
+
+    char buffer[PROC_BUFFER_SIZE];
+    bool read = _proc_read_team(id, team, buffer);
+    pthread_mutex_unlock(&_proc_lock);
+    return read ? B_OK : B_BAD_TEAM_ID;
+}
+
+status_t _proc_next_team(int32 *cookie, _proc_team *team)
+{
+    pthread_mutex_lock(&_proc_lock);
+    status_t result = _proc_refresh_teams();
+    if (result == B_OK) {
+        /* first team after the one of cookie, teams may exit in between */
+        int32 low = 0, high = _proc_teams_count;
+        while (low < high) {
+            int32 middle = (low + high) / 2;
+            if (_proc_teams[middle].info.team <= *cookie) low = middle + 1;
+            else high = middle;
+        }
+        if (low < _proc_teams_count) {
+            *team = _proc_teams[low];
+            *cookie = team->info.team;
+        } else {
+            result = B_BAD_VALUE;
+        }
+    }
+    pthread_mutex_unlock(&_proc_lock);
+    return result;
+}
+
+status_t _proc_get_thread(team_id team, thread_id id, thread_info *thread)
+{
+    pthread_mutex_lock(&_proc_lock);
+    _proc_threads *list;
+    DL_FOREACH(_proc_thread_lists, list) {
+        if ((team > 0 && list->team != team) || !_proc_fresh(list->time)) continue;
+        thread_info *found = bsearch(&id, list->threads, list->count, sizeof(thread_info), _proc_compare_id);
+        if (found) {
+            *thread = *found;
+            pthread_mutex_unlock(&_proc_lock);
+            return B_OK;
+        }
+    }
+
+    /* below its team to make sure it belongs to it */
+    char buffer[PROC_BUFFER_SIZE], path[48];
+    if (team > 0) snprintf(path, sizeof(path), "%d/task/%d/stat", team, id);
+    else snprintf(path, sizeof(path), "%d/stat", id);
+    status_t result = _proc_read(path, buffer, sizeof(buffer), NULL) >= 0 && _proc_scan_stat(buffer, thread, NULL)
+                      ? B_OK : B_BAD_THREAD_ID;
+    if (result == B_OK && team <= 0) {
+        snprintf(path, sizeof(path), "%d/status", id);
+        const char *tgid = _proc_read(path, buffer, sizeof(buffer), NULL) >= 0 ? strstr(buffer, "\nTgid:") : NULL;
+        if (tgid) {
+            tgid += sizeof("\nTgid:") - 1;
+            team = _proc_scan_number(&tgid);
+        } else {
+            result = B_BAD_THREAD_ID;
+        }
+    }
+    thread->team = team;
+    pthread_mutex_unlock(&_proc_lock);
+    return result;
+}
+
+status_t _proc_next_thread(team_id team, int32 *cookie, thread_info *thread)
+{
+    pthread_mutex_lock(&_proc_lock);
+    _proc_threads *list = _proc_refresh_threads(team);
+    status_t result = list ? B_BAD_VALUE : B_BAD_TEAM_ID;
+    for (int32 i = 0; list && i < list->count; i++) {
+        if (list->threads[i].thread > *cookie) {
+            *thread = list->threads[i];
+            *cookie = thread->thread;
+            result = B_OK;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&_proc_lock);
+    return result;
+}
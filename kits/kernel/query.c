@@ -0,0 +1,711 @@
+#include <OS.h>
+#include <fs_attr.h>
+#include <fs_query.h>
+#include <TypeConstants.h>
+
+#include <ctype.h>
+#include <errno.h>
+#include <fnmatch.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "private.h"
+#include "utlist.h"
+#include "index.h"
+
+/* Queries.
+ * A predicate is parsed into a term tree. The planner picks for every
+ * && the cheapest side on an index and for every || all sides, so a
+ * query reads only index ranges: an inode set for ==, the literal
+ * prefix of globs, a bounded scan for < and >. Without such a plan
+ * B_QUERY_NON_INDEXED scans the node table.
+ * Candidates are read from an index in batches under its lock, then
+ * checked one by one against the node and its attributes, so results
+ * are exact even when the index lags behind.
+ */
+#define QUERY_BATCH         256 // candidates read at once
+#define QUERY_MAX_DEPTH     64  // of nested terms
+#define QUERY_NO_PLAN       UINT32_MAX
+
+enum {
+    QUERY_AND,
+    QUERY_OR,
+    QUERY_NOT,
+    QUERY_TERM
+};
+
+enum {
+    QUERY_EQUAL,
+    QUERY_NOT_EQUAL,
+    QUERY_LESS,
+    QUERY_LESS_EQUAL,
+    QUERY_GREATER,
+    QUERY_GREATER_EQUAL
+};
+
+typedef struct _query_term_struct {
+    int32       kind;
+    int32       op;
+    struct _query_term_struct *left;
+    struct _query_term_struct *right;
+    char        *attribute;
+    char        *value;     // unescaped
+    char        *pattern;   // for fnmatch(), or NULL when value has no wildcards
+} _query_term;
+
+/* Keys from start on, up to those starting with end */
+typedef struct {
+    _btree      *tree;
+    bool        nodes;      // node table, inode is in key prefix
+    uint8       start[INDEX_KEY_SIZE];
+    size_t      start_size;
+    uint8       end[INDEX_KEY_SIZE];
+    size_t      end_size;
+} _query_scan;
+
+/* Inodes returned by former scans of a union */
+typedef struct {
+    uint64      *slots;
+    uint32      mask;
+    uint32      count;
+} _query_set;
+
+typedef struct _query_struct {
+    _index_volume *volume;
+    _query_term *root;
+    bool        attributes; // predicate reads attributes
+    _query_scan *scans;
+    int32       scans_count;
+    int32       scan;       // current one
+    uint8       last[INDEX_KEY_SIZE];
+    size_t      last_size;  // 0 before first batch of scan
+    ino_t       nodes[QUERY_BATCH];
+    int32       nodes_count;
+    int32       nodes_index;
+    _query_set  seen;
+    char        path[PATH_MAX]; // of value
+    struct dirent value;
+    struct _query_struct *next;
+    struct _query_struct *prev;
+} _query;
+
+typedef struct {
+    const char  *p;
+    int32       depth;
+} _query_parser;
+
+static pthread_mutex_t _query_lock = PTHREAD_MUTEX_INITIALIZER;
+static _query *_queries = NULL;
+
+static void _query_term_free(_query_term *term)
+{
+    if (!term) return;
+    _query_term_free(term->left);
+    _query_term_free(term->right);
+    free(term->attribute);
+    free(term->value);
+    free(term->pattern);
+    free(term);
+}
+
+static void _query_skip(_query_parser *parser)
+{
+    while (isspace((unsigned char)*parser->p)) parser->p++;
+}
+
+static bool _query_accept(_query_parser *parser, const char *token)
+{
+    _query_skip(parser);
+    size_t length = strlen(token);
+    if (strncmp(parser->p, token, length) != 0) return false;
+    parser->p += length;
+    return true;
+}
+
+/* Reads quoted or bare word, keeping escapes in pattern when asked. */
+static char *_query_word(_query_parser *parser, const char *stops, char **pattern)
+{
+    _query_skip(parser);
+    size_t length = strlen(parser->p);
+    char *word = malloc(length + 1);
+    char *raw = pattern ? malloc(length + 1) : NULL;
+    if (!word || (pattern && !raw)) {
+        free(word);
+        free(raw);
+        return NULL;
+    }
+
+    char quote = (*parser->p == '"' || *parser->p == '\'') ? *parser->p++ : '\0';
+    size_t used = 0, rawUsed = 0;
+    bool wildcards = false;
+    while (*parser->p) {
+        char c = *parser->p;
+        if (quote ? c == quote : (isspace((unsigned char)c) || strchr(stops, c))) break;
+        if (c == '\\' && parser->p[1]) {
+            if (raw) raw[rawUsed++] = c;
+            c = *++parser->p;
+        } else if (c == '*' || c == '?' || c == '[') {
+            wildcards = true;
+        }
+        word[used++] = c;
+        if (raw) raw[rawUsed++] = c;
+        parser->p++;
+    }
+    bool valid = quote ? *parser->p == quote : used > 0; // unterminated, or empty
+    if (quote && valid) parser->p++;
+    word[used] = '\0';
+    if (raw) raw[rawUsed] = '\0';
+
+    if (!valid) {
+        free(word);
+        free(raw);
+        return NULL;
+    }
+    if (pattern) {
+        if (wildcards) *pattern = raw;
+        else free(raw);
+    }
+    return word;
+}
+
+static _query_term *_query_parse_or(_query_parser *parser);
+
+static _query_term *_query_parse_term(_query_parser *parser)
+{
+    static const struct {
+        const char  *token;
+        int32       op;
+    } ops[] = {
+        { "==", QUERY_EQUAL },
+        { "!=", QUERY_NOT_EQUAL },
+        { "<=", QUERY_LESS_EQUAL },
+        { ">=", QUERY_GREATER_EQUAL },
+        { "<", QUERY_LESS },
+        { ">", QUERY_GREATER },
+        { "=", QUERY_EQUAL },
+    };
+
+    _query_term *term = calloc(1, sizeof(_query_term));
+    if (!term) return NULL;
+    term->kind = QUERY_TERM;
+    term->attribute = _query_word(parser, "=!<>()&|", NULL);
+    if (!term->attribute || strlen(term->attribute) > B_ATTR_NAME_LENGTH) {
+        _query_term_free(term);
+        return NULL;
+    }
+
+    size_t i;
+    for (i = 0; i < sizeof(ops) / sizeof(ops[0]); i++) {
+        if (_query_accept(parser, ops[i].token)) break;
+    }
+    if (i == sizeof(ops) / sizeof(ops[0])) {
+        _query_term_free(term);
+        return NULL;
+    }
+    term->op = ops[i].op;
+    term->value = _query_word(parser, "()&|", &term->pattern);
+    if (!term->value) {
+        _query_term_free(term);
+        return NULL;
+    }
+    return term;
+}
+
+static _query_term *_query_parse_unary(_query_parser *parser)
+{
+    if (++parser->depth > QUERY_MAX_DEPTH) return NULL;
+
+    _query_term *term;
+    if (_query_accept(parser, "!")) {
+        _query_term *operand = _query_parse_unary(parser);
+        term = operand ? calloc(1, sizeof(_query_term)) : NULL;
+        if (term) {
+            term->kind = QUERY_NOT;
+            term->left = operand;
+        } else {
+            _query_term_free(operand);
+        }
+    } else if (_query_accept(parser, "(")) {
+        term = _query_parse_or(parser);
+        if (term && !_query_accept(parser, ")")) {
+            _query_term_free(term);
+            term = NULL;
+        }
+    } else {
+        term = _query_parse_term(parser);
+    }
+    parser->depth--;
+    return term;
+}
+
+static _query_term *_query_parse_binary(_query_parser *parser, int32 kind)
+{
+    _query_term *left = kind == QUERY_OR ? _query_parse_binary(parser, QUERY_AND) : _query_parse_unary(parser);
+    while (left && _query_accept(parser, kind == QUERY_OR ? "||" : "&&")) {
+        _query_term *right = kind == QUERY_OR ? _query_parse_binary(parser, QUERY_AND) : _query_parse_unary(parser);
+        _query_term *term = right ? calloc(1, sizeof(_query_term)) : NULL;
+        if (!term) {
+            _query_term_free(left);
+            _query_term_free(right);
+            return NULL;
+        }
+        term->kind = kind;
+        term->left = left;
+        term->right = right;
+        left = term;
+    }
+    return left;
+}
+
+static _query_term *_query_parse_or(_query_parser *parser)
+{
+    return _query_parse_binary(parser, QUERY_OR);
+}
+
+static bool _query_special(const char *attribute)
+{
+    return strcmp(attribute, "name") == 0 || strcmp(attribute, "size") == 0
+           || strcmp(attribute, "last_modified") == 0;
+}
+
+static bool _query_reads_attributes(const _query_term *term)
+{
+    if (!term) return false;
+    if (term->kind == QUERY_TERM) return !_query_special(term->attribute);
+    return _query_reads_attributes(term->left) || _query_reads_attributes(term->right);
+}
+
+static bool _query_is_string(uint32 type)
+{
+    return type == B_STRING_TYPE || type == INDEX_MIME_STRING_TYPE;
+}
+
+static bool _query_is_signed(uint32 type)
+{
+    return type == B_INT8_TYPE || type == B_INT16_TYPE || type == B_INT32_TYPE || type == B_INT64_TYPE
+           || type == B_OFF_T_TYPE || type == B_SSIZE_T_TYPE || type == B_TIME_TYPE;
+}
+
+static bool _query_is_unsigned(uint32 type)
+{
+    return type == B_UINT8_TYPE || type == B_UINT16_TYPE || type == B_UINT32_TYPE || type == B_UINT64_TYPE
+           || type == B_SIZE_T_TYPE || type == B_BOOL_TYPE;
+}
+
+static bool _query_is_real(uint32 type)
+{
+    return type == B_FLOAT_TYPE || type == B_DOUBLE_TYPE;
+}
+
+/* Encodes query value like _index_encode() does attributes of type.
+ * Returns 0 when it is no value of type.
+ */
+static size_t _query_encode(uint32 type, const char *string, uint8 *value)
+{
+    char *end;
+    errno = 0;
+    if (_query_is_string(type)) {
+        return _index_encode(type, string, strlen(string) + 1, value);
+    } else if (_query_is_signed(type)) {
+        int64 number = strtoll(string, &end, 0);
+        return *end || errno ? 0 : _index_encode(B_INT64_TYPE, &number, sizeof(number), value);
+    } else if (_query_is_unsigned(type)) {
+        uint64 number = strtoull(string, &end, 0);
+        return *end || errno ? 0 : _index_encode(B_UINT64_TYPE, &number, sizeof(number), value);
+    } else if (_query_is_real(type)) {
+        double number = strtod(string, &end);
+        return *end || errno ? 0 : _index_encode(B_DOUBLE_TYPE, &number, sizeof(number), value);
+    }
+    return _index_encode(type, string, strlen(string), value);
+}
+
+/* Cost of scanning index for term, with scan filled in when given. */
+static uint32 _query_term_scan(_query *query, const _query_term *term, _query_scan *scan)
+{
+    if (_query_special(term->attribute)) return QUERY_NO_PLAN;
+    _index *index = _index_get(query->volume, term->attribute);
+    if (!index) return QUERY_NO_PLAN;
+
+    uint8 value[INDEX_VALUE_SIZE];
+    size_t size = 0;
+    uint32 cost;
+    bool start = true, end = true;
+    if (term->op == QUERY_NOT_EQUAL) {
+        /* every node having the attribute */
+        start = end = false;
+        cost = 8;
+    } else if (term->pattern && term->op == QUERY_EQUAL && _query_is_string(index->type)) {
+        /* literal prefix of glob */
+        for (const char *p = term->pattern; *p && *p != '*' && *p != '?' && *p != '[' && size < INDEX_MAX_VALUE; p++) {
+            if (*p == '\\' && p[1]) p++;
+            value[size++] = *p;
+        }
+        cost = size ? 2 : 8;
+    } else {
+        size = _query_encode(index->type, term->value, value);
+        if (!size) return QUERY_NO_PLAN;
+        if (term->op == QUERY_LESS || term->op == QUERY_LESS_EQUAL) start = false;
+        if (term->op == QUERY_GREATER || term->op == QUERY_GREATER_EQUAL) end = false;
+        cost = start && end ? 1 : 4;
+    }
+
+    if (scan) {
+        scan->tree = &index->tree;
+        scan->nodes = false;
+        scan->start[0] = scan->end[0] = INDEX_KEY_VALUE;
+        scan->start_size = scan->end_size = 1;
+        if (start) {
+            memcpy(scan->start + 1, value, size);
+            scan->start_size += size;
+        }
+        if (end) {
+            memcpy(scan->end + 1, value, size);
+            scan->end_size += size;
+        }
+    }
+    return cost;
+}
+
+static uint32 _query_cost(_query *query, const _query_term *term)
+{
+    uint32 left, right;
+    switch (term->kind) {
+    case QUERY_AND:
+        left = _query_cost(query, term->left);
+        right = _query_cost(query, term->right);
+        return min_c(left, right);
+    case QUERY_OR:
+        left = _query_cost(query, term->left);
+        right = _query_cost(query, term->right);
+        return left == QUERY_NO_PLAN || right == QUERY_NO_PLAN ? QUERY_NO_PLAN : left + right;
+    case QUERY_TERM:
+        return _query_term_scan(query, term, NULL);
+    default:
+        return QUERY_NO_PLAN;
+    }
+}
+
+/* Appends scans of planned term, which has a plan. */
+static status_t _query_plan(_query *query, const _query_term *term)
+{
+    if (term->kind == QUERY_AND) {
+        return _query_plan(query, _query_cost(query, term->left) <= _query_cost(query, term->right)
+                                  ? term->left : term->right);
+    } else if (term->kind == QUERY_OR) {
+        status_t result = _query_plan(query, term->left);
+        return result == B_OK ? _query_plan(query, term->right) : result;
+    }
+
+    _query_scan *scans = realloc(query->scans, (query->scans_count + 1) * sizeof(_query_scan));
+    if (!scans) return B_NO_MEMORY;
+    query->scans = scans;
+    _query_term_scan(query, term, &scans[query->scans_count++]);
+    return B_OK;
+}
+
+/* Adds node, false when it was in set already. */
+static bool _query_set_add(_query_set *set, uint64 node)
+{
+    if ((set->count + 1) * 2 > set->mask) {
+        uint32 mask = set->mask ? set->mask * 2 + 1 : 255;
+        uint64 *slots = calloc(mask + 1, sizeof(uint64));
+        if (!slots) return true; // returned twice at worst
+        for (uint32 i = 0; set->slots && i <= set->mask; i++) {
+            if (!set->slots[i]) continue;
+            uint32 j = set->slots[i] * 0x9E3779B97F4A7C15ULL >> 32 & mask;
+            while (slots[j]) j = (j + 1) & mask;
+            slots[j] = set->slots[i];
+        }
+        free(set->slots);
+        set->slots = slots;
+        set->mask = mask;
+    }
+
+    uint32 i = node * 0x9E3779B97F4A7C15ULL >> 32 & set->mask;
+    for (; set->slots[i]; i = (i + 1) & set->mask) {
+        if (set->slots[i] == node) return false;
+    }
+    set->slots[i] = node;
+    set->count++;
+    return true;
+}
+
+/* Reads next batch of candidates, none when all scans are done. */
+static void _query_fetch(_query *query)
+{
+    query->nodes_count = query->nodes_index = 0;
+    while (query->nodes_count == 0 && query->scan < query->scans_count) {
+        _query_scan *scan = &query->scans[query->scan];
+        if (_btree_lock(scan->tree, false) != B_OK) {
+            query->scan++;
+            query->last_size = 0;
+            continue;
+        }
+
+        _btree_cursor cursor;
+        if (query->last_size) _btree_seek(scan->tree, &cursor, query->last, query->last_size);
+        else _btree_seek(scan->tree, &cursor, scan->start, scan->start_size);
+
+        bool done = true;
+        const void *key, *value;
+        size_t keySize, valueSize;
+        while (_btree_get(scan->tree, &cursor, &key, &keySize, &value, &valueSize)) {
+            if (memcmp(key, scan->end, min_c(keySize, scan->end_size)) > 0) break;
+            bool last = keySize == query->last_size && memcmp(key, query->last, keySize) == 0;
+            if (!last) {
+                if (query->nodes_count == QUERY_BATCH) {
+                    done = false;
+                    break;
+                }
+                if (scan->nodes && keySize == INDEX_NODE_KEY_SIZE)
+                    query->nodes[query->nodes_count++] = _index_key_node((const uint8 *)key + 1);
+                else if (!scan->nodes && keySize >= 1 + sizeof(uint64))
+                    query->nodes[query->nodes_count++] = _index_key_node((const uint8 *)key + keySize - sizeof(uint64));
+                memcpy(query->last, key, keySize);
+                query->last_size = keySize;
+            }
+            _btree_next(scan->tree, &cursor);
+        }
+        _btree_unlock(scan->tree);
+
+        if (done) {
+            query->scan++;
+            query->last_size = 0;
+        }
+    }
+}
+
+static int _query_compare(uint32 type, const void *data, size_t size, const char *string)
+{
+    if (_query_is_string(type)) {
+        size_t length = strnlen(data, size);
+        int result = strncmp(data, string, length);
+        return result ? result : (string[length] ? -1 : 0);
+    } else if (_query_is_signed(type)) {
+        int64 a, b = strtoll(string, NULL, 0);
+        if (!_index_read_signed(data, size, &a)) return -2;
+        return a < b ? -1 : a > b;
+    } else if (_query_is_unsigned(type)) {
+        uint64 a, b = strtoull(string, NULL, 0);
+        if (!_index_read_unsigned(data, size, &a)) return -2;
+        return a < b ? -1 : a > b;
+    } else if (_query_is_real(type)) {
+        double a, b = strtod(string, NULL);
+        if (size == sizeof(float)) a = *(const float *)data;
+        else if (size == sizeof(double)) a = *(const double *)data;
+        else return -2;
+        return a < b ? -1 : a > b;
+    }
+    size_t length = strlen(string);
+    int result = memcmp(data, string, min_c(size, length));
+    return result ? result : (size < length ? -1 : size > length);
+}
+
+static bool _query_match(const _query_term *term, const char *name, const struct stat *st,
+                         const fs_attr_entry *entries, ssize_t count)
+{
+    switch (term->kind) {
+    case QUERY_AND:
+        return _query_match(term->left, name, st, entries, count)
+               && _query_match(term->right, name, st, entries, count);
+    case QUERY_OR:
+        return _query_match(term->left, name, st, entries, count)
+               || _query_match(term->right, name, st, entries, count);
+    case QUERY_NOT:
+        return !_query_match(term->left, name, st, entries, count);
+    }
+
+    uint32 type;
+    const void *data;
+    size_t size;
+    int64 number;
+    if (strcmp(term->attribute, "name") == 0) {
+        type = B_STRING_TYPE;
+        data = name;
+        size = strlen(name);
+    } else if (strcmp(term->attribute, "size") == 0 || strcmp(term->attribute, "last_modified") == 0) {
+        number = term->attribute[0] == 's' ? st->st_size : st->st_mtime;
+        type = B_INT64_TYPE;
+        data = &number;
+        size = sizeof(number);
+    } else {
+        ssize_t i;
+        for (i = 0; i < count && strcmp(entries[i].name, term->attribute) != 0; i++) {}
+        if (i == count) return false; // nodes without attribute never match
+        type = entries[i].type;
+        data = entries[i].data;
+        size = entries[i].size;
+    }
+
+    if (term->pattern && _query_is_string(type) && (term->op == QUERY_EQUAL || term->op == QUERY_NOT_EQUAL)) {
+        char string[INDEX_MAX_VALUE * 4 + 1];
+        size_t length = min_c(strnlen(data, size), sizeof(string) - 1);
+        memcpy(string, data, length);
+        string[length] = '\0';
+        return (fnmatch(term->pattern, string, 0) == 0) == (term->op == QUERY_EQUAL);
+    }
+
+    int result = _query_compare(type, data, size, term->value);
+    if (result == -2) return false;
+    switch (term->op) {
+    case QUERY_EQUAL: return result == 0;
+    case QUERY_NOT_EQUAL: return result != 0;
+    case QUERY_LESS: return result < 0;
+    case QUERY_LESS_EQUAL: return result <= 0;
+    case QUERY_GREATER: return result > 0;
+    default: return result >= 0;
+    }
+}
+
+/* Checks candidate against the node itself. */
+static bool _query_check(_query *query, ino_t node)
+{
+    _index_volume *volume = query->volume;
+    struct stat st;
+    if (node == volume->root_node
+        || _index_node_path(volume, node, query->path, sizeof(query->path)) != B_OK
+        || lstat(query->path, &st) < 0 || st.st_ino != node || st.st_dev != volume->device)
+        return false;
+
+    fs_attr_entry *entries = NULL;
+    ssize_t count = 0;
+    if (query->attributes) {
+        count = _attr_read_path(query->path, &entries);
+        if (count < 0) count = 0;
+    }
+    const char *name = strrchr(query->path, '/') + 1;
+    bool match = _query_match(query->root, name, &st, entries, count);
+    free(entries);
+    if (!match) return false;
+
+    query->value.d_ino = node;
+    query->value.d_off = 0;
+    query->value.d_reclen = sizeof(struct dirent);
+    query->value.d_type = IFTODT(st.st_mode);
+    snprintf(query->value.d_name, sizeof(query->value.d_name), "%s", name);
+    return true;
+}
+
+static void _query_free(_query *query)
+{
+    _query_term_free(query->root);
+    free(query->scans);
+    free(query->seen.slots);
+    free(query);
+}
+
+DIR *fs_open_query(dev_t device, const char *predicate, uint32 flags)
+{
+    if (!predicate) {
+        errno = B_BAD_VALUE;
+        return NULL;
+    }
+    if (flags & B_LIVE_QUERY) {
+        errno = B_NOT_SUPPORTED;
+        return NULL;
+    }
+
+    _query *query = calloc(1, sizeof(_query));
+    if (!query) {
+        errno = B_NO_MEMORY;
+        return NULL;
+    }
+    _query_parser parser = { predicate, 0 };
+    query->root = _query_parse_or(&parser);
+    _query_skip(&parser);
+    if (!query->root || *parser.p) {
+        _query_free(query);
+        errno = B_BAD_VALUE;
+        return NULL;
+    }
+    query->attributes = _query_reads_attributes(query->root);
+
+    query->volume = _index_volume_get(device);
+    if (!query->volume) {
+        status_t result = errno;
+        _query_free(query);
+        errno = result;
+        return NULL;
+    }
+
+    status_t result = B_OK;
+    if (_query_cost(query, query->root) != QUERY_NO_PLAN) {
+        result = _query_plan(query, query->root);
+    } else if (flags & B_QUERY_NON_INDEXED) {
+        query->scans = calloc(1, sizeof(_query_scan));
+        if (query->scans) {
+            query->scans_count = 1;
+            query->scans->tree = &query->volume->nodes;
+            query->scans->nodes = true;
+            query->scans->start[0] = query->scans->end[0] = INDEX_KEY_NODE;
+            query->scans->start_size = query->scans->end_size = 1;
+        } else {
+            result = B_NO_MEMORY;
+        }
+    } else {
+        result = B_BAD_INDEX;
+    }
+    if (result != B_OK) {
+        _query_free(query);
+        errno = result;
+        return NULL;
+    }
+
+    pthread_mutex_lock(&_query_lock);
+    DL_APPEND(_queries, query);
+    pthread_mutex_unlock(&_query_lock);
+    return (DIR *)query;
+}
+
+int fs_close_query(DIR *d)
+{
+    if (!d) {
+        errno = B_BAD_VALUE;
+        return -1;
+    }
+    _query *query = (_query *)d;
+    pthread_mutex_lock(&_query_lock);
+    DL_DELETE(_queries, query);
+    pthread_mutex_unlock(&_query_lock);
+    _query_free(query);
+    return 0;
+}
+
+struct dirent *fs_read_query(DIR *d)
+{
+    if (!d) {
+        errno = B_BAD_VALUE;
+        return NULL;
+    }
+    _query *query = (_query *)d;
+    for (;;) {
+        if (query->nodes_index == query->nodes_count) {
+            _query_fetch(query);
+            if (!query->nodes_count) return NULL;
+        }
+        ino_t node = query->nodes[query->nodes_index++];
+        if (query->scans_count > 1 && !_query_set_add(&query->seen, node)) continue;
+        if (_query_check(query, node)) return &query->value;
+    }
+}
+
+status_t get_path_for_dirent(struct dirent *dent, char *buf, size_t len)
+{
+    if (!dent || !buf) return B_BAD_VALUE;
+
+    status_t result = B_BAD_VALUE;
+    pthread_mutex_lock(&_query_lock);
+    _query *query;
+    DL_FOREACH(_queries, query) {
+        if (&query->value == dent) {
+            result = strlen(query->path) < len ? B_OK : B_BUFFER_OVERFLOW;
+            if (result == B_OK) strcpy(buf, query->path);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&_query_lock);
+    return result;
+}
@@ -0,0 +1,210 @@
+#include <OS.h>
+
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/mman.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include "private.h"
+
+/* Flight recorder.
+ * Every thread writes fixed size records into a ring of its own, so a
+ * record is a timestamp and a few stores without locks or atomic read-
+ * modify-writes; the head is published with a release store. Readers copy
+ * a ring and drop the records the writer may have overwritten meanwhile.
+ * Rings are never freed: a thread that exits leaves its ring, and its
+ * records, to the next thread that starts recording.
+ * Records are stamped with the raw cycle counter, and converted to
+ * system_time() microseconds when read against a pair of readings taken
+ * when recording started, so recording costs no clock call.
+ */
+#define RECORDER_RING_SIZE  512     // records per thread, power of two
+#define RECORDER_RING_MASK  (RECORDER_RING_SIZE - 1)
+
+typedef struct _recorder_ring_struct {
+    thread_id   owner;  // 0 if free
+    uint64      head;   // records written
+    struct _recorder_ring_struct *next;
+    flight_record records[RECORDER_RING_SIZE];
+} _recorder_ring;
+
+#if defined(__x86_64__) || defined(__i386__)
+#define _recorder_ticks() ((int64)__rdtsc())
+#elif defined(__aarch64__)
+static inline int64 _recorder_ticks(void)
+{
+    uint64 ticks;
+    __asm__ volatile ("mrs %0, cntvct_el0" : "=r"(ticks));
+    return ticks;
+}
+#else
+#define _recorder_ticks() system_time()
+#endif
+
+int32 _flight_recording = 1;
+
+static _recorder_ring *_recorder_rings = NULL; // push only
+static __thread _recorder_ring *_recorder_self;
+static pthread_key_t _recorder_key;
+static pthread_once_t _recorder_once = PTHREAD_ONCE_INIT;
+static int64 _recorder_base_ticks;
+static bigtime_t _recorder_base_usecs;
+
+static void _recorder_detach(void *data)
+{
+    _recorder_ring *ring = data;
+    __atomic_store_n(&ring->owner, 0, __ATOMIC_RELEASE);
+}
+
+/* CLOCK_MONOTONIC is system_time() of B_MONOTONIC_CLOCK_SOURCE, and is
+ * safe in the crash handler. */
+static bigtime_t _recorder_usecs(void)
+{
+    struct timespec tm;
+    clock_gettime(CLOCK_MONOTONIC, &tm);
+    return tm.tv_sec * 1000000 + tm.tv_nsec / 1000;
+}
+
+static void _recorder_init(void)
+{
+    _recorder_base_usecs = _recorder_usecs();
+    _recorder_base_ticks = _recorder_ticks();
+    pthread_key_create(&_recorder_key, _recorder_detach);
+}
+
+/* Converts stamps of records to microseconds, with the rate since recording started. */
+static void _recorder_convert(flight_record *records, size_t count)
+{
+    bigtime_t now = _recorder_usecs();
+    int64 ticks = _recorder_ticks();
+    int64 elapsed = ticks - _recorder_base_ticks;
+    if (elapsed <= 0) return;
+    for (size_t i = 0; i < count; i++)
+        records[i].time = now - (bigtime_t)((__int128)(ticks - records[i].time) * (now - _recorder_base_usecs) / elapsed);
+}
+
+static _recorder_ring *_recorder_attach(void)
+{
+    pthread_once(&_recorder_once, _recorder_init);
+    thread_id self = find_thread(NULL);
+
+    _recorder_ring *ring;
+    for (ring = __atomic_load_n(&_recorder_rings, __ATOMIC_ACQUIRE); ring; ring = ring->next) {
+        if (!ring->owner && cmpxchg(&ring->owner, 0, self) == 0) break;
+    }
+
+    if (!ring) {
+        ring = mmap(NULL, sizeof(_recorder_ring), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (ring == MAP_FAILED) return NULL;
+        ring->owner = self;
+        ring->next = __atomic_load_n(&_recorder_rings, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&_recorder_rings, &ring->next, ring, true,
+                                            __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    }
+
+    pthread_setspecific(_recorder_key, ring);
+    _recorder_self = ring;
+    return ring;
+}
+
+void set_flight_recording(bool enabled)
+{
+    __atomic_store_n(&_flight_recording, enabled ? 1 : 0, __ATOMIC_RELAXED);
+}
+
+void record_event(uint32 event, int64 arg0, int64 arg1)
+{
+    if (unlikely(!__atomic_load_n(&_flight_recording, __ATOMIC_RELAXED))) return;
+
+    _recorder_ring *ring = _recorder_self;
+    if (unlikely(!ring) && !(ring = _recorder_attach())) return;
+
+    uint64 head = ring->head;
+    flight_record *record = &ring->records[head & RECORDER_RING_MASK];
+    record->time = _recorder_ticks();
+    record->thread = ring->owner;
+    record->event = event;
+    record->args[0] = arg0;
+    record->args[1] = arg1;
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+/* Copies records of ring oldest first, returns how many are intact. */
+static size_t _recorder_copy(_recorder_ring *ring, flight_record *records)
+{
+    uint64 head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    uint64 first = head > RECORDER_RING_SIZE ? head - RECORDER_RING_SIZE : 0;
+    for (uint64 i = first; i < head; i++) records[i - first] = ring->records[i & RECORDER_RING_MASK];
+
+    /* the writer may be overwriting the one after its head */
+    uint64 now = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    uint64 intact = now >= RECORDER_RING_SIZE ? now - RECORDER_RING_SIZE + 1 : 0;
+    if (intact <= first) return head - first;
+    if (intact >= head) return 0;
+    memmove(records, records + (intact - first), (head - intact) * sizeof(flight_record));
+    return head - intact;
+}
+
+static int _recorder_compare(const void *a, const void *b)
+{
+    bigtime_t ta = ((const flight_record *)a)->time, tb = ((const flight_record *)b)->time;
+    return ta < tb ? -1 : ta > tb;
+}
+
+ssize_t get_flight_records(flight_record *records, size_t count)
+{
+    if (!records) return B_BAD_VALUE;
+
+    size_t rings = 0;
+    _recorder_ring *ring;
+    for (ring = __atomic_load_n(&_recorder_rings, __ATOMIC_ACQUIRE); ring; ring = ring->next) rings++;
+    flight_record *all = malloc((rings ? rings : 1) * RECORDER_RING_SIZE * sizeof(flight_record));
+    if (!all) return B_NO_MEMORY;
+
+    /* rings pushed meanwhile are not counted, and not copied */
+    size_t copied = 0;
+    ring = __atomic_load_n(&_recorder_rings, __ATOMIC_ACQUIRE);
+    for (size_t i = 0; ring && i < rings; ring = ring->next, i++)
+        copied += _recorder_copy(ring, all + copied);
+
+    /* latest count records, oldest first */
+    qsort(all, copied, sizeof(flight_record), _recorder_compare);
+    count = min_c(count, copied);
+    memcpy(records, all + copied - count, count * sizeof(flight_record));
+    free(all);
+    _recorder_convert(records, count);
+    return count;
+}
+
+/* No allocations, so the crash handler can call it. */
+status_t dump_flight_records(int fd)
+{
+    bigtime_t now = _recorder_usecs();
+    _recorder_ring *ring;
+    for (ring = __atomic_load_n(&_recorder_rings, __ATOMIC_ACQUIRE); ring; ring = ring->next) {
+        uint64 head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        if (!head) continue;
+        dprintf(fd, "flight records of thread %d%s:\n", (int)ring->owner, ring->owner ? "" : " (exited)");
+
+        /* one at a time, the oldest may be overwritten while printing */
+        uint64 first = head > RECORDER_RING_SIZE ? head - RECORDER_RING_SIZE : 0;
+        for (uint64 i = first; i < head; i++) {
+            flight_record record = ring->records[i & RECORDER_RING_MASK];
+            uint64 written = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+            if (written >= RECORDER_RING_SIZE && i <= written - RECORDER_RING_SIZE) continue;
+            _recorder_convert(&record, 1);
+
+            char event[11];
+            sprint_code(event, &record.event);
+            dprintf(fd, "  %+" PRId64 " us %5d %s %" PRId64 " %" PRId64 "\n", record.time - now,
+                    (int)record.thread, event, record.args[0], record.args[1]);
+        }
+    }
+    return B_OK;
+}
@@ -1,50 +1,113 @@
 #include <stddef.h>
+#include <limits.h>
 #include <unistd.h>
 #include <sys/syscall.h>
 #include <linux/futex.h>
 #include "private.h"
+#include "rwlock.h"
 
-const static unsigned _rwlock_OPEN = 1;
-const static unsigned _rwlock_WLOCKED = 0;
+#define RWLOCK_SPIN 100
 
-void _rwlock_unlock(unsigned *_rwlock_lock)
+static uint32 _rwlock_next_shard = 0;
+/* shard + 1 of current thread, 0 until first read lock */
+static __thread uint32 _rwlock_thread_shard;
+/* address of it identifies write lock holder */
+static __thread char _rwlock_self;
+
+static inline void _rwlock_futex_wait(uint32 *word, uint32 value)
 {
-    unsigned current, wanted;
-    do {
-        current = *_rwlock_lock;
-        if (current == _rwlock_OPEN) return;
-        if (current == _rwlock_WLOCKED) {
-            wanted = _rwlock_OPEN;
-        } else {
-            wanted = current - 1;
-        }
-    } while (cmpxchg(_rwlock_lock, current, wanted) != current);
-    syscall(SYS_futex, _rwlock_lock, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+    syscall(SYS_futex, word, FUTEX_WAIT_PRIVATE, value, NULL, NULL, 0);
+}
+
+static inline void _rwlock_futex_wake(uint32 *word, int count)
+{
+    syscall(SYS_futex, word, FUTEX_WAKE_PRIVATE, count, NULL, NULL, 0);
+}
+
+static inline uint32 *_rwlock_readers(_rwlock *lock)
+{
+    uint32 shard = _rwlock_thread_shard;
+    if (unlikely(!shard)) {
+        shard = (atomic_add(&_rwlock_next_shard, 1) - 1) % RWLOCK_SHARDS + 1;
+        _rwlock_thread_shard = shard;
+    }
+    return &lock->shards[shard - 1].readers;
 }
 
-void _rwlock_rlock(unsigned *_rwlock_lock)
+static inline void _rwlock_read_done(_rwlock *lock, uint32 *readers)
 {
-    unsigned current;
-    while ((current = *_rwlock_lock) == _rwlock_WLOCKED || cmpxchg(_rwlock_lock, current, current + 1) != current) {
-        while (syscall(SYS_futex, _rwlock_lock, FUTEX_WAIT_PRIVATE, current, NULL, NULL, 0) != 0) {
-            cpu_relax();
-            if (*_rwlock_lock >= _rwlock_OPEN) break;
+    /* last reader of the shard lets pending writer proceed */
+    if (atomic_sub(readers, 1) == 0 && __atomic_load_n(&lock->writer, __ATOMIC_ACQUIRE)) {
+        _rwlock_futex_wake(readers, 1);
+    }
+}
+
+static void _rwlock_wait_writer(_rwlock *lock)
+{
+    for (int i = 0; i < RWLOCK_SPIN; i++) {
+        if (!__atomic_load_n(&lock->writer, __ATOMIC_ACQUIRE)) return;
+        cpu_relax();
+    }
+
+    uint32 writer;
+    while ((writer = __atomic_load_n(&lock->writer, __ATOMIC_ACQUIRE)) != 0) {
+        /* mark sleepers so write unlock wakes us */
+        if (writer == 1 && cmpxchg(&lock->writer, 1, 2) != 1) continue;
+        _rwlock_futex_wait(&lock->writer, 2);
+    }
+}
+
+void _rwlock_unlock(_rwlock *lock)
+{
+    if (lock->owner == &_rwlock_self) {
+        lock->owner = NULL;
+        if (__atomic_exchange_n(&lock->writer, 0, __ATOMIC_RELEASE) == 2) {
+            /* bulk wake of readers and writers */
+            _rwlock_futex_wake(&lock->writer, INT_MAX);
         }
-        // will be able to acquire rlock no matter what unlock woke us
+        return;
     }
+
+    _rwlock_read_done(lock, _rwlock_readers(lock));
 }
 
-void _rwlock_wlock(unsigned *_rwlock_lock)
+void _rwlock_rlock(_rwlock *lock)
 {
-    unsigned current;
-    while ((current = cmpxchg(_rwlock_lock, _rwlock_OPEN, _rwlock_WLOCKED)) != _rwlock_OPEN) {
-        while (syscall(SYS_futex, _rwlock_lock, FUTEX_WAIT_PRIVATE, current, NULL, NULL, 0) != 0) {
-            cpu_relax();
-            if (*_rwlock_lock == _rwlock_OPEN) break;
+    uint32 *readers = _rwlock_readers(lock);
+    for (;;) {
+        atomic_add(readers, 1);
+        if (likely(__atomic_load_n(&lock->writer, __ATOMIC_ACQUIRE) == 0)) return;
+
+        /* writer is pending or holds the lock, back off so it can drain */
+        _rwlock_read_done(lock, readers);
+        _rwlock_wait_writer(lock);
+    }
+}
+
+void _rwlock_wlock(_rwlock *lock)
+{
+    /* mutex from "Futexes Are Tricky", 2 means there may be sleepers */
+    uint32 writer = cmpxchg(&lock->writer, 0, 1);
+    if (writer != 0) {
+        if (writer != 2) writer = __atomic_exchange_n(&lock->writer, 2, __ATOMIC_SEQ_CST);
+        while (writer != 0) {
+            _rwlock_futex_wait(&lock->writer, 2);
+            writer = __atomic_exchange_n(&lock->writer, 2, __ATOMIC_SEQ_CST);
         }
-        if (*_rwlock_lock != _rwlock_OPEN) {
-            // in rlock - won't be able to acquire lock - wake someone else
-            syscall(SYS_futex, _rwlock_lock, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+    }
+    lock->owner = &_rwlock_self;
+
+    /* new readers see the writer word and back off, wait for the rest */
+    for (int i = 0; i < RWLOCK_SHARDS; i++) {
+        uint32 *readers = &lock->shards[i].readers;
+        uint32 count;
+        int spin = 0;
+        while ((count = __atomic_load_n(readers, __ATOMIC_ACQUIRE)) != 0) {
+            if (spin++ < RWLOCK_SPIN) {
+                cpu_relax();
+                continue;
+            }
+            _rwlock_futex_wait(readers, count);
         }
     }
 }
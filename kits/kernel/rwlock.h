@@ -1,9 +1,33 @@
-void _rwlock_unlock(unsigned *_rwlock_lock);
-void _rwlock_rlock(unsigned *_rwlock_lock);
-void _rwlock_wlock(unsigned *_rwlock_lock);
+#include <SupportDefs.h>
+
+/* Reader-writer lock with reader counts sharded over cache lines, so
+ * read locking does not bounce one line across all cores. Each thread
+ * always counts itself in the same shard.
+ * Writers are serialized on the writer word and have preference: while
+ * it is set new readers back off and sleep on it, and write unlock wakes
+ * them all at once. Read locks must not nest, a pending writer would
+ * deadlock the inner one.
+ */
+#define RWLOCK_SHARDS 32
+
+typedef struct {
+    uint32      readers; // futex
+} __attribute__((aligned(64))) _rwlock_shard;
+
+typedef struct {
+    struct {
+        uint32  writer; // futex: 0 free, 1 write locked, 2 with sleepers
+        void    *owner; // write lock holder
+    } __attribute__((aligned(64)));
+    _rwlock_shard shards[RWLOCK_SHARDS];
+} _rwlock;
+
+void _rwlock_unlock(_rwlock *lock);
+void _rwlock_rlock(_rwlock *lock);
+void _rwlock_wlock(_rwlock *lock);
 
 #define RWLOCK(name) \
-    static unsigned name ## _lock = 1; \
+    static _rwlock name ## _lock; \
     inline static void name ## _unlock() { _rwlock_unlock(& name ## _lock); } \
     inline static void name ## _rlock()  { _rwlock_rlock (& name ## _lock); } \
     inline static void name ## _wlock()  { _rwlock_wlock (& name ## _lock); }
@@ -1,6 +1,8 @@
 #include <OS.h>
 
 #include <stdlib.h>
+#include <stdio.h>
+#include <inttypes.h>
 #include <errno.h>
 #include <string.h>
 #include <time.h>
@@ -11,13 +13,291 @@
 #include <sched.h>
 #include <pthread.h>
 #include <linux/futex.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <signal.h>
 #include <assert.h>
 
+#include <trace.h>
+
 #include "private.h"
+#include "utlist.h"
+#include "rwlock.h"
+#include "idhash.h"
+
+/* Shared semaphores live in an arena shared by teams of one user in one
+ * pid namespace, so team ids in its slots mean the same to all of them.
+ * Their sem_id is slot index + 1. Private semaphores are malloc'd, so their
+ * ids are pointers and never fall into the slot range.
+ */
+#define SEM_ARENA_PATH      "/dev/shm/libbe-sem-%u-%lu" /* uid, pid namespace */
+#define SEM_ARENA_SLOTS     4096
+/* slot team while being created or deleted, 0 is a free slot */
+#define SEM_SLOT_BUSY       (-1)
+
+typedef struct {
+    uint32      hint; // where to look for a free slot
+    _sem_info   sems[SEM_ARENA_SLOTS];
+} _sem_arena;
+
+static _sem_arena *_sem_arena_base = NULL;
+static pthread_once_t _sem_arena_once = PTHREAD_ONCE_INIT;
+
+static void _sem_arena_attach(void)
+{
+    struct stat st;
+    if (stat("/proc/self/ns/pid", &st) < 0) return;
+
+    char path[64];
+    uid_t uid = geteuid();
+    snprintf(path, sizeof(path), SEM_ARENA_PATH, (unsigned)uid, (unsigned long)st.st_ino);
+    int fd = open(path, O_RDWR | O_CREAT | O_NOFOLLOW | O_CLOEXEC, 0600);
+    if (fd < 0) return;
+
+    /* don't trust an arena planted by someone else */
+    void *address = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_uid == uid
+        && (st.st_mode & 0077) == 0) {
+        /* new arena is zero filled, so every slot starts free */
+        if (st.st_size >= (off_t)sizeof(_sem_arena) || ftruncate(fd, sizeof(_sem_arena)) == 0)
+            address = mmap(NULL, sizeof(_sem_arena), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    if (address == MAP_FAILED) return;
+
+    _sem_arena_base = address;
+}
+
+static _sem_arena *_get_sem_arena(void)
+{
+    pthread_once(&_sem_arena_once, _sem_arena_attach);
+    return _sem_arena_base;
+}
+
+static inline bool _sem_is_shared(sem_id sem)
+{
+    /* sem 0 wraps around and is not shared */
+    return sem - 1 < SEM_ARENA_SLOTS;
+}
+
+static inline int _sem_futex_flags(sem_id sem)
+{
+    return _sem_is_shared(sem) ? 0 : FUTEX_PRIVATE_FLAG;
+}
+
+/* arena never spans pid namespaces, so team is a pid here */
+static inline bool _sem_team_alive(team_id team)
+{
+    return kill(team, 0) == 0 || errno != ESRCH;
+}
+
+static _sem_info *_get_sem(sem_id sem)
+{
+    if (likely(!_sem_is_shared(sem))) return (_sem_info *)sem;
+
+    _sem_arena *arena = _get_sem_arena();
+    if (!arena) return NULL;
+
+    _sem_info *info = &arena->sems[sem - 1];
+    if (__atomic_load_n(&info->team, __ATOMIC_ACQUIRE) <= 0) return NULL;
+    return info;
+}
+
+static sem_id _create_shared_sem(uint32 thread_count, const char *name)
+{
+    _sem_arena *arena = _get_sem_arena();
+    if (!arena) return B_NO_MORE_SEMS;
+
+    uint32 hint = arena->hint;
+    for (uint32 i = 0; i < SEM_ARENA_SLOTS; i++) {
+        uint32 slot = (hint + i) % SEM_ARENA_SLOTS;
+        _sem_info *info = &arena->sems[slot];
+
+        /* slots of teams that died without deleting them are free too */
+        team_id team = info->team;
+        if (team == SEM_SLOT_BUSY) continue;
+        if (team != 0 && _sem_team_alive(team)) continue;
+        if (cmpxchg(&info->team, team, SEM_SLOT_BUSY) != team) continue;
+
+        COPY_OS_NAME_LENGTH(info->name, name);
+        info->count = thread_count;
+        info->spin = 0;
+        info->latest_holder = 0;
+        __atomic_store_n(&info->team, _info->team, __ATOMIC_RELEASE);
+
+        arena->hint = slot + 1;
+        return slot + 1;
+    }
+
+    return B_NO_MORE_SEMS;
+}
+
+/* Contention profiling, records live in this team only and are keyed by
+ * sem_id, so shared semaphores are profiled per team.
+ */
+int32 _sem_profiling = 0;
+
+typedef struct _sem_profile_struct {
+    sem_id      sem;
+    char        name[B_OS_NAME_LENGTH];
+    int64       acquisitions;
+    int64       contended;
+    bigtime_t   wait_time;
+    bigtime_t   hold_time;
+    bigtime_t   acquired; // latest acquire, hold time is measured from it
+    int64       wait_histogram[B_SEM_PROFILE_BUCKETS];
+    int64       hold_histogram[B_SEM_PROFILE_BUCKETS];
+    uint32      holder;
+    thread_id   holders[B_SEM_PROFILE_HOLDERS];
+    struct _sem_profile_struct *next;
+    struct _sem_profile_struct *prev;
+} _sem_profile;
+
+static _sem_profile *_sem_profiles = NULL;
+static _idhash _sem_profiles_index;
+RWLOCK(_sem_profiles)
+
+/* bucket n counts times in [2^(n-1), 2^n) microseconds */
+static inline int _sem_profile_bucket(bigtime_t time)
+{
+    if (time <= 0) return 0;
+    int bucket = 64 - __builtin_clzll(time);
+    return bucket < B_SEM_PROFILE_BUCKETS ? bucket : B_SEM_PROFILE_BUCKETS - 1;
+}
+
+/* returns profile with _sem_profiles read locked, unlock in caller function! */
+static _sem_profile *_sem_profile_rlock(sem_id sem)
+{
+    _sem_profiles_rlock();
+    _sem_profile *profile = _idhash_find(&_sem_profiles_index, sem);
+    if (profile) return profile;
+    _sem_profiles_unlock();
+
+    const _sem_info *info = _get_sem(sem);
+    if (!info) return NULL;
+
+    profile = calloc(1, sizeof(_sem_profile));
+    if (!profile) return NULL;
+    profile->sem = sem;
+    COPY_OS_NAME_LENGTH(profile->name, info->name);
+
+    _sem_profiles_wlock();
+    if (_idhash_find(&_sem_profiles_index, sem)
+        || _idhash_insert(&_sem_profiles_index, sem, profile) != B_OK) {
+        free(profile);
+    } else {
+        DL_APPEND(_sem_profiles, profile);
+    }
+    _sem_profiles_unlock();
+
+    _sem_profiles_rlock();
+    profile = _idhash_find(&_sem_profiles_index, sem);
+    if (!profile) _sem_profiles_unlock();
+    return profile;
+}
+
+static void _sem_profile_remove(sem_id sem)
+{
+    _sem_profiles_wlock();
+    _sem_profile *profile = _idhash_remove(&_sem_profiles_index, sem);
+    if (profile) DL_DELETE(_sem_profiles, profile);
+    _sem_profiles_unlock();
+    free(profile);
+}
+
+void _sem_profile_acquired(sem_id sem, bool contended, bigtime_t wait)
+{
+    _sem_profile *profile = _sem_profile_rlock(sem);
+    if (!profile) return;
+
+    atomic_add(&profile->acquisitions, 1);
+    if (contended) atomic_add(&profile->contended, 1);
+    atomic_add(&profile->wait_time, wait);
+    atomic_add(&profile->wait_histogram[_sem_profile_bucket(wait)], 1);
+    profile->acquired = system_time();
+    uint32 holder = atomic_xadd(&profile->holder, 1);
+    profile->holders[holder % B_SEM_PROFILE_HOLDERS] = _info->tid;
+
+    _sem_profiles_unlock();
+}
+
+void _sem_profile_released(sem_id sem)
+{
+    _sem_profile *profile = _sem_profile_rlock(sem);
+    if (!profile) return;
+
+    bigtime_t acquired = profile->acquired;
+    if (acquired) {
+        bigtime_t hold = system_time() - acquired;
+        atomic_add(&profile->hold_time, hold);
+        atomic_add(&profile->hold_histogram[_sem_profile_bucket(hold)], 1);
+    }
+
+    _sem_profiles_unlock();
+}
+
+void set_sem_profiling(bool enabled)
+{
+    __atomic_store_n(&_sem_profiling, enabled ? 1 : 0, __ATOMIC_RELAXED);
+}
+
+/* WARNING! you need to lock _sem_profiles in caller function! */
+static void _fill_sem_profile_info(sem_profile_info *info, const _sem_profile *profile)
+{
+    info->acquisitions = profile->acquisitions;
+    info->contended_acquisitions = profile->contended;
+    info->wait_time = profile->wait_time;
+    info->hold_time = profile->hold_time;
+    memcpy(info->wait_histogram, profile->wait_histogram, sizeof(info->wait_histogram));
+    memcpy(info->hold_histogram, profile->hold_histogram, sizeof(info->hold_histogram));
+
+    /* most recent holder first */
+    uint32 holder = profile->holder;
+    for (uint32 i = 0; i < B_SEM_PROFILE_HOLDERS; i++) {
+        info->latest_holders[i] = i < holder
+            ? profile->holders[(holder - 1 - i) % B_SEM_PROFILE_HOLDERS] : 0;
+    }
+}
+
+status_t dump_sem_profiling(int fd)
+{
+    _sem_profiles_rlock();
+    _sem_profile *profile;
+    DL_FOREACH(_sem_profiles, profile) {
+        sem_profile_info info;
+        _fill_sem_profile_info(&info, profile);
+
+        int64 acquisitions = info.acquisitions ? info.acquisitions : 1;
+        dprintf(fd, "sem %#lx \"%s\": %" PRId64 " acquired, %" PRId64 " contended,"
+                " wait %" PRId64 " us avg, hold %" PRId64 " us avg, holders",
+                (unsigned long)profile->sem, profile->name,
+                info.acquisitions, info.contended_acquisitions,
+                info.wait_time / acquisitions, info.hold_time / acquisitions);
+        for (int i = 0; i < B_SEM_PROFILE_HOLDERS && info.latest_holders[i]; i++) {
+            dprintf(fd, " %d", (int)info.latest_holders[i]);
+        }
+
+        dprintf(fd, "\n  wait us:");
+        for (int i = 0; i < B_SEM_PROFILE_BUCKETS; i++) {
+            if (info.wait_histogram[i])
+                dprintf(fd, " <%" PRId64 ":%" PRId64, (int64)1 << i, info.wait_histogram[i]);
+        }
+        dprintf(fd, "\n  hold us:");
+        for (int i = 0; i < B_SEM_PROFILE_BUCKETS; i++) {
+            if (info.hold_histogram[i])
+                dprintf(fd, " <%" PRId64 ":%" PRId64, (int64)1 << i, info.hold_histogram[i]);
+        }
+        dprintf(fd, "\n");
+    }
+    _sem_profiles_unlock();
+
+    return B_OK;
+}
 
 sem_id create_sem(uint32 thread_count, const char * name)
 {
-    _sem_info *info = malloc(sizeof(_sem_info));
+    _sem_info *info = calloc(1, sizeof(_sem_info));
 
     if (info == NULL) {
         return B_NO_MEMORY;
@@ -30,15 +310,42 @@ sem_id create_sem(uint32 thread_count, const char * name)
     return (sem_id)info;
 }
 
+sem_id create_sem_etc(uint32 thread_count, const char *name, uint32 flags)
+{
+    if (flags & B_SHARED_SEM) {
+        return _create_shared_sem(thread_count, name);
+    }
+
+    return create_sem(thread_count, name);
+}
+
 status_t delete_sem(sem_id sem)
 {
-    if (((_sem_info *)sem)->team != _info->team) {
+    _sem_info *info = _get_sem(sem);
+    if (!info || info->team != _info->team) {
+        return B_BAD_SEM_ID;
+    }
+
+    if (_sem_profiles) {
+        _sem_profile_remove(sem);
+    }
+
+    if (!_sem_is_shared(sem)) {
+        syscall(SYS_futex, &info->count, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+        free(info);
+        return B_NO_ERROR;
+    }
+
+    if (cmpxchg(&info->team, _info->team, SEM_SLOT_BUSY) != _info->team) {
         return B_BAD_SEM_ID;
     }
 
-    syscall(SYS_futex, (uint32_t *)sem, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+    /* change the futex word so waiters about to sleep see it, then wake
+     * everyone, they notice the busy slot and return B_BAD_SEM_ID */
+    atomic_add(&info->count, 1);
+    syscall(SYS_futex, &info->count, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
 
-    free((void*)sem);
+    __atomic_store_n(&info->team, 0, __ATOMIC_RELEASE);
 
     return B_NO_ERROR;
 }
@@ -46,111 +353,237 @@ status_t delete_sem(sem_id sem)
 status_t get_sem_count(sem_id sem, int32* thread_count)
 {
     assert(thread_count);
-    const _sem_info *info = (_sem_info *)sem;
+    const _sem_info *info = _get_sem(sem);
+    if (!info) {
+        return B_BAD_SEM_ID;
+    }
 
-    return info->count;
+    *thread_count = info->count;
+    return B_OK;
+}
+
+status_t set_sem_owner(sem_id sem, team_id team)
+{
+    _sem_info *info = _get_sem(sem);
+    if (!info) {
+        return B_BAD_SEM_ID;
+    }
+
+    if (!_sem_is_shared(sem)) {
+        /* private semaphores can not leave the team */
+        return team == _info->team ? B_OK : B_BAD_TEAM_ID;
+    }
+
+    if (team <= 0 || !_sem_team_alive(team)) {
+        return B_BAD_TEAM_ID;
+    }
+
+    team_id owner = info->team;
+    if (owner <= 0 || cmpxchg(&info->team, owner, team) != owner) {
+        return B_BAD_SEM_ID;
+    }
+
+    return B_OK;
+}
+
+static void _fill_sem_info(sem_info *info, sem_id sem, const _sem_info *_nfo)
+{
+    info->count = _nfo->count;
+    info->latest_holder = _nfo->latest_holder;
+    info->team = _nfo->team;
+    info->sem = sem;
+    COPY_OS_NAME_LENGTH(info->name, _nfo->name);
 }
 
 status_t _get_sem_info(sem_id sem, struct sem_info *info, size_t infoSize)
 {
     assert(info);
-    const _sem_info *_info = (_sem_info *)sem;
+    const _sem_info *_nfo = _get_sem(sem);
+    if (!_nfo) {
+        return B_BAD_SEM_ID;
+    }
 
-    info->count = _info->count;
-    info->latest_holder = _info->latest_holder;
-    info->team = _info->team;
-    info->sem = sem;
-    COPY_OS_NAME_LENGTH(info->name, _info->name);
+    _fill_sem_info(info, sem, _nfo);
+
+    /* get_sem_profile_info() passes the larger struct */
+    if (infoSize >= sizeof(sem_profile_info)) {
+        sem_profile_info *profileInfo = (sem_profile_info *)info;
+        memset((char *)profileInfo + sizeof(sem_info), 0,
+               sizeof(sem_profile_info) - sizeof(sem_info));
+
+        _sem_profiles_rlock();
+        const _sem_profile *profile = _idhash_find(&_sem_profiles_index, sem);
+        if (profile) _fill_sem_profile_info(profileInfo, profile);
+        _sem_profiles_unlock();
+    }
 
     return B_NO_ERROR;
 }
 
+/* Only shared semaphores are enumerated, private ones are not registered. */
+status_t _get_next_sem_info(team_id team, int32 *cookie, struct sem_info *info, size_t infoSize)
+{
+    assert(cookie && info);
+    if (team == 0) team = _info->team;
+
+    _sem_arena *arena = _get_sem_arena();
+    if (!arena || *cookie < 0) {
+        return B_BAD_VALUE;
+    }
+
+    for (int32 slot = *cookie; slot < SEM_ARENA_SLOTS; slot++) {
+        const _sem_info *_nfo = &arena->sems[slot];
+        if (__atomic_load_n(&_nfo->team, __ATOMIC_ACQUIRE) != team) continue;
+
+        _fill_sem_info(info, slot + 1, _nfo);
+        *cookie = slot + 1;
+        return B_NO_ERROR;
+    }
+
+    *cookie = SEM_ARENA_SLOTS;
+    return B_BAD_VALUE;
+}
+
 // http://locklessinc.com/articles/mutex_cv_futex/
 
-status_t acquire_sem_etc(sem_id sem, uint32 count, uint32 flags, bigtime_t microsecond_timeout)
+/* Spin budget is twice the average spins recent acquires needed, within
+ * these limits. Spins that did not pay off shrink it, so semaphores held
+ * for long go to sleep right away.
+ */
+#define SEM_SPIN_MIN    16
+#define SEM_SPIN_MAX    1000
+
+static bool _sem_take(_sem_info *info, int32 count)
 {
-    if (microsecond_timeout == 0 && flags & B_RELATIVE_TIMEOUT && *((uint32*)sem) < count) {
-        return B_WOULD_BLOCK;
+    int32 a = info->count;
+    /* check if there is enough to take */
+    return a >= count && cmpxchg(&info->count, a, a - count) == a;
+}
+
+static inline __attribute__((always_inline))
+status_t _acquire_sem(sem_id sem, uint32 count, uint32 flags, bigtime_t microsecond_timeout,
+                      bool *contended)
+{
+    _sem_info *info = _get_sem(sem);
+    status_t status = B_NO_ERROR;
+
+    if (!info) {
+        return B_BAD_SEM_ID;
     }
 
-    uint32 i, a, b, c;
+    *contended = false;
+    if (microsecond_timeout == 0 && flags & B_RELATIVE_TIMEOUT) {
+        if (!_sem_take(info, count)) return B_WOULD_BLOCK;
+        goto done;
+    }
 
+    /* FUTEX_WAIT_BITSET takes absolute CLOCK_MONOTONIC deadline */
     struct timespec *to = NULL;
     struct timespec tm;
-    if (flags & (B_ABSOLUTE_TIMEOUT | B_RELATIVE_TIMEOUT)) {
-        if (flags & B_RELATIVE_TIMEOUT) {
-            if (clock_gettime(CLOCK_REALTIME, &tm) != 0) {
-                return B_FROM_POSIX_ERROR(errno);
-            }
-        }
-        else {
-            memset(&tm, 0, sizeof(struct timespec));
-        }
-        tm.tv_sec += microsecond_timeout / 1000000;
-        tm.tv_nsec += (microsecond_timeout % 1000000) * 1000;
-        if (tm.tv_nsec > 1000000000) {
-            tm.tv_nsec -= 1000000000;
-            tm.tv_sec++;
-        }
+    if (flags & B_ABSOLUTE_TIMEOUT
+        || (flags & B_RELATIVE_TIMEOUT && microsecond_timeout != B_INFINITE_TIMEOUT)) {
+        bigtime_t when = microsecond_timeout;
+        if (flags & B_RELATIVE_TIMEOUT) when += system_time();
+        if (when < 0) when = 0;
+        tm.tv_sec = when / 1000000;
+        tm.tv_nsec = (when % 1000000) * 1000;
         to = &tm;
     }
 
-again:
     /* spin and try to acquire */
-    for (i = 0; i < 100; i++)
-    {
-        a = *((uint32*)sem);
-        /* check if there is enough to take */
-        if (a >= count) {
-            b = a - count;
-            c = cmpxchg((uint32*)sem, a, b);
-            /* managed to take what we wanted? */
-            if (c == a) {
-                _info->state = 0;
-                _info->sem = 0;
-
-                /* BeBook: Warning:
-                 * The lastest_holder field is highly undependable; in some cases,
-                 * the kernel doesn't even record the semaphore acquirer. Although
-                 * you can use this field as a hint while debugging, you shouldn't
-                 * take it too seriously. Love, Mom.
-                 */
-                ((_sem_info *)sem)->latest_holder = _info->tid;
-
-                return B_NO_ERROR;
-            }
+    int32 spin = info->spin;
+    int32 budget = min_c(spin * 2 + SEM_SPIN_MIN, SEM_SPIN_MAX);
+    for (int32 i = 0; i < budget; i++) {
+        if (_sem_take(info, count)) {
+            info->spin = spin + (i - spin) / 8;
+            *contended = i > 0;
+            goto done;
         }
-
         cpu_relax();
     }
+    info->spin = spin - spin / 8;
+    *contended = true;
 
     _info->state = B_THREAD_WAITING;
     _info->sem = sem;
 
-    while (((_sem_info *)sem)->count < count)
-    {
-        /* Wait in the kernel */
-        if (syscall(SYS_futex, (uint32_t *)sem, FUTEX_WAIT_PRIVATE, ((_sem_info *)sem)->count, to, NULL, 0) != 0) {
-            switch (errno) {
-            case ETIMEDOUT:
-                return B_TIMED_OUT;
-            case EWOULDBLOCK: //case EAGAIN:
-                goto again;
-            case EACCES:
-                return B_BAD_SEM_ID;
-            case EFAULT:
-            case EINVAL:
-            case ENOSYS:
-                return B_BAD_VALUE;
-            case EINTR:
-                return B_INTERRUPTED;
-            default:
-                return B_FROM_POSIX_ERROR(errno);
-            }
+    bool shared = _sem_is_shared(sem);
+    for (;;) {
+        /* shared slot was deleted while we were waiting */
+        if (shared && __atomic_load_n(&info->team, __ATOMIC_ACQUIRE) <= 0) {
+            status = B_BAD_SEM_ID;
+            break;
+        }
+        if (_sem_take(info, count)) break;
+
+        int32 value = info->count;
+        if (value >= (int32)count) continue;
+
+        /* Wait in the kernel, releaser wakes only when there are waiters */
+        atomic_add(&info->waiters, 1);
+        BE_TRACE2(sem_sleep_start, sem, count);
+        long ret = syscall(SYS_futex, &info->count, FUTEX_WAIT_BITSET | _sem_futex_flags(sem), value,
+                           to, NULL, FUTEX_BITSET_MATCH_ANY);
+        int error = errno;
+        BE_TRACE2(sem_sleep_done, sem, ret);
+        atomic_sub(&info->waiters, 1);
+        if (ret == 0) continue;
+
+        switch (error) {
+        case EWOULDBLOCK: //case EAGAIN:
+            continue;
+        case ETIMEDOUT:
+            status = B_TIMED_OUT;
+            break;
+        case EACCES:
+            status = B_BAD_SEM_ID;
+            break;
+        case EFAULT:
+        case EINVAL:
+        case ENOSYS:
+            status = B_BAD_VALUE;
+            break;
+        case EINTR:
+            status = B_INTERRUPTED;
+            break;
+        default:
+            status = B_FROM_POSIX_ERROR(error);
+            break;
         }
+        break;
     }
 
-    goto again;
+done:
+    _info->state = 0;
+    _info->sem = 0;
+
+    /* BeBook: Warning:
+     * The lastest_holder field is highly undependable; in some cases,
+     * the kernel doesn't even record the semaphore acquirer. Although
+     * you can use this field as a hint while debugging, you shouldn't
+     * take it too seriously. Love, Mom.
+     */
+    if (status == B_NO_ERROR) info->latest_holder = _info->tid;
+
+    return status;
+}
+
+status_t acquire_sem_etc(sem_id sem, uint32 count, uint32 flags, bigtime_t microsecond_timeout)
+{
+    bool contended;
+    status_t status;
+
+    BE_TRACE4(sem_acquire_start, sem, count, flags, microsecond_timeout);
+    if (unlikely(_sem_profiling)) {
+        bigtime_t start = system_time();
+        status = _acquire_sem(sem, count, flags, microsecond_timeout, &contended);
+        if (status == B_NO_ERROR) _sem_profile_acquired(sem, contended, system_time() - start);
+    } else {
+        status = _acquire_sem(sem, count, flags, microsecond_timeout, &contended);
+    }
+    BE_TRACE3(sem_acquire_done, sem, count, status);
+    record_event(B_RECORD_SEM_ACQUIRE, sem, status == B_NO_ERROR ? (int64)count : (int64)status);
+    return status;
 }
 
 status_t release_sem_etc(sem_id sem, int32 count, uint32 flags)
@@ -159,35 +592,35 @@ status_t release_sem_etc(sem_id sem, int32 count, uint32 flags)
         return B_BAD_VALUE;
     }
 
-    int i;
+    if (unlikely(_sem_profiling)) {
+        _sem_profile_released(sem);
+    }
+    BE_TRACE2(sem_release, sem, count);
+    record_event(B_RECORD_SEM_RELEASE, sem, count);
 
-    /* release, and if was not contended then exit */
-    i = atomic_xadd((int*)sem, count);
-    if (i > 0) {
-        /* BeBook:
-         * Normally, releasing a semaphore automatically invokes the kernel's scheduler.
-         * In other words, when your thread calls release_sem(), you're pretty much
-         * guaranteed that some other thread will be switched in immediately afterwards,
-         * even if your thread hasn't gotten its fair share of CPU time.
-         */
-        if (flags & B_DO_NOT_RESCHEDULE) {
-            sched_yield();
-        }
-        return B_NO_ERROR;
+    _sem_info *info = _get_sem(sem);
+    if (!info) {
+        return B_BAD_SEM_ID;
     }
 
-    /* Spin and hope someone acquires what we released */
-    for (i = 0; i < 200; i++)
-    {
-        if (*((int*)sem) <= 0)
-        {
-            return B_NO_ERROR;
-        }
-        cpu_relax();
+    /* release, and if nobody sleeps then exit without syscall */
+    atomic_add(&info->count, count);
+    if (info->waiters == 0) {
+        return B_NO_ERROR;
     }
 
     /* we need to wake someone(s) up */
-    syscall(SYS_futex, (uint32_t*)sem, FUTEX_WAKE_PRIVATE, count, NULL, NULL, 0);
+    long woken = syscall(SYS_futex, &info->count, FUTEX_WAKE | _sem_futex_flags(sem), count, NULL, NULL, 0);
+
+    /* BeBook:
+     * Normally, releasing a semaphore automatically invokes the kernel's scheduler.
+     * In other words, when your thread calls release_sem(), you're pretty much
+     * guaranteed that some other thread will be switched in immediately afterwards,
+     * even if your thread hasn't gotten its fair share of CPU time.
+     */
+    if (woken > 0 && !(flags & B_DO_NOT_RESCHEDULE)) {
+        sched_yield();
+    }
 
     return B_NO_ERROR;
 }
@@ -0,0 +1,315 @@
+#include <OS.h>
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#include "private.h"
+
+/* Work-stealing task pool.
+ * Every worker owns a Chase-Lev deque: it pushes and pops at the bottom,
+ * idle workers steal from the top. Tasks submitted by other threads go to
+ * a shared injection queue. Workers are spawned with spawn_thread(), so
+ * they are ordinary registered threads.
+ */
+#define TASK_DEQUE_SIZE     1024 // power of 2, overflow goes to injection queue
+#define TASK_WORKERS_MAX    256
+#define TASK_SPIN           100
+
+enum {
+    TASK_QUEUED = 0,
+    TASK_DONE
+};
+
+typedef struct _task_struct {
+    thread_func func;
+    void        *data;
+    status_t    result;
+    uint32      state;      // futex
+    uint32      waiters;    // sleeping in wait_for_task()
+    int32       refs;       // task_id + queue
+    struct _task_struct *next; // injection queue
+} _task;
+
+typedef struct {
+    int64       top __attribute__((aligned(64)));
+    int64       bottom __attribute__((aligned(64)));
+    _task       *tasks[TASK_DEQUE_SIZE];
+    thread_id   thread;
+    uint32      seed;       // victim selection
+} _task_worker;
+
+static _task_worker *_task_workers = NULL;
+static int32 _task_workers_count = 0;
+static int32 _task_workers_wanted = 0;
+static pthread_once_t _task_pool_once = PTHREAD_ONCE_INIT;
+static __thread _task_worker *_task_self = NULL;
+
+static pthread_mutex_t _task_inject_lock = PTHREAD_MUTEX_INITIALIZER;
+static _task *_task_inject_head = NULL;
+static _task *_task_inject_tail = NULL;
+static int32 _task_inject_count = 0;
+
+static uint32 _task_work_seq = 0;  // futex; bumped on every submit
+static uint32 _task_idle = 0;      // workers sleeping on _task_work_seq
+
+static inline long _task_futex_wait(uint32 *word, uint32 value)
+{
+    return syscall(SYS_futex, word, FUTEX_WAIT_PRIVATE, value, NULL, NULL, 0);
+}
+
+static inline void _task_futex_wake(uint32 *word, int count)
+{
+    syscall(SYS_futex, word, FUTEX_WAKE_PRIVATE, count, NULL, NULL, 0);
+}
+
+static void _task_release(_task *task)
+{
+    if (atomic_sub(&task->refs, 1) == 0) free(task);
+}
+
+/* Owner only. Returns false when deque is full. */
+static bool _task_push(_task_worker *worker, _task *task)
+{
+    int64 bottom = __atomic_load_n(&worker->bottom, __ATOMIC_RELAXED);
+    int64 top = __atomic_load_n(&worker->top, __ATOMIC_ACQUIRE);
+    if (bottom - top >= TASK_DEQUE_SIZE) return false;
+
+    __atomic_store_n(&worker->tasks[bottom & (TASK_DEQUE_SIZE - 1)], task, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    __atomic_store_n(&worker->bottom, bottom + 1, __ATOMIC_RELAXED);
+    return true;
+}
+
+/* Owner only, takes most recently pushed task. */
+static _task *_task_pop(_task_worker *worker)
+{
+    int64 bottom = __atomic_load_n(&worker->bottom, __ATOMIC_RELAXED) - 1;
+    __atomic_store_n(&worker->bottom, bottom, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    int64 top = __atomic_load_n(&worker->top, __ATOMIC_RELAXED);
+
+    if (top > bottom) {
+        __atomic_store_n(&worker->bottom, bottom + 1, __ATOMIC_RELAXED);
+        return NULL;
+    }
+
+    _task *task = __atomic_load_n(&worker->tasks[bottom & (TASK_DEQUE_SIZE - 1)], __ATOMIC_RELAXED);
+    if (top == bottom) {
+        /* last one, race with thieves */
+        if (!__atomic_compare_exchange_n(&worker->top, &top, top + 1, false,
+                                         __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+            task = NULL;
+        __atomic_store_n(&worker->bottom, bottom + 1, __ATOMIC_RELAXED);
+    }
+    return task;
+}
+
+/* Any thread, takes oldest task. */
+static _task *_task_steal(_task_worker *worker)
+{
+    int64 top = __atomic_load_n(&worker->top, __ATOMIC_ACQUIRE);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    int64 bottom = __atomic_load_n(&worker->bottom, __ATOMIC_ACQUIRE);
+    if (top >= bottom) return NULL;
+
+    _task *task = __atomic_load_n(&worker->tasks[top & (TASK_DEQUE_SIZE - 1)], __ATOMIC_RELAXED);
+    if (!__atomic_compare_exchange_n(&worker->top, &top, top + 1, false,
+                                     __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+        return NULL;
+    return task;
+}
+
+static void _task_inject(_task *task)
+{
+    task->next = NULL;
+    pthread_mutex_lock(&_task_inject_lock);
+    if (_task_inject_tail) _task_inject_tail->next = task;
+    else _task_inject_head = task;
+    _task_inject_tail = task;
+    __atomic_store_n(&_task_inject_count, _task_inject_count + 1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&_task_inject_lock);
+}
+
+static _task *_task_take_injected(void)
+{
+    if (!__atomic_load_n(&_task_inject_count, __ATOMIC_ACQUIRE)) return NULL;
+
+    pthread_mutex_lock(&_task_inject_lock);
+    _task *task = _task_inject_head;
+    if (task) {
+        _task_inject_head = task->next;
+        if (!_task_inject_head) _task_inject_tail = NULL;
+        __atomic_store_n(&_task_inject_count, _task_inject_count - 1, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&_task_inject_lock);
+    return task;
+}
+
+/* Own deque first, then injection queue, then steal starting at random victim. */
+static _task *_task_find(_task_worker *self)
+{
+    _task *task = self ? _task_pop(self) : NULL;
+    if (task) return task;
+
+    task = _task_take_injected();
+    if (task) return task;
+
+    int32 count = _task_workers_count;
+    uint32 start = 0;
+    if (self) {
+        self->seed = self->seed * 1103515245 + 12345;
+        start = self->seed >> 16;
+    }
+    for (int32 i = 0; i < count; i++) {
+        _task_worker *victim = &_task_workers[(start + i) % count];
+        if (victim == self) continue;
+        task = _task_steal(victim);
+        if (task) return task;
+    }
+    return NULL;
+}
+
+static void _task_run(_task *task)
+{
+    task->result = task->func(task->data);
+    __atomic_store_n(&task->state, TASK_DONE, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&task->waiters, __ATOMIC_ACQUIRE))
+        _task_futex_wake(&task->state, INT_MAX);
+    _task_release(task);
+}
+
+static int32 _task_worker_main(void *data)
+{
+    _task_worker *self = data;
+    _task_self = self;
+
+    for (;;) {
+        _task *task = _task_find(self);
+        if (task) {
+            _task_run(task);
+            continue;
+        }
+
+        for (int i = 0; i < TASK_SPIN && !task; i++) {
+            cpu_relax();
+            task = _task_find(self);
+        }
+        if (task) {
+            _task_run(task);
+            continue;
+        }
+
+        /* submitter bumps sequence before it looks for idle workers */
+        uint32 seq = __atomic_load_n(&_task_work_seq, __ATOMIC_ACQUIRE);
+        atomic_add(&_task_idle, 1);
+        task = _task_find(self);
+        if (!task) _task_futex_wait(&_task_work_seq, seq);
+        atomic_sub(&_task_idle, 1);
+        if (task) _task_run(task);
+    }
+    return B_OK;
+}
+
+static void _task_pool_start(void)
+{
+    int32 count = _task_workers_wanted;
+    if (count <= 0) count = sysconf(_SC_NPROCESSORS_ONLN);
+    if (count <= 0) count = 1;
+    if (count > TASK_WORKERS_MAX) count = TASK_WORKERS_MAX;
+
+    _task_workers = calloc(count, sizeof(_task_worker));
+    if (!_task_workers) return;
+
+    for (int32 i = 0; i < count; i++) {
+        _task_worker *worker = &_task_workers[i];
+        char name[B_OS_NAME_LENGTH];
+        snprintf(name, sizeof(name), "task worker %d", (int)i);
+        worker->seed = i + 1;
+        worker->thread = spawn_thread(_task_worker_main, name, B_NORMAL_PRIORITY, worker);
+        if (worker->thread < 0) break;
+        /* thieves only look at workers that are counted */
+        __atomic_store_n(&_task_workers_count, i + 1, __ATOMIC_RELEASE);
+        resume_thread(worker->thread);
+    }
+}
+
+status_t set_task_pool_workers(int32 count)
+{
+    if (count < 0 || count > TASK_WORKERS_MAX) return B_BAD_VALUE;
+    if (__atomic_load_n(&_task_workers, __ATOMIC_ACQUIRE)) return B_NOT_ALLOWED;
+
+    _task_workers_wanted = count;
+    return B_OK;
+}
+
+int32 count_task_pool_workers(void)
+{
+    pthread_once(&_task_pool_once, _task_pool_start);
+    return _task_workers_count;
+}
+
+task_id submit_task(thread_func func, void *data)
+{
+    if (!func) return B_BAD_VALUE;
+
+    pthread_once(&_task_pool_once, _task_pool_start);
+    if (!_task_workers_count) return B_NO_MORE_THREADS;
+
+    _task *task = malloc(sizeof(_task));
+    if (!task) return B_NO_MEMORY;
+    task->func = func;
+    task->data = data;
+    task->result = B_OK;
+    task->state = TASK_QUEUED;
+    task->waiters = 0;
+    task->refs = 2;
+
+    /* tasks spawned by tasks stay on the same core, unless stolen */
+    if (!_task_self || !_task_push(_task_self, task)) _task_inject(task);
+
+    atomic_add(&_task_work_seq, 1);
+    if (__atomic_load_n(&_task_idle, __ATOMIC_ACQUIRE))
+        _task_futex_wake(&_task_work_seq, 1);
+
+    return (task_id)task;
+}
+
+status_t wait_for_task(task_id id, status_t *result)
+{
+    /* failed submit_task() returns error codes, which are negative */
+    if (id <= 0) return B_BAD_VALUE;
+    _task *task = (_task *)id;
+
+    while (__atomic_load_n(&task->state, __ATOMIC_ACQUIRE) != TASK_DONE) {
+        /* worker runs other tasks meanwhile, it must not block the pool */
+        if (_task_self) {
+            _task *other = _task_find(_task_self);
+            if (other) {
+                _task_run(other);
+                continue;
+            }
+        }
+
+        atomic_add(&task->waiters, 1);
+        if (__atomic_load_n(&task->state, __ATOMIC_ACQUIRE) != TASK_DONE) {
+            if (_task_self) {
+                /* task is running elsewhere, look for more work soon */
+                struct timespec timeout = { .tv_sec = 0, .tv_nsec = 100000 };
+                syscall(SYS_futex, &task->state, FUTEX_WAIT_PRIVATE, TASK_QUEUED, &timeout, NULL, 0);
+            } else {
+                _task_futex_wait(&task->state, TASK_QUEUED);
+            }
+        }
+        atomic_sub(&task->waiters, 1);
+    }
+
+    if (result) *result = task->result;
+    _task_release(task);
+    return B_OK;
+}
@@ -4,12 +4,11 @@
 #include <sys/types.h>
 #include <signal.h>
 #include <string.h>
-#include <stdio.h>
-#include <sys/types.h>
-#include <sys/stat.h>
 #include <unistd.h>
 #include <pthread.h>
 
+#include "private.h"
+
 status_t kill_team(team_id team)
 {
     if (kill(team, SIGKILL) != 0) {
@@ -27,44 +26,33 @@ status_t kill_team(team_id team)
 
 status_t _get_team_info(team_id id, team_info *info, size_t size)
 {
-    memset(info, 0, size);
-
-    /* It's dangerous to go alone! Take this.
-     *                proc(5)                */
+    if (!info || size > sizeof(team_info)) return B_BAD_VALUE;
 
-    char statfile[B_FILE_NAME_LENGTH];
-    snprintf(statfile, B_FILE_NAME_LENGTH, "/proc/%d/stat", id);
-    FILE *f = fopen(statfile, "r");
-    if (f == NULL) return B_BAD_TEAM_ID;
+    _proc_team team;
+    status_t ret = _proc_get_team(id ? id : getpid(), &team);
+    if (ret == B_OK) memcpy(info, &team.info, size);
+    return ret;
+}
 
-    long num_threads;
-    int items = fscanf(f, "%d %*s %*c %*d %*d %*d %*d %*d %*u %*u "
-                          "%*u %*u %*u %*u %*u %*d %*d %*d %*d %ld",
-                       &info->team, &num_threads);
-    fclose(f);
-    if (items < 2) return B_BAD_VALUE;
-    info->thread_count = (int32)num_threads;
+status_t _get_next_team_info(int32 *cookie, team_info *info, size_t size)
+{
+    if (!cookie || !info || size > sizeof(team_info)) return B_BAD_VALUE;
 
-    struct stat statst = {};
-    if (stat(statfile, &statst) != 0) return B_BAD_TEAM_ID;
-    info->uid = statst.st_uid;
-    info->gid = statst.st_gid;
+    _proc_team team;
+    status_t ret = _proc_next_team(cookie, &team);
+    if (ret == B_OK) memcpy(info, &team.info, size);
+    return ret;
+}
 
-    snprintf(statfile, B_FILE_NAME_LENGTH, "/proc/%d/cmdline", id);
-    int fd = open(statfile, O_RDONLY);
-    if (fd < 0) return B_BAD_TEAM_ID;
-    ssize_t count;
-    char buf[1];
-    unsigned i = 0;
-    while ((count = read(fd, &buf, 1)) > 0) {
-        if (*buf == '\0') info->argc++;
-        if (i < 64) info->args[i] = (*buf == '\0') ? ' ' : *buf;
-        i++;
-    }
-    close(fd);
-    if (count < 0) return B_BAD_VALUE;
+status_t _get_team_usage_info(team_id id, int32 who, team_usage_info *info, size_t size)
+{
+    if (!info || size > sizeof(team_usage_info)) return B_BAD_VALUE;
+    if (who != B_TEAM_USAGE_SELF && who != B_TEAM_USAGE_CHILDREN) return B_BAD_VALUE;
 
-    return B_OK;
+    _proc_team team;
+    status_t ret = _proc_get_team(id ? id : getpid(), &team);
+    if (ret == B_OK) memcpy(info, who == B_TEAM_USAGE_SELF ? &team.usage : &team.children, size);
+    return ret;
 }
 
 int atfork(void (*fun)(void))
@@ -7,10 +7,12 @@
 #include <limits.h>
 #include <linux/futex.h>
 #include <pthread.h>
+#include <sched.h>
 #include <signal.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/ioctl.h>
+#include <sys/eventfd.h>
 #include <sys/mman.h>
 #include <sys/prctl.h>
 #include <sys/resource.h>
@@ -19,17 +21,170 @@
 #include <sys/wait.h>
 #include <unistd.h>
 
+#include <trace.h>
+
 #include "private.h"
 #include "rwlock.h"
 #include "utlist.h"
+#include "idhash.h"
+
+/* Thread mailbox for send_data()/receive_data().
+ * Senders reserve space at tail by CAS and publish record by storing its
+ * length. Owning thread is the only reader, so it consumes without locking
+ * and zeroes consumed bytes, so uncommitted record always reads as len == 0.
+ * Receiver sleeps on doorbell futex; eventfd is made on demand for threads
+ * polling for data, see _get_thread_data_read_fd().
+ */
+#define MAILBOX_SIZE        (64 * 1024)
+#define MAILBOX_ALIGN       16
+/* larger payloads are passed as pointer to heap copy */
+#define MAILBOX_INLINE_MAX  (MAILBOX_SIZE / 4)
+
+#define MAILBOX_RECORD_PAD  0x80000000  // skip to the start of buffer
+#define MAILBOX_RECORD_HEAP 0x40000000  // payload is pointer to heap copy
+#define MAILBOX_RECORD_MASK 0x3fffffff
+
+typedef struct {
+    uint32      len;        // record length | flags; 0 while not committed
+    thread_id   sender;
+    int32       code;
+    uint32      size;       // message size
+} _mailbox_record;
+
+struct _thread_mailbox_struct {
+    uint64      head;       // read position, owner only
+    uint64      tail;       // reserved position
+    int32       refs;       // owner + senders in flight
+    int32       count;      // queued (reserved) messages
+    uint32      closed;
+    uint32      doorbell;   // futex; bumped on every send
+    uint32      space;      // futex; bumped on every receive
+    uint32      receiving;  // owner sleeping on doorbell
+    uint32      senders;    // sleeping on space
+    int         eventfd;    // -1 until polled
+    uint8       data[MAILBOX_SIZE];
+};
 
 /* current thread info */
 __thread _thread_info *_info = NULL;
 
 /* head of linked list of all _thread_info */
 static _thread_info *_threads = NULL;
+/* thread_id -> _thread_info */
+static _idhash _threads_index;
 RWLOCK(_threads)
 
+static inline long _futex_wait(uint32 *addr, uint32 val)
+{
+    return syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, NULL, NULL, 0);
+}
+
+static inline void _futex_wake(uint32 *addr, int count)
+{
+    syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, count, NULL, NULL, 0);
+}
+
+static inline _mailbox_record *_mailbox_record_at(_thread_mailbox *mailbox, uint64 pos)
+{
+    return (_mailbox_record *)&mailbox->data[pos & (MAILBOX_SIZE - 1)];
+}
+
+static _thread_mailbox *_mailbox_create(void)
+{
+    _thread_mailbox *mailbox = mmap(NULL, sizeof(_thread_mailbox), PROT_READ | PROT_WRITE,
+                                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mailbox == MAP_FAILED) return NULL;
+
+    mailbox->refs = 1;
+    mailbox->eventfd = -1;
+    return mailbox;
+}
+
+/* Wakes up senders, they fail from now on. */
+static void _mailbox_close(_thread_mailbox *mailbox)
+{
+    mailbox->closed = 1;
+    atomic_add(&mailbox->space, 1);
+    if (mailbox->senders) _futex_wake(&mailbox->space, INT_MAX);
+}
+
+static void _mailbox_release(_thread_mailbox *mailbox)
+{
+    if (atomic_sub(&mailbox->refs, 1) != 0) return;
+
+    /* free payloads of unread messages */
+    for (uint64 head = mailbox->head; head != mailbox->tail;) {
+        _mailbox_record *rec = _mailbox_record_at(mailbox, head);
+        if (rec->len == 0) break;
+        if (rec->len & MAILBOX_RECORD_HEAP) free(*(void **)(rec + 1));
+        head += rec->len & MAILBOX_RECORD_MASK;
+    }
+
+    if (mailbox->eventfd >= 0) close(mailbox->eventfd);
+    munmap(mailbox, sizeof(_thread_mailbox));
+}
+
+static status_t _mailbox_send(_thread_mailbox *mailbox, int32 code,
+                              const void *buffer, size_t bufferSize)
+{
+    uint32 flags = 0;
+    void *heap = NULL;
+    size_t size = bufferSize;
+    if (bufferSize > MAILBOX_INLINE_MAX) {
+        heap = malloc(bufferSize);
+        if (!heap) return B_NO_MEMORY;
+        memcpy(heap, buffer, bufferSize);
+        buffer = &heap;
+        size = sizeof(heap);
+        flags = MAILBOX_RECORD_HEAP;
+    }
+    size_t reclen = (sizeof(_mailbox_record) + size + MAILBOX_ALIGN - 1) & ~(size_t)(MAILBOX_ALIGN - 1);
+
+    for (;;) {
+        if (mailbox->closed) {
+            free(heap);
+            return B_BAD_THREAD_ID;
+        }
+
+        uint32 seq = __atomic_load_n(&mailbox->space, __ATOMIC_ACQUIRE);
+        uint64 tail = __atomic_load_n(&mailbox->tail, __ATOMIC_ACQUIRE);
+        uint64 head = __atomic_load_n(&mailbox->head, __ATOMIC_ACQUIRE);
+
+        /* records never wrap, rest of buffer is skipped with pad record */
+        size_t offset = tail & (MAILBOX_SIZE - 1);
+        size_t pad = offset + reclen > MAILBOX_SIZE ? MAILBOX_SIZE - offset : 0;
+
+        if (tail + pad + reclen - head <= MAILBOX_SIZE) {
+            if (cmpxchg(&mailbox->tail, tail, tail + pad + reclen) != tail) continue;
+            atomic_add(&mailbox->count, 1);
+
+            if (pad) {
+                _mailbox_record *rec = _mailbox_record_at(mailbox, tail);
+                __atomic_store_n(&rec->len, pad | MAILBOX_RECORD_PAD, __ATOMIC_RELEASE);
+                tail += pad;
+            }
+
+            _mailbox_record *rec = _mailbox_record_at(mailbox, tail);
+            rec->sender = _info->tid;
+            rec->code = code;
+            rec->size = bufferSize;
+            if (size) memcpy(rec + 1, buffer, size);
+            __atomic_store_n(&rec->len, reclen | flags, __ATOMIC_RELEASE);
+
+            atomic_add(&mailbox->doorbell, 1);
+            if (mailbox->receiving) _futex_wake(&mailbox->doorbell, 1);
+            int fd = __atomic_load_n(&mailbox->eventfd, __ATOMIC_SEQ_CST);
+            if (fd >= 0) eventfd_write(fd, 1);
+            return B_OK;
+        }
+
+        /* mailbox is full, wait for receiver */
+        atomic_add(&mailbox->senders, 1);
+        _futex_wait(&mailbox->space, seq);
+        atomic_sub(&mailbox->senders, 1);
+    }
+}
+
 static void _thread_init(void)
 {
     /* fill main thread info */
@@ -37,6 +192,7 @@ static void _thread_init(void)
     _info->pthread = pthread_self();
     _info->tid = syscall(SYS_gettid);
     _info->team = getpid();
+    _info->priority = B_NORMAL_PRIORITY;
     _info->task_state = TASK_RUNNING;
     prctl(PR_GET_NAME, (unsigned long) _info->name, 0, 0, 0);
     pthread_attr_t attr;
@@ -44,21 +200,165 @@ static void _thread_init(void)
     size_t size;
     pthread_attr_getstack(&attr, &_info->stack_base, &size);
     _info->stack_end = (char*)_info->stack_base + size;
-	pipe2(_info->data_pipe, 0);
+	_info->mailbox = _mailbox_create();
 	/* add it as first thread */
     _threads_wlock();
+    _idhash_insert(&_threads_index, _info->tid, _info);
     DL_APPEND(_threads, _info);
     _threads_unlock();
 }
 __attribute__((section(".init_array"))) void (* p_thread_init)(void) = &_thread_init;
 
-/* WARNING! you need to lock _threads in caller function! */
+/* WARNING! you need to lock _threads in caller function to keep info alive! */
 _thread_info *_find_thread_info(thread_id thread)
 {
     if (_info->tid == thread) return _info;
-    _thread_info *info;
-    DL_SEARCH_SCALAR(_threads, info, tid, thread);
-    return info;
+    return _idhash_find(&_threads_index, thread);
+}
+
+/* Scheduling of Be priorities, per team. Default bands:
+ *   0          SCHED_IDLE
+ *   1..5       SCHED_BATCH, nice 19..11
+ *   6..99      SCHED_OTHER, nice 8..0 up to B_NORMAL_PRIORITY, then down to -20
+ *   100..119   SCHED_RR
+ *   120        SCHED_FIFO
+ * Real time priority is Be priority - 99. Policies the team is not allowed
+ * to use degrade to the strongest one it can get.
+ */
+#define PRIORITY_MAX    B_REAL_TIME_PRIORITY
+
+typedef struct {
+    int32   policy;     // B_SCHED_*
+    int32   level;      // nice value, or real time priority
+} _priority_policy;
+
+static _priority_policy _priority_policies[PRIORITY_MAX + 1];
+static pthread_once_t _priority_policies_once = PTHREAD_ONCE_INIT;
+
+/* glibc has no wrapper for sched_setattr() */
+struct _sched_attr {
+    uint32  size;
+    uint32  sched_policy;
+    uint64  sched_flags;
+    int32   sched_nice;
+    uint32  sched_priority;
+    uint64  sched_runtime;
+    uint64  sched_deadline;
+    uint64  sched_period;
+};
+
+static void _priority_policies_init(void)
+{
+    for (int32 priority = 0; priority <= PRIORITY_MAX; priority++) {
+        _priority_policy *policy = &_priority_policies[priority];
+        if (priority < B_LOWEST_ACTIVE_PRIORITY) {
+            policy->policy = B_SCHED_IDLE;
+            policy->level = 19;
+        } else if (priority <= B_LOW_PRIORITY) {
+            policy->policy = B_SCHED_BATCH;
+            policy->level = 19 - (priority - B_LOWEST_ACTIVE_PRIORITY) * 2;
+        } else if (priority <= B_NORMAL_PRIORITY) {
+            policy->policy = B_SCHED_NORMAL;
+            policy->level = (B_NORMAL_PRIORITY - priority) * 2;
+        } else if (priority < B_REAL_TIME_DISPLAY_PRIORITY) {
+            policy->policy = B_SCHED_NORMAL;
+            policy->level = max_c(B_NORMAL_PRIORITY - priority, -20);
+        } else {
+            policy->policy = priority < B_REAL_TIME_PRIORITY ? B_SCHED_ROUND_ROBIN : B_SCHED_FIFO;
+            policy->level = priority - 99;
+        }
+    }
+}
+
+static int _sched_policy(int32 policy)
+{
+    switch (policy) {
+    case B_SCHED_IDLE:
+        return SCHED_IDLE;
+    case B_SCHED_BATCH:
+        return SCHED_BATCH;
+    case B_SCHED_ROUND_ROBIN:
+        return SCHED_RR;
+    case B_SCHED_FIFO:
+        return SCHED_FIFO;
+    case B_SCHED_NORMAL:
+    default:
+        return SCHED_OTHER;
+    }
+}
+
+static status_t _set_sched_policy(pid_t tid, int32 policy, int32 level)
+{
+    struct _sched_attr attr = { .size = sizeof(attr) };
+    attr.sched_policy = _sched_policy(policy);
+    if (policy == B_SCHED_ROUND_ROBIN || policy == B_SCHED_FIFO) {
+        attr.sched_priority = min_c(max_c(level, 1), 99);
+    } else {
+        attr.sched_nice = min_c(max_c(level, -20), 19);
+    }
+
+    if (syscall(SYS_sched_setattr, tid, &attr, 0) == 0) return B_OK;
+    switch (errno) {
+    case ESRCH:
+        return B_BAD_THREAD_ID;
+    case EPERM:
+        return B_PERMISSION_DENIED;
+    case EINVAL:
+    case E2BIG:
+        return B_BAD_VALUE;
+    default:
+        return B_FROM_POSIX_ERROR(errno);
+    }
+}
+
+/* Applies team's policy for priority, falling back to what is permitted:
+ * real time to the highest time sharing level, raised nice to nice 0.
+ */
+static status_t _apply_thread_priority(pid_t tid, int32 priority)
+{
+    pthread_once(&_priority_policies_once, _priority_policies_init);
+    _priority_policy policy = _priority_policies[min_c(max_c(priority, 0), PRIORITY_MAX)];
+
+    status_t status = _set_sched_policy(tid, policy.policy, policy.level);
+    if (status != B_PERMISSION_DENIED) return status;
+
+    if (policy.policy == B_SCHED_ROUND_ROBIN || policy.policy == B_SCHED_FIFO) {
+        policy.policy = B_SCHED_NORMAL;
+        policy.level = -20;
+        if (_set_sched_policy(tid, policy.policy, policy.level) == B_OK) return B_OK;
+    }
+
+    /* RLIMIT_NICE may allow part of the way */
+    struct rlimit limit;
+    int32 lowest = 0;
+    if (getrlimit(RLIMIT_NICE, &limit) == 0 && limit.rlim_cur != RLIM_INFINITY)
+        lowest = 20 - (int32)limit.rlim_cur;
+    if (policy.level < lowest) {
+        policy.level = min_c(lowest, 0);
+        if (_set_sched_policy(tid, policy.policy, policy.level) == B_OK) return B_OK;
+    }
+    return _set_sched_policy(tid, policy.policy, 0);
+}
+
+status_t set_priority_policy(int32 priority, int32 policy, int32 level)
+{
+    if (priority < 0 || priority > PRIORITY_MAX) return B_BAD_VALUE;
+    if (policy < B_SCHED_IDLE || policy > B_SCHED_FIFO) return B_BAD_VALUE;
+
+    pthread_once(&_priority_policies_once, _priority_policies_init);
+    _priority_policies[priority].policy = policy;
+    _priority_policies[priority].level = level;
+    return B_OK;
+}
+
+status_t get_priority_policy(int32 priority, int32 *policy, int32 *level)
+{
+    if (priority < 0 || priority > PRIORITY_MAX) return B_BAD_VALUE;
+
+    pthread_once(&_priority_policies_once, _priority_policies_init);
+    if (policy) *policy = _priority_policies[priority].policy;
+    if (level) *level = _priority_policies[priority].level;
+    return B_OK;
 }
 
 static void _sigaction_handler(int sig)
@@ -102,6 +402,7 @@ static void* _thread_wrapper(void *arg)
     _info->pthread = pthread_self();
     _info->tid = syscall(SYS_gettid);
     prctl(PR_SET_NAME, (unsigned long) _info->name, 0, 0, 0);
+    _apply_thread_priority(_info->tid, _info->priority);
 
     pthread_attr_t attr;
     pthread_getattr_np(_info->pthread, &attr);
@@ -114,18 +415,21 @@ static void* _thread_wrapper(void *arg)
 
     _suspend_thread(_info, TASK_NEW);
 
+    BE_TRACE1(thread_start, _info->tid);
     status_t exit = _info->func(_info->data);
+    BE_TRACE2(thread_exit, _info->tid, exit);
 
     _info->task_state = TASK_EXITED;
     if (_info->task_state_copy) *_info->task_state_copy = _info->task_state;
 
-    _threads_wlock();
-
-	// close read end to release anyone sending to us
-	close(_info->data_pipe[0]);
+	// release anyone sending to us
+	_mailbox_close(_info->mailbox);
 
+    _threads_wlock();
+	_idhash_remove(&_threads_index, _info->tid);
 	DL_DELETE(_threads, _info);
 	_threads_unlock();
+	_mailbox_release(_info->mailbox);
 	free(_info);
 
 	return (void *)(intptr_t)exit;
@@ -151,38 +455,15 @@ thread_id spawn_thread(thread_func func, const char *name, int32 priority, void
         goto error1;
     }
 
-    if (pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED) != 0) {
-        ret = B_NO_MORE_THREADS;
-        goto error2;
-    }
-
-    if (priority > 99) {
-        if (pthread_attr_setschedpolicy(&attr, SCHED_RR) != 0) {
-            ret = B_NO_MORE_THREADS;
-            goto error2;
-        }
-        struct sched_param schedparam;
-        schedparam.sched_priority = priority - 99;
-        if (schedparam.sched_priority > 99) schedparam.sched_priority = 99;
-        if (pthread_attr_setschedparam(&attr, &schedparam) != 0) {
-            ret = B_NO_MORE_THREADS;
-            goto error2;
-        }
-    }
-    else {
-        /* FIXME! use BFS SCHED_ scheduling! */
-        if (pthread_attr_setschedpolicy(&attr, SCHED_OTHER) != 0) {
-            ret = B_NO_MORE_THREADS;
-            goto error2;
-        }
-    }
-    info->priority = priority;
+    /* new thread applies it to itself, see _apply_thread_priority() */
+    info->priority = min_c(max_c(priority, 0), PRIORITY_MAX);
 
     info->func = func;
     info->data = data;
 
-	if (pipe2(info->data_pipe, 0) != 0) {
-		ret = B_FROM_POSIX_ERROR(errno);
+	info->mailbox = _mailbox_create();
+	if (!info->mailbox) {
+		ret = B_NO_MEMORY;
 		goto error2;
 	}
 
@@ -212,18 +493,21 @@ thread_id spawn_thread(thread_func func, const char *name, int32 priority, void
 	syscall(SYS_futex, &info->tid, FUTEX_WAIT_PRIVATE, 0, NULL, NULL, 0);
 
 	_threads_wlock();
+	_idhash_insert(&_threads_index, info->tid, info);
 	DL_APPEND(_threads, info);
 	_threads_unlock();
 
+	BE_TRACE3(thread_spawn, info->tid, info->priority, info->name);
 	return info->tid;
 error2:
     pthread_attr_destroy(&attr);
+    if (info->mailbox) _mailbox_release(info->mailbox);
 error1:
     free(info);
     return ret;
 }
 
-status_t wait_for_thread(thread_id thread, status_t* exit_value)
+static status_t _wait_for_thread(thread_id thread, status_t* exit_value)
 {
     _threads_rlock();
     _thread_info *info = _find_thread_info(thread);
@@ -234,13 +518,18 @@ status_t wait_for_thread(thread_id thread, status_t* exit_value)
     _task_state state;
 
     if (!info || info->task_state != TASK_RUNNING) {
+        /* resume_thread() takes the read lock itself, they must not nest */
+        _threads_unlock();
         status = resume_thread(thread);
         if (status != B_OK) {
-            goto exit;
+            return status;
         }
+        _threads_rlock();
+        info = _find_thread_info(thread);
     }
 
     if (!info) {
+        _threads_unlock();
         /* have to assume that thread is the main thread of team */
         int wstatus;
         if (waitpid(thread, &wstatus, 0) < 0) {
@@ -281,9 +570,13 @@ status_t wait_for_thread(thread_id thread, status_t* exit_value)
 
     *exit_value = (intptr_t)exit;
     return state == TASK_EXITED ? B_OK : B_INTERRUPTED;
+}
 
-exit:
-    _threads_unlock();
+status_t wait_for_thread(thread_id thread, status_t* exit_value)
+{
+    BE_TRACE1(thread_wait_start, thread);
+    status_t status = _wait_for_thread(thread, exit_value);
+    BE_TRACE2(thread_wait_done, thread, status);
     return status;
 }
 
@@ -326,6 +619,8 @@ status_t resume_thread(thread_id thread)
     _thread_info *info = _find_thread_info(thread);
     if (!info) {
         _threads_unlock();
+        status_t status = _image_resume(thread);
+        if (status != B_BAD_THREAD_ID) return status;
         /* soo... it is not is this team... just SIG it... */
         if (syscall(SYS_tkill, thread, SIGCONT) != 0) {
             switch (errno) {
@@ -367,6 +662,95 @@ inline void exit_thread(status_t status)
     pthread_exit(&status);
 }
 
+status_t set_thread_priority(thread_id thread, int32 newPriority)
+{
+    if (newPriority < 0 || newPriority > PRIORITY_MAX) return B_BAD_VALUE;
+
+    _threads_rlock();
+    _thread_info *info = _find_thread_info(thread);
+    if (!info || info->task_state == TASK_EXITED) {
+        _threads_unlock();
+        return B_BAD_THREAD_ID;
+    }
+    int32 oldPriority = info->priority;
+    info->priority = newPriority;
+    _threads_unlock();
+
+    status_t status = _apply_thread_priority(thread, newPriority);
+    /* BeBook: returns the previous priority */
+    return status == B_OK ? oldPriority : status;
+}
+
+status_t set_thread_affinity(thread_id thread, const void *cpuMask, size_t maskSize)
+{
+    if (!cpuMask || maskSize == 0) return B_BAD_VALUE;
+
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    memcpy(&set, cpuMask, min_c(maskSize, sizeof(set)));
+    if (sched_setaffinity(thread, sizeof(set), &set) == 0) return B_OK;
+    switch (errno) {
+    case ESRCH:
+        return B_BAD_THREAD_ID;
+    case EPERM:
+        return B_PERMISSION_DENIED;
+    default:
+        return B_BAD_VALUE;
+    }
+}
+
+status_t get_thread_affinity(thread_id thread, void *cpuMask, size_t maskSize)
+{
+    if (!cpuMask) return B_BAD_VALUE;
+
+    cpu_set_t set;
+    if (sched_getaffinity(thread, sizeof(set), &set) != 0) {
+        return errno == ESRCH ? B_BAD_THREAD_ID : B_BAD_VALUE;
+    }
+    memset(cpuMask, 0, maskSize);
+    memcpy(cpuMask, &set, min_c(maskSize, sizeof(set)));
+    return B_OK;
+}
+
+/* Keeps thread on CPUs of NUMA node. For calling thread memory is also
+ * preferably allocated from the node.
+ */
+status_t set_thread_numa_node(thread_id thread, int32 node)
+{
+    if (node < 0) return B_BAD_VALUE;
+
+    char path[64];
+    snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", (int)node);
+    FILE *file = fopen(path, "r");
+    if (!file) return B_BAD_VALUE;
+
+    /* cpulist is like "0-7,16-23" */
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    int first, last;
+    char separator = ',';
+    while (separator == ',' && fscanf(file, "%d", &first) == 1) {
+        last = first;
+        if (fscanf(file, "%c", &separator) == 1 && separator == '-') {
+            if (fscanf(file, "%d", &last) != 1) break;
+            if (fscanf(file, "%c", &separator) != 1) separator = '\n';
+        }
+        for (int cpu = first; cpu <= last && cpu < CPU_SETSIZE; cpu++) CPU_SET(cpu, &set);
+    }
+    fclose(file);
+    if (CPU_COUNT(&set) == 0) return B_BAD_VALUE;
+
+    status_t status = set_thread_affinity(thread, &set, sizeof(set));
+    if (status != B_OK || thread != _info->tid) return status;
+
+    unsigned long nodemask[4] = {};
+    if ((size_t)node >= sizeof(nodemask) * 8) return B_OK;
+    nodemask[node / (sizeof(long) * 8)] = 1UL << (node % (sizeof(long) * 8));
+    /* MPOL_PREFERRED, only a hint */
+    syscall(SYS_set_mempolicy, 1, nodemask, sizeof(nodemask) * 8);
+    return B_OK;
+}
+
 status_t rename_thread(thread_id thread, const char *new_name)
 {
 	_threads_rlock();
@@ -383,90 +767,80 @@ status_t rename_thread(thread_id thread, const char *new_name)
 
 bool has_data(thread_id thread)
 {
-    _thread_info *info = _find_thread_info(thread);
-	if (!info) return false;
-
-	int nbytes = 0;
-	ioctl(info->data_pipe[0], FIONREAD, &nbytes);
-	return nbytes > 0;
+	_threads_rlock();
+	_thread_info *info = _find_thread_info(thread);
+	bool queued = info && __atomic_load_n(&info->mailbox->count, __ATOMIC_ACQUIRE) > 0;
+	_threads_unlock();
+	return queued;
 }
 
 status_t send_data(thread_id thread, int32 code, const void *buffer, size_t bufferSize)
 {
-	if (bufferSize > PIPE_BUF - sizeof(thread_id) - sizeof(int32))
-		return B_BAD_VALUE;
-
-	int write_end = _get_thread_data_write_fd(thread);
-	if (write_end < 0)
-		return write_end;
-
-	size_t data_size   = sizeof(thread_id) + sizeof(int32) + bufferSize;
-	void  *data_buffer = malloc(data_size);	 // FIXME: mmap
-	if (!data_buffer)
-		return B_NO_MEMORY;
-
-	void *write_ptr			  = data_buffer;
-	(*(thread_id *)write_ptr) = _info->tid;
-	write_ptr += sizeof(pid_t);
-	(*(int32 *)write_ptr) = code;
-	write_ptr += sizeof(int32);
-	if (buffer && bufferSize)
-		memcpy(write_ptr, buffer, bufferSize);
-
-	if (write(write_end, data_buffer, data_size) < 0) {
-		free(data_buffer);
-
-		switch (errno) {
-			case EINTR:
-				return B_INTERRUPTED;
-			case EPIPE:
-				return B_BAD_THREAD_ID;
-			default:
-				return B_FROM_POSIX_ERROR(errno);
-		}
-	}
+	_threads_rlock();
+	_thread_info *info = _find_thread_info(thread);
+	_thread_mailbox *mailbox = info ? info->mailbox : NULL;
+	if (mailbox) atomic_add(&mailbox->refs, 1);
+	_threads_unlock();
+	if (!mailbox) return B_BAD_THREAD_ID;
 
-	free(data_buffer);
-	return B_OK;
+	status_t status = _mailbox_send(mailbox, code, buffer, bufferSize);
+	_mailbox_release(mailbox);
+	return status;
 }
 
 int32 receive_data(thread_id *sender, void *buffer, size_t bufferSize)
 {
+	_thread_mailbox *mailbox = _info->mailbox;
 	_info->state = B_THREAD_RECEIVING;
 
-	size_t head_size   = sizeof(thread_id) + sizeof(int32);
-	size_t data_size   = head_size + bufferSize;
-	void  *data_buffer = malloc(data_size);	 // FIXME: mmap
-	if (!data_buffer)
-		return B_NO_MEMORY;
-
-	int bytes_read = read(_info->data_pipe[0], data_buffer, data_size);
-	if (bytes_read < head_size) {
-		free(data_buffer);
-
-		if (bytes_read < 0) {
-			switch (errno) {
-				case EINTR:
-					return B_INTERRUPTED;
-				case EPIPE:
-					return B_BUSTED_PIPE;
-				default:
-					return B_FROM_POSIX_ERROR(errno);
-			}
+	_mailbox_record *rec;
+	for (;;) {
+		uint32 seq = __atomic_load_n(&mailbox->doorbell, __ATOMIC_ACQUIRE);
+		rec = _mailbox_record_at(mailbox, mailbox->head);
+		uint32 len = __atomic_load_n(&rec->len, __ATOMIC_ACQUIRE);
+		if (len & MAILBOX_RECORD_PAD) {
+			len &= MAILBOX_RECORD_MASK;
+			memset(rec, 0, len);
+			__atomic_store_n(&mailbox->head, mailbox->head + len, __ATOMIC_RELEASE);
+			continue;
+		}
+		if (len != 0) break;
+
+		atomic_add(&mailbox->receiving, 1);
+		long ret = _futex_wait(&mailbox->doorbell, seq);
+		atomic_sub(&mailbox->receiving, 1);
+		if (ret != 0 && errno == EINTR) {
+			_info->state = 0;
+			return B_INTERRUPTED;
 		}
-
-		return B_RESULT_NOT_REPRESENTABLE;
 	}
 
-	if (sender) {
-		*sender = *((thread_id *)data_buffer);
+	if (sender) *sender = rec->sender;
+	int32 code = rec->code;
+	if (rec->len & MAILBOX_RECORD_HEAP) {
+		void *heap = *(void **)(rec + 1);
+		if (buffer && bufferSize) memcpy(buffer, heap, min_c(bufferSize, rec->size));
+		free(heap);
 	}
-	int32 code = *((int32 *)(data_buffer + sizeof(thread_id)));
-	if (buffer && bufferSize) {
-		memcpy(buffer, data_buffer + head_size, min_c(bufferSize, bytes_read - head_size));
+	else if (buffer && bufferSize) {
+		memcpy(buffer, rec + 1, min_c(bufferSize, rec->size));
 	}
 
-	free(data_buffer);
+	size_t reclen = rec->len & MAILBOX_RECORD_MASK;
+	memset(rec, 0, reclen);
+	__atomic_store_n(&mailbox->head, mailbox->head + reclen, __ATOMIC_RELEASE);
+	int32 queued = atomic_sub(&mailbox->count, 1);
+
+	atomic_add(&mailbox->space, 1);
+	if (mailbox->senders) _futex_wake(&mailbox->space, INT_MAX);
+
+	/* leave eventfd readable only while there is something to receive */
+	if (queued == 0 && mailbox->eventfd >= 0) {
+		eventfd_t value;
+		eventfd_read(mailbox->eventfd, &value);
+		if (__atomic_load_n(&mailbox->count, __ATOMIC_SEQ_CST) > 0)
+			eventfd_write(mailbox->eventfd, 1);
+	}
 
 	_info->state = 0;
 
@@ -475,23 +849,17 @@ int32 receive_data(thread_id *sender, void *buffer, size_t bufferSize)
 
 int _get_thread_data_read_fd()
 {
-	return _info->data_pipe[0];
-}
-
-int _get_thread_data_write_fd(thread_id thread)
-{
-	_threads_rlock();
-	_thread_info *info = _find_thread_info(thread);
-
-	if (!info) {
-		_threads_unlock();
-		return B_BAD_THREAD_ID;
+	_thread_mailbox *mailbox = _info->mailbox;
+	if (mailbox->eventfd < 0) {
+		int fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+		if (fd < 0) return B_FROM_POSIX_ERROR(errno);
+
+		__atomic_store_n(&mailbox->eventfd, fd, __ATOMIC_SEQ_CST);
+		/* ring for messages queued before */
+		if (__atomic_load_n(&mailbox->count, __ATOMIC_SEQ_CST) > 0)
+			eventfd_write(fd, 1);
 	}
-
-	int write_end = info->data_pipe[1];
-	_threads_unlock();
-
-	return write_end;
+	return mailbox->eventfd;
 }
 
 /** WARNING! you need to lock _threads in caller function! */
@@ -522,11 +890,24 @@ static status_t _fill_thread_info(thread_info *info, _thread_info *_nfo, size_t
         break;
     }
 
-    struct rusage usage;
-    getrusage(RUSAGE_THREAD, &usage);
-    info->user_time = usage.ru_utime.tv_sec * 1000000 + usage.ru_utime.tv_usec;
-    info->kernel_time = usage.ru_stime.tv_sec * 1000000 + usage.ru_stime.tv_usec;
+    return B_OK;
+}
+
+/* reads /proc, so call it without _threads lock */
+static void _fill_thread_times(thread_info *info)
+{
+    thread_info proc;
+    if (_proc_get_thread(info->team, info->thread, &proc) == B_OK) {
+        info->user_time = proc.user_time;
+        info->kernel_time = proc.kernel_time;
+    }
+}
 
+/* threads not spawned by spawn_thread(), or of other teams */
+static status_t _fill_proc_thread_info(thread_info *info, thread_info *proc, size_t size)
+{
+    if (!info || size > sizeof(thread_info)) return B_BAD_VALUE;
+    memcpy(info, proc, size);
     return B_OK;
 }
 
@@ -534,17 +915,24 @@ status_t _get_thread_info(thread_id id, thread_info *info, size_t size)
 {
     _threads_rlock();
     _thread_info *_nfo = _find_thread_info(id);
-    if (!_nfo) return B_BAD_VALUE;
+    if (!_nfo) {
+        _threads_unlock();
+        thread_info proc;
+        status_t ret = _proc_get_thread(0, id, &proc);
+        return ret == B_OK ? _fill_proc_thread_info(info, &proc, size) : ret;
+    }
     status_t ret = _fill_thread_info(info, _nfo, size);
     _threads_unlock();
+    if (ret == B_OK) _fill_thread_times(info);
     return ret;
 }
 
 status_t _get_next_thread_info(team_id team, int32 *cookie, thread_info *info, size_t size)
 {
     if (team != 0 && team != _info->team) {
-        // do not support getting threads of other team
-        return B_BAD_VALUE;
+        thread_info proc;
+        status_t ret = _proc_next_thread(team, cookie, &proc);
+        return ret == B_OK ? _fill_proc_thread_info(info, &proc, size) : ret;
     }
 
     status_t ret = B_OK;
@@ -552,7 +940,7 @@ status_t _get_next_thread_info(team_id team, int32 *cookie, thread_info *info, s
     _thread_info *_nfo;
     _threads_rlock();
     if (*cookie) {
-        DL_SEARCH_SCALAR(_threads, _nfo, tid, *cookie);
+        _nfo = _find_thread_info(*cookie);
         if (!_nfo) {
             ret = B_BAD_VALUE;
             goto exit;
@@ -570,5 +958,6 @@ status_t _get_next_thread_info(team_id team, int32 *cookie, thread_info *info, s
     ret = _fill_thread_info(info, _nfo, size);
 exit:
     _threads_unlock();
+    if (ret == B_OK) _fill_thread_times(info);
     return ret;
 }
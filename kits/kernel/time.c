@@ -1,38 +1,200 @@
 #include <OS.h>
 
 #include <time.h>
+#include <stdio.h>
 #include <errno.h>
 #include <assert.h>
+#include <string.h>
 #include <unistd.h>
 #include <pthread.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <x86intrin.h>
+#endif
 
 #include "private.h"
 
-uint32 real_time_clock()
+/* TSC clock source.
+ * system_time() extrapolates from the last resync point with a multiply
+ * and shift of elapsed TSC ticks. The first caller that finds the resync
+ * point older than TSC_RESYNC_USECS reads CLOCK_MONOTONIC again, refines
+ * the frequency over the whole run, and slews the rate so the error is
+ * gone by the next resync instead of stepping the clock back.
+ * Readers never lock, resync publishes under a sequence counter.
+ */
+#define TSC_CALIBRATE_USECS 10000
+#define TSC_RESYNC_USECS    50000
+#define TSC_STEP_USECS      1000    // larger errors are stepped, not slewed
+#define TSC_SHIFT           40
+
+typedef struct {
+    uint32      seq;            // odd while resync is in progress
+    uint64      base_tsc;
+    bigtime_t   base_usecs;
+    uint64      mult;           // usecs per tick << TSC_SHIFT
+    uint64      resync_ticks;
+    bigtime_t   realtime_offset; // CLOCK_REALTIME - CLOCK_MONOTONIC
+} _tsc_clock;
+
+static _tsc_clock _tsc;
+static uint64 _tsc_origin_tsc; // calibration baseline
+static bigtime_t _tsc_origin_usecs;
+static pthread_mutex_t _tsc_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint32 _time_source = B_MONOTONIC_CLOCK_SOURCE;
+
+static inline bigtime_t _clock_usecs(clockid_t clock)
 {
     struct timespec tm;
-    if (clock_gettime(CLOCK_REALTIME, &tm) != 0) {
+    if (clock_gettime(clock, &tm) != 0) {
         return 0;
     }
-    return tm.tv_sec;
+    return tm.tv_sec * 1000000 + tm.tv_nsec / 1000;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+#define _rdtsc() __rdtsc()
+
+static bool _tsc_invariant(void)
+{
+    unsigned int eax, ebx, ecx, edx;
+    if (!__get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx) || !(edx & (1 << 8)))
+        return false;
+
+    /* kernel switches away from TSC when cores are not in sync */
+    char source[16] = { 0 };
+    FILE *file = fopen("/sys/devices/system/clocksource/clocksource0/current_clocksource", "re");
+    if (!file) return false;
+    bool tsc = fgets(source, sizeof(source), file) && strncmp(source, "tsc\n", 4) == 0;
+    fclose(file);
+    return tsc;
+}
+#else
+#define _rdtsc() 0ULL
+
+static bool _tsc_invariant(void)
+{
+    return false;
+}
+#endif
+
+/* WARNING! you need to lock _tsc_lock in caller function! */
+static void _tsc_resync(void)
+{
+    uint64 tsc = _rdtsc();
+    bigtime_t now = _clock_usecs(CLOCK_MONOTONIC);
+    bigtime_t offset = _clock_usecs(CLOCK_REALTIME) - now;
+
+    uint64 mult = ((unsigned __int128)(now - _tsc_origin_usecs) << TSC_SHIFT) / (tsc - _tsc_origin_tsc);
+    uint64 resync_ticks = ((uint64)TSC_RESYNC_USECS << TSC_SHIFT) / mult;
+    bigtime_t base = now;
+
+    uint64 elapsed = tsc - _tsc.base_tsc;
+    if (_tsc.mult && elapsed < 2 * _tsc.resync_ticks) {
+        bigtime_t current = _tsc.base_usecs + (bigtime_t)((elapsed * _tsc.mult) >> TSC_SHIFT);
+        bigtime_t error = now - current;
+        if (error > -TSC_STEP_USECS && error < TSC_STEP_USECS) {
+            /* stay continuous, catch up by next resync */
+            base = current;
+            mult += error * ((int64)1 << TSC_SHIFT) / (int64)resync_ticks;
+        }
+    }
+
+    atomic_add(&_tsc.seq, 1);
+    __atomic_store_n(&_tsc.base_tsc, tsc, __ATOMIC_RELAXED);
+    __atomic_store_n(&_tsc.base_usecs, base, __ATOMIC_RELAXED);
+    __atomic_store_n(&_tsc.mult, mult, __ATOMIC_RELAXED);
+    __atomic_store_n(&_tsc.resync_ticks, resync_ticks, __ATOMIC_RELAXED);
+    __atomic_store_n(&_tsc.realtime_offset, offset, __ATOMIC_RELAXED);
+    atomic_add(&_tsc.seq, 1);
+}
+
+/* monotonic time, plus realtime offset when asked for */
+static bigtime_t _tsc_time(bigtime_t *realtime_offset)
+{
+    for (;;) {
+        uint32 seq;
+        while ((seq = __atomic_load_n(&_tsc.seq, __ATOMIC_ACQUIRE)) & 1) {
+            cpu_relax();
+        }
+        uint64 base_tsc = __atomic_load_n(&_tsc.base_tsc, __ATOMIC_RELAXED);
+        bigtime_t base = __atomic_load_n(&_tsc.base_usecs, __ATOMIC_RELAXED);
+        uint64 mult = __atomic_load_n(&_tsc.mult, __ATOMIC_RELAXED);
+        uint64 resync_ticks = __atomic_load_n(&_tsc.resync_ticks, __ATOMIC_RELAXED);
+        if (realtime_offset)
+            *realtime_offset = __atomic_load_n(&_tsc.realtime_offset, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&_tsc.seq, __ATOMIC_RELAXED) != seq)
+            continue;
+
+        uint64 elapsed = _rdtsc() - base_tsc;
+        if (likely(elapsed < resync_ticks))
+            return base + (bigtime_t)((elapsed * mult) >> TSC_SHIFT);
+
+        pthread_mutex_lock(&_tsc_lock);
+        if (__atomic_load_n(&_tsc.seq, __ATOMIC_RELAXED) == seq)
+            _tsc_resync();
+        pthread_mutex_unlock(&_tsc_lock);
+    }
+}
+
+status_t set_system_time_source(uint32 source)
+{
+    switch (source) {
+    case B_MONOTONIC_CLOCK_SOURCE:
+        __atomic_store_n(&_time_source, source, __ATOMIC_RELEASE);
+        return B_OK;
+    case B_TSC_CLOCK_SOURCE:
+        break;
+    default:
+        return B_BAD_VALUE;
+    }
+
+    if (!_tsc_invariant()) return B_NOT_SUPPORTED;
+
+    pthread_mutex_lock(&_tsc_lock);
+    if (!_tsc.mult) {
+        _tsc_origin_tsc = _rdtsc();
+        _tsc_origin_usecs = _clock_usecs(CLOCK_MONOTONIC);
+        snooze(TSC_CALIBRATE_USECS);
+        _tsc_resync();
+    }
+    pthread_mutex_unlock(&_tsc_lock);
+
+    __atomic_store_n(&_time_source, source, __ATOMIC_RELEASE);
+    return B_OK;
 }
 
+uint32 get_system_time_source()
+{
+    return __atomic_load_n(&_time_source, __ATOMIC_ACQUIRE);
+}
+
+uint32 real_time_clock()
+{
+    return real_time_clock_usecs() / 1000000;
+}
+
+/* with the TSC, a change of the wall clock shows up at next resync */
 bigtime_t real_time_clock_usecs()
 {
-    struct timespec tm;
-    if (clock_gettime(CLOCK_REALTIME, &tm) != 0) {
-        return 0;
+    if (__atomic_load_n(&_time_source, __ATOMIC_ACQUIRE) == B_TSC_CLOCK_SOURCE) {
+        bigtime_t offset;
+        bigtime_t now = _tsc_time(&offset);
+        return now + offset;
     }
-    return tm.tv_sec * 1000000 + tm.tv_nsec / 1000;
+    return _clock_usecs(CLOCK_REALTIME);
 }
 
 bigtime_t system_time()
 {
-    struct timespec tm;
-    if (clock_gettime(CLOCK_MONOTONIC, &tm) != 0) {
-        return 0;
-    }
-    return tm.tv_sec * 1000000 + tm.tv_nsec / 1000;
+    if (__atomic_load_n(&_time_source, __ATOMIC_ACQUIRE) == B_TSC_CLOCK_SOURCE)
+        return _tsc_time(NULL);
+    return _clock_usecs(CLOCK_MONOTONIC);
+}
+
+bigtime_t system_time_coarse()
+{
+    return _clock_usecs(CLOCK_MONOTONIC_COARSE);
 }
 
 static status_t _snooze(bigtime_t microseconds, int flags)
@@ -0,0 +1,339 @@
+#include <OS.h>
+
+#include <stdlib.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/timerfd.h>
+
+#include "private.h"
+#include "idhash.h"
+
+/* Timer service.
+ * All timers of the team live in one min-heap ordered by deadline and are
+ * fired by a single service thread sleeping on a timerfd. The timerfd is
+ * armed for the earliest deadline plus its slack, and every timer due by
+ * then fires in the same wakeup. Periodic timers fired together are
+ * rescheduled from the same base, so they stay in phase afterwards.
+ */
+#define TIMER_HEAP_MIN      64
+
+typedef struct {
+    timer_id    id;
+    timer_hook  hook;
+    void        *data;
+    bigtime_t   deadline;
+    bigtime_t   period;
+    bigtime_t   slack;
+    int32       index;      // heap position, -1 when not queued
+} _timer;
+
+static pthread_mutex_t _timer_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t _timer_done = PTHREAD_COND_INITIALIZER;
+static pthread_once_t _timer_once = PTHREAD_ONCE_INIT;
+
+static _timer **_timer_heap = NULL;
+static int32 _timer_heap_size = 0;
+static int32 _timer_heap_count = 0;
+static _idhash _timer_index;
+static timer_id _timer_next_id = 1;
+
+static int _timer_fd = -1;
+static thread_id _timer_thread = -1;
+static _timer *_timer_running = NULL;   // hook being called
+static bool _timer_running_cancelled = false;
+
+static timer_id _timer_alarm = -1;
+
+/* WARNING! you need to lock _timer_lock in caller function! */
+static inline bool _timer_before(_timer *a, _timer *b)
+{
+    return a->deadline < b->deadline;
+}
+
+static inline void _timer_heap_set(int32 index, _timer *timer)
+{
+    _timer_heap[index] = timer;
+    timer->index = index;
+}
+
+static void _timer_sift_up(int32 index)
+{
+    _timer *timer = _timer_heap[index];
+    while (index > 0) {
+        int32 parent = (index - 1) / 2;
+        if (!_timer_before(timer, _timer_heap[parent])) break;
+        _timer_heap_set(index, _timer_heap[parent]);
+        index = parent;
+    }
+    _timer_heap_set(index, timer);
+}
+
+static void _timer_sift_down(int32 index)
+{
+    _timer *timer = _timer_heap[index];
+    for (;;) {
+        int32 child = index * 2 + 1;
+        if (child >= _timer_heap_count) break;
+        if (child + 1 < _timer_heap_count && _timer_before(_timer_heap[child + 1], _timer_heap[child]))
+            child++;
+        if (!_timer_before(_timer_heap[child], timer)) break;
+        _timer_heap_set(index, _timer_heap[child]);
+        index = child;
+    }
+    _timer_heap_set(index, timer);
+}
+
+static status_t _timer_heap_push(_timer *timer)
+{
+    if (_timer_heap_count == _timer_heap_size) {
+        int32 size = _timer_heap_size ? _timer_heap_size * 2 : TIMER_HEAP_MIN;
+        _timer **heap = realloc(_timer_heap, size * sizeof(_timer *));
+        if (!heap) return B_NO_MEMORY;
+        _timer_heap = heap;
+        _timer_heap_size = size;
+    }
+    _timer_heap_set(_timer_heap_count++, timer);
+    _timer_sift_up(timer->index);
+    return B_OK;
+}
+
+static void _timer_heap_remove(_timer *timer)
+{
+    int32 index = timer->index;
+    _timer *last = _timer_heap[--_timer_heap_count];
+    timer->index = -1;
+    if (last == timer) return;
+
+    _timer_heap_set(index, last);
+    if (index > 0 && _timer_before(last, _timer_heap[(index - 1) / 2]))
+        _timer_sift_up(index);
+    else
+        _timer_sift_down(index);
+}
+
+/* WARNING! you need to lock _timer_lock in caller function! */
+static void _timer_arm(void)
+{
+    struct itimerspec spec = { 0 };
+    if (_timer_heap_count) {
+        bigtime_t when = _timer_heap[0]->deadline + _timer_heap[0]->slack;
+        if (when <= 0) when = 1; // zero would disarm
+        spec.it_value.tv_sec = when / 1000000;
+        spec.it_value.tv_nsec = (when % 1000000) * 1000;
+    }
+    timerfd_settime(_timer_fd, TFD_TIMER_ABSTIME, &spec, NULL);
+}
+
+static int32 _timer_service(void *data)
+{
+    (void)data;
+
+    for (;;) {
+        uint64 expirations;
+        if (read(_timer_fd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN && errno != EINTR)
+            break;
+
+        pthread_mutex_lock(&_timer_lock);
+        bigtime_t now = system_time();
+        bigtime_t base = _timer_heap_count ? _timer_heap[0]->deadline : now;
+
+        while (_timer_heap_count && _timer_heap[0]->deadline <= now) {
+            _timer *timer = _timer_heap[0];
+            _timer_heap_remove(timer);
+
+            _timer_running = timer;
+            _timer_running_cancelled = false;
+            pthread_mutex_unlock(&_timer_lock);
+
+            timer->hook(timer->data);
+
+            pthread_mutex_lock(&_timer_lock);
+            _timer_running = NULL;
+            if (_timer_running_cancelled) {
+                /* canceller left freeing to us */
+                free(timer);
+            } else if (timer->index < 0 && timer->period > 0) {
+                /* not reset by the hook */
+                timer->deadline = base + timer->period;
+                if (timer->deadline <= now)
+                    timer->deadline += ((now - timer->deadline) / timer->period + 1) * timer->period;
+                if (_timer_heap_push(timer) != B_OK) {
+                    _idhash_remove(&_timer_index, timer->id);
+                    free(timer);
+                }
+            } else if (timer->index < 0) {
+                _idhash_remove(&_timer_index, timer->id);
+                free(timer);
+            }
+            pthread_cond_broadcast(&_timer_done);
+        }
+
+        _timer_arm();
+        pthread_mutex_unlock(&_timer_lock);
+    }
+
+    close(_timer_fd);
+    _timer_fd = -1;
+    return B_ERROR;
+}
+
+static void _timer_service_start(void)
+{
+    _timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+    if (_timer_fd < 0) return;
+
+    _timer_thread = spawn_thread(_timer_service, "timer service", B_URGENT_DISPLAY_PRIORITY, NULL);
+    if (_timer_thread < 0) {
+        close(_timer_fd);
+        _timer_fd = -1;
+        return;
+    }
+    resume_thread(_timer_thread);
+}
+
+timer_id add_timer(timer_hook hook, void *data, bigtime_t when, bigtime_t period, bigtime_t slack)
+{
+    if (!hook || period < 0 || slack < 0) return B_BAD_VALUE;
+
+    pthread_once(&_timer_once, _timer_service_start);
+    if (_timer_fd < 0) return B_NO_MORE_THREADS;
+
+    _timer *timer = malloc(sizeof(_timer));
+    if (!timer) return B_NO_MEMORY;
+    timer->hook = hook;
+    timer->data = data;
+    timer->deadline = when;
+    timer->period = period;
+    timer->slack = slack;
+    timer->index = -1;
+
+    pthread_mutex_lock(&_timer_lock);
+    timer->id = _timer_next_id++;
+    if (_timer_next_id <= 0) _timer_next_id = 1;
+
+    status_t result = _idhash_insert(&_timer_index, timer->id, timer);
+    if (result == B_OK) {
+        result = _timer_heap_push(timer);
+        if (result != B_OK) _idhash_remove(&_timer_index, timer->id);
+    }
+    if (result != B_OK) {
+        pthread_mutex_unlock(&_timer_lock);
+        free(timer);
+        return result;
+    }
+
+    if (timer->index == 0) _timer_arm();
+    pthread_mutex_unlock(&_timer_lock);
+    return timer->id;
+}
+
+status_t reset_timer(timer_id id, bigtime_t when, bigtime_t period)
+{
+    if (period < 0) return B_BAD_VALUE;
+
+    pthread_mutex_lock(&_timer_lock);
+    _timer *timer = _idhash_find(&_timer_index, id);
+    if (!timer || (timer == _timer_running && _timer_running_cancelled)) {
+        pthread_mutex_unlock(&_timer_lock);
+        return B_BAD_VALUE;
+    }
+
+    bool wasFirst = timer->index == 0;
+    if (timer->index >= 0) _timer_heap_remove(timer);
+    timer->deadline = when;
+    timer->period = period;
+
+    status_t result = _timer_heap_push(timer);
+    if (result != B_OK) {
+        /* cannot fail, removal above made room */
+        _idhash_remove(&_timer_index, timer->id);
+        if (timer != _timer_running) free(timer);
+        else _timer_running_cancelled = true;
+    }
+    else if (wasFirst || timer->index == 0) _timer_arm();
+    pthread_mutex_unlock(&_timer_lock);
+    return result;
+}
+
+status_t cancel_timer(timer_id id)
+{
+    pthread_mutex_lock(&_timer_lock);
+    _timer *timer = _idhash_remove(&_timer_index, id);
+    if (!timer) {
+        pthread_mutex_unlock(&_timer_lock);
+        return B_BAD_VALUE;
+    }
+
+    if (timer->index >= 0) {
+        bool wasFirst = timer->index == 0;
+        _timer_heap_remove(timer);
+        if (wasFirst) _timer_arm();
+    }
+
+    if (timer == _timer_running) {
+        /* service thread frees it once hook returns */
+        _timer_running_cancelled = true;
+        if (find_thread(NULL) != _timer_thread) {
+            while (_timer_running == timer)
+                pthread_cond_wait(&_timer_done, &_timer_lock);
+        }
+    } else {
+        free(timer);
+    }
+    pthread_mutex_unlock(&_timer_lock);
+    return B_OK;
+}
+
+static void _alarm_hook(void *data)
+{
+    (void)data;
+    kill(getpid(), SIGALRM);
+}
+
+bigtime_t set_alarm(bigtime_t when, uint32 flags)
+{
+    bigtime_t now = system_time();
+    bigtime_t remaining = 0;
+    bigtime_t period = 0;
+
+    switch (flags) {
+    case B_ONE_SHOT_ABSOLUTE_ALARM:
+        break;
+    case B_ONE_SHOT_RELATIVE_ALARM:
+        if (when != B_INFINITE_TIMEOUT) when += now;
+        break;
+    case B_PERIODIC_ALARM:
+        if (when <= 0) return B_BAD_VALUE;
+        if (when != B_INFINITE_TIMEOUT) {
+            period = when;
+            when += now;
+        }
+        break;
+    default:
+        return B_BAD_VALUE;
+    }
+
+    pthread_mutex_lock(&_timer_lock);
+    if (_timer_alarm > 0) {
+        _timer *timer = _idhash_find(&_timer_index, _timer_alarm);
+        if (timer && timer->index >= 0)
+            remaining = max_c(timer->deadline - now, 0);
+    }
+    timer_id previous = _timer_alarm;
+    _timer_alarm = -1;
+    pthread_mutex_unlock(&_timer_lock);
+
+    if (previous > 0) cancel_timer(previous);
+
+    /* B_INFINITE_TIMEOUT just cancels */
+    if (when != B_INFINITE_TIMEOUT) {
+        timer_id timer = add_timer(_alarm_hook, NULL, when, period, 0);
+        if (timer < 0) return timer;
+        pthread_mutex_lock(&_timer_lock);
+        _timer_alarm = timer;
+        pthread_mutex_unlock(&_timer_lock);
+    }
+    return remaining;
+}
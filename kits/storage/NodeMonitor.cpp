@@ -0,0 +1,68 @@
+#include "NodeMonitor.h"
+
+#include <Looper.h>
+#include <Node.h>
+#include <syscalls.h>
+
+port_id _get_looper_port_(const BLooper *looper);
+int32	_get_handler_token_(const BHandler *handler);
+
+// Resolves messenger to the port of its looper, and the token of its
+// handler. Notifications carry the token, so the looper routes them to
+// that handler, and handlers of one looper stop watching apart.
+static status_t get_target(const BMessenger &target, port_id *port, int32 *token)
+{
+	BLooper	*looper;
+	BHandler *handler = target.Target(&looper);
+	if (!looper && handler)
+		looper = handler->Looper();
+	if (!looper)
+		return B_BAD_VALUE;
+
+	*port  = _get_looper_port_(looper);
+	*token = _get_handler_token_(handler ? handler : looper);
+	return *port >= B_OK ? B_OK : B_BAD_PORT_ID;
+}
+
+status_t watch_node(const node_ref *node, uint32 flags, BMessenger target)
+{
+	if (!target.IsValid())
+		return B_BAD_VALUE;
+
+	port_id	 port;
+	int32	 token;
+	status_t error = get_target(target, &port, &token);
+	if (error != B_OK)
+		return error;
+
+	if (flags == B_STOP_WATCHING)
+		return node ? _kern_stop_watching(node->fd, port, token) : B_BAD_VALUE;
+
+	if (!node)
+		return B_BAD_VALUE;
+	return _kern_start_watching(node->fd, flags, port, token);
+}
+
+status_t watch_node(const node_ref *node, uint32 flags, const BHandler *handler, const BLooper *looper)
+{
+	return watch_node(node, flags, BMessenger(handler, looper));
+}
+
+status_t stop_watching(BMessenger target)
+{
+	if (!target.IsValid())
+		return B_BAD_VALUE;
+
+	port_id	 port;
+	int32	 token;
+	status_t error = get_target(target, &port, &token);
+	if (error != B_OK)
+		return error;
+
+	return _kern_stop_notifying(port, token);
+}
+
+status_t stop_watching(const BHandler *handler, const BLooper *looper)
+{
+	return stop_watching(BMessenger(handler, looper));
+}
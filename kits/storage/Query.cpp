@@ -0,0 +1,333 @@
+#include "Query.h"
+
+#include <Entry.h>
+#include <String.h>
+#include <fs_query.h>
+#include <pimpl.h>
+
+#include <ctype.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+class BQuery::impl
+{
+   public:
+	enum element_kind {
+		ATTRIBUTE,
+		VALUE,
+		STRING,	 // text is escaped, without quotes
+		EXPRESSION
+	};
+
+	struct element {
+		element_kind kind;
+		std::string	 text;
+	};
+
+	std::vector<element> stack;
+	std::string			 predicate;
+	dev_t				 device = -1;
+	DIR					*query	= nullptr;
+
+	impl() = default;
+	~impl() { close(); }
+
+	void close()
+	{
+		if (query)
+			fs_close_query(query);
+		query = nullptr;
+	}
+
+	status_t push(element_kind kind, const std::string &text)
+	{
+		if (query)
+			return B_NOT_ALLOWED;
+		stack.push_back({kind, text});
+		predicate.clear();
+		return B_OK;
+	}
+
+	status_t push_value(const char *format, ...) __attribute__((format(printf, 2, 3)));
+	status_t build();
+};
+
+status_t BQuery::impl::push_value(const char *format, ...)
+{
+	char	text[64];
+	va_list args;
+	va_start(args, format);
+	vsnprintf(text, sizeof(text), format, args);
+	va_end(args);
+	return push(VALUE, text);
+}
+
+// Predicate of the stack, which must hold one expression.
+status_t BQuery::impl::build()
+{
+	if (!predicate.empty())
+		return B_OK;
+	if (stack.size() != 1 || stack[0].kind != EXPRESSION)
+		return B_NO_INIT;
+	predicate = stack[0].text;
+	return B_OK;
+}
+
+BQuery::BQuery()
+	: BEntryList() {}
+
+BQuery::~BQuery() {}
+
+status_t BQuery::Clear()
+{
+	m->close();
+	m->stack.clear();
+	m->predicate.clear();
+	return B_OK;
+}
+
+status_t BQuery::PushAttr(const char *attrName)
+{
+	if (!attrName || !attrName[0])
+		return B_BAD_VALUE;
+	std::string text(attrName);
+	if (text.find_first_of("=!<>()&|\"' \t") != std::string::npos) {
+		std::string quoted("\"");
+		for (char c : text) {
+			if (c == '"' || c == '\\')
+				quoted += '\\';
+			quoted += c;
+		}
+		text = quoted + '"';
+	}
+	return m->push(impl::ATTRIBUTE, text);
+}
+
+status_t BQuery::PushOp(query_op op)
+{
+	static const char *const ops[] = {nullptr, "==", ">", ">=", "<", "<=", "!="};
+
+	if (m->query)
+		return B_NOT_ALLOWED;
+	std::vector<impl::element> &stack = m->stack;
+	size_t						size  = stack.size();
+	std::string					text;
+
+	if (op == B_NOT) {
+		if (size < 1 || stack[size - 1].kind != impl::EXPRESSION)
+			return B_BAD_VALUE;
+		text = "(!" + stack[size - 1].text + ")";
+		stack.pop_back();
+	} else if (op == B_AND || op == B_OR) {
+		if (size < 2 || stack[size - 2].kind != impl::EXPRESSION || stack[size - 1].kind != impl::EXPRESSION)
+			return B_BAD_VALUE;
+		text = "(" + stack[size - 2].text + (op == B_AND ? "&&" : "||") + stack[size - 1].text + ")";
+		stack.resize(size - 2);
+	} else if (op >= B_EQ && op <= B_ENDS_WITH) {
+		if (size < 2 || stack[size - 2].kind != impl::ATTRIBUTE
+			|| (stack[size - 1].kind != impl::VALUE && stack[size - 1].kind != impl::STRING))
+			return B_BAD_VALUE;
+		const impl::element &value = stack[size - 1];
+		if (op >= B_CONTAINS && value.kind != impl::STRING)
+			return B_BAD_VALUE;
+
+		std::string operand = value.text;
+		if (op == B_CONTAINS || op == B_ENDS_WITH)
+			operand = "*" + operand;
+		if (op == B_CONTAINS || op == B_BEGINS_WITH)
+			operand += "*";
+		if (value.kind == impl::STRING)
+			operand = "\"" + operand + "\"";
+		text = "(" + stack[size - 2].text + (op >= B_CONTAINS ? "==" : ops[op]) + operand + ")";
+		stack.resize(size - 2);
+	} else {
+		return B_BAD_VALUE;
+	}
+	return m->push(impl::EXPRESSION, text);
+}
+
+status_t BQuery::PushUInt32(uint32 value)
+{
+	return m->push_value("%" PRIu32, value);
+}
+
+status_t BQuery::PushInt32(int32 value)
+{
+	return m->push_value("%" PRId32, value);
+}
+
+status_t BQuery::PushUInt64(uint64 value)
+{
+	return m->push_value("%" PRIu64, value);
+}
+
+status_t BQuery::PushInt64(int64 value)
+{
+	return m->push_value("%" PRId64, value);
+}
+
+status_t BQuery::PushFloat(float value)
+{
+	return m->push_value("%.9g", value);
+}
+
+status_t BQuery::PushDouble(double value)
+{
+	return m->push_value("%.17g", value);
+}
+
+// Wildcards stay wildcards, case insensitive letters become [xX].
+status_t BQuery::PushString(const char *value, bool caseInsensitive)
+{
+	if (!value)
+		return B_BAD_VALUE;
+	std::string text;
+	for (const char *p = value; *p; p++) {
+		char lower = tolower(*p), upper = toupper(*p);
+		if (caseInsensitive && lower != upper) {
+			text += '[';
+			text += lower;
+			text += upper;
+			text += ']';
+			continue;
+		}
+		if (*p == '"' || *p == '\\')
+			text += '\\';
+		text += *p;
+	}
+	return m->push(impl::STRING, text);
+}
+
+status_t BQuery::SetVolume(dev_t device)
+{
+	if (m->query)
+		return B_NOT_ALLOWED;
+	m->device = device;
+	return B_OK;
+}
+
+status_t BQuery::SetPredicate(const char *expression)
+{
+	if (m->query)
+		return B_NOT_ALLOWED;
+	if (!expression)
+		return B_BAD_VALUE;
+	m->stack.clear();
+	m->predicate = expression;
+	return B_OK;
+}
+
+bool BQuery::IsLive() const
+{
+	return false;
+}
+
+status_t BQuery::GetPredicate(char *buffer, size_t length)
+{
+	if (!buffer)
+		return B_BAD_VALUE;
+	status_t result = m->build();
+	if (result != B_OK)
+		return result;
+	if (m->predicate.size() >= length)
+		return B_BAD_VALUE;
+	strcpy(buffer, m->predicate.c_str());
+	return B_OK;
+}
+
+status_t BQuery::GetPredicate(BString *predicate)
+{
+	if (!predicate)
+		return B_BAD_VALUE;
+	status_t result = m->build();
+	if (result == B_OK)
+		predicate->SetTo(m->predicate.c_str());
+	return result;
+}
+
+size_t BQuery::PredicateLength()
+{
+	return m->build() == B_OK ? m->predicate.size() + 1 : 0;
+}
+
+dev_t BQuery::TargetDevice() const
+{
+	return m->device;
+}
+
+status_t BQuery::Fetch()
+{
+	if (m->query)
+		return B_NOT_ALLOWED;
+	if (m->device < 0)
+		return B_NO_INIT;
+	status_t result = m->build();
+	if (result != B_OK)
+		return result;
+
+	m->query = fs_open_query(m->device, m->predicate.c_str(), 0);
+	return m->query ? B_OK : errno;
+}
+
+status_t BQuery::GetNextEntry(BEntry *entry, bool traverse)
+{
+	if (!entry)
+		return B_BAD_VALUE;
+	if (!m->query)
+		return B_FILE_ERROR;
+
+	char	path[B_PATH_NAME_LENGTH];
+	dirent *dent = fs_read_query(m->query);
+	if (!dent)
+		return B_ENTRY_NOT_FOUND;
+	status_t result = get_path_for_dirent(dent, path, sizeof(path));
+	return result == B_OK ? entry->SetTo(path, traverse) : result;
+}
+
+status_t BQuery::GetNextRef(entry_ref *ref)
+{
+	if (!ref)
+		return B_BAD_VALUE;
+	if (!m->query)
+		return B_FILE_ERROR;
+
+	char	path[B_PATH_NAME_LENGTH];
+	dirent *dent = fs_read_query(m->query);
+	if (!dent)
+		return B_ENTRY_NOT_FOUND;
+	status_t result = get_path_for_dirent(dent, path, sizeof(path));
+	return result == B_OK ? get_ref_for_path(path, ref) : result;
+}
+
+int32 BQuery::GetNextDirents(struct dirent *buf, size_t length, int32 count)
+{
+	if (!buf)
+		return B_BAD_VALUE;
+	if (!m->query)
+		return B_FILE_ERROR;
+
+	count = min_c((size_t)count, length / sizeof(struct dirent));
+	int32 read;
+	for (read = 0; read < count; read++) {
+		dirent *dent = fs_read_query(m->query);
+		if (!dent)
+			break;
+		buf[read] = *dent;
+	}
+	return read;
+}
+
+status_t BQuery::Rewind()
+{
+	return B_ERROR;
+}
+
+int32 BQuery::CountEntries()
+{
+	return B_ERROR;
+}
@@ -128,6 +128,10 @@ void BLocker::Unlock()
 			// greater than 1 for a semaphore so the release is always done.
 			release_sem(fSemaphoreID);
 		}
+		else if (__builtin_expect(_sem_profiling, 0)) {
+			// The semaphore did not see this hold, account it here.
+			_sem_profile_released(fSemaphoreID);
+		}
 	}
 }
 
@@ -246,6 +250,11 @@ bool BLocker::AcquireLock(bigtime_t timeout, status_t *error)
 			//     to continue to function.
 			//
 		}
+		else if (__builtin_expect(_sem_profiling, 0)) {
+			// Uncontended benaphore acquisitions never reach the semaphore,
+			// record them for the contention profile.
+			_sem_profile_acquired(fSemaphoreID, false, 0);
+		}
 	}
 
 	// If the lock has successfully been acquired.
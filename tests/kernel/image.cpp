@@ -38,5 +38,23 @@ int main(int argc, char **argv)
     get_image_symbol(addon, "_fini", B_SYMBOL_TYPE_TEXT, &fini);
     fprintf(stderr, "addon image symbols: %p %p\n", init, fini);
 
+    // loads of the same add-on share one image and its symbols
+    const char *libm = "libm.so.6";
+    thread_id preload = preload_add_ons(&libm, 1);
+    status_t preloaded;
+    wait_for_thread(preload, &preloaded);
+    image_id first = load_add_on(libm), second = load_add_on(libm);
+    void *cos1 = NULL, *cos2 = NULL, *missing;
+    get_image_symbol(first, "cos", B_SYMBOL_TYPE_TEXT, &cos1);
+    get_image_symbol(second, "cos", B_SYMBOL_TYPE_TEXT, &cos2);
+    fprintf(stderr, "add-on %ld %ld, cos %p %p\n", first, second, cos1, cos2);
+    if (first < 0 || first != second || !cos1 || cos1 != cos2
+        || get_image_symbol(first, "no_such_symbol", B_SYMBOL_TYPE_ANY, &missing) == B_OK) {
+        fprintf(stderr, "add-on registry failed\n");
+        exit(EXIT_FAILURE);
+    }
+    unload_add_on(second);
+    unload_add_on(first);
+
     return return_value;
 }
@@ -0,0 +1,102 @@
+#include <KernelKit.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#define LAUNCHES 20
+
+static const char *true_argv[] = { "/bin/true", NULL };
+
+static bigtime_t launch_image()
+{
+    bigtime_t start = system_time();
+    thread_id team = load_image(1, true_argv, (const char **)environ);
+    if (team < 0 || resume_thread(team) != B_OK) {
+        printf("failed load_image: %d\n", team);
+        exit(EXIT_FAILURE);
+    }
+    bigtime_t launched = system_time() - start;
+    int32 ret;
+    if (wait_for_thread(team, &ret) != B_OK || ret != 0) {
+        printf("failed wait_for_thread\n");
+        exit(EXIT_FAILURE);
+    }
+    return launched;
+}
+
+// until the exec, as resume_thread() waits for it
+static bigtime_t launch_fork()
+{
+    int exec[2];
+    pipe2(exec, O_CLOEXEC);
+    bigtime_t start = system_time();
+    pid_t pid = fork();
+    if (pid == 0) {
+        execv(true_argv[0], (char * const *)true_argv);
+        _exit(EXIT_FAILURE);
+    }
+    close(exec[1]);
+    char c;
+    read(exec[0], &c, 1);
+    bigtime_t launched = system_time() - start;
+    close(exec[0]);
+    waitpid(pid, NULL, 0);
+    return launched;
+}
+
+// best of LAUNCHES, in microseconds
+static bigtime_t bench(bigtime_t (*launch)())
+{
+    bigtime_t best = B_INFINITE_TIMEOUT;
+    for (int i = 0; i < LAUNCHES; i++)
+        best = min_c(best, launch());
+    return best;
+}
+
+int main(int argc, char **argv)
+{
+    setbuf(stdout, NULL); // do not buffer
+
+    // launch latency must not grow with the resident size of the parent
+    static const size_t sizes[] = { 0, 256, 1024 };
+    for (size_t mb : sizes) {
+        size_t size = mb << 20;
+        void *rss = size ? mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0) : NULL;
+        if (rss == MAP_FAILED) {
+            printf("%4zu MB rss: no memory\n", mb);
+            continue;
+        }
+        if (rss)
+            memset(rss, 1, size);
+
+        bigtime_t image = bench(launch_image), forked = bench(launch_fork);
+        printf("%4zu MB rss: load_image %5lld us, fork %5lld us\n", mb, (long long)image, (long long)forked);
+        if (rss)
+            munmap(rss, size);
+    }
+
+    // a failing exec is reported by resume_thread()
+    const char *missing_argv[] = { "/nonexistent", NULL };
+    thread_id team = load_image(1, missing_argv, (const char **)environ);
+    status_t resumed = resume_thread(team);
+    int32 ret;
+    wait_for_thread(team, &ret);
+    printf("missing image: %d\n", resumed);
+    if (resumed != B_ENTRY_NOT_FOUND)
+        return EXIT_FAILURE;
+
+    // teams killed before they were resumed
+    team = load_image(1, true_argv, (const char **)environ);
+    kill_team(team);
+    waitpid(team, NULL, 0);
+    if (resume_thread(team) == B_OK) {
+        printf("resumed killed team\n");
+        return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+}
@@ -41,6 +41,24 @@ int32 reader(void *data)
     }
 }
 
+// block until the port is deleted under them
+static status_t blocked[2] = { B_OK, B_OK };
+
+int32 blocked_reader(void *data)
+{
+    int32 code;
+    char buffer[16];
+    blocked[0] = read_port((port_id)(intptr_t)data, &code, buffer, sizeof(buffer));
+    return blocked[0];
+}
+
+int32 blocked_writer(void *data)
+{
+    port_id port = (port_id)(intptr_t)data;
+    while ((blocked[1] = write_port(port, 1, "full", 4)) == B_OK);
+    return blocked[1];
+}
+
 status_t send_message(port_id port, int32 code, const char *message)
 {
     size_t len = strlen(message);
@@ -79,9 +97,67 @@ int main(int argc, char *argv[])
 
     send_message(port, 0x1111, "testing... etc");
 
+    // writes are in the flight recorder
+    flight_record records[64];
+    ssize_t count = get_flight_records(records, 64);
+    bool recorded = false;
+    for (ssize_t i = 0; i < count; i++) {
+        recorded |= records[i].event == B_RECORD_PORT_WRITE && records[i].args[0] == port
+                    && records[i].args[1] == 0x1111;
+    }
+    fprintf(stdout, "main: flight records: %zd, write recorded: %d\n", count, recorded);
+    if (!recorded)
+        return EXIT_FAILURE;
+
     fprintf(stdout, "main: close_port: %d\n", close_port(port));
 
     snooze(1000000);
 
     fprintf(stdout, "main: delete_port: %d\n", delete_port(port));
+
+    // threads blocked on a deleted port return, the port stays mapped for them
+    port_id empty = create_port(1, "empty");
+    port_id full = create_port(1, "full");
+    resume_thread(spawn_thread(blocked_reader, "blocked reader", B_NORMAL_PRIORITY, (void *)(intptr_t)empty));
+    resume_thread(spawn_thread(blocked_writer, "blocked writer", B_NORMAL_PRIORITY, (void *)(intptr_t)full));
+    snooze(100000);
+    delete_port(empty);
+    delete_port(full);
+    snooze(100000);
+    for (int i = 0; i < 2; i++) {
+        fprintf(stdout, "main: blocked %d returned: %d\n", i, blocked[i]);
+        if (blocked[i] != B_BAD_PORT_ID)
+            return EXIT_FAILURE;
+    }
+
+    // large payloads arrive intact copied, mapped and when bigger than the ring
+    port_id large = create_port(4, "large");
+    static const size_t sizes[] = { 256 * 1024, 256 * 1024, 8 * 1024 * 1024 };
+    char *payload = (char *)malloc(sizes[2]);
+    char *copy = (char *)malloc(sizes[2]);
+    for (size_t i = 0; i < sizes[2]; i++)
+        payload[i] = (char)(i * 7);
+    for (int i = 0; i < 3; i++) {
+        status_t status = write_port(large, i, payload, sizes[i]);
+        ssize_t read;
+        int32 code;
+        bool same;
+        if (i == 1) {
+            const void *data = NULL;
+            read = read_port_mapped(large, &code, &data, 0, 0);
+            same = read == (ssize_t)sizes[i] && memcmp(data, payload, sizes[i]) == 0;
+            if (read >= 0) unmap_port_message(data, read);
+        } else {
+            read = read_port(large, &code, copy, sizes[2]);
+            same = read == (ssize_t)sizes[i] && memcmp(copy, payload, sizes[i]) == 0;
+        }
+        fprintf(stdout, "main: large %d write: %d read: %zd same: %d\n", i, status, read, same);
+        if (status != B_OK || code != i || !same)
+            return EXIT_FAILURE;
+    }
+    free(payload);
+    free(copy);
+    delete_port(large);
+
+    return EXIT_SUCCESS;
 }
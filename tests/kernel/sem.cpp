@@ -6,6 +6,8 @@
 #include <unistd.h>
 #include <syscall.h>
 #include <assert.h>
+#include <sys/wait.h>
+#include <sys/stat.h>
 
 #define atomic_inc(P) __sync_add_and_fetch((P), 1)
 #define atomic_dec(P) __sync_add_and_fetch((P), -1)
@@ -141,5 +143,25 @@ int main(int argc, char **argv)
         }
     }
 
+    // shared semaphore is released by another team, its arena is private to the user
+    sem_id shared = create_sem_etc(0, "shared", B_SHARED_SEM);
+    printf("[main] shared sem: %d\n", shared);
+    assert(shared > 0);
+    pid_t child = fork();
+    if (child == 0) _exit(release_sem(shared) == B_OK ? EXIT_SUCCESS : EXIT_FAILURE);
+    int status = -1;
+    waitpid(child, &status, 0);
+    status_t ret = acquire_sem_etc(shared, 1, B_RELATIVE_TIMEOUT, 1000000);
+    printf("[main] shared sem released by team %d: %d\n", child, ret);
+    assert(WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS && ret == B_OK);
+    struct stat st;
+    char path[64];
+    stat("/proc/self/ns/pid", &st);
+    snprintf(path, sizeof(path), "/dev/shm/libbe-sem-%u-%lu", (unsigned)geteuid(), (unsigned long)st.st_ino);
+    ret = stat(path, &st);
+    printf("[main] shared sem arena %s: %d mode %o\n", path, ret, st.st_mode & 0777);
+    assert(ret == 0 && st.st_uid == geteuid() && (st.st_mode & 0777) == 0600);
+    delete_sem(shared);
+
     return EXIT_SUCCESS;
 }
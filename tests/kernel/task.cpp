@@ -0,0 +1,59 @@
+#include <OS.h>
+
+#include <stdlib.h>
+#include <stdio.h>
+
+int32 fib(void *data)
+{
+    intptr_t n = (intptr_t)data;
+    if (n < 2) return n;
+
+    // one half goes to the pool, the other runs here
+    task_id task = submit_task(fib, (void *)(n - 1));
+    int32 b = fib((void *)(n - 2));
+    status_t a;
+    wait_for_task(task, &a);
+    return a + b;
+}
+
+int32 square(void *data)
+{
+    intptr_t n = (intptr_t)data;
+    return n * n;
+}
+
+int main(int argc, char **argv)
+{
+    setbuf(stdout, NULL); // do not buffer
+
+    printf("workers: %d\n", count_task_pool_workers());
+
+    task_id tasks[100];
+    for (int i = 0; i < 100; i++) {
+        tasks[i] = submit_task(square, (void *)(intptr_t)i);
+    }
+    int64 sum = 0;
+    for (int i = 0; i < 100; i++) {
+        status_t result;
+        wait_for_task(tasks[i], &result);
+        sum += result;
+    }
+    printf("sum of squares: %lld\n", (long long)sum);
+
+    bigtime_t start = system_time();
+    task_id task = submit_task(fib, (void *)20);
+    status_t result;
+    wait_for_task(task, &result);
+    printf("fib(20) = %d in %lld us\n", result, (long long)(system_time() - start));
+
+    task = submit_task(NULL, NULL);
+    printf("bad task: %ld, wait: %d\n", (long)task, (int)wait_for_task(task, NULL));
+
+    int32 cookie = 0;
+    thread_info info;
+    while (get_next_thread_info(0, &cookie, &info) == B_OK) {
+        printf("thread %d: %s\n", info.thread, info.name);
+    }
+
+    return sum == 328350 && result == 6765 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
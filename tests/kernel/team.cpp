@@ -27,6 +27,27 @@ int32 status(void *data)
     printf("         uid:\t%d\n", tm_info.uid);
     printf("         gid:\t%d\n", tm_info.gid);
 
+    team_usage_info usage;
+    if (get_team_usage_info(tm_info.team, B_TEAM_USAGE_SELF, &usage) != B_OK) {
+        printf("failed get_team_usage_info\n");
+        exit(EXIT_FAILURE);
+    }
+    printf("   user time:\t%lld\n", (long long)usage.user_time);
+    printf(" kernel time:\t%lld\n", (long long)usage.kernel_time);
+
+    // the current team must be among all teams
+    int32 cookie = 0, teams = 0;
+    bool found = false;
+    while (get_next_team_info(&cookie, &tm_info) == B_OK) {
+        found |= tm_info.team == th_info.team;
+        teams++;
+    }
+    printf("       teams:\t%d\n", teams);
+    if (!found) {
+        printf("failed get_next_team_info\n");
+        exit(EXIT_FAILURE);
+    }
+
     return EXIT_SUCCESS;
 }
 
@@ -0,0 +1,55 @@
+#include <OS.h>
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+
+#define CALLS 10000000
+
+static double bench(const char *name, bigtime_t (*clock)(void))
+{
+    struct timespec start, end;
+    bigtime_t last = clock();
+    bool monotonic = true;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < CALLS; i++) {
+        bigtime_t now = clock();
+        if (now < last) monotonic = false;
+        last = now;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    double ns = ((end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec)) / CALLS;
+    printf("%-28s %6.1f ns/call%s\n", name, ns, monotonic ? "" : " NOT MONOTONIC");
+    return monotonic ? ns : -1;
+}
+
+int main(int argc, char **argv)
+{
+    setbuf(stdout, NULL); // do not buffer
+
+    bool ok = bench("system_time (monotonic)", system_time) >= 0;
+    ok &= bench("system_time_coarse", system_time_coarse) >= 0;
+    ok &= bench("real_time_clock_usecs", real_time_clock_usecs) >= 0;
+
+    status_t result = set_system_time_source(B_TSC_CLOCK_SOURCE);
+    if (result != B_OK) {
+        printf("TSC clock source not supported\n");
+        return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
+    ok &= bench("system_time (tsc)", system_time) >= 0;
+    bench("real_time_clock_usecs (tsc)", real_time_clock_usecs);
+
+    // TSC time must track CLOCK_MONOTONIC after running for a while
+    snooze(200000);
+    struct timespec tm;
+    clock_gettime(CLOCK_MONOTONIC, &tm);
+    bigtime_t drift = system_time() - (tm.tv_sec * 1000000 + tm.tv_nsec / 1000);
+    printf("drift against CLOCK_MONOTONIC: %lld us\n", (long long)drift);
+    ok &= drift > -100 && drift < 100;
+
+    set_system_time_source(B_MONOTONIC_CLOCK_SOURCE);
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
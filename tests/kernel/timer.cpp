@@ -0,0 +1,49 @@
+#include <OS.h>
+
+#include <stdlib.h>
+#include <stdio.h>
+
+#define RUNNERS 1000
+
+static int32 ticks = 0;
+static int32 once = 0;
+
+void tick(void *data)
+{
+    (void)data;
+    __sync_add_and_fetch(&ticks, 1);
+}
+
+void fire_once(void *data)
+{
+    *(int32 *)data += 1;
+}
+
+int main(int argc, char **argv)
+{
+    setbuf(stdout, NULL); // do not buffer
+
+    // many periodic timers with slack should share service wakeups
+    timer_id timers[RUNNERS];
+    bigtime_t start = system_time();
+    for (int i = 0; i < RUNNERS; i++) {
+        timers[i] = add_timer(tick, NULL, start + 10000 + i, 10000, 1000);
+        if (timers[i] < 0) {
+            printf("add_timer failed: %d\n", timers[i]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    add_timer(fire_once, &once, start + 5000, 0, 0);
+
+    snooze(105000);
+    for (int i = 0; i < RUNNERS; i++) cancel_timer(timers[i]);
+    int32 fired = ticks;
+    printf("%d ticks in %lld us\n", fired, (long long)(system_time() - start));
+
+    snooze(30000);
+    printf("after cancel: %d ticks, one-shot fired %d times\n", ticks, once);
+
+    bool ok = fired >= RUNNERS * 9 && ticks == fired && once == 1;
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -88,6 +88,36 @@ int main(int argc, char **argv)
         goto exit;
     }
 
+    // second pass comes from the cache, the write after it must not
+    for (int pass = 0; pass < 3; pass++) {
+        if (pass == 2 && fs_write_attr(fd, "test", B_STRING_TYPE, 0, "cached", 6) < 0) {
+            fprintf(stderr, "Error rewriting attribute 'test': %d %s\n", errno, strerror(errno));
+            ret = EXIT_FAILURE;
+            goto exit;
+        }
+
+        fs_attr_entry *entries;
+        ssize_t count = fs_read_attrs(fd, &entries);
+        if (count != 2) {
+            fprintf(stderr, "Error reading attributes, got %zd: %d\n", count, errno);
+            ret = EXIT_FAILURE;
+            goto exit;
+        }
+        const char *expected = pass == 2 ? "cached" : "--test";
+        bool found = false;
+        for (ssize_t i = 0; i < count; i++) {
+            if (strcmp(entries[i].name, "test") != 0) continue;
+            found = entries[i].type == B_STRING_TYPE && entries[i].size == 6
+                    && memcmp(entries[i].data, expected, 6) == 0;
+        }
+        free(entries);
+        if (!found) {
+            fprintf(stderr, "Error finding attribute 'test' as '%s' in pass %d\n", expected, pass);
+            ret = EXIT_FAILURE;
+            goto exit;
+        }
+    }
+
 exit:
     close(fd);
 
@@ -0,0 +1,98 @@
+#include <AppKit.h>
+#include <Node.h>
+#include <NodeMonitor.h>
+#include <Path.h>
+
+#include <atomic>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+class MonitorLooper : public BLooper
+{
+   public:
+	MonitorLooper() : BLooper("monitor test"), created(0), changed(0) {}
+
+	void MessageReceived(BMessage *message) override
+	{
+		if (message->what != B_NODE_MONITOR) {
+			BLooper::MessageReceived(message);
+			return;
+		}
+		message->PrintToStream();
+
+		int32 opcode;
+		if (message->FindInt32("opcode", &opcode) != B_OK)
+			return;
+		if (opcode == B_ENTRY_CREATED)
+			created++;
+		if (opcode == B_STAT_CHANGED)
+			changed++;
+	}
+
+	std::atomic<int32> created;
+	std::atomic<int32> changed;
+};
+
+class MonitorHandler : public BHandler
+{
+   public:
+	MonitorHandler() : BHandler("monitor handler"), changed(0) {}
+
+	void MessageReceived(BMessage *message) override
+	{
+		int32 opcode;
+		if (message->what == B_NODE_MONITOR && message->FindInt32("opcode", &opcode) == B_OK
+			&& opcode == B_STAT_CHANGED)
+			changed++;
+	}
+
+	std::atomic<int32> changed;
+};
+
+int main(int argc, char **argv)
+{
+	setbuf(stdout, NULL); // do not buffer
+
+	char temp[] = "/var/tmp/monitorXXXXXX";
+	if (!mkdtemp(temp)) {
+		fprintf(stderr, "Error creating temp directory: %d %s\n", errno, strerror(errno));
+		return EXIT_FAILURE;
+	}
+
+	MonitorLooper *looper = new MonitorLooper();
+	MonitorHandler *handler = new MonitorHandler();
+	looper->AddHandler(handler);
+	looper->Run();
+
+	node_ref dir(open(temp, O_RDONLY | O_DIRECTORY));
+	status_t err = watch_node(&dir, B_WATCH_DIRECTORY, looper);
+	printf("watch directory: %s\n", strerror(err));
+
+	BPath path(temp, "file");
+	int	  fd = open(path.Path(), O_CREAT | O_WRONLY, 0644);
+	node_ref file(open(path.Path(), O_RDONLY));
+	// notifications go to the watching handler, not the preferred one
+	err = watch_node(&file, B_WATCH_STAT, handler, looper);
+	printf("watch file: %s\n", strerror(err));
+
+	// a burst of writes arrives as one B_STAT_CHANGED
+	for (int i = 0; i < 1000; i++)
+		write(fd, "x", 1);
+	close(fd);
+
+	snooze(100000);
+	printf("created: %d, stat changed: %d, handler stat changed: %d\n", looper->created.load(),
+		   looper->changed.load(), handler->changed.load());
+	int ret = looper->created == 1 && looper->changed == 0 && handler->changed == 1 ? EXIT_SUCCESS : EXIT_FAILURE;
+
+	stop_watching(handler, looper);
+	stop_watching(looper);
+	unlink(path.Path());
+	rmdir(temp);
+
+	looper->Lock();
+	looper->Quit();
+	return ret;
+}
@@ -0,0 +1,134 @@
+#include <KernelKit.h>
+#include <StorageKit.h>
+#include <String.h>
+#include <TypeConstants.h>
+#include <syscalls.h>
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define FILES 100
+
+static void write_attrs(const char *path, const char *type, int32 rating)
+{
+	int fd = open(path, O_CREAT | O_WRONLY, 0644);
+	fs_write_attr(fd, "BEOS:TYPE", B_MIME_STRING_TYPE, 0, type, strlen(type) + 1);
+	fs_write_attr(fd, "Test:Rating", B_INT32_TYPE, 0, &rating, sizeof(rating));
+	close(fd);
+}
+
+static int32 count_query(dev_t device, const char *predicate)
+{
+	DIR *query = fs_open_query(device, predicate, 0);
+	if (!query)
+		return -1;
+	int32 count = 0;
+	while (fs_read_query(query))
+		count++;
+	fs_close_query(query);
+	return count;
+}
+
+// Indexing catches up in the background, so poll for the expected count.
+static bool wait_for_count(dev_t device, const char *predicate, int32 expected)
+{
+	int32 count = -1;
+	for (int i = 0; i < 100 && count != expected; i++) {
+		snooze(50000);
+		count = count_query(device, predicate);
+	}
+	printf("%s: %d (expected %d)\n", predicate, count, expected);
+	return count == expected;
+}
+
+int main(int argc, char **argv)
+{
+	setbuf(stdout, NULL); // do not buffer
+
+	// a small volume of its own keeps the crawl short
+	char temp[] = "/dev/shm/queryXXXXXX";
+	char fallback[] = "/var/tmp/queryXXXXXX";
+	char *dir = mkdtemp(temp);
+	if (!dir)
+		dir = mkdtemp(fallback);
+	if (!dir) {
+		fprintf(stderr, "Error creating temp directory: %d %s\n", errno, strerror(errno));
+		return EXIT_FAILURE;
+	}
+
+	struct stat st;
+	stat(dir, &st);
+	dev_t device = st.st_dev;
+
+	char path[PATH_MAX];
+	for (int i = 0; i < FILES; i++) {
+		snprintf(path, sizeof(path), "%s/file%d", dir, i);
+		write_attrs(path, i % 2 ? "text/plain" : "image/png", i % 10);
+	}
+	if (fs_create_index(device, "Test:Rating", B_INT32_TYPE, 0) < 0 && errno != B_FILE_EXISTS)
+		fprintf(stderr, "Error creating index: %s\n", strerror(errno));
+
+	status_t err = _kern_start_indexing(device);
+	printf("start indexing: %s\n", strerror(err));
+
+	int ret = EXIT_SUCCESS;
+	if (!wait_for_count(device, "BEOS:TYPE==\"text/plain\"", FILES / 2)
+		|| !wait_for_count(device, "(BEOS:TYPE==text/*)&&(Test:Rating>=5)", FILES * 3 / 10)
+		|| !wait_for_count(device, "(Test:Rating==0)||(Test:Rating==9)", FILES / 5))
+		ret = EXIT_FAILURE;
+
+	// changes reach the indices through node monitoring
+	snprintf(path, sizeof(path), "%s/file0", dir);
+	write_attrs(path, "audio/x-wav", 0);
+	snprintf(path, sizeof(path), "%s/new", dir);
+	write_attrs(path, "audio/x-wav", 0);
+	if (!wait_for_count(device, "BEOS:TYPE==audio/*", 2))
+		ret = EXIT_FAILURE;
+	unlink(path);
+	if (!wait_for_count(device, "BEOS:TYPE==audio/*", 1))
+		ret = EXIT_FAILURE;
+
+	// the same through BQuery
+	BQuery query;
+	query.SetVolume(device);
+	query.PushAttr("BEOS:TYPE");
+	query.PushString("AUDIO/*", true);
+	query.PushOp(B_EQ);
+	BString text;
+	query.GetPredicate(&text);
+	printf("predicate: %s\n", text.String());
+	err = query.Fetch();
+	int32	  found = 0;
+	entry_ref ref;
+	while (err == B_OK && query.GetNextRef(&ref) == B_OK)
+		found++;
+	printf("fetch: %s, found %d\n", strerror(err), found);
+	if (found != 1)
+		ret = EXIT_FAILURE;
+
+	// predicates without an index fail unless asked to scan
+	const char *predicate = "name==file1*";
+	if (fs_open_query(device, predicate, 0) || errno != B_BAD_INDEX)
+		ret = EXIT_FAILURE;
+	DIR *scan = fs_open_query(device, predicate, B_QUERY_NON_INDEXED);
+	int32 scanned = 0;
+	while (scan && fs_read_query(scan))
+		scanned++;
+	if (scan)
+		fs_close_query(scan);
+	printf("%s: %d (expected %d)\n", predicate, scanned, 11);
+	if (scanned != 11)
+		ret = EXIT_FAILURE;
+
+	_kern_stop_indexing(device);
+	for (int i = 0; i < FILES; i++) {
+		snprintf(path, sizeof(path), "%s/file%d", dir, i);
+		unlink(path);
+	}
+	rmdir(dir);
+	return ret;
+}